@@ -12,6 +12,9 @@
  *	The code is thread-safe.  Although under normal use only
  *	one interpreter will be used to add/remove mounts and volumes,
  *	it does cope with multiple interpreters in multiple threads.
+ *	Mounts are private to the thread which made them, unless they
+ *	are shared, in which case other threads forward operations on
+ *	them to that thread (see VfsSharedMount).
  *	
  * Copyright (c) 2001-2004 Vince Darley.
  * Copyright (c) 2006 ActiveState Software Inc.
@@ -27,6 +30,43 @@
 /* Required to access the 'stat' structure fields, and TclInExit() */
 #include "tclInt.h"
 #include "tclPort.h"
+#include <stddef.h>
+#include "vfs.h"
+#include "vfsInt.h"
+
+/*
+ * On Linux, shared libraries are loaded from a mount through an
+ * anonymous memory file rather than a temporary copy on disk (see
+ * VfsLoadFile).
+ */
+
+#if defined(__linux__)
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  ifdef SYS_memfd_create
+#    define VFS_MEMFD_LOAD
+#    ifndef MFD_CLOEXEC
+#      define MFD_CLOEXEC 0x0001U
+#    endif
+#  endif
+#endif
+
+/*
+ * Memory channels move their contents to an unlinked temporary file
+ * once they grow beyond their -spillsize (see VfsSpillCreate), but
+ * not on Windows, where they are always kept in memory.
+ */
+
+#ifndef __WIN32__
+#  define VFS_SPILL
+#  ifndef P_tmpdir
+#    define P_tmpdir "/tmp"
+#  endif
+#endif
+
+/* Default -spillsize of read-write memory channels */
+#define VFS_SPILL_SIZE (64 * 1024 * 1024)
 
 /*
  * Windows needs to know which symbols to export.  Unix does not.
@@ -43,23 +83,72 @@
 #endif
 
 /*
- * tclvfs will return this code instead of TCL_OK/ERROR/etc. to propagate
- * through the Tcl_Eval* calls to indicate a posix error has been raised by
- * some vfs implementation.  -1 is what Tcl expects, adopts from posix's
- * standard error value.
+ * Static tracepoints (USDT) for perf, bpftrace and systemtap, built in
+ * with 'configure --enable-usdt', which needs <sys/sdt.h>.  The 'vfs'
+ * provider has four probes:
+ * 
+ *   fs__entry(op, mount, relative)            around each call Tcl
+ *   fs__return(op, mount, relative, result)   makes to the filesystem
+ *   callback__entry(op, mount, relative)      around each evaluation
+ *   callback__return(op, mount, relative, code)  of a mount's command
+ * 
+ * 'op' is the name of the operation as passed to the command (or
+ * "close" for a close callback), 'mount' the mount point and 'relative'
+ * the path within it, all strings.  'result' is what the filesystem
+ * call returned (0, or -1 for failure) and 'code' what the command did.
+ * Each probe has a semaphore, which is set while a tracer is attached,
+ * so that the arguments are only computed then.
+ */
+
+#ifdef VFS_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define VFS_PROBE_SEMAPHORE(name) \
+    unsigned short vfs_##name##_semaphore \
+	__attribute__ ((unused)) __attribute__ ((section (".probes")))
+
+VFS_PROBE_SEMAPHORE(fs__entry);
+VFS_PROBE_SEMAPHORE(fs__return);
+VFS_PROBE_SEMAPHORE(callback__entry);
+VFS_PROBE_SEMAPHORE(callback__return);
+
+#define VfsProbeEnabled(name)	__builtin_expect(vfs_##name##_semaphore, 0)
+#define VfsProbe3(name, a, b, c) \
+    STAP_PROBE3(vfs, name, a, b, c)
+#define VfsProbe4(name, a, b, c, d) \
+    STAP_PROBE4(vfs, name, a, b, c, d)
+#define VFS_FS_PROC(name)	&VfsProbed##name
+#else
+#define VfsProbeEnabled(name)	0
+#define VfsProbe3(name, a, b, c)
+#define VfsProbe4(name, a, b, c, d)
+#define VFS_FS_PROC(name)	&Vfs##name
+#endif /* VFS_USDT */
+
+/*
+ * tclvfs will return TCLVFS_POSIXERROR (see vfs.h) instead of
+ * TCL_OK/ERROR/etc. to propagate through the Tcl_Eval* calls to indicate
+ * a posix error has been raised by some vfs implementation.  -1 is what
+ * Tcl expects, adopts from posix's standard error value.
  */
-#define TCLVFS_POSIXERROR (-1)
 
 #ifndef CONST86
 #define CONST86
 #endif
 
 /*
- * Only the _Init function is exported.
+ * Only the _Init function and those in vfs.decls are exported.
  */
 
 EXTERN int Vfs_Init _ANSI_ARGS_((Tcl_Interp*));
 
+/* 
+ * The public C interface is made available through a stubs table;
+ * see vfs.h.
+ */
+extern VfsStubs vfsStubs;
+
 /* 
  * Functions to add and remove a volume from the list of volumes.
  * These aren't currently exported, but could be in the future.
@@ -94,6 +183,103 @@ typedef struct Vfs_InterpCmd {
                            * command will be evaluated. */
 } Vfs_InterpCmd;
 
+/*
+ * struct VfsMount --
+ * 
+ * Each filesystem mount point which is registered will result in
+ * the allocation of one of these structures.  They are stored
+ * in a linked list whose head is 'listOfMounts', which retains the
+ * order in which mounts were made, and linked both ways so that one
+ * can be taken out without searching.  For fast lookups each mount
+ * is also indexed by its mount point string in 'mountTable' (older
+ * mounts of the same mount point chained from it through 'shadowed'),
+ * and (unless it ends in a separator) chained into 'dirTable' under
+ * the directory which contains it.
+ * 
+ * To avoid building a new command list for every filesystem
+ * operation, the elements of the mount command are split out once
+ * into 'objv', which has room for the standard and extra arguments
+ * of each callback after them (see VfsCallbackInit).  Since the
+ * command word is kept alive there, Tcl also caches the resolved
+ * command in it across calls.  If a callback re-enters the same
+ * mount while 'objv' is in use, a temporary array is used instead.
+ * 
+ * A mount may be unmounted (even by its own callback) while one of
+ * its callbacks is running, so callbacks hold a reference in
+ * 'refCount' and the structure is only freed when that drops to zero.
+ */
+
+typedef struct VfsMount {
+    CONST char* mountPoint;
+    int mountLen;
+    int isVolume;
+    Vfs_InterpCmd interpCmd;
+    struct VfsMount* nextMount;
+    struct VfsMount* prevMount;   /* Or NULL, if first in the list */
+    struct VfsMount* nextSibling; /* Next mount in the same directory,
+                                   * for 'glob -types mount'. */
+    struct VfsMount* prevSibling; /* Or NULL, if first in 'dirTable' */
+    struct VfsMount* shadowed;    /* Next newest mount of the same mount
+                                   * point, hidden by this one. */
+    Tcl_Obj **objv;               /* Command prefix words, followed by
+                                   * space for the callback arguments,
+                                   * or NULL if the command is not a
+                                   * valid list. */
+    int prefixObjc;               /* Number of command prefix words */
+    int objvInUse;                /* Is 'objv' in use by a callback? */
+    int refCount;                 /* Number of callbacks in progress,
+                                   * plus one while mounted. */
+    long cacheTtl;                /* How long, in milliseconds, results
+                                   * may be cached; 0 disables caching
+                                   * and VFS_CACHE_FOREVER never
+                                   * expires results. */
+    Tcl_HashTable *statCache;     /* Relative path -> VfsCacheEntry */
+    Tcl_HashTable *globCache;     /* VfsKey -> VfsGlobCacheEntry */
+    Tcl_WideInt cacheBytes;       /* Memory charged for both */
+    CONST Vfs_Driver *driverPtr;  /* Functions implementing a mount
+                                   * made from C, or NULL if each
+                                   * operation evaluates 'objv'. */
+    ClientData driverData;        /* Passed to each of those */
+    struct VfsSharedMount *sharedPtr;
+                                  /* Description shared with other
+                                   * threads, or NULL if private. */
+    int isProxy;                  /* Does this stand in for a shared
+                                   * mount of another thread? */
+    struct VfsMountStats *statsPtr;
+                                  /* Counters for 'vfs::filesystem
+                                   * stats', or NULL if none yet. */
+    int isAsync;                  /* Is each callback run as a coroutine,
+                                   * servicing events until it returns? */
+    int asyncClose;               /* Are close callbacks of its memory
+                                   * channels deferred? */
+} VfsMount;
+
+/*
+ * Flag for Vfs_AddMount, besides those of Vfs_Mount, given by
+ * 'vfs::filesystem mount -async'.  It has no effect on driver mounts.
+ */
+#define VFS_MOUNT_ASYNC		(1<<16)
+#define VFS_MOUNT_ASYNCCLOSE	(1<<17)	/* -asyncclose */
+
+/* 
+ * Fetch a function from a mount's driver, or NULL if the driver does
+ * not have it (or was built against an older vfs.h without it).
+ */
+#define VfsDriverProc(mountPtr, field) \
+    (((mountPtr)->driverPtr->structureLength >= (int) \
+	    (offsetof(Vfs_Driver, field) + sizeof((mountPtr)->driverPtr->field))) \
+	? (mountPtr)->driverPtr->field : NULL)
+
+
+/*
+ * The standard arguments of every callback are the operation name,
+ * the root, the relative path and the actual path.  No callback
+ * currently needs more than VFS_MAX_EXTRA_ARGS further arguments.
+ */
+
+#define VFS_STD_ARGS		4
+#define VFS_MAX_EXTRA_ARGS	4
+
 /*
  * struct VfsNativeRep --
  * 
@@ -105,22 +291,207 @@ typedef struct Vfs_InterpCmd {
  * global filesystem epoch that Tcl retains is modified, and all
  * path internal representations are therefore discarded.  Therefore we
  * don't have to worry about vfs files containing stale VfsNativeRep
- * structures (but it also means we mustn't touch the fsCmd field
+ * structures (but it also means we mustn't touch the mountPtr field
  * of one of these structures if the interpreter has gone).  This
  * means when we free one of these structures, we just free the
- * memory allocated, and ignore the fsCmd pointer (which may or may
+ * memory allocated, and ignore the mountPtr pointer (which may or may
  * not point to valid memory).
+ * 
+ * The root and relative parts of the path passed to every callback
+ * are computed the first time they are needed and then kept here,
+ * so that repeated operations on the same path object allocate
+ * nothing.  These structures are allocated in slabs (see
+ * VfsAllocNativeRep), since Tcl creates and discards a great many
+ * of them.  Path objects may outlive the thread exit handler, so a
+ * slab still in use then is orphaned rather than freed, and frees
+ * itself once the last of its structures is released.
  */
 
 typedef struct VfsNativeRep {
     int splitPosition;    /* The index into the string representation
                            * of the file which indicates where the 
                            * vfs filesystem is mounted. */
-    Vfs_InterpCmd* fsCmd; /* The Tcl interpreter and command pair
-                           * which will be used to perform all filesystem 
+    VfsMount* mountPtr;   /* The mount whose Tcl interpreter and command
+                           * pair will be used to perform all filesystem 
                            * actions on this file. */
+    Tcl_Obj *rootObj;     /* Cached root and relative parts of the */
+    Tcl_Obj *relativeObj; /* path, or NULL if not yet computed. */
+    struct VfsNativeRep *nextFree;
+                          /* Next structure on the free list, while
+                           * this one is unused. */
+    struct VfsNativeRepSlab *slabPtr;
+                          /* The slab this structure was carved from. */
 } VfsNativeRep;
 
+#define VFS_NATIVEREP_SLAB_SIZE 64
+
+typedef struct VfsNativeRepSlab {
+    struct VfsNativeRepSlab *nextSlab;
+    int numLive;          /* Structures of this slab in use. */
+    int orphaned;         /* Its thread has exited; free it when
+                           * numLive drops to 0. */
+    VfsNativeRep reps[VFS_NATIVEREP_SLAB_SIZE];
+} VfsNativeRepSlab;
+
+/*
+ * Operations which are dispatched to a mount's command.  The names are
+ * interned per thread, so the same objects are passed to every
+ * callback.
+ */
+
+enum VfsOp {
+    VFS_OP_STAT, VFS_OP_ACCESS, VFS_OP_OPEN, VFS_OP_MATCHINDIRECTORY,
+    VFS_OP_DELETEFILE, VFS_OP_CREATEDIRECTORY, VFS_OP_REMOVEDIRECTORY,
+    VFS_OP_FILEATTRIBUTES, VFS_OP_UTIME, VFS_OP_COPYFILE, VFS_OP_RENAMEFILE,
+    VFS_OP_COPYDIRECTORY, VFS_OP_STATMANY, VFS_OP_PREFETCH, VFS_OP_MEMORY,
+    VFS_OP_COUNT
+};
+
+static CONST char *vfsOpNames[] = {
+    "stat", "access", "open", "matchindirectory",
+    "deletefile", "createdirectory", "removedirectory",
+    "fileattributes", "utime", "copyfile", "renamefile",
+    "copydirectory", "statmany", "prefetch", "memory", NULL
+};
+
+/*
+ * struct VfsMountStats --
+ * 
+ * What 'vfs::filesystem stats' reports about a mount: how often its
+ * paths were looked up, and for each operation (plus the close
+ * callbacks of its channels) how many callbacks were made, how many
+ * failed, their total time in microseconds and a histogram of their
+ * times, in which bucket i counts callbacks taking less than 2^i
+ * microseconds but at least 2^(i-1); the last bucket also counts
+ * anything slower.  Nothing is counted unless enabled in the thread
+ * with 'vfs::filesystem stats -enable'.
+ */
+
+#define VFS_STATS_CLOSE		(VFS_OP_COUNT)
+#define VFS_STATS_OPS		(VFS_OP_COUNT+1)
+#define VFS_STATS_BUCKETS	24
+
+typedef struct VfsOpStats {
+    long calls;
+    long errors;
+    long posixErrors;
+    Tcl_WideInt time;
+    long histogram[VFS_STATS_BUCKETS];
+} VfsOpStats;
+
+typedef struct VfsMountStats {
+    long lookups;
+    VfsOpStats ops[VFS_STATS_OPS];
+} VfsMountStats;
+
+/*
+ * struct VfsTrace --
+ * 
+ * The callbacks recorded by 'vfs::filesystem trace start', kept in a
+ * ring of 'size' records of which the oldest is overwritten once it
+ * is full.  Each thread has its own, so no locking is needed.  Only
+ * callbacks taking at least 'threshold' microseconds are recorded.
+ */
+
+typedef struct VfsTraceRecord {
+    Tcl_Time start;
+    Tcl_WideInt duration;   /* In microseconds */
+    Tcl_WideInt bytes;      /* Position a channel had reached when its
+                             * close callback was made, else -1 */
+    int op;                 /* enum VfsOp or VFS_STATS_CLOSE */
+    int code;               /* What the callback returned */
+    Tcl_Obj *rootObj;       /* The mount, and the path in it, both */
+    Tcl_Obj *relativeObj;   /* NULL while the record is unused */
+} VfsTraceRecord;
+
+typedef struct VfsTrace {
+    int active;             /* Cleared by 'trace stop' */
+    int size;
+    long count;             /* Records ever made, of which the last
+                             * 'size' are kept */
+    Tcl_WideInt threshold;
+    VfsTraceRecord *records;
+} VfsTrace;
+
+#define VFS_TRACE_SIZE 256
+
+/*
+ * Small integer arguments (access modes, glob types, attribute indices
+ * and so on) are also shared from a per-thread table.
+ */
+
+#define VFS_SMALL_INTS 256
+
+/*
+ * struct VfsCallback --
+ * 
+ * Everything needed to evaluate one callback of a mount.  See
+ * VfsCallbackInit.
+ */
+
+typedef struct VfsCallback {
+    Tcl_Interp *interp;   /* Interpreter to evaluate the callback in */
+    VfsMount *mountPtr;   /* Mount whose command is used (we hold a
+                           * reference on it) */
+    Tcl_Obj **objv;       /* Words of the command; either the mount's
+                           * own array or a temporary copy */
+    int objc;             /* Number of words so far */
+    int op;               /* enum VfsOp */
+    int timed;            /* Are statistics or a trace being kept? */
+    Tcl_Time start;       /* If so, when the callback started */
+} VfsCallback;
+
+/* 
+ * The outcome of a callback of an -async mount, whose handler runs as
+ * a coroutine and may yield to the event loop before it returns.
+ */
+typedef struct VfsAsyncCall {
+    int done;             /* Set by vfs::AsyncReturn */
+    int code;             /* Return code of the handler */
+    Tcl_Obj *resultPtr;   /* Its result, and its return options */
+    Tcl_Obj *optionsPtr;
+    int errNum;           /* Errno as it returned, for posixerror */
+} VfsAsyncCall;
+
+/*
+ * A 'vfs::filesystem prefetch' whose handlers may still be at work.
+ * Each handler which does its work in the background is given the
+ * serial number of a VfsPrefetchCall, to hand to vfs::PrefetchDone
+ * when it has finished.  Once none is left the -command is run, and
+ * the record freed unless something is in 'prefetch -wait' for it,
+ * or there is no -command and some handler failed: then it is kept
+ * until a 'prefetch -wait' collects the messages.
+ */
+typedef struct VfsPrefetch {
+    int id;
+    int pending;          /* Handler calls not yet finished */
+    int waiters;          /* Nesting of 'prefetch -wait' on it */
+    int finished;         /* Has VfsPrefetchIdleProc run? */
+    Tcl_Interp *interp;   /* Where it was asked for */
+    Tcl_Obj *command;     /* -command prefix, or NULL */
+    Tcl_Obj *errors;      /* Messages given by failed handlers */
+} VfsPrefetch;
+
+typedef struct VfsPrefetchCall {
+    VfsPrefetch *prefetchPtr;
+    Tcl_Interp *interp;   /* Of the mount whose handler was called */
+    int running;          /* Has the handler not yet returned? */
+    int done;             /* Has vfs::PrefetchDone been called? */
+} VfsPrefetchCall;
+
+/* The root, relative and actual path arguments of a callback */
+#define VfsCallbackRoot(cbPtr) \
+    ((cbPtr)->objv[(cbPtr)->mountPtr->prefixObjc + 1])
+#define VfsCallbackRelative(cbPtr) \
+    ((cbPtr)->objv[(cbPtr)->mountPtr->prefixObjc + 2])
+#define VfsCallbackPath(cbPtr) \
+    ((cbPtr)->objv[(cbPtr)->mountPtr->prefixObjc + 3])
+
+/* The leading arguments of every Vfs_Driver function */
+#define VfsDriverArgs(cbPtr) \
+    (cbPtr)->mountPtr->driverData, (cbPtr)->interp, \
+    VfsCallbackRoot(cbPtr), VfsCallbackRelative(cbPtr), VfsCallbackPath(cbPtr)
+
 /*
  * struct VfsChannelCleanupInfo --
  * 
@@ -146,8 +517,362 @@ typedef struct VfsChannelCleanupInfo {
                              * carry out any cleanup that is necessary. */
     Tcl_Interp* interp;     /* The interpreter in which to evaluate the
                              * cleanup operation. */
+    struct VfsSharedMount *sharedPtr;
+                            /* If the channel was opened for another
+                             * thread, the shared mount through which
+                             * it was opened; we hold a reference. */
+    VfsMount *mountPtr;     /* The mount it was opened in, and the */
+    Tcl_Obj *rootObj;       /* path, for its statistics and traces; */
+    Tcl_Obj *relativeObj;   /* we hold references to all three. */
 } VfsChannelCleanupInfo;
 
+/*
+ * struct VfsSpill --
+ * 
+ * The temporary file holding the contents of a memory channel which
+ * has spilled.  It is shared, like the byte array objects of those
+ * which have not, by the channel and any deferred close callback or
+ * channel made from that, and is copied before a write if shared.
+ */
+
+typedef struct VfsSpill {
+    int fd;
+    Tcl_WideInt length;
+    int refCount;         /* Guarded by vfsSharedMutex, since a
+                           * channel may go to another thread */
+} VfsSpill;
+
+/*
+ * struct VfsPendingClose --
+ * 
+ * The close callback of a memory channel from a mount made with
+ * -asyncclose, queued to run when the thread is next idle.  The
+ * channel itself has gone, but its contents are kept, and when the
+ * callback runs it is given a new memory channel of the same name
+ * holding them.  Until then, opening the file for reading gives these
+ * contents; anything else touching it runs the queue first.
+ */
+
+typedef struct VfsPendingClose {
+    VfsMount *mountPtr;           /* We hold references to this and */
+    Tcl_Obj *closeCallback;       /* all the objects. */
+    Tcl_Obj *rootObj;
+    Tcl_Obj *relativeObj;
+    Tcl_Obj *dataObj;             /* Contents of the channel, unless */
+    VfsSpill *spillPtr;           /* they spilled here instead */
+    char *channelName;
+    struct VfsPendingClose *nextPtr;
+} VfsPendingClose;
+
+/*
+ * struct VfsMemChannel --
+ * 
+ * A channel over bytes held in memory, in a byte array object.  Those
+ * made by 'vfs::memchan' are read-write: their object is normally
+ * unshared, and is grown in place, its allocation doubling as needed
+ * so that appending is cheap.  It only becomes shared when handed out
+ * by 'vfs::memdata', and is then copied before it is next written.
+ * Those made for an open handler's '-data' are read-only, and read
+ * straight out of the object the handler returned.  That object is
+ * shared, so its value cannot change, but its byte array may be
+ * regenerated, so it is looked up again for each read.
+ * 
+ * A read-write channel which grows beyond its spill size moves its
+ * contents to a VfsSpill, and from then on reads and writes go to
+ * that file, so that writing a large file through a mount does not
+ * hold all of it in memory until its close callback.
+ * 
+ * A memory channel is always readable and writable; while fileevents
+ * are wanted it is on the thread's list of ready channels (below).
+ */
+
+typedef struct VfsMemChannel {
+    Tcl_Channel channel;
+    Tcl_Obj *dataObj;           /* NULL once spilled */
+    int capacity;               /* Bytes allocated for dataObj's byte
+                                 * array, as far as we know. */
+    VfsSpill *spillPtr;         /* Where the contents are, once spilled */
+    Tcl_WideInt spillSize;      /* Length beyond which they spill, or 0 */
+    Tcl_WideInt position;
+    int interest;               /* TCL_READABLE/TCL_WRITABLE, if being
+                                 * watched */
+    int closed;
+    VfsMount *mountPtr;         /* If it was opened through a mount,
+                                 * which (until that goes) ... */
+    Tcl_ThreadId owner;         /* ... in which thread, for 'vfs::
+                                 * filesystem memory'.  It is then on
+                                 * the list of vfsMemChannels. */
+    struct VfsMemChannel *prevPtr;
+    struct VfsMemChannel *nextPtr;
+} VfsMemChannel;
+
+/*
+ * Channels which are always ready, memory channels and those of the
+ * Tcl libraries which call 'vfs::ChannelReady', are each given an
+ * entry in a per-thread table while they are watched.  A single event
+ * source then notifies all of them in one pass of the event loop,
+ * instead of each channel keeping a timer of its own, and nothing is
+ * done at all when none is watched.
+ */
+
+typedef struct VfsReadyChannel {
+    Tcl_Channel channel;
+    int mask;             /* TCL_READABLE/TCL_WRITABLE being watched */
+    int queued;           /* Is a VfsReadyEvent for it in the queue? */
+    int closeHandler;     /* Was a close handler set to remove it? */
+} VfsReadyChannel;
+
+typedef struct VfsReadyEvent {
+    Tcl_Event header;
+    Tcl_Channel channel;
+} VfsReadyEvent;
+
+static Tcl_DriverCloseProc VfsMemClose;
+static Tcl_DriverInputProc VfsMemInput;
+static Tcl_DriverOutputProc VfsMemOutput;
+static Tcl_DriverSeekProc VfsMemSeek;
+static Tcl_DriverSetOptionProc VfsMemSetOption;
+static Tcl_DriverGetOptionProc VfsMemGetOption;
+static Tcl_DriverWideSeekProc VfsMemWideSeek;
+static Tcl_DriverWatchProc VfsMemWatch;
+static Tcl_DriverGetHandleProc VfsMemGetHandle;
+
+static void            VfsReadySet(Tcl_Channel chan, int mask, 
+				   int closeHandler);
+static Tcl_CloseProc   VfsReadyClosed;
+static Tcl_EventSetupProc VfsReadySetupProc;
+static Tcl_EventCheckProc VfsReadyCheckProc;
+static int             VfsReadyEventProc(Tcl_Event *evPtr, int flags);
+
+static Tcl_ChannelType vfsMemChannelType = {
+    "vfsmem",
+    TCL_CHANNEL_VERSION_3,
+    VfsMemClose,
+    VfsMemInput,
+    VfsMemOutput,
+    VfsMemSeek,
+    VfsMemSetOption,
+    VfsMemGetOption,
+    VfsMemWatch,
+    VfsMemGetHandle,
+    NULL,			/* close2Proc */
+    NULL,			/* blockModeProc */
+    NULL,			/* flushProc */
+    NULL,			/* handlerProc */
+    VfsMemWideSeek
+};
+
+/*
+ * struct VfsSharedMount --
+ * 
+ * A mount made with 'vfs::filesystem mount -shared' (or Vfs_Mount with
+ * VFS_MOUNT_SHARED) is visible to every thread of the process, not
+ * just the one which made it.  It is described by one of these, kept
+ * in the process-wide list 'sharedMounts' while it is mounted.
+ * 
+ * The list rarely changes, so rather than take 'vfsSharedMutex' for
+ * every path lookup, each thread compares 'sharedMountEpoch' with the
+ * value it saw last, and only when that has moved brings its own mount
+ * table up to date (see VfsSyncSharedMounts).  It does this by adding
+ * a proxy VfsMount for each shared mount of another thread, and
+ * dropping the proxies of those which have been unmounted.
+ * 
+ * Operations on a proxy are carried out by the owning thread, whose
+ * interpreter is the only one which can evaluate the mount's command:
+ * they are queued to it as events and the calling thread waits for
+ * the result (see VfsRemoteCall).  The owner must therefore service
+ * its event loop.  A C driver mounted with VFS_MOUNT_THREADSAFE is
+ * instead called directly by every thread, and its unmountProc is
+ * called once the last proxy for it has gone.
+ * 
+ * A shared mount may also have a pool of worker threads (see VfsPool),
+ * each with its own interpreter and its own private mount of the same
+ * path, to which other threads send their read-only operations.
+ * 
+ * Everything but 'mounted', 'refCount', 'busy' and 'poolPtr' is
+ * constant once the structure is in the list; those are protected by
+ * the mutex.
+ */
+
+typedef struct VfsSharedMount {
+    char *mountPoint;
+    int mountLen;
+    int isVolume;
+    char *mountCmd;               /* String form of the owner's command,
+                                   * for 'vfs::filesystem info'. */
+    Tcl_ThreadId owner;           /* Thread which made the mount */
+    int mounted;                  /* Cleared once it is unmounted */
+    CONST Vfs_Driver *driverPtr;  /* Driver to call directly, if it */
+    ClientData driverData;        /* is thread-safe, or NULL. */
+    int refCount;                 /* The owner's mount, proxies, and
+                                   * channels opened through proxies. */
+    int busy;                     /* Calls queued to the owner */
+    struct VfsPool *poolPtr;      /* Workers for read-only calls, or NULL */
+    struct VfsSharedMount *nextPtr;
+} VfsSharedMount;
+
+/*
+ * struct VfsPool --
+ * 
+ * The worker threads of a mount made with 'vfs::filesystem mount
+ * -pool'.  Each worker creates an interpreter, evaluates the init
+ * script there (which should load whatever implements the mount's
+ * command, opening its own handle on the archive or server), and
+ * mounts the same path privately.  It is described to other threads
+ * by a VfsSharedMount of its own, not in 'sharedMounts', to which
+ * calls are dispatched just as to the owner of a shared mount; the
+ * least busy worker is chosen for each.  Operations which change the
+ * filesystem are still carried out by the owner.
+ * 
+ * 'state' and 'errorStr' are protected by 'vfsSharedMutex'.
+ */
+
+typedef struct VfsPoolWorker {
+    struct VfsPool *poolPtr;
+    VfsSharedMount *recordPtr;    /* Owned by the worker thread */
+    Tcl_ThreadId thread;
+    int state;                    /* 0 starting, 1 serving, -1 failed */
+    char *errorStr;               /* Why it failed */
+    int quit;                     /* Set by VfsPoolQuitProc */
+} VfsPoolWorker;
+
+typedef struct VfsPool {
+    int size;
+    VfsPoolWorker *workers;
+    char *initScript;
+    char *autoPath;               /* The owner's, so the workers can
+                                   * find the same packages */
+    char *version;                /* Of vfs, to load in the workers */
+    int isAsync;                  /* Do the workers mount with -async? */
+    Tcl_Condition cond;           /* Notified as each worker starts */
+    int stopped;
+} VfsPool;
+
+typedef struct VfsPoolQuitEvent {
+    Tcl_Event header;
+    VfsPoolWorker *workerPtr;
+} VfsPoolQuitEvent;
+
+/*
+ * A thread which has cache entries, one of those the memory limit is
+ * shared out among (see VfsCacheTrim).
+ */
+typedef struct VfsCacheThread {
+    Tcl_ThreadId thread;
+    Tcl_WideInt bytes;            /* Charged for its entries */
+    int linked;                   /* Is it on vfsCacheThreads? */
+    int trimQueued;               /* Has it been asked to trim? */
+    struct VfsCacheThread *nextPtr;
+} VfsCacheThread;
+
+static VfsSharedMount *sharedMounts = NULL;
+static int sharedMountEpoch = 1;
+static unsigned long memChannelCount = 0;
+static VfsMemChannel *vfsMemChannels = NULL;
+static Tcl_WideInt vfsCacheBytes = 0;   /* Charged for the caches of all
+                                         * threads' mounts */
+static Tcl_WideInt vfsMemoryLimit = 0;  /* Beyond which they are trimmed,
+                                         * or 0 */
+static VfsCacheThread *vfsCacheThreads = NULL;
+static int vfsNumCacheThreads = 0;
+TCL_DECLARE_MUTEX(vfsSharedMutex)
+
+#ifdef VFS_MEMFD_LOAD
+/*
+ * struct VfsLoadedLib --
+ * 
+ * A shared library loaded from a mount, copied into a memory file
+ * (memfd_create) which the native filesystem then loads as
+ * /proc/self/fd/N.  These are kept in the process-wide list
+ * 'loadedLibs', so that a library with the same contents is only
+ * materialized once however many interpreters or threads load it,
+ * wherever it is found.  The descriptors are never closed: the
+ * dynamic linker recognizes libraries it has already loaded by name,
+ * so none of these names may come to mean another file.
+ */
+
+typedef struct VfsLoadedLib {
+    Tcl_WideUInt hash;            /* FNV-1a hash of the contents */
+    int size;
+    int fd;
+    struct VfsLoadedLib *nextPtr;
+} VfsLoadedLib;
+
+static VfsLoadedLib *loadedLibs = NULL;
+TCL_DECLARE_MUTEX(vfsLoadMutex)
+
+/* The load proc of a filesystem of version 2 (Tcl 8.6) takes flags */
+typedef int (VfsLoadFileProc2) _ANSI_ARGS_((Tcl_Interp *interp, 
+	Tcl_Obj *pathPtr, Tcl_LoadHandle *handlePtr, 
+	Tcl_FSUnloadFileProc **unloadProcPtr, int flags));
+static VfsLoadFileProc2 VfsLoadFile;
+#define VFS_LOAD_CHUNK 65536
+#endif /* VFS_MEMFD_LOAD */
+
+/*
+ * struct VfsRemoteCall --
+ * 
+ * An operation on a shared mount, passed from the calling thread to
+ * the owning thread.  The caller fills in 'op' and its arguments
+ * (which point into the caller's own data: it is blocked until the
+ * owner sets 'done'), and the owner performs the same filesystem
+ * function on a new path object of its own and fills in the results.
+ * Tcl_Objs cannot cross threads, so everything is passed as strings;
+ * channels are moved with Tcl_CutChannel and Tcl_SpliceChannel.
+ *
+ * The owner may itself be waiting for a call of its own, to a mount of
+ * the caller's or of a third thread which is waiting for it in turn,
+ * in which case it would never service its event loop.  So each event
+ * is also kept on 'vfsRemotePending' until one side claims it, and a
+ * thread waiting for a call of its own carries out those addressed to
+ * it there (see VfsRemoteDispatch); 'vfsRemoteWaiting' lists the calls
+ * being waited for, so that their threads can be woken for this.
+ */
+
+/* Operations forwarded besides those of enum VfsOp */
+#define VFS_OP_FILEATTRSGET	(VFS_OP_COUNT)
+#define VFS_OP_FILEATTRSSET	(VFS_OP_COUNT+1)
+#define VFS_OP_INVALIDATE	(VFS_OP_COUNT+2)
+#define VFS_OP_CLOSE		(VFS_OP_COUNT+3)
+
+typedef struct VfsRemoteCall {
+    int op;
+    VfsSharedMount *sharedPtr;
+    CONST char *path;             /* The caller's path strings */
+    CONST char *destPath;         /* For copies and renames */
+    int intArg;                   /* Mode, recursive flag, attribute 
+                                   * index or glob type */
+    int permissions;
+    int haveTypes;                /* Was a glob type given? */
+    CONST char *strArg;           /* Glob pattern or attribute value */
+    Tcl_StatBuf *statBufPtr;
+    struct utimbuf *tval;
+    Tcl_Channel chan;             /* Opened, or to be closed */
+    Tcl_CloseProc *closeProc;     /* Close handler to run in the */
+    ClientData closeData;         /* owner for VFS_OP_CLOSE. */
+    int result;                   /* Result of the operation, and */
+    int errNum;                   /* errno in the owning thread. */
+    char *resultStr;              /* Glob result, attribute names or
+                                   * value, or error message; allocated
+                                   * by the owner and freed by the
+                                   * caller. */
+    int done;
+    Tcl_Condition cond;
+    Tcl_ThreadId caller;          /* Thread waiting for it */
+    struct VfsRemoteCall *nextWaiting;
+} VfsRemoteCall;
+
+typedef struct VfsRemoteEvent {
+    Tcl_Event header;
+    VfsRemoteCall *callPtr;       /* NULL once claimed */
+    Tcl_ThreadId owner;           /* Thread it is queued to */
+    struct VfsRemoteEvent *nextPending;
+} VfsRemoteEvent;
+
+/* Protected by vfsSharedMutex */
+static VfsRemoteEvent *vfsRemotePending = NULL;
+static VfsRemoteCall *vfsRemoteWaiting = NULL;
+
 
 /*
  * Forward declarations for procedures defined later in this file:
@@ -156,6 +881,21 @@ typedef struct VfsChannelCleanupInfo {
 static int		 VfsFilesystemObjCmd _ANSI_ARGS_((ClientData dummy,
 			    Tcl_Interp *interp, int objc, 
 			    Tcl_Obj *CONST objv[]));
+static int		 VfsMemchanObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
+static int		 VfsMemdataObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
+static int		 VfsAsyncReturnObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
+static int		 VfsPrefetchDoneObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
+static int		 VfsChannelReadyObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
 
 /* 
  * Now we define the virtual filesystem callbacks.  Note that some
@@ -177,6 +917,9 @@ static Tcl_FSFileAttrStringsProc VfsFileAttrStrings;
 static Tcl_FSFileAttrsGetProc VfsFileAttrsGet;
 static Tcl_FSFileAttrsSetProc VfsFileAttrsSet;
 static Tcl_FSUtimeProc VfsUtime;
+static Tcl_FSCopyFileProc VfsCopyFile;
+static Tcl_FSRenameFileProc VfsRenameFile;
+static Tcl_FSCopyDirectoryProc VfsCopyDirectory;
 static Tcl_FSPathInFilesystemProc VfsPathInFilesystem;
 static Tcl_FSFilesystemPathTypeProc VfsFilesystemPathType;
 static Tcl_FSFilesystemSeparatorProc VfsFilesystemSeparator;
@@ -184,6 +927,24 @@ static Tcl_FSFreeInternalRepProc VfsFreeInternalRep;
 static Tcl_FSDupInternalRepProc VfsDupInternalRep;
 static Tcl_FSListVolumesProc VfsListVolumes;
 
+#ifdef VFS_USDT
+/* The same, firing the fs__entry and fs__return probes */
+static Tcl_FSStatProc VfsProbedStat;
+static Tcl_FSAccessProc VfsProbedAccess;
+static Tcl_FSOpenFileChannelProc VfsProbedOpenFileChannel;
+static Tcl_FSMatchInDirectoryProc VfsProbedMatchInDirectory;
+static Tcl_FSDeleteFileProc VfsProbedDeleteFile;
+static Tcl_FSCreateDirectoryProc VfsProbedCreateDirectory;
+static Tcl_FSRemoveDirectoryProc VfsProbedRemoveDirectory; 
+static Tcl_FSFileAttrStringsProc VfsProbedFileAttrStrings;
+static Tcl_FSFileAttrsGetProc VfsProbedFileAttrsGet;
+static Tcl_FSFileAttrsSetProc VfsProbedFileAttrsSet;
+static Tcl_FSUtimeProc VfsProbedUtime;
+static Tcl_FSCopyFileProc VfsProbedCopyFile;
+static Tcl_FSRenameFileProc VfsProbedRenameFile;
+static Tcl_FSCopyDirectoryProc VfsProbedCopyDirectory;
+#endif
+
 static Tcl_Filesystem vfsFilesystem = {
     "tclvfs",
     sizeof(Tcl_Filesystem),
@@ -202,50 +963,68 @@ static Tcl_Filesystem vfsFilesystem = {
     NULL,
     &VfsFilesystemPathType,
     &VfsFilesystemSeparator,
-    &VfsStat,
-    &VfsAccess,
-    &VfsOpenFileChannel,
-    &VfsMatchInDirectory,
-    &VfsUtime,
+    VFS_FS_PROC(Stat),
+    VFS_FS_PROC(Access),
+    VFS_FS_PROC(OpenFileChannel),
+    VFS_FS_PROC(MatchInDirectory),
+    VFS_FS_PROC(Utime),
     /* We choose not to support symbolic links inside our vfs's */
     NULL,
     &VfsListVolumes,
-    &VfsFileAttrStrings,
-    &VfsFileAttrsGet,
-    &VfsFileAttrsSet,
-    &VfsCreateDirectory,
-    &VfsRemoveDirectory, 
-    &VfsDeleteFile,
-    /* No copy file - fallback will occur at Tcl level */
-    NULL,
-    /* No rename file - fallback will occur at Tcl level */
-    NULL,
-    /* No copy directory - fallback will occur at Tcl level */
-    NULL, 
+    VFS_FS_PROC(FileAttrStrings),
+    VFS_FS_PROC(FileAttrsGet),
+    VFS_FS_PROC(FileAttrsSet),
+    VFS_FS_PROC(CreateDirectory),
+    VFS_FS_PROC(RemoveDirectory),
+    VFS_FS_PROC(DeleteFile),
+    /* 
+     * Copies and renames within one mount are offered to its handler,
+     * otherwise fallback will occur at Tcl level.
+     */
+    VFS_FS_PROC(CopyFile),
+    VFS_FS_PROC(RenameFile),
+    VFS_FS_PROC(CopyDirectory),
     /* Use stat for lstat */
     NULL,
+#ifdef VFS_MEMFD_LOAD
+    (Tcl_FSLoadFileProc *) &VfsLoadFile,
+#else
     /* No load - fallback on core implementation */
     NULL,
+#endif
     /* We don't need a getcwd or chdir - fallback on Tcl's versions */
     NULL,
     NULL
 };
 
 /*
- * struct VfsMount --
+ * struct VfsKey --
  * 
- * Each filesystem mount point which is registered will result in
- * the allocation of one of these structures.  They are stored
- * in a linked list whose head is 'listOfMounts'.
+ * Key used for our mount point hash tables.  It allows us to look up
+ * any prefix of a normalized path without first copying that prefix
+ * into a separate nul-terminated string.  Entries store their own
+ * nul-terminated copy of the key.
  */
 
-typedef struct VfsMount {
-    CONST char* mountPoint;
-    int mountLen;
-    int isVolume;
-    Vfs_InterpCmd interpCmd;
-    struct VfsMount* nextMount;
-} VfsMount;
+typedef struct VfsKey {
+    CONST char *string;
+    int length;
+} VfsKey;
+
+static unsigned int     VfsHashKey(Tcl_HashTable *tablePtr, VOID *keyPtr);
+static int              VfsCompareKeys(VOID *keyPtr, Tcl_HashEntry *hPtr);
+static Tcl_HashEntry*   VfsAllocKeyEntry(Tcl_HashTable *tablePtr, 
+					 VOID *keyPtr);
+static void             VfsFreeKeyEntry(Tcl_HashEntry *hPtr);
+
+static Tcl_HashKeyType vfsKeyType = {
+    TCL_HASH_KEY_TYPE_VERSION,	/* version */
+    0,				/* flags */
+    VfsHashKey,			/* hashKeyProc */
+    VfsCompareKeys,		/* compareKeysProc */
+    VfsAllocKeyEntry,		/* allocEntryProc */
+    VfsFreeKeyEntry		/* freeEntryProc */
+};
 
 #define TCL_TSD_INIT(keyPtr)	(ThreadSpecificData *)Tcl_GetThreadData((keyPtr), sizeof(ThreadSpecificData))
 
@@ -264,21 +1043,159 @@ typedef struct VfsMount {
  * a tclvfs implementation.  This is most useful for debugging.
  *
  * When it is not NULL we keep a refCount on it.
+ *
+ * The mount point indices are:
+ *
+ * mountTable -- maps each mount point to its (most recently added)
+ * VfsMount, from which any older ones are chained through 'shadowed'.
+ *
+ * rootTable -- maps the first component of each mount point (see
+ * VfsRootKeyLength) to the number of mounts which start with it.  A
+ * path whose first component is not in this table cannot be inside
+ * any mount, which lets us reject almost all native paths with a
+ * single probe.  Mounts of a bare root directory ("/") would match
+ * every path, so they are just counted in 'rootMounts' and disable
+ * this filter while they exist.
+ *
+ * dirTable -- maps the directory containing each mount point to the
+ * chain of mounts (linked through 'nextSibling') directly inside it.
+ *
+ * maxMountLen is the length of the longest mount point, so we need
+ * not probe for longer prefixes at all.  When that mount goes during
+ * a batch (see VfsBeginMounts) it is only worked out again at the end,
+ * 'maxMountStale' being set meanwhile; until then it is merely too
+ * long, which is harmless.
+ *
+ * The remaining fields hold the objects shared by all callbacks made
+ * from this thread (each created on first use, and holding a
+ * refCount), the free list of VfsNativeRep structures, and the state
+ * of the thread's proxies for shared mounts.
  */
 
+/* Keys understood in a 'stat' handler result */
+
+enum VfsStatField {
+    VFS_STAT_DEV, VFS_STAT_INO, VFS_STAT_MODE, VFS_STAT_NLINK, 
+    VFS_STAT_UID, VFS_STAT_GID, VFS_STAT_SIZE, VFS_STAT_ATIME, 
+    VFS_STAT_MTIME, VFS_STAT_CTIME, VFS_STAT_TYPE, VFS_STAT_COUNT
+};
+
 typedef struct ThreadSpecificData {
     VfsMount *listOfMounts;
     Tcl_Obj *vfsVolumes;
     Tcl_Obj *internalErrorScript;
+    int mountTablesInit;
+    Tcl_HashTable mountTable;
+    Tcl_HashTable rootTable;
+    Tcl_HashTable dirTable;
+    int rootMounts;
+    int maxMountLen;
+    int maxMountStale;
+    Tcl_Obj *opNames[VFS_OP_COUNT];
+    Tcl_Obj *smallInts[VFS_SMALL_INTS];
+    Tcl_Obj *modeObjs[6];
+    Tcl_Obj *emptyObj;
+    Tcl_Obj *patternObj;  /* Most recently used glob pattern */
+    VfsNativeRep *freeNativeReps;
+    VfsNativeRepSlab *nativeRepSlabs;
+    int statKeysInit;
+    Tcl_HashTable statKeyTable;  /* Stat key -> enum VfsStatField */
+    Tcl_Obj *statKeyObjs[VFS_STAT_COUNT];    /* Interned keys for dict lookups */
+    int sharedEpoch;      /* Value of sharedMountEpoch when our proxies
+                           * were last brought up to date. */
+    int exitHandlerInit;  /* Is VfsThreadExitProc set up for us? */
+    int exiting;          /* Set once it has run */
+    Tcl_Interp *proxyInterp;  /* Given to thread-safe drivers called
+                               * through our proxies. */
+    VfsSharedMount *servingPtr;   /* Shared mount whose operation we are
+                                   * carrying out for another thread */
+    int statsEnabled;     /* Are mounts' statistics being kept? */
+    long lookupMisses;    /* Paths found to be in no mount, if so */
+    VfsTrace *tracePtr;   /* Callbacks recorded, or NULL */
+    int mountBatch;       /* Nesting of VfsBeginMounts */
+    int mountsChanged;    /* Have mounts changed since the outermost
+                           * VfsBeginMounts? */
+    int asyncInit;
+    Tcl_HashTable asyncTable; /* Key -> VfsAsyncCall, for the handler
+                               * coroutines of -async mounts */
+    int asyncCount;       /* Key of the most recent of those */
+    Tcl_Obj *asyncLambda; /* Body run by each of those coroutines */
+    VfsPendingClose *pendingCloses;   /* Queue of deferred close */
+    VfsPendingClose **pendingTail;    /* callbacks, and its end */
+    int closeIdle;        /* Is VfsCloseIdleProc scheduled? */
+    int closeRunning;     /* Is one of them running? */
+    Tcl_Obj *closeErrors; /* List of path and message for each that
+                           * failed, for 'vfs::filesystem sync' */
+    int prefetchInit;
+    Tcl_HashTable prefetchTable;  /* Id -> VfsPrefetch */
+    Tcl_HashTable prefetchCalls;  /* Serial -> VfsPrefetchCall */
+    int prefetchIds;      /* Last prefetch id handed out */
+    int prefetchCount;    /* Last call serial handed out */
+    int normCacheInit;
+    Tcl_HashTable normCache;  /* Absolute path -> its VfsNormEntry */
+    int normEpoch;        /* sharedMountEpoch when normCache was begun */
+    int spillSizeSet;     /* Has 'vfs::filesystem spillsize' been used? */
+    Tcl_WideInt spillSize;  /* If so, what it set */
+    struct VfsCacheLink *cacheHead; /* Cache entries of our mounts, */
+    struct VfsCacheLink *cacheTail; /* most recently used first */
+    VfsCacheThread cacheThread;   /* What they take, under vfsSharedMutex */
+    int readyInit;        /* Is the table, and our event source, set up? */
+    Tcl_HashTable readyTable; /* Tcl_Channel -> VfsReadyChannel, for
+                               * the always ready channels watched */
 } ThreadSpecificData;
+
+/* Must callbacks be timed? */
+#define VfsTiming(tsdPtr) \
+    ((tsdPtr)->statsEnabled \
+	    || ((tsdPtr)->tracePtr != NULL && (tsdPtr)->tracePtr->active))
 static Tcl_ThreadDataKey dataKey;
 
+/* 
+ * Bring this thread's proxies up to date if another thread has
+ * changed its shared mounts.  An unlocked read suffices: the thread
+ * which made the change then bumps Tcl's own filesystem epoch, which
+ * makes Tcl come back to us.
+ */
+
+#define VfsCheckSharedMounts(tsdPtr) \
+    if ((tsdPtr)->sharedEpoch != sharedMountEpoch) { \
+	VfsSyncSharedMounts(tsdPtr); \
+    }
+
 /* We might wish to consider exporting these in the future */
 
-static int             Vfs_AddMount(Tcl_Obj* mountPoint, int isVolume, 
-				    Tcl_Interp *interp, Tcl_Obj* mountCmd);
+static int             Vfs_AddMount(Tcl_Obj* mountPoint, int flags, 
+				    Tcl_Interp *interp, Tcl_Obj* mountCmd,
+				    long cacheTtl, CONST Vfs_Driver *driverPtr,
+				    ClientData driverData);
 static int             Vfs_RemoveMount(Tcl_Obj* mountPoint, Tcl_Interp* interp);
+static VfsMount*       VfsNewMount(ThreadSpecificData *tsdPtr, 
+				   CONST char *mountPoint, int len,
+				   int isVolume, Tcl_Interp *interp, 
+				   Tcl_Obj *mountCmd, long cacheTtl,
+				   CONST Vfs_Driver *driverPtr,
+				   ClientData driverData);
+static void            VfsBeginMounts(ThreadSpecificData *tsdPtr);
+static void            VfsEndMounts(ThreadSpecificData *tsdPtr);
+static void            VfsMountsChanged(ThreadSpecificData *tsdPtr);
+static int             VfsMountOne(Tcl_Interp *interp, Tcl_Obj *pathObj,
+				   Tcl_Obj *cmdObj, int flags, long cacheTtl,
+				   int poolSize, Tcl_Obj *initScript);
+static int             VfsMountBatch(Tcl_Interp *interp, Tcl_Obj *listObj,
+				     int flags, long cacheTtl, int poolSize,
+				     Tcl_Obj *initScript);
+static int             VfsUnmountBatch(Tcl_Interp *interp, 
+				       Tcl_Obj *listObj);
+static void            VfsUnlinkMount(ThreadSpecificData *tsdPtr, 
+				      VfsMount *mountPtr);
+static void            VfsFindMaxMountLen(ThreadSpecificData *tsdPtr);
 static Vfs_InterpCmd*  Vfs_FindMount(Tcl_Obj *pathMount, int mountLen);
+static VfsMount*       VfsLookupMount(ThreadSpecificData *tsdPtr,
+				      CONST char *path, int len);
+static void            VfsIndexMount(ThreadSpecificData *tsdPtr, 
+				     VfsMount *mountPtr);
+static void            VfsUnindexMount(ThreadSpecificData *tsdPtr, 
+				       VfsMount *mountPtr);
 static Tcl_Obj*        Vfs_ListMounts(void);
 static void            Vfs_UnregisterWithInterp _ANSI_ARGS_((ClientData, 
 							     Tcl_Interp*));
@@ -287,14 +1204,124 @@ static void            Vfs_RegisterWithInterp _ANSI_ARGS_((Tcl_Interp*));
 /* Some private helper procedures */
 
 static VfsNativeRep*   VfsGetNativePath(Tcl_Obj* pathPtr);
+static VfsNativeRep*   VfsAllocNativeRep(ThreadSpecificData *tsdPtr);
 static Tcl_CloseProc   VfsCloseProc;
+static void            VfsCloseDefer(VfsChannelCleanupInfo *channelRet);
+static Tcl_IdleProc    VfsCloseIdleProc;
+static VfsPendingClose* VfsCloseFind(Tcl_Obj *pathPtr);
+static int             VfsCloseConflict(ThreadSpecificData *tsdPtr,
+				VfsMount *mountPtr, int op, 
+				Tcl_Obj *relativeObj);
+static void            VfsCloseRun(ThreadSpecificData *tsdPtr, 
+				   VfsMount *mountPtr);
+static void            VfsCloseDiscard(ThreadSpecificData *tsdPtr, 
+				       Tcl_Interp *interp);
+static int             VfsCloseSync(Tcl_Interp *interp, VfsMount *mountPtr);
+static Tcl_Channel     VfsNewMemChannel(Tcl_Obj *dataObj, VfsSpill *spillPtr,
+					 int mode, CONST char *name);
+static unsigned char*  VfsMemReserve(VfsMemChannel *memPtr, int length);
+static int             VfsMemSpill(VfsMemChannel *memPtr);
+static void            VfsMemTrack(Tcl_Channel chan, VfsMount *mountPtr);
+static void            VfsMemUnlink(VfsMemChannel *memPtr);
+static void            VfsMemForget(VfsMount *mountPtr);
+static int             VfsMemoryCmd(Tcl_Interp *interp, int objc, 
+				    Tcl_Obj *CONST objv[]);
+static Tcl_Obj*        VfsMemoryReport(Tcl_Obj *pathPtr);
+static void            VfsCacheAdd(VfsMount *mountPtr, Tcl_HashEntry *hPtr,
+				   struct VfsCacheLink *linkPtr, int size);
+static void            VfsCacheTouch(struct VfsCacheLink *linkPtr);
+static void            VfsCacheDrop(struct VfsCacheLink *linkPtr);
+static void            VfsCacheCharge(ThreadSpecificData *tsdPtr, 
+				      Tcl_WideInt size);
+static int             VfsCacheOverShare(VfsCacheThread *threadPtr);
+static void            VfsCacheTrim(ThreadSpecificData *tsdPtr,
+				    struct VfsCacheLink *keepPtr);
+static Tcl_EventProc   VfsCacheTrimEventProc;
+static VfsSpill*       VfsSpillCreate(void);
+static void            VfsSpillRelease(VfsSpill *spillPtr);
+static int             VfsSpillOwn(VfsMemChannel *memPtr);
+static int             VfsSpillRead(VfsSpill *spillPtr, char *buf, 
+				    int toRead, Tcl_WideInt offset);
+static int             VfsSpillWrite(VfsSpill *spillPtr, CONST char *buf, 
+				     int toWrite, Tcl_WideInt offset);
 static void            VfsExitProc(ClientData clientData);
 static void            VfsThreadExitProc(ClientData clientData);
+static void            VfsNormCacheFlush(ThreadSpecificData *tsdPtr);
 static Tcl_Obj*	       VfsFullyNormalizePath(Tcl_Interp *interp, 
 				             Tcl_Obj *pathPtr);
-static Tcl_Obj*        VfsBuildCommandForPath(Tcl_Interp **iRef, 
-			          CONST char* cmd, Tcl_Obj * pathPtr);
+static VfsNativeRep*   VfsGetRelativePath(Tcl_Obj *pathPtr);
+static int             VfsNoDriverProc(void);
+static void            VfsShareMount(VfsMount *mountPtr, int threadSafe);
+static VfsSharedMount* VfsNewShared(CONST char *mountPoint, int mountLen,
+				    int isVolume, CONST char *mountCmd);
+static void            VfsUnshareMount(VfsSharedMount *sharedPtr);
+static void            VfsReleaseShared(VfsSharedMount *sharedPtr);
+static void            VfsSyncSharedMounts(ThreadSpecificData *tsdPtr);
+static VfsSharedMount* VfsGetRemote(Tcl_Obj *pathPtr, int readOnly);
+static int             VfsPoolStart(Tcl_Interp *interp, Tcl_Obj *mountPoint,
+				    int size, Tcl_Obj *initScript);
+static void            VfsPoolStop(VfsPool *poolPtr);
+static void            VfsPoolFree(VfsPool *poolPtr);
+static Tcl_ThreadCreateProc VfsPoolThread;
+static int             VfsPoolQuitProc(Tcl_Event *evPtr, int flags);
+static VfsSharedMount* VfsServingShared(void);
+static void            VfsRemoteInit(VfsRemoteCall *callPtr, int op,
+				     VfsSharedMount *sharedPtr, 
+				     Tcl_Obj *pathPtr);
+static int             VfsRemoteDispatch(VfsRemoteCall *callPtr);
+static int             VfsRemoteClose(VfsSharedMount *sharedPtr, 
+				      Tcl_CloseProc *closeProc,
+				      ClientData closeData, Tcl_Channel chan);
+static int             VfsRemoteEventProc(Tcl_Event *evPtr, int flags);
+static VfsRemoteCall*  VfsRemoteClaim(VfsRemoteEvent *evPtr);
+static void            VfsRemoteRun(VfsRemoteCall *callPtr);
+static int             VfsRemoteCancel(Tcl_Event *evPtr, 
+				       ClientData clientData);
+static void            VfsRemoteExecute(VfsRemoteCall *callPtr);
+static int             VfsCopyOrRename(int op, Tcl_Obj *srcPathPtr,
+				       Tcl_Obj *destPathPtr, 
+				       Tcl_Obj **errorPtr);
+static void            VfsCacheInvalidate(VfsMount *mountPtr, 
+					  CONST char *relative, int len,
+					  int recursive);
+static void            VfsCacheFree(VfsMount *mountPtr);
+static int             VfsCallbackInit(VfsCallback *cbPtr, int op,
+				        Tcl_Obj *pathPtr);
+static void            VfsCallbackAppend(VfsCallback *cbPtr, 
+					  Tcl_Obj *objPtr);
+static int             VfsCallbackEval(VfsCallback *cbPtr);
+static int             VfsAsyncEval(VfsCallback *cbPtr);
+static void            VfsCallbackFree(VfsCallback *cbPtr);
+static void            VfsCallbackStats(VfsCallback *cbPtr, int returnVal);
+static VfsMountStats*  VfsGetStats(VfsMount *mountPtr);
+static void            VfsTimingRecord(VfsMount *mountPtr, int op,
+			    int returnVal, Tcl_Time *startPtr,
+			    Tcl_Obj *rootObj, Tcl_Obj *relativeObj,
+			    Tcl_WideInt bytes);
+static void            VfsStatsRecord(VfsMount *mountPtr, int op, 
+				      int returnVal, Tcl_WideInt elapsed);
+static Tcl_Obj*        VfsStatsObj(VfsMount *mountPtr, int reset);
+static void            VfsTraceStart(ThreadSpecificData *tsdPtr, int size,
+				     Tcl_WideInt threshold);
+static void            VfsTraceFree(ThreadSpecificData *tsdPtr);
+static Tcl_Obj*        VfsTraceDump(ThreadSpecificData *tsdPtr);
+static void            VfsReleaseMount(VfsMount *mountPtr);
+static Tcl_Obj*        VfsIntObj(int value);
+static Tcl_Obj*        VfsGetMode(int mode);
+static Tcl_Obj*        VfsPatternObj(CONST char *pattern);
 static void            VfsInternalError(Tcl_Interp* interp);
+static int             VfsStatBufCmd(Tcl_Interp *interp, int objc,
+				     Tcl_Obj *CONST objv[]);
+static int             VfsStatManyCmd(Tcl_Interp *interp, Tcl_Obj *dirPtr,
+				      Tcl_Obj *namesPtr, int lstat);
+static int             VfsPrefetchCmd(Tcl_Interp *interp, int objc,
+				      Tcl_Obj *CONST objv[]);
+static Tcl_IdleProc    VfsPrefetchIdleProc;
+static Tcl_TimerProc   VfsPrefetchTimeout;
+static void            VfsPrefetchDiscard(ThreadSpecificData *tsdPtr,
+					  Tcl_Interp *interp);
+static void            VfsPrefetchFree(ThreadSpecificData *tsdPtr,
+				       VfsPrefetch *prefetchPtr);
 
 /* 
  * Hard-code platform dependencies.  We do not need to worry 
@@ -321,7 +1348,7 @@ static void            VfsInternalError(Tcl_Interp* interp);
  *	message in the interp's result if an error occurs.
  *
  * Side effects:
- *	Adds a command to the Tcl interpreter.
+ *	Adds commands to the Tcl interpreter.
  *
  *----------------------------------------------------------------------
  */
@@ -349,7 +1376,8 @@ Vfs_Init(interp)
     /* keep in sync with actual version */
 #define PACKAGE_VERSION "1.4"
 #endif
-    if (Tcl_PkgProvide(interp, "vfs", PACKAGE_VERSION) == TCL_ERROR) {
+    if (Tcl_PkgProvideEx(interp, "vfs", PACKAGE_VERSION, 
+			 (ClientData) &vfsStubs) == TCL_ERROR) {
         return TCL_ERROR;
     }
 
@@ -360,6 +1388,18 @@ Vfs_Init(interp)
 
     Tcl_CreateObjCommand(interp, "vfs::filesystem", VfsFilesystemObjCmd, 
 	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::memchan", VfsMemchanObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::memdata", VfsMemdataObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::AsyncReturn", VfsAsyncReturnObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::PrefetchDone", VfsPrefetchDoneObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::ChannelReady", VfsChannelReadyObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vfs::ZipIndex", VfsZipIndexObjCmd, 
+	    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
     Vfs_RegisterWithInterp(interp);
     return TCL_OK;
 }
@@ -387,6 +1427,7 @@ Vfs_RegisterWithInterp(interp)
     Tcl_Interp *interp;
 {
     ClientData vfsAlreadyRegistered;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
     /* 
      * We need to know if the interpreter is deleted, so we can
      * remove all interp-specific mounts.
@@ -401,7 +1442,10 @@ Vfs_RegisterWithInterp(interp)
     if (vfsAlreadyRegistered == NULL) {
 	Tcl_FSRegister((ClientData)1, &vfsFilesystem);
 	Tcl_CreateExitHandler(VfsExitProc, (ClientData)NULL);
+    }
+    if (!tsdPtr->exitHandlerInit) {
 	Tcl_CreateThreadExitHandler(VfsThreadExitProc, NULL);
+	tsdPtr->exitHandlerInit = 1;
     }
 }
    
@@ -411,13 +1455,15 @@ Vfs_RegisterWithInterp(interp)
  *
  * Vfs_UnregisterWithInterp --
  *
- *	Remove all of the mount points that this interpreter handles.
+ *	Remove all of the mount points that this interpreter handles,
+ *	in a single pass over the mount list.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	None.
+ *	Tcl is told once that the mounts have changed, if any were
+ *	removed.
  *
  *----------------------------------------------------------------------
  */
@@ -426,11 +1472,23 @@ Vfs_UnregisterWithInterp(dummy, interp)
     ClientData dummy;
     Tcl_Interp *interp;
 {
-    int res = TCL_OK;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    VfsMount *mountPtr, *nextPtr;
+
+    /* It is too late to run their deferred close callbacks */
+    VfsCloseDiscard(tsdPtr, interp);
+    VfsPrefetchDiscard(tsdPtr, interp);
     /* Remove all of this interpreters mount points */
-    while (res == TCL_OK) {
-        res = Vfs_RemoveMount(NULL, interp);
+    VfsBeginMounts(tsdPtr);
+    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+	 mountPtr = nextPtr) {
+	nextPtr = mountPtr->nextMount;
+	if (mountPtr->interpCmd.interp == interp && !mountPtr->isProxy) {
+	    VfsUnlinkMount(tsdPtr, mountPtr);
+	    VfsMountsChanged(tsdPtr);
+	}
     }
+    VfsEndMounts(tsdPtr);
     /* Make sure our assoc data has been deleted */
     Tcl_DeleteAssocData(interp, "vfs::inUse");
 }
@@ -443,7 +1501,9 @@ Vfs_UnregisterWithInterp(dummy, interp)
  *
  *	Adds a new vfs mount point.  After this call all filesystem
  *	access within that mount point will be redirected to the
- *	interpreter/mountCmd pair.
+ *	interpreter/mountCmd pair, or if 'driverPtr' is given, to the
+ *	functions of that driver.  'flags' are the VFS_MOUNT_* flags
+ *	of Vfs_Mount.
  *	
  *	This command must not be called unless 'interp' has already
  *	been registered with 'Vfs_RegisterWithInterp' above.  This 
@@ -456,17 +1516,24 @@ Vfs_UnregisterWithInterp(dummy, interp)
  * Side effects:
  *	A new volume may be added to the list of available volumes.
  *	Future filesystem access inside the mountPoint will be 
- *	redirected.  Tcl is informed that a new mount has been added
- *	and this will make all cached path representations invalid.
+ *	redirected (in all threads, if the mount is shared).  Tcl is
+ *	informed that a new mount has been added (now, or at the end
+ *	of a batch) and this will make all cached path representations
+ *	invalid.
  *
  *----------------------------------------------------------------------
  */
 static int 
-Vfs_AddMount(mountPoint, isVolume, interp, mountCmd)
+Vfs_AddMount(mountPoint, flags, interp, mountCmd, cacheTtl, 
+	     driverPtr, driverData)
     Tcl_Obj* mountPoint;
-    int isVolume;
+    int flags;
     Tcl_Interp* interp;
-    Tcl_Obj* mountCmd;
+    Tcl_Obj* mountCmd;          /* Command prefix, or for a driver
+                                 * mount, its description. */
+    long cacheTtl;              /* See VfsMount. */
+    CONST Vfs_Driver *driverPtr;/* NULL for a Tcl mount. */
+    ClientData driverData;
 {
     char *strRep;
     int len;
@@ -484,65 +1551,162 @@ Vfs_AddMount(mountPoint, isVolume, interp, mountCmd)
         return TCL_ERROR;
     }
     
-    newMount = (VfsMount*) ckalloc(sizeof(VfsMount));
-    
-    if (newMount == NULL) {
-	return TCL_ERROR;
-    }
     strRep = Tcl_GetStringFromObj(mountPoint, &len);
-    newMount->mountPoint = (char*) ckalloc(1+(unsigned)len);
-    newMount->mountLen = len;
-    
-    if (newMount->mountPoint == NULL) {
-	ckfree((char*)newMount);
+    newMount = VfsNewMount(tsdPtr, strRep, len, 
+			   (flags & VFS_MOUNT_VOLUME) != 0, interp, mountCmd, 
+			   cacheTtl, driverPtr, driverData);
+    if (newMount == NULL) {
 	return TCL_ERROR;
     }
-    
-    strcpy((char*)newMount->mountPoint, strRep);
-    newMount->interpCmd.mountCmd = mountCmd;
-    newMount->interpCmd.interp = interp;
-    newMount->isVolume = isVolume;
-    Tcl_IncrRefCount(mountCmd);
-    
-    newMount->nextMount = tsdPtr->listOfMounts;
-    tsdPtr->listOfMounts = newMount;
-
-    if (isVolume) {
-	Vfs_AddVolume(mountPoint);
+    newMount->isAsync = (driverPtr == NULL && (flags & VFS_MOUNT_ASYNC));
+    newMount->asyncClose = (driverPtr == NULL 
+			    && (flags & VFS_MOUNT_ASYNCCLOSE));
+    if (flags & (VFS_MOUNT_SHARED|VFS_MOUNT_THREADSAFE)) {
+	VfsShareMount(newMount, 
+		(driverPtr != NULL && (flags & VFS_MOUNT_THREADSAFE)));
     }
-    Tcl_FSMountsChanged(&vfsFilesystem);
+    VfsMountsChanged(tsdPtr);
     return TCL_OK;
 }
 
-
 /*
  *----------------------------------------------------------------------
  *
- * Vfs_RemoveMount --
+ * VfsNewMount --
  *
- *	This procedure searches for a matching mount point and removes
- *	it if one is found.  If 'mountPoint' is given, then both it and
- *	the interpreter must match for a mount point to be removed.
- *	
- *	If 'mountPoint' is NULL, then the first mount point for the
- *	given interpreter is removed (if any).
+ *	Create a mount in this thread's mount table, for Vfs_AddMount
+ *	or as a proxy for another thread's shared mount.
  *
  * Results:
- *	TCL_OK if a mount was removed, TCL_ERROR otherwise.
+ *	The new mount, or NULL if memory could not be allocated.
  *
  * Side effects:
- *	A volume may be removed from the current list of volumes
- *	(as returned by 'file volumes').  A vfs may be removed from
- *	the filesystem.  If successful, Tcl will be informed that
- *	the list of current mounts has changed, and all cached file
- *	representations will be made invalid.
+ *	A new volume may be added to the list of available volumes.
+ *	Tcl is not told of the change.
  *
  *----------------------------------------------------------------------
  */
-static int 
-Vfs_RemoveMount(mountPoint, interp)
-    Tcl_Obj* mountPoint;
-    Tcl_Interp *interp;
+
+static VfsMount*
+VfsNewMount(tsdPtr, mountPoint, len, isVolume, interp, mountCmd, cacheTtl,
+	    driverPtr, driverData)
+    ThreadSpecificData *tsdPtr;
+    CONST char *mountPoint;
+    int len;
+    int isVolume;
+    Tcl_Interp* interp;
+    Tcl_Obj* mountCmd;
+    long cacheTtl;
+    CONST Vfs_Driver *driverPtr;
+    ClientData driverData;
+{
+    int objc, i;
+    Tcl_Obj **objv;
+    VfsMount *newMount;
+    
+    newMount = (VfsMount*) ckalloc(sizeof(VfsMount));
+    
+    if (newMount == NULL) {
+	return NULL;
+    }
+    newMount->mountPoint = (char*) ckalloc(1+(unsigned)len);
+    newMount->mountLen = len;
+    
+    if (newMount->mountPoint == NULL) {
+	ckfree((char*)newMount);
+	return NULL;
+    }
+    
+    memcpy((char*)newMount->mountPoint, mountPoint, (size_t)len);
+    ((char*)newMount->mountPoint)[len] = '\0';
+    newMount->interpCmd.mountCmd = mountCmd;
+    newMount->interpCmd.interp = interp;
+    newMount->isVolume = isVolume;
+    Tcl_IncrRefCount(mountCmd);
+
+    /* 
+     * Split the command prefix once, leaving room for the arguments
+     * of each callback after it.  Driver mounts use only the latter.
+     */
+    if (driverPtr != NULL) {
+	objc = 0;
+	objv = NULL;
+    }
+    if (driverPtr != NULL 
+	    || Tcl_ListObjGetElements(NULL, mountCmd, &objc, &objv) == TCL_OK) {
+	newMount->objv = (Tcl_Obj**) ckalloc(sizeof(Tcl_Obj*) 
+			* (objc + VFS_STD_ARGS + VFS_MAX_EXTRA_ARGS));
+	for (i = 0; i < objc; i++) {
+	    newMount->objv[i] = objv[i];
+	    Tcl_IncrRefCount(objv[i]);
+	}
+	newMount->prefixObjc = objc;
+    } else {
+	newMount->objv = NULL;
+	newMount->prefixObjc = 0;
+    }
+    newMount->objvInUse = 0;
+    newMount->refCount = 1;
+    newMount->cacheTtl = cacheTtl;
+    newMount->statCache = NULL;
+    newMount->globCache = NULL;
+    newMount->cacheBytes = 0;
+    newMount->driverPtr = driverPtr;
+    newMount->driverData = driverData;
+    newMount->sharedPtr = NULL;
+    newMount->statsPtr = NULL;
+    newMount->isProxy = 0;
+    newMount->isAsync = 0;
+    newMount->asyncClose = 0;
+    
+    newMount->prevMount = NULL;
+    newMount->nextMount = tsdPtr->listOfMounts;
+    if (tsdPtr->listOfMounts != NULL) {
+	tsdPtr->listOfMounts->prevMount = newMount;
+    }
+    tsdPtr->listOfMounts = newMount;
+    VfsIndexMount(tsdPtr, newMount);
+
+    if (isVolume) {
+	Tcl_Obj *volObj = Tcl_NewStringObj(mountPoint, len);
+	Tcl_IncrRefCount(volObj);
+	Vfs_AddVolume(volObj);
+	Tcl_DecrRefCount(volObj);
+    }
+    return newMount;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vfs_RemoveMount --
+ *
+ *	This procedure searches for a matching mount point and removes
+ *	it if one is found.  If 'mountPoint' is given, then both it and
+ *	the interpreter must match for a mount point to be removed.
+ *	
+ *	If 'mountPoint' is NULL, then the first mount point for the
+ *	given interpreter is removed (if any).  Proxies for the shared
+ *	mounts of other threads are never removed this way.
+ *
+ * Results:
+ *	TCL_OK if a mount was removed, TCL_ERROR otherwise.
+ *
+ * Side effects:
+ *	A volume may be removed from the current list of volumes
+ *	(as returned by 'file volumes').  A vfs may be removed from
+ *	the filesystem.  If successful, Tcl will be informed (now, or
+ *	at the end of a batch) that the list of current mounts has
+ *	changed, and all cached file representations will be made
+ *	invalid.
+ *
+ *----------------------------------------------------------------------
+ */
+static int 
+Vfs_RemoveMount(mountPoint, interp)
+    Tcl_Obj* mountPoint;
+    Tcl_Interp *interp;
 {
     /* These two are only used if mountPoint is non-NULL */
     char *strRep = NULL;
@@ -550,51 +1714,177 @@ Vfs_RemoveMount(mountPoint, interp)
     ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
     
     VfsMount *mountIter;
-    /* Set to NULL just to avoid warnings */
-    VfsMount *lastMount = NULL;
     
     if (mountPoint != NULL) {
+	/* Its mounts, newest first, as they are in the list */
 	strRep = Tcl_GetStringFromObj(mountPoint, &len);
+	mountIter = VfsLookupMount(tsdPtr, strRep, len);
+    } else {
+	mountIter = tsdPtr->listOfMounts;
     }
-
-    mountIter = tsdPtr->listOfMounts;
     
     while (mountIter != NULL) {
-	if ((interp == mountIter->interpCmd.interp) 
-	    && ((mountPoint == NULL) ||
-		(mountIter->mountLen == len && 
-		 !strcmp(mountIter->mountPoint, strRep)))) {
+	if ((interp == mountIter->interpCmd.interp) && !mountIter->isProxy) {
 	    /* We've found the mount. */
-	    if (mountIter == tsdPtr->listOfMounts) {
-		tsdPtr->listOfMounts = mountIter->nextMount;
-	    } else {
-		lastMount->nextMount = mountIter->nextMount;
-	    }
-	    /* Free the allocated memory */
-	    if (mountIter->isVolume) {
-		if (mountPoint == NULL) {
-		    Tcl_Obj *volObj = Tcl_NewStringObj(mountIter->mountPoint, 
-						       mountIter->mountLen);
-		    Tcl_IncrRefCount(volObj);
-		    Vfs_RemoveVolume(volObj);
-		    Tcl_DecrRefCount(volObj);
-		} else {
-		    Vfs_RemoveVolume(mountPoint);
-		}
-	    }
-	    ckfree((char*)mountIter->mountPoint);
-	    Tcl_DecrRefCount(mountIter->interpCmd.mountCmd);
-	    ckfree((char*)mountIter);
-	    Tcl_FSMountsChanged(&vfsFilesystem);
+	    VfsUnlinkMount(tsdPtr, mountIter);
+	    VfsMountsChanged(tsdPtr);
 	    return TCL_OK;
 	}
-	lastMount = mountIter;
-	mountIter = mountIter->nextMount;
+	mountIter = (mountPoint != NULL) ? mountIter->shadowed 
+		: mountIter->nextMount;
     }
     return TCL_ERROR;
 }
 
-
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsUnlinkMount --
+ *
+ *	Take a mount out of this thread's mount table, and if it is
+ *	shared, withdraw it from the other threads.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A volume may be removed.  The mount is freed once no callbacks
+ *	are using it.  Tcl is not told of the change.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsUnlinkMount(ThreadSpecificData *tsdPtr, VfsMount *mountPtr)
+{
+    if (mountPtr->prevMount != NULL) {
+	mountPtr->prevMount->nextMount = mountPtr->nextMount;
+    } else {
+	tsdPtr->listOfMounts = mountPtr->nextMount;
+    }
+    if (mountPtr->nextMount != NULL) {
+	mountPtr->nextMount->prevMount = mountPtr->prevMount;
+    }
+    VfsUnindexMount(tsdPtr, mountPtr);
+    if (mountPtr->isVolume) {
+	Tcl_Obj *volObj = Tcl_NewStringObj(mountPtr->mountPoint, 
+					   mountPtr->mountLen);
+	Tcl_IncrRefCount(volObj);
+	Vfs_RemoveVolume(volObj);
+	Tcl_DecrRefCount(volObj);
+    }
+    if (mountPtr->sharedPtr != NULL && !mountPtr->isProxy) {
+	VfsUnshareMount(mountPtr->sharedPtr);
+	VfsPoolStop(mountPtr->sharedPtr->poolPtr);
+    }
+    /* Free the allocated memory */
+    VfsReleaseMount(mountPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsBeginMounts, VfsEndMounts --
+ *
+ *	Bracket a number of changes to this thread's mount table, so
+ *	that Tcl is told of them all at once, at the end.  These nest.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	VfsEndMounts invalidates all cached path representations if
+ *	any mounts were added or removed in between, and finds the
+ *	longest mount point again if it was removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsBeginMounts(ThreadSpecificData *tsdPtr)
+{
+    tsdPtr->mountBatch++;
+}
+
+static void
+VfsEndMounts(ThreadSpecificData *tsdPtr)
+{
+    if (--tsdPtr->mountBatch == 0 && tsdPtr->maxMountStale) {
+	VfsFindMaxMountLen(tsdPtr);
+    }
+    if (tsdPtr->mountBatch == 0 && tsdPtr->mountsChanged) {
+	tsdPtr->mountsChanged = 0;
+	VfsNormCacheFlush(tsdPtr);
+	Tcl_FSMountsChanged(&vfsFilesystem);
+    }
+}
+
+/* Tell Tcl that a mount was added or removed, or note it for later */
+static void
+VfsMountsChanged(ThreadSpecificData *tsdPtr)
+{
+    if (tsdPtr->mountBatch > 0) {
+	tsdPtr->mountsChanged = 1;
+    } else {
+	VfsNormCacheFlush(tsdPtr);
+	Tcl_FSMountsChanged(&vfsFilesystem);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsReleaseMount --
+ *
+ *	Release a reference to a mount, freeing it once it has been
+ *	unmounted and no callbacks using it are in progress.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May free memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsReleaseMount(VfsMount *mountPtr)
+{
+    int i;
+
+    if (--mountPtr->refCount > 0) {
+	return;
+    }
+    if (mountPtr->objv != NULL) {
+	for (i = 0; i < mountPtr->prefixObjc; i++) {
+	    Tcl_DecrRefCount(mountPtr->objv[i]);
+	}
+	ckfree((char*)mountPtr->objv);
+    }
+    VfsCacheFree(mountPtr);
+    VfsMemForget(mountPtr);
+    if (mountPtr->statsPtr != NULL) {
+	ckfree((char*)mountPtr->statsPtr);
+    }
+    if (mountPtr->driverPtr != NULL && (mountPtr->sharedPtr == NULL 
+	    || (!mountPtr->isProxy && mountPtr->sharedPtr->driverPtr == NULL))) {
+	Vfs_UnmountProc *unmountProc = VfsDriverProc(mountPtr, unmountProc);
+	if (unmountProc != NULL) {
+	    unmountProc(mountPtr->driverData);
+	}
+    }
+    if (mountPtr->sharedPtr != NULL) {
+	/* A thread-safe driver is told when the last thread lets go */
+	VfsReleaseShared(mountPtr->sharedPtr);
+    }
+    ckfree((char*)mountPtr->mountPoint);
+    Tcl_DecrRefCount(mountPtr->interpCmd.mountCmd);
+    ckfree((char*)mountPtr);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -621,13 +1911,14 @@ Vfs_FindMount(pathMount, mountLen)
     Tcl_Obj *pathMount;
     int mountLen;
 {
-    VfsMount *mountIter;
+    VfsMount *mountPtr;
     char *mountStr;
     ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
     
     if (pathMount == NULL) {
 	return NULL;
     }
+    VfsCheckSharedMounts(tsdPtr);
     
     if (mountLen == -1) {
         mountStr = Tcl_GetStringFromObj(pathMount, &mountLen);
@@ -635,1045 +1926,7298 @@ Vfs_FindMount(pathMount, mountLen)
 	mountStr = Tcl_GetString(pathMount);
     }
 
-    mountIter = tsdPtr->listOfMounts;
-    while (mountIter != NULL) {
-	if (mountIter->mountLen == mountLen && 
-	  !strncmp(mountIter->mountPoint, mountStr, (size_t)mountLen)) {
-	    Vfs_InterpCmd *ret = &mountIter->interpCmd;
-	    return ret;
-	}
-	mountIter = mountIter->nextMount;
+    mountPtr = VfsLookupMount(tsdPtr, mountStr, mountLen);
+    if (mountPtr == NULL) {
+	return NULL;
     }
-    return NULL;
+    return &mountPtr->interpCmd;
 }
 
-
 /*
  *----------------------------------------------------------------------
  *
- * Vfs_ListMounts --
+ * Vfs_Mount --
+ *
+ *	Public interface to mount a filesystem implemented in C by
+ *	the functions of 'driverPtr'.  Unless VFS_MOUNT_VOLUME is
+ *	given, the mount point is normalized first, as by
+ *	'vfs::filesystem mount'.  With VFS_MOUNT_SHARED other threads
+ *	see the mount too, and have this thread call the driver; with
+ *	VFS_MOUNT_THREADSAFE they call it themselves.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See Vfs_AddMount.  The driver's unmountProc will be called
+ *	with 'clientData' once the mount has gone.
  *
- *	Returns a valid Tcl list, with refCount of zero, containing
- *	all currently mounted paths.
- *	
  *----------------------------------------------------------------------
  */
-static Tcl_Obj* 
-Vfs_ListMounts(void) 
-{
-    VfsMount *mountIter;
-    Tcl_Obj *res = Tcl_NewObj();
-    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
 
-    /* Build list of mounts */
-    mountIter = tsdPtr->listOfMounts;
-    while (mountIter != NULL) {
-	Tcl_Obj* mount = Tcl_NewStringObj(mountIter->mountPoint, 
-					  mountIter->mountLen);
-	Tcl_ListObjAppendElement(NULL, res, mount);
-	mountIter = mountIter->nextMount;
+int
+Vfs_Mount(interp, mountPoint, flags, cacheTtl, driverPtr, clientData)
+    Tcl_Interp *interp;		/* Interpreter which owns the mount. */
+    Tcl_Obj *mountPoint;
+    int flags;			/* VFS_MOUNT_* flags */
+    long cacheTtl;		/* Milliseconds, VFS_CACHE_NONE or 
+				 * VFS_CACHE_FOREVER. */
+    CONST Vfs_Driver *driverPtr;
+    ClientData clientData;	/* Passed to every driver function. */
+{
+    Tcl_Obj *typeObj;
+    int retVal;
+    
+    if (driverPtr == NULL || driverPtr->structureLength 
+	    < (int) offsetof(Vfs_Driver, statProc)) {
+	Tcl_SetResult(interp, "invalid vfs driver", TCL_STATIC);
+	return TCL_ERROR;
     }
-    return res;
+    typeObj = Tcl_NewStringObj(driverPtr->typeName != NULL 
+			       ? driverPtr->typeName : "vfs", -1);
+    Tcl_IncrRefCount(typeObj);
+    if (flags & VFS_MOUNT_VOLUME) {
+	retVal = Vfs_AddMount(mountPoint, flags, interp, typeObj, cacheTtl,
+			      driverPtr, clientData);
+    } else {
+	Tcl_Obj *path;
+	path = VfsFullyNormalizePath(interp, mountPoint);
+	retVal = Vfs_AddMount(path, flags, interp, typeObj, cacheTtl,
+			      driverPtr, clientData);
+	if (path != NULL) { Tcl_DecrRefCount(path); }
+    }
+    Tcl_DecrRefCount(typeObj);
+    return retVal;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * VfsFilesystemObjCmd --
+ * Vfs_Unmount --
  *
- *	This procedure implements the "vfs::filesystem" command.  It is
- *	used to mount/unmount particular interfaces to new filesystems,
- *	or to query for what is mounted where.
+ *	Public interface to remove a mount, whether made by Vfs_Mount
+ *	or by 'vfs::filesystem mount'.
  *
  * Results:
- *	A standard Tcl result.
+ *	A standard Tcl result; an error if nothing is mounted there.
  *
  * Side effects:
- *	Inserts or removes a filesystem from Tcl's stack.
+ *	See Vfs_RemoveMount.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-VfsFilesystemObjCmd(dummy, interp, objc, objv)
-    ClientData dummy;
+int
+Vfs_Unmount(interp, mountPoint)
     Tcl_Interp *interp;
-    int		objc;
-    Tcl_Obj	*CONST objv[];
+    Tcl_Obj *mountPoint;
 {
-    int index;
-    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    if (Vfs_RemoveMount(mountPoint, interp) == TCL_ERROR) {
+	Tcl_Obj *path;
+	int retVal;
+	path = VfsFullyNormalizePath(interp, mountPoint);
+	retVal = Vfs_RemoveMount(path, interp);
+	Tcl_DecrRefCount(path);
+	if (retVal == TCL_ERROR) {
+	    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+		    "no such mount \"", Tcl_GetString(mountPoint), 
+		    "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+    }
+    return TCL_OK;
+}
 
-    static CONST char *optionStrings[] = {
-	"info", "internalerror", "mount", "unmount", 
-	"fullynormalize", "posixerror", 
-	NULL
-    };
-    
-    enum options {
-	VFS_INFO, VFS_INTERNAL_ERROR, VFS_MOUNT, VFS_UNMOUNT, 
-	VFS_NORMALIZE, VFS_POSIXERROR
-    };
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vfs_GetMount --
+ *
+ *	Public interface to find what is mounted at a mount point.
+ *
+ * Results:
+ *	TCL_OK if there is a mount, in which case its driver (NULL
+ *	for a mount handled by a Tcl command) and clientData are
+ *	stored in the given locations; TCL_ERROR otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    if (objc < 2) {
-	Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
-	return TCL_ERROR;
+int
+Vfs_GetMount(mountPoint, driverPtrPtr, clientDataPtr)
+    Tcl_Obj *mountPoint;
+    CONST Vfs_Driver **driverPtrPtr;
+    ClientData *clientDataPtr;
+{
+    VfsMount *mountPtr;
+    CONST char *mountStr;
+    int mountLen;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    
+    VfsCheckSharedMounts(tsdPtr);
+    mountStr = Tcl_GetStringFromObj(mountPoint, &mountLen);
+    mountPtr = VfsLookupMount(tsdPtr, mountStr, mountLen);
+    if (mountPtr == NULL) {
+	Tcl_Obj *path = VfsFullyNormalizePath(NULL, mountPoint);
+	if (path != NULL) {
+	    mountStr = Tcl_GetStringFromObj(path, &mountLen);
+	    mountPtr = VfsLookupMount(tsdPtr, mountStr, mountLen);
+	    Tcl_DecrRefCount(path);
+	}
+	if (mountPtr == NULL) {
+	    return TCL_ERROR;
+	}
     }
-    if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
-	    &index) != TCL_OK) {
-	return TCL_ERROR;
+    if (driverPtrPtr != NULL) {
+	*driverPtrPtr = mountPtr->driverPtr;
+    }
+    if (clientDataPtr != NULL) {
+	*clientDataPtr = mountPtr->driverData;
     }
+    return TCL_OK;
+}
 
-    switch ((enum options) index) {
-	case VFS_INTERNAL_ERROR: {
-	    if (objc > 3) {
-		Tcl_WrongNumArgs(interp, 2, objv, "?script?");
-		return TCL_ERROR;
-	    }
-	    if (objc == 2) {
-	        /* Return the current script */
-		if (tsdPtr->internalErrorScript != NULL) {
-		    Tcl_SetObjResult(interp, tsdPtr->internalErrorScript);
-		}
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsHashKey, VfsCompareKeys, VfsAllocKeyEntry, VfsFreeKeyEntry --
+ *
+ *	Implementation of the 'vfsKeyType' hash key type, whose keys
+ *	are counted (not necessarily nul-terminated) strings.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+VfsHashKey(Tcl_HashTable *tablePtr, VOID *keyPtr)
+{
+    VfsKey *key = (VfsKey*) keyPtr;
+    CONST char *string = key->string;
+    unsigned int result = 0;
+    int i;
+
+    /* The same hash function as Tcl uses for its string keys */
+    for (i = 0; i < key->length; i++) {
+	result += (result<<3) + (unsigned char) string[i];
+    }
+    return result;
+}
+
+static int
+VfsCompareKeys(VOID *keyPtr, Tcl_HashEntry *hPtr)
+{
+    VfsKey *key = (VfsKey*) keyPtr;
+    CONST char *entryString = hPtr->key.string;
+
+    return (!strncmp(key->string, entryString, (size_t)key->length)
+	    && entryString[key->length] == '\0');
+}
+
+static Tcl_HashEntry*
+VfsAllocKeyEntry(Tcl_HashTable *tablePtr, VOID *keyPtr)
+{
+    VfsKey *key = (VfsKey*) keyPtr;
+    Tcl_HashEntry *hPtr;
+    unsigned int size;
+
+    size = sizeof(Tcl_HashEntry) + key->length + 1 - sizeof(hPtr->key);
+    if (size < sizeof(Tcl_HashEntry)) {
+	size = sizeof(Tcl_HashEntry);
+    }
+    hPtr = (Tcl_HashEntry*) ckalloc(size);
+    memcpy(hPtr->key.string, key->string, (size_t)key->length);
+    hPtr->key.string[key->length] = '\0';
+    hPtr->clientData = NULL;
+    return hPtr;
+}
+
+static void
+VfsFreeKeyEntry(Tcl_HashEntry *hPtr)
+{
+    ckfree((char*)hPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsRootKeyLength, VfsDirKeyLength --
+ *
+ *	Helpers which determine the keys under which a mount point
+ *	(or a path) is stored in the 'rootTable' and 'dirTable'
+ *	indices respectively.
+ *
+ *	The root key is the path up to, but not including, its first
+ *	separator after the first character, so '/home/foo/a.zip' is
+ *	keyed as '/home', 'ftp://' as 'ftp:' and 'C:/foo' as 'C:'.
+ *	
+ *	The directory key is the path up to, but not including, its
+ *	last separator, or -1 if the path has no separator or ends
+ *	with one (in which case it can never be listed as an entry
+ *	of a directory).
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsRootKeyLength(CONST char *path, int len)
+{
+    int i;
+
+    for (i = 1; i < len; i++) {
+	if (path[i] == VFS_SEPARATOR) {
+	    return i;
+	}
+    }
+    return len;
+}
+
+static int
+VfsDirKeyLength(CONST char *path, int len)
+{
+    int i;
+
+    for (i = len - 1; i >= 0; i--) {
+	if (path[i] == VFS_SEPARATOR) {
+	    return (i == len - 1) ? -1 : i;
+	}
+    }
+    return -1;
+}
+
+static void
+VfsInitMountTables(ThreadSpecificData *tsdPtr)
+{
+    if (!tsdPtr->mountTablesInit) {
+	Tcl_InitCustomHashTable(&tsdPtr->mountTable, TCL_CUSTOM_TYPE_KEYS,
+				&vfsKeyType);
+	Tcl_InitCustomHashTable(&tsdPtr->rootTable, TCL_CUSTOM_TYPE_KEYS,
+				&vfsKeyType);
+	Tcl_InitCustomHashTable(&tsdPtr->dirTable, TCL_CUSTOM_TYPE_KEYS,
+				&vfsKeyType);
+	tsdPtr->rootMounts = 0;
+	tsdPtr->maxMountLen = 0;
+	tsdPtr->maxMountStale = 0;
+	tsdPtr->mountTablesInit = 1;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsIndexMount --
+ *
+ *	Add a newly created mount (which must already be at the head
+ *	of 'listOfMounts') to the lookup indices.  If the same mount
+ *	point is already mounted, the new mount shadows it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory allocation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsIndexMount(ThreadSpecificData *tsdPtr, VfsMount *mountPtr)
+{
+    Tcl_HashEntry *hPtr;
+    VfsKey key;
+    int isNew, dirLen;
+
+    VfsInitMountTables(tsdPtr);
+
+    key.string = mountPtr->mountPoint;
+    key.length = mountPtr->mountLen;
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->mountTable, (char*)&key, &isNew);
+    mountPtr->shadowed = isNew ? NULL : (VfsMount*) Tcl_GetHashValue(hPtr);
+    Tcl_SetHashValue(hPtr, (ClientData)mountPtr);
+
+    key.length = VfsRootKeyLength(mountPtr->mountPoint, mountPtr->mountLen);
+    if (key.length == mountPtr->mountLen && key.length > 0
+	    && mountPtr->mountPoint[key.length-1] == VFS_SEPARATOR) {
+	tsdPtr->rootMounts++;
+    } else {
+	hPtr = Tcl_CreateHashEntry(&tsdPtr->rootTable, (char*)&key, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData)(size_t)(isNew ? 1 :
+		(int)(size_t)Tcl_GetHashValue(hPtr) + 1));
+    }
+
+    dirLen = VfsDirKeyLength(mountPtr->mountPoint, mountPtr->mountLen);
+    mountPtr->nextSibling = NULL;
+    mountPtr->prevSibling = NULL;
+    if (dirLen >= 0) {
+	key.length = dirLen;
+	hPtr = Tcl_CreateHashEntry(&tsdPtr->dirTable, (char*)&key, &isNew);
+	if (!isNew) {
+	    mountPtr->nextSibling = (VfsMount*) Tcl_GetHashValue(hPtr);
+	    mountPtr->nextSibling->prevSibling = mountPtr;
+	}
+	Tcl_SetHashValue(hPtr, (ClientData)mountPtr);
+    }
+
+    if (mountPtr->mountLen > tsdPtr->maxMountLen) {
+	tsdPtr->maxMountLen = mountPtr->mountLen;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsUnindexMount --
+ *
+ *	Remove a mount (which must already have been unlinked from
+ *	'listOfMounts') from the lookup indices.  If an older mount
+ *	of the same mount point exists, it becomes visible again.
+ *	Only the mount's own entries are visited, but for the
+ *	longest mount point; outside a batch, that means looking
+ *	through all the mounts for the next longest.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsUnindexMount(ThreadSpecificData *tsdPtr, VfsMount *mountPtr)
+{
+    Tcl_HashEntry *hPtr;
+    VfsMount *mountIter;
+    VfsKey key;
+    int dirLen;
+
+    VfsInitMountTables(tsdPtr);
+
+    key.string = mountPtr->mountPoint;
+    key.length = mountPtr->mountLen;
+    hPtr = Tcl_FindHashEntry(&tsdPtr->mountTable, (char*)&key);
+    if (hPtr != NULL) {
+	mountIter = (VfsMount*) Tcl_GetHashValue(hPtr);
+	if (mountIter == mountPtr) {
+	    /* A mount we were shadowing is visible again */
+	    if (mountPtr->shadowed != NULL) {
+		Tcl_SetHashValue(hPtr, (ClientData)mountPtr->shadowed);
 	    } else {
-		/* Set the script */
-		int len;
-		if (tsdPtr->internalErrorScript != NULL) {
-		    Tcl_DecrRefCount(tsdPtr->internalErrorScript);
-		}
-		Tcl_GetStringFromObj(objv[2], &len);
-		if (len == 0) {
-		    /* Clear our script */
-		    tsdPtr->internalErrorScript = NULL;
-		} else {
-		    /* Set it */
-		    tsdPtr->internalErrorScript = objv[2];
-		    Tcl_IncrRefCount(tsdPtr->internalErrorScript);
-		}
+		Tcl_DeleteHashEntry(hPtr);
 	    }
-	    return TCL_OK;
-	}
-	case VFS_POSIXERROR: {
-	    int posixError = -1;
-	    if (objc != 3) {
-		Tcl_WrongNumArgs(interp, 2, objv, "errorcode");
-		return TCL_ERROR;
+	} else {
+	    while (mountIter != NULL && mountIter->shadowed != mountPtr) {
+		mountIter = mountIter->shadowed;
 	    }
-	    if (Tcl_GetIntFromObj(NULL, objv[2], &posixError) != TCL_OK) {
-		return TCL_ERROR;
+	    if (mountIter != NULL) {
+		mountIter->shadowed = mountPtr->shadowed;
 	    }
-	    Tcl_SetErrno(posixError);
-	    /*
-	     * This special error code propagate to the Tcl_Eval* calls in
-	     * other parts of the vfs C code to indicate a posix error
-	     * being raised by some vfs implementation.
-	     */
-	    return TCLVFS_POSIXERROR;
 	}
-	case VFS_NORMALIZE: {
-	    Tcl_Obj *path;
-	    if (objc != 3) {
-		Tcl_WrongNumArgs(interp, 2, objv, "path");
-		return TCL_ERROR;
-	    }
-	    path = VfsFullyNormalizePath(interp, objv[2]);
-	    if (path == NULL) {
-		Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-			"not a valid path \"", Tcl_GetString(objv[2]), 
-			"\"", (char *) NULL);
+    }
+
+    key.length = VfsRootKeyLength(mountPtr->mountPoint, mountPtr->mountLen);
+    if (key.length == mountPtr->mountLen && key.length > 0
+	    && mountPtr->mountPoint[key.length-1] == VFS_SEPARATOR) {
+	tsdPtr->rootMounts--;
+    } else {
+	hPtr = Tcl_FindHashEntry(&tsdPtr->rootTable, (char*)&key);
+	if (hPtr != NULL) {
+	    int count = (int)(size_t)Tcl_GetHashValue(hPtr) - 1;
+	    if (count == 0) {
+		Tcl_DeleteHashEntry(hPtr);
 	    } else {
-		Tcl_SetObjResult(interp, path);
-		Tcl_DecrRefCount(path);
-		return TCL_OK;
+		Tcl_SetHashValue(hPtr, (ClientData)(size_t)count);
+	    }
+	}
+    }
+
+    dirLen = VfsDirKeyLength(mountPtr->mountPoint, mountPtr->mountLen);
+    if (dirLen >= 0) {
+	key.length = dirLen;
+	if (mountPtr->nextSibling != NULL) {
+	    mountPtr->nextSibling->prevSibling = mountPtr->prevSibling;
+	}
+	if (mountPtr->prevSibling != NULL) {
+	    mountPtr->prevSibling->nextSibling = mountPtr->nextSibling;
+	} else {
+	    hPtr = Tcl_FindHashEntry(&tsdPtr->dirTable, (char*)&key);
+	    if (hPtr != NULL && mountPtr->nextSibling != NULL) {
+		Tcl_SetHashValue(hPtr, (ClientData)mountPtr->nextSibling);
+	    } else if (hPtr != NULL) {
+		Tcl_DeleteHashEntry(hPtr);
 	    }
 	}
-        case VFS_MOUNT: {
-	    if (objc < 4 || objc > 5) {
-		Tcl_WrongNumArgs(interp, 1, objv, "mount ?-volume? path cmd");
-		return TCL_ERROR;
-	    }
-	    if (objc == 5) {
-		char *option = Tcl_GetString(objv[2]);
-		if (strcmp("-volume", option)) {
-		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-			    "bad option \"", option,
-			    "\": must be -volume", (char *) NULL);
-		    return TCL_ERROR;
-		}
-		return Vfs_AddMount(objv[3], 1, interp, objv[4]);
-	    } else {
-		Tcl_Obj *path;
-		int retVal;
-		path = VfsFullyNormalizePath(interp, objv[2]);
-		retVal = Vfs_AddMount(path, 0, interp, objv[3]);
-		if (path != NULL) { Tcl_DecrRefCount(path); }
-		return retVal;
-	    }
-	    break;
+    }
+
+    if (mountPtr->mountLen == tsdPtr->maxMountLen) {
+	if (tsdPtr->mountBatch > 0) {
+	    tsdPtr->maxMountStale = 1;
+	} else {
+	    VfsFindMaxMountLen(tsdPtr);
+	}
+    }
+}
+
+/* Work out the length of the longest mount point again */
+static void
+VfsFindMaxMountLen(ThreadSpecificData *tsdPtr)
+{
+    VfsMount *mountIter;
+
+    tsdPtr->maxMountLen = 0;
+    for (mountIter = tsdPtr->listOfMounts; mountIter != NULL; 
+	 mountIter = mountIter->nextMount) {
+	if (mountIter->mountLen > tsdPtr->maxMountLen) {
+	    tsdPtr->maxMountLen = mountIter->mountLen;
+	}
+    }
+    tsdPtr->maxMountStale = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsLookupMount --
+ *
+ *	Look up the mount whose mount point is exactly the first 'len'
+ *	bytes of 'path'.
+ *
+ * Results:
+ *	The most recently added such mount, or NULL.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VfsMount*
+VfsLookupMount(ThreadSpecificData *tsdPtr, CONST char *path, int len)
+{
+    Tcl_HashEntry *hPtr;
+    VfsKey key;
+
+    if (tsdPtr->listOfMounts == NULL || len > tsdPtr->maxMountLen) {
+	return NULL;
+    }
+    key.string = path;
+    key.length = len;
+    hPtr = Tcl_FindHashEntry(&tsdPtr->mountTable, (char*)&key);
+    if (hPtr == NULL) {
+	return NULL;
+    }
+    return (VfsMount*) Tcl_GetHashValue(hPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMayContainMount --
+ *
+ *	Cheap negative filter: check whether the normalized 'path'
+ *	could lie inside any mount point at all.
+ *
+ * Results:
+ *	0 if the path is certainly outside all mounts, 1 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMayContainMount(ThreadSpecificData *tsdPtr, CONST char *path, int len)
+{
+    VfsKey key;
+
+    if (tsdPtr->listOfMounts == NULL) {
+	return 0;
+    }
+    if (tsdPtr->rootMounts > 0) {
+	return 1;
+    }
+    key.string = path;
+    key.length = VfsRootKeyLength(path, len);
+    return (Tcl_FindHashEntry(&tsdPtr->rootTable, (char*)&key) != NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vfs_ListMounts --
+ *
+ *	Returns a valid Tcl list, with refCount of zero, containing
+ *	all currently mounted paths.
+ *	
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj* 
+Vfs_ListMounts(void) 
+{
+    VfsMount *mountIter;
+    Tcl_Obj *res = Tcl_NewObj();
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    VfsCheckSharedMounts(tsdPtr);
+
+    /* Build list of mounts */
+    mountIter = tsdPtr->listOfMounts;
+    while (mountIter != NULL) {
+	Tcl_Obj* mount = Tcl_NewStringObj(mountIter->mountPoint, 
+					  mountIter->mountLen);
+	Tcl_ListObjAppendElement(NULL, res, mount);
+	mountIter = mountIter->nextMount;
+    }
+    return res;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsShareMount --
+ *
+ *	Make a mount of this thread visible to all threads.  If
+ *	'threadSafe' is set, they call its driver directly, otherwise
+ *	they forward each operation to this thread.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Other threads add proxies for the mount the next time they look
+ *	up a path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsShareMount(VfsMount *mountPtr, int threadSafe)
+{
+    VfsSharedMount *sharedPtr;
+
+    sharedPtr = VfsNewShared(mountPtr->mountPoint, mountPtr->mountLen,
+	    mountPtr->isVolume, Tcl_GetString(mountPtr->interpCmd.mountCmd));
+    sharedPtr->owner = Tcl_GetCurrentThread();
+    sharedPtr->mounted = 1;
+    sharedPtr->driverPtr = threadSafe ? mountPtr->driverPtr : NULL;
+    sharedPtr->driverData = threadSafe ? mountPtr->driverData : NULL;
+    mountPtr->sharedPtr = sharedPtr;
+    
+    Tcl_MutexLock(&vfsSharedMutex);
+    sharedPtr->nextPtr = sharedMounts;
+    sharedMounts = sharedPtr;
+    sharedMountEpoch++;
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+/* A new description of a mount, not yet mounted or owned by anyone */
+static VfsSharedMount*
+VfsNewShared(CONST char *mountPoint, int mountLen, int isVolume, 
+	     CONST char *mountCmd)
+{
+    VfsSharedMount *sharedPtr;
+
+    sharedPtr = (VfsSharedMount*) ckalloc(sizeof(VfsSharedMount));
+    memset(sharedPtr, 0, sizeof(VfsSharedMount));
+    sharedPtr->mountPoint = ckalloc(1 + (unsigned) mountLen);
+    memcpy(sharedPtr->mountPoint, mountPoint, (size_t) mountLen);
+    sharedPtr->mountPoint[mountLen] = '\0';
+    sharedPtr->mountLen = mountLen;
+    sharedPtr->isVolume = isVolume;
+    sharedPtr->mountCmd = ckalloc(1 + (unsigned) strlen(mountCmd));
+    strcpy(sharedPtr->mountCmd, mountCmd);
+    sharedPtr->refCount = 1;
+    return sharedPtr;
+}
+
+/* Withdraw a shared mount from the other threads, if not already done */
+static void
+VfsUnshareMount(VfsSharedMount *sharedPtr)
+{
+    VfsSharedMount **linkPtr;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    if (sharedPtr->mounted) {
+	sharedPtr->mounted = 0;
+	for (linkPtr = &sharedMounts; *linkPtr != sharedPtr; 
+	     linkPtr = &(*linkPtr)->nextPtr) {
+	    /* Empty loop body */
+	}
+	*linkPtr = sharedPtr->nextPtr;
+	sharedMountEpoch++;
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+/* 
+ * Release a reference to a shared mount, freeing it (and telling a
+ * thread-safe driver that it is no longer used) when the last goes.
+ */
+static void
+VfsReleaseShared(VfsSharedMount *sharedPtr)
+{
+    int last;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    last = (--sharedPtr->refCount == 0);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    if (!last) {
+	return;
+    }
+    if (sharedPtr->driverPtr != NULL) {
+	Vfs_UnmountProc *unmountProc = VfsDriverProc(sharedPtr, unmountProc);
+	if (unmountProc != NULL) {
+	    unmountProc(sharedPtr->driverData);
+	}
+    }
+    if (sharedPtr->poolPtr != NULL) {
+	VfsPoolFree(sharedPtr->poolPtr);
+    }
+    ckfree(sharedPtr->mountPoint);
+    ckfree(sharedPtr->mountCmd);
+    ckfree((char*)sharedPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsSyncSharedMounts --
+ *
+ *	Bring this thread's proxies for the shared mounts of other
+ *	threads up to date.  Called through VfsCheckSharedMounts
+ *	whenever 'sharedMountEpoch' has changed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Adds and removes mounts and volumes in this thread.  Tcl is
+ *	not told, since the thread which changed its shared mounts has
+ *	already done so.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsSyncSharedMounts(ThreadSpecificData *tsdPtr)
+{
+    VfsMount *mountPtr, **gonePtrs = NULL;
+    VfsSharedMount *sharedPtr, **newPtrs = NULL;
+    int numShared = 0, numProxies = 0, numNew = 0, numGone = 0, i;
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+
+    if (tsdPtr->exiting) {
+	return;
+    }
+    if (!tsdPtr->exitHandlerInit) {
+	/* This thread may never have loaded the package */
+	Tcl_CreateThreadExitHandler(VfsThreadExitProc, NULL);
+	tsdPtr->exitHandlerInit = 1;
+    }
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    tsdPtr->sharedEpoch = sharedMountEpoch;
+    for (sharedPtr = sharedMounts; sharedPtr != NULL; 
+	 sharedPtr = sharedPtr->nextPtr) {
+	numShared++;
+    }
+    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+	 mountPtr = mountPtr->nextMount) {
+	if (mountPtr->isProxy) {
+	    numProxies++;
+	}
+    }
+    if (numProxies > 0) {
+	gonePtrs = (VfsMount**) ckalloc(numProxies * sizeof(VfsMount*));
+	for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+	     mountPtr = mountPtr->nextMount) {
+	    if (mountPtr->isProxy && !mountPtr->sharedPtr->mounted) {
+		gonePtrs[numGone++] = mountPtr;
+	    }
+	}
+    }
+    if (numShared > 0) {
+	newPtrs = (VfsSharedMount**) 
+		ckalloc(numShared * sizeof(VfsSharedMount*));
+	for (sharedPtr = sharedMounts; sharedPtr != NULL; 
+	     sharedPtr = sharedPtr->nextPtr) {
+	    if (sharedPtr->owner == self) {
+		continue;
+	    }
+	    if (sharedPtr->poolPtr != NULL) {
+		/* Workers have their own mounts of the same path */
+		VfsPool *poolPtr = sharedPtr->poolPtr;
+		for (i = 0; i < poolPtr->size; i++) {
+		    if (poolPtr->workers[i].recordPtr->owner == self) {
+			break;
+		    }
+		}
+		if (i < poolPtr->size) {
+		    continue;
+		}
+	    }
+	    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+		 mountPtr = mountPtr->nextMount) {
+		if (mountPtr->sharedPtr == sharedPtr) {
+		    break;
+		}
+	    }
+	    if (mountPtr == NULL) {
+		/* The new proxy's reference */
+		sharedPtr->refCount++;
+		newPtrs[numNew++] = sharedPtr;
+	    }
+	}
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+
+    for (i = 0; i < numGone; i++) {
+	VfsUnlinkMount(tsdPtr, gonePtrs[i]);
+    }
+    /* 
+     * The list is newest first; add the oldest first, so that later
+     * mounts hide earlier ones here just as they do in their owners.
+     */
+    for (i = numNew - 1; i >= 0; i--) {
+	Tcl_Obj *cmdObj;
+	Tcl_Interp *interp = NULL;
+
+	sharedPtr = newPtrs[i];
+	if (sharedPtr->driverPtr != NULL) {
+	    /* Thread-safe drivers need an interpreter for their errors */
+	    if (tsdPtr->proxyInterp == NULL) {
+		tsdPtr->proxyInterp = Tcl_CreateInterp();
+	    }
+	    interp = tsdPtr->proxyInterp;
+	}
+	cmdObj = Tcl_NewStringObj(sharedPtr->mountCmd, -1);
+	Tcl_IncrRefCount(cmdObj);
+	/* The owner caches results; we would never hear of changes */
+	mountPtr = VfsNewMount(tsdPtr, sharedPtr->mountPoint, 
+			       sharedPtr->mountLen, sharedPtr->isVolume, 
+			       interp, cmdObj, VFS_CACHE_NONE,
+			       sharedPtr->driverPtr, sharedPtr->driverData);
+	Tcl_DecrRefCount(cmdObj);
+	if (mountPtr == NULL) {
+	    VfsReleaseShared(sharedPtr);
+	    continue;
+	}
+	mountPtr->sharedPtr = sharedPtr;
+	mountPtr->isProxy = 1;
+    }
+    if (gonePtrs != NULL) {
+	ckfree((char*)gonePtrs);
+    }
+    if (newPtrs != NULL) {
+	ckfree((char*)newPtrs);
+    }
+}
+
+/* 
+ * The shared mount to which an operation on a path must be forwarded,
+ * or NULL if it can be carried out in this thread.  Operations which
+ * only read go to the least busy worker, if the mount has a pool.
+ */
+static VfsSharedMount*
+VfsGetRemote(Tcl_Obj *pathPtr, int readOnly)
+{
+    VfsNativeRep *nativeRep = VfsGetNativePath(pathPtr);
+    VfsSharedMount *sharedPtr, *bestPtr = NULL;
+    VfsPool *poolPtr;
+    int i;
+
+    if (nativeRep == NULL || !nativeRep->mountPtr->isProxy 
+	    || nativeRep->mountPtr->driverPtr != NULL) {
+	return NULL;
+    }
+    sharedPtr = nativeRep->mountPtr->sharedPtr;
+    if (readOnly) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	poolPtr = sharedPtr->poolPtr;
+	if (poolPtr != NULL) {
+	    for (i = 0; i < poolPtr->size; i++) {
+		VfsSharedMount *workerPtr = poolPtr->workers[i].recordPtr;
+		if (workerPtr->mounted 
+			&& (bestPtr == NULL || workerPtr->busy < bestPtr->busy)) {
+		    bestPtr = workerPtr;
+		}
+	    }
+	}
+	Tcl_MutexUnlock(&vfsSharedMutex);
+    }
+    return (bestPtr != NULL) ? bestPtr : sharedPtr;
+}
+
+/* 
+ * The shared mount on whose behalf this thread is carrying out an
+ * operation, if any, with a new reference to it.
+ */
+static VfsSharedMount*
+VfsServingShared(void)
+{
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    VfsSharedMount *sharedPtr = tsdPtr->servingPtr;
+
+    if (sharedPtr != NULL) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	sharedPtr->refCount++;
+	Tcl_MutexUnlock(&vfsSharedMutex);
+    }
+    return sharedPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsRemoteInit, VfsRemoteDispatch --
+ *
+ *	Prepare an operation on 'pathPtr' for the owner of a shared
+ *	mount, and once the caller has filled in its arguments, send
+ *	it to the owner and wait for the result.  The owner must be
+ *	servicing its event loop, or waiting here itself; meanwhile,
+ *	operations other threads send to this one are carried out.
+ *
+ * Results:
+ *	The result of the operation in the owning thread, whose errno
+ *	is copied to this thread.  If the mount has been unmounted,
+ *	TCLVFS_POSIXERROR with ENOENT.  The caller must free any
+ *	'resultStr'.
+ *
+ * Side effects:
+ *	Whatever the operation does.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsRemoteInit(VfsRemoteCall *callPtr, int op, VfsSharedMount *sharedPtr,
+	      Tcl_Obj *pathPtr)
+{
+    memset(callPtr, 0, sizeof(VfsRemoteCall));
+    callPtr->op = op;
+    callPtr->sharedPtr = sharedPtr;
+    callPtr->path = (pathPtr == NULL) ? NULL : Tcl_GetString(pathPtr);
+}
+
+static int
+VfsRemoteDispatch(VfsRemoteCall *callPtr)
+{
+    VfsSharedMount *sharedPtr = callPtr->sharedPtr;
+    VfsRemoteEvent *evPtr;
+
+    callPtr->result = TCLVFS_POSIXERROR;
+    callPtr->errNum = ENOENT;
+    Tcl_MutexLock(&vfsSharedMutex);
+    /* 
+     * The owner withdraws its mounts before it exits, so while the
+     * mount is there the event cannot be lost.
+     */
+    if (sharedPtr->mounted) {
+	Tcl_ThreadId self = Tcl_GetCurrentThread();
+	VfsRemoteCall *waitPtr, **prevPtrPtr;
+
+	evPtr = (VfsRemoteEvent*) ckalloc(sizeof(VfsRemoteEvent));
+	evPtr->header.proc = VfsRemoteEventProc;
+	evPtr->callPtr = callPtr;
+	evPtr->owner = sharedPtr->owner;
+	evPtr->nextPending = vfsRemotePending;
+	vfsRemotePending = evPtr;
+	Tcl_ThreadQueueEvent(sharedPtr->owner, (Tcl_Event*)evPtr, 
+			     TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(sharedPtr->owner);
+	/* Wake the owner if it is waiting here for a call of its own */
+	for (waitPtr = vfsRemoteWaiting; waitPtr != NULL; 
+	     waitPtr = waitPtr->nextWaiting) {
+	    if (waitPtr->caller == sharedPtr->owner) {
+		Tcl_ConditionNotify(&waitPtr->cond);
+	    }
+	}
+	sharedPtr->busy++;
+	callPtr->caller = self;
+	callPtr->nextWaiting = vfsRemoteWaiting;
+	vfsRemoteWaiting = callPtr;
+	while (!callPtr->done) {
+	    VfsRemoteCall *inPtr = NULL;
+	    VfsRemoteEvent *pendPtr;
+
+	    for (pendPtr = vfsRemotePending; pendPtr != NULL; 
+		 pendPtr = pendPtr->nextPending) {
+		if (pendPtr->owner == self) {
+		    inPtr = VfsRemoteClaim(pendPtr);
+		    break;
+		}
+	    }
+	    if (inPtr != NULL) {
+		/* Its event is left in our queue, to be discarded */
+		Tcl_MutexUnlock(&vfsSharedMutex);
+		VfsRemoteRun(inPtr);
+		Tcl_MutexLock(&vfsSharedMutex);
+		continue;
+	    }
+	    Tcl_ConditionWait(&callPtr->cond, &vfsSharedMutex, NULL);
+	}
+	for (prevPtrPtr = &vfsRemoteWaiting; *prevPtrPtr != callPtr;
+	     prevPtrPtr = &(*prevPtrPtr)->nextWaiting) {
+	    /* Empty loop body */
+	}
+	*prevPtrPtr = callPtr->nextWaiting;
+	sharedPtr->busy--;
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    Tcl_ConditionFinalize(&callPtr->cond);
+    Tcl_SetErrno(callPtr->errNum);
+    return callPtr->result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsRemoteClose --
+ *
+ *	Close handlers of channels opened through a proxy must run in
+ *	the thread which opened them, since they evaluate Tcl code or
+ *	touch the mount there.  Each starts by calling this, which
+ *	lends the channel (if any) back to that thread and runs the
+ *	handler there instead.
+ *
+ * Results:
+ *	0 if the caller is in the owning thread and should go ahead,
+ *	1 if the handler has been dealt with.
+ *
+ * Side effects:
+ *	If the owner has unmounted the mount, the handler is skipped
+ *	and what it would have freed is lost.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsRemoteClose(VfsSharedMount *sharedPtr, Tcl_CloseProc *closeProc,
+	       ClientData closeData, Tcl_Channel chan)
+{
+    VfsRemoteCall call;
+
+    if (sharedPtr->owner == Tcl_GetCurrentThread()) {
+	return 0;
+    }
+    VfsRemoteInit(&call, VFS_OP_CLOSE, sharedPtr, NULL);
+    call.closeProc = closeProc;
+    call.closeData = closeData;
+    call.chan = chan;
+    if (chan != NULL) {
+	Tcl_CutChannel(chan);
+    }
+    if (VfsRemoteDispatch(&call) != TCL_OK) {
+	VfsReleaseShared(sharedPtr);
+    }
+    if (chan != NULL) {
+	Tcl_SpliceChannel(chan);
+    }
+    return 1;
+}
+
+/* 
+ * Take the call of a queued event off 'vfsRemotePending', unless it
+ * has already been taken.  The mutex must be held.
+ */
+static VfsRemoteCall*
+VfsRemoteClaim(VfsRemoteEvent *evPtr)
+{
+    VfsRemoteCall *callPtr = evPtr->callPtr;
+    VfsRemoteEvent **prevPtrPtr;
+
+    if (callPtr != NULL) {
+	for (prevPtrPtr = &vfsRemotePending; *prevPtrPtr != evPtr;
+	     prevPtrPtr = &(*prevPtrPtr)->nextPending) {
+	    /* Empty loop body */
+	}
+	*prevPtrPtr = evPtr->nextPending;
+	evPtr->callPtr = NULL;
+    }
+    return callPtr;
+}
+
+/* Carry out an operation sent by another thread, and wake it */
+static void
+VfsRemoteRun(VfsRemoteCall *callPtr)
+{
+    VfsRemoteExecute(callPtr);
+    Tcl_MutexLock(&vfsSharedMutex);
+    callPtr->done = 1;
+    Tcl_ConditionNotify(&callPtr->cond);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+static int
+VfsRemoteEventProc(Tcl_Event *evPtr, int flags)
+{
+    VfsRemoteCall *callPtr;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    callPtr = VfsRemoteClaim((VfsRemoteEvent*)evPtr);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    if (callPtr != NULL) {
+	VfsRemoteRun(callPtr);
+    }
+    return 1;
+}
+
+/* Fail an operation queued for this thread, which is exiting */
+static int
+VfsRemoteCancel(Tcl_Event *evPtr, ClientData clientData)
+{
+    VfsRemoteCall *callPtr;
+
+    if (evPtr->proc != VfsRemoteEventProc) {
+	return 0;
+    }
+    Tcl_MutexLock(&vfsSharedMutex);
+    callPtr = VfsRemoteClaim((VfsRemoteEvent*)evPtr);
+    if (callPtr != NULL) {
+	callPtr->result = TCLVFS_POSIXERROR;
+	callPtr->errNum = ENOENT;
+	callPtr->done = 1;
+	Tcl_ConditionNotify(&callPtr->cond);
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    return 1;
+}
+
+/* Copy a result for another thread */
+static char*
+VfsRemoteString(Tcl_Obj *objPtr)
+{
+    CONST char *str;
+    char *copy;
+    int len;
+
+    str = Tcl_GetStringFromObj(objPtr, &len);
+    copy = ckalloc(1 + (unsigned) len);
+    memcpy(copy, str, (size_t) len + 1);
+    return copy;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsRemoteExecute --
+ *
+ *	Carry out, in the thread which owns a shared mount, an
+ *	operation forwarded by another thread, by calling the same
+ *	filesystem function on a path object of our own.  Error
+ *	messages are left in the mount's interpreter by those which
+ *	report them, and passed back from there.
+ *
+ * Results:
+ *	None; the results are stored in the call.
+ *
+ * Side effects:
+ *	Whatever the operation does.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsRemoteExecute(VfsRemoteCall *callPtr)
+{
+    Tcl_Obj *pathPtr, *objPtr = NULL;
+    Tcl_Interp *interp;
+    Tcl_SavedResult savedResult;
+    VfsNativeRep *nativeRep;
+    VfsSharedMount *oldServingPtr;
+    int wantMessage = 0;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (callPtr->op == VFS_OP_CLOSE) {
+	if (callPtr->chan != NULL) {
+	    Tcl_SpliceChannel(callPtr->chan);
+	}
+	callPtr->closeProc(callPtr->closeData);
+	if (callPtr->chan != NULL) {
+	    Tcl_CutChannel(callPtr->chan);
+	}
+	callPtr->result = TCL_OK;
+	return;
+    }
+
+    pathPtr = Tcl_NewStringObj(callPtr->path, -1);
+    Tcl_IncrRefCount(pathPtr);
+    nativeRep = VfsGetNativePath(pathPtr);
+    if (nativeRep == NULL) {
+	/* Unmounted since the call was queued */
+	Tcl_DecrRefCount(pathPtr);
+	callPtr->result = TCLVFS_POSIXERROR;
+	callPtr->errNum = ENOENT;
+	return;
+    }
+    interp = nativeRep->mountPtr->interpCmd.interp;
+    if (interp != NULL) {
+	Tcl_SaveResult(interp, &savedResult);
+    }
+    oldServingPtr = tsdPtr->servingPtr;
+    tsdPtr->servingPtr = callPtr->sharedPtr;
+    Tcl_SetErrno(0);
+
+    switch (callPtr->op) {
+	case VFS_OP_STAT:
+	    callPtr->result = VfsStat(pathPtr, callPtr->statBufPtr);
+	    break;
+	case VFS_OP_ACCESS:
+	    callPtr->result = VfsAccess(pathPtr, callPtr->intArg);
+	    break;
+	case VFS_OP_OPEN:
+	    wantMessage = 1;
+	    callPtr->chan = VfsOpenFileChannel(interp, pathPtr, 
+		    callPtr->intArg, callPtr->permissions);
+	    if (callPtr->chan != NULL) {
+		/* The caller splices it into its own thread */
+		Tcl_CutChannel(callPtr->chan);
+		callPtr->result = TCL_OK;
+	    } else {
+		callPtr->result = TCL_ERROR;
+	    }
+	    break;
+	case VFS_OP_MATCHINDIRECTORY: {
+	    Tcl_GlobTypeData types;
+
+	    wantMessage = 1;
+	    memset(&types, 0, sizeof(Tcl_GlobTypeData));
+	    types.type = callPtr->intArg;
+	    objPtr = Tcl_NewObj();
+	    Tcl_IncrRefCount(objPtr);
+	    callPtr->result = VfsMatchInDirectory(interp, objPtr, pathPtr,
+		    callPtr->strArg, callPtr->haveTypes ? &types : NULL);
+	    if (callPtr->result == TCL_OK) {
+		callPtr->resultStr = VfsRemoteString(objPtr);
+	    }
+	    break;
+	}
+	case VFS_OP_DELETEFILE:
+	    callPtr->result = VfsDeleteFile(pathPtr);
+	    break;
+	case VFS_OP_CREATEDIRECTORY:
+	    callPtr->result = VfsCreateDirectory(pathPtr);
+	    break;
+	case VFS_OP_REMOVEDIRECTORY:
+	    callPtr->result = VfsRemoveDirectory(pathPtr, callPtr->intArg, 
+						 NULL);
+	    break;
+	case VFS_OP_COPYFILE:
+	case VFS_OP_RENAMEFILE:
+	case VFS_OP_COPYDIRECTORY: {
+	    Tcl_Obj *destPtr = Tcl_NewStringObj(callPtr->destPath, -1);
+
+	    Tcl_IncrRefCount(destPtr);
+	    callPtr->result = VfsCopyOrRename(callPtr->op, pathPtr, destPtr,
+					      NULL);
+	    Tcl_DecrRefCount(destPtr);
+	    break;
+	}
+	case VFS_OP_FILEATTRIBUTES:
+	    VfsFileAttrStrings(pathPtr, &objPtr);
+	    if (objPtr != NULL) {
+		Tcl_IncrRefCount(objPtr);
+		callPtr->resultStr = VfsRemoteString(objPtr);
+		callPtr->result = TCL_OK;
+	    } else {
+		callPtr->result = TCL_ERROR;
+	    }
+	    break;
+	case VFS_OP_FILEATTRSGET:
+	    wantMessage = 1;
+	    callPtr->result = VfsFileAttrsGet(interp, callPtr->intArg, 
+					      pathPtr, &objPtr);
+	    if (callPtr->result == TCL_OK) {
+		Tcl_IncrRefCount(objPtr);
+		callPtr->resultStr = VfsRemoteString(objPtr);
+	    } else {
+		objPtr = NULL;
+	    }
+	    break;
+	case VFS_OP_FILEATTRSSET:
+	    wantMessage = 1;
+	    objPtr = Tcl_NewStringObj(callPtr->strArg, -1);
+	    Tcl_IncrRefCount(objPtr);
+	    callPtr->result = VfsFileAttrsSet(interp, callPtr->intArg, 
+					      pathPtr, objPtr);
+	    break;
+	case VFS_OP_UTIME:
+	    callPtr->result = VfsUtime(pathPtr, callPtr->tval);
+	    break;
+	case VFS_OP_INVALIDATE:
+	    nativeRep = VfsGetRelativePath(pathPtr);
+	    if (nativeRep != NULL) {
+		int len;
+		CONST char *relative;
+		relative = Tcl_GetStringFromObj(nativeRep->relativeObj, &len);
+		VfsCacheInvalidate(nativeRep->mountPtr, relative, len, 
+				   callPtr->intArg);
+	    }
+	    callPtr->result = TCL_OK;
+	    break;
+    }
+    callPtr->errNum = Tcl_GetErrno();
+
+    tsdPtr->servingPtr = oldServingPtr;
+    if (objPtr != NULL) {
+	Tcl_DecrRefCount(objPtr);
+    }
+    if (interp != NULL) {
+	if (wantMessage && callPtr->result != TCL_OK
+		&& *Tcl_GetStringResult(interp) != '\0') {
+	    callPtr->resultStr = VfsRemoteString(Tcl_GetObjResult(interp));
+	}
+	Tcl_RestoreResult(interp, &savedResult);
+    }
+    Tcl_DecrRefCount(pathPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsPoolStart --
+ *
+ *	Start 'size' worker threads for the shared mount at
+ *	'mountPoint', each of which evaluates 'initScript' in a new
+ *	interpreter and then mounts the same path with the same
+ *	command there.  Waits until all of them are ready.
+ *
+ * Results:
+ *	A standard Tcl result; if any worker could not start, its
+ *	error is left in 'interp' and all are stopped again.
+ *
+ * Side effects:
+ *	Read-only operations from other threads go to the workers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsPoolStart(Tcl_Interp *interp, Tcl_Obj *mountPoint, int size, 
+	     Tcl_Obj *initScript)
+{
+    VfsMount *mountPtr;
+    VfsSharedMount *sharedPtr;
+    VfsPool *poolPtr;
+    CONST char *str;
+    Tcl_Obj *autoPath;
+    int len, i, ready;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    str = Tcl_GetStringFromObj(mountPoint, &len);
+    mountPtr = VfsLookupMount(tsdPtr, str, len);
+    if (mountPtr == NULL || mountPtr->sharedPtr == NULL) {
+	return TCL_ERROR;
+    }
+    sharedPtr = mountPtr->sharedPtr;
+
+    poolPtr = (VfsPool*) ckalloc(sizeof(VfsPool));
+    memset(poolPtr, 0, sizeof(VfsPool));
+    poolPtr->size = size;
+    poolPtr->workers = (VfsPoolWorker*) 
+	    ckalloc(size * sizeof(VfsPoolWorker));
+    memset(poolPtr->workers, 0, size * sizeof(VfsPoolWorker));
+    str = (initScript == NULL) ? "" : Tcl_GetString(initScript);
+    poolPtr->initScript = ckalloc(1 + (unsigned) strlen(str));
+    strcpy(poolPtr->initScript, str);
+    autoPath = Tcl_GetVar2Ex(interp, "auto_path", NULL, TCL_GLOBAL_ONLY);
+    str = (autoPath == NULL) ? "" : Tcl_GetString(autoPath);
+    poolPtr->autoPath = ckalloc(1 + (unsigned) strlen(str));
+    strcpy(poolPtr->autoPath, str);
+    str = Tcl_PkgPresent(interp, "vfs", NULL, 0);
+    if (str == NULL) {
+	str = PACKAGE_VERSION;
+    }
+    poolPtr->version = ckalloc(1 + (unsigned) strlen(str));
+    strcpy(poolPtr->version, str);
+    poolPtr->isAsync = mountPtr->isAsync;
+    Tcl_ResetResult(interp);
+
+    for (i = 0; i < size; i++) {
+	VfsPoolWorker *workerPtr = &poolPtr->workers[i];
+
+	workerPtr->poolPtr = poolPtr;
+	workerPtr->recordPtr = VfsNewShared(sharedPtr->mountPoint, 
+		sharedPtr->mountLen, sharedPtr->isVolume, sharedPtr->mountCmd);
+    }
+    Tcl_MutexLock(&vfsSharedMutex);
+    sharedPtr->poolPtr = poolPtr;
+    Tcl_MutexUnlock(&vfsSharedMutex);
+
+    for (i = 0; i < size; i++) {
+	VfsPoolWorker *workerPtr = &poolPtr->workers[i];
+
+	if (Tcl_CreateThread(&workerPtr->thread, VfsPoolThread, 
+		(ClientData) workerPtr, TCL_THREAD_STACK_DEFAULT, 
+		TCL_THREAD_JOINABLE) != TCL_OK) {
+	    workerPtr->thread = NULL;
+	    workerPtr->state = -1;
+	}
+    }
+
+    /* Wait for each to report */
+    Tcl_MutexLock(&vfsSharedMutex);
+    do {
+	ready = 1;
+	for (i = 0; i < size; i++) {
+	    if (poolPtr->workers[i].state == 0) {
+		ready = 0;
+	    }
+	}
+	if (!ready) {
+	    Tcl_ConditionWait(&poolPtr->cond, &vfsSharedMutex, NULL);
+	}
+    } while (!ready);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+
+    for (i = 0; i < size; i++) {
+	VfsPoolWorker *workerPtr = &poolPtr->workers[i];
+
+	if (workerPtr->state < 0) {
+	    if (workerPtr->thread == NULL) {
+		Tcl_AppendResult(interp, "couldn't create worker thread",
+				 (char *) NULL);
+	    } else {
+		Tcl_AppendResult(interp, "error in pool init script: ", 
+				 workerPtr->errorStr, (char *) NULL);
+	    }
+	    VfsPoolStop(poolPtr);
+	    return TCL_ERROR;
+	}
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsPoolThread --
+ *
+ *	The body of a worker thread: set up its interpreter and private
+ *	mount, report to VfsPoolStart, and then service the calls sent
+ *	to it until VfsPoolStop tells it to quit.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Everything the mount's command does.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+VfsPoolThread(ClientData clientData)
+{
+    VfsPoolWorker *workerPtr = (VfsPoolWorker*) clientData;
+    VfsPool *poolPtr = workerPtr->poolPtr;
+    VfsSharedMount *recordPtr = workerPtr->recordPtr;
+    Tcl_Interp *interp;
+    Tcl_Obj *pathObj, *cmdObj;
+    int result;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    recordPtr->owner = Tcl_GetCurrentThread();
+    Tcl_MutexUnlock(&vfsSharedMutex);
+
+    interp = Tcl_CreateInterp();
+    Tcl_SetVar(interp, "auto_path", poolPtr->autoPath, TCL_GLOBAL_ONLY);
+    result = Tcl_Init(interp);
+    if (result == TCL_OK && Tcl_PkgRequire(interp, "vfs", poolPtr->version,
+					     1) == NULL) {
+	result = TCL_ERROR;
+    }
+    if (result == TCL_OK) {
+	result = Tcl_EvalEx(interp, poolPtr->initScript, -1, 
+			    TCL_EVAL_GLOBAL);
+    }
+    if (result == TCL_OK) {
+	pathObj = Tcl_NewStringObj(recordPtr->mountPoint, 
+				   recordPtr->mountLen);
+	Tcl_IncrRefCount(pathObj);
+	cmdObj = Tcl_NewStringObj(recordPtr->mountCmd, -1);
+	Tcl_IncrRefCount(cmdObj);
+	result = Vfs_AddMount(pathObj, 
+		(recordPtr->isVolume ? VFS_MOUNT_VOLUME : 0)
+		| (poolPtr->isAsync ? VFS_MOUNT_ASYNC : 0), interp, cmdObj, 
+		VFS_CACHE_NONE, NULL, NULL);
+	Tcl_DecrRefCount(pathObj);
+	Tcl_DecrRefCount(cmdObj);
+    }
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    if (result == TCL_OK) {
+	recordPtr->mounted = 1;
+	workerPtr->state = 1;
+    } else {
+	workerPtr->errorStr = VfsRemoteString(Tcl_GetObjResult(interp));
+	workerPtr->state = -1;
+    }
+    Tcl_ConditionNotify(&poolPtr->cond);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+
+    while (result == TCL_OK && !workerPtr->quit) {
+	Tcl_DoOneEvent(TCL_ALL_EVENTS);
+    }
+    Tcl_DeleteInterp(interp);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+static int
+VfsPoolQuitProc(Tcl_Event *evPtr, int flags)
+{
+    ((VfsPoolQuitEvent*)evPtr)->workerPtr->quit = 1;
+    return 1;
+}
+
+/* 
+ * Stop and wait for the workers of a pool, which is freed with the
+ * shared mount.  Calls already queued to them are carried out first.
+ */
+static void
+VfsPoolStop(VfsPool *poolPtr)
+{
+    int i, code;
+
+    if (poolPtr == NULL || poolPtr->stopped) {
+	return;
+    }
+    poolPtr->stopped = 1;
+    for (i = 0; i < poolPtr->size; i++) {
+	VfsPoolWorker *workerPtr = &poolPtr->workers[i];
+
+	if (workerPtr->thread == NULL) {
+	    continue;
+	}
+	Tcl_MutexLock(&vfsSharedMutex);
+	workerPtr->recordPtr->mounted = 0;
+	if (workerPtr->state > 0) {
+	    VfsPoolQuitEvent *evPtr;
+
+	    evPtr = (VfsPoolQuitEvent*) ckalloc(sizeof(VfsPoolQuitEvent));
+	    evPtr->header.proc = VfsPoolQuitProc;
+	    evPtr->workerPtr = workerPtr;
+	    Tcl_ThreadQueueEvent(workerPtr->thread, (Tcl_Event*)evPtr,
+				 TCL_QUEUE_TAIL);
+	    Tcl_ThreadAlert(workerPtr->thread);
+	}
+	Tcl_MutexUnlock(&vfsSharedMutex);
+	Tcl_JoinThread(workerPtr->thread, &code);
+    }
+}
+
+static void
+VfsPoolFree(VfsPool *poolPtr)
+{
+    int i;
+
+    for (i = 0; i < poolPtr->size; i++) {
+	VfsReleaseShared(poolPtr->workers[i].recordPtr);
+	if (poolPtr->workers[i].errorStr != NULL) {
+	    ckfree(poolPtr->workers[i].errorStr);
+	}
+    }
+    Tcl_ConditionFinalize(&poolPtr->cond);
+    ckfree((char*)poolPtr->workers);
+    ckfree(poolPtr->initScript);
+    ckfree(poolPtr->autoPath);
+    ckfree(poolPtr->version);
+    ckfree((char*)poolPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMountOne --
+ *
+ *	Carry out 'vfs::filesystem mount' for one path and command,
+ *	with the options already parsed.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See Vfs_AddMount; a pool of worker threads may be started.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMountOne(interp, pathObj, cmdObj, flags, cacheTtl, poolSize, initScript)
+    Tcl_Interp *interp;
+    Tcl_Obj *pathObj;
+    Tcl_Obj *cmdObj;
+    int flags;
+    long cacheTtl;
+    int poolSize;
+    Tcl_Obj *initScript;
+{
+    Tcl_Obj *path;
+    int retVal;
+
+    if (flags & VFS_MOUNT_VOLUME) {
+	path = pathObj;
+	Tcl_IncrRefCount(path);
+    } else {
+	path = VfsFullyNormalizePath(interp, pathObj);
+    }
+    retVal = Vfs_AddMount(path, flags, interp, cmdObj, cacheTtl, NULL, NULL);
+    if (retVal == TCL_OK && poolSize > 0) {
+	retVal = VfsPoolStart(interp, path, poolSize, initScript);
+	if (retVal != TCL_OK) {
+	    Tcl_Obj *errorObj = Tcl_GetObjResult(interp);
+	    Tcl_IncrRefCount(errorObj);
+	    Vfs_RemoveMount(path, interp);
+	    Tcl_SetObjResult(interp, errorObj);
+	    Tcl_DecrRefCount(errorObj);
+	}
+    }
+    if (path != NULL) { Tcl_DecrRefCount(path); }
+    return retVal;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMountBatch --
+ *
+ *	Carry out 'vfs::filesystem mount -batch', mounting each of a
+ *	list of path and command pairs with the same options.  Either
+ *	all are mounted or, if one fails, none are.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Tcl is told of the new mounts once, rather than once for each.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMountBatch(interp, listObj, flags, cacheTtl, poolSize, initScript)
+    Tcl_Interp *interp;
+    Tcl_Obj *listObj;
+    int flags;
+    long cacheTtl;
+    int poolSize;
+    Tcl_Obj *initScript;
+{
+    int objc, pairc, i, retVal = TCL_OK;
+    Tcl_Obj **objv, **pairv;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (Tcl_ListObjGetElements(interp, listObj, &objc, &objv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    for (i = 0; i < objc; i++) {
+	if (Tcl_ListObjGetElements(interp, objv[i], &pairc, &pairv) 
+		!= TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (pairc != 2) {
+	    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+		    "bad mount \"", Tcl_GetString(objv[i]),
+		    "\": must be a list of path and command", (char *) NULL);
+	    return TCL_ERROR;
+	}
+    }
+    /* Keep the elements safe from anything the mounts might do */
+    Tcl_IncrRefCount(listObj);
+    VfsBeginMounts(tsdPtr);
+    for (i = 0; i < objc; i++) {
+	Tcl_ListObjGetElements(NULL, objv[i], &pairc, &pairv);
+	retVal = VfsMountOne(interp, pairv[0], pairv[1], flags, cacheTtl, 
+			     poolSize, initScript);
+	if (retVal != TCL_OK) {
+	    break;
+	}
+    }
+    if (retVal != TCL_OK) {
+	Tcl_Obj *errorObj = Tcl_GetObjResult(interp);
+	Tcl_IncrRefCount(errorObj);
+	/* Undo the mounts already made, newest first */
+	while (--i >= 0) {
+	    Tcl_ListObjGetElements(NULL, objv[i], &pairc, &pairv);
+	    Vfs_Unmount(interp, pairv[0]);
+	}
+	Tcl_SetObjResult(interp, errorObj);
+	Tcl_DecrRefCount(errorObj);
+    }
+    VfsEndMounts(tsdPtr);
+    Tcl_DecrRefCount(listObj);
+    return retVal;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsUnmountBatch --
+ *
+ *	Carry out 'vfs::filesystem unmount -batch', unmounting each of
+ *	a list of paths.
+ *
+ * Results:
+ *	A standard Tcl result: an error if any path was not mounted,
+ *	though all the others are still unmounted.
+ *
+ * Side effects:
+ *	Tcl is told of the removed mounts once, rather than once for
+ *	each.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsUnmountBatch(interp, listObj)
+    Tcl_Interp *interp;
+    Tcl_Obj *listObj;
+{
+    int objc, i, retVal = TCL_OK;
+    Tcl_Obj **objv, *errorObj = NULL;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (Tcl_ListObjGetElements(interp, listObj, &objc, &objv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    Tcl_IncrRefCount(listObj);
+    VfsBeginMounts(tsdPtr);
+    for (i = 0; i < objc; i++) {
+	if (Vfs_Unmount(interp, objv[i]) != TCL_OK) {
+	    if (errorObj == NULL) {
+		/* Report the first failure */
+		errorObj = Tcl_GetObjResult(interp);
+		Tcl_IncrRefCount(errorObj);
+	    }
+	    Tcl_ResetResult(interp);
+	    retVal = TCL_ERROR;
+	}
+    }
+    VfsEndMounts(tsdPtr);
+    Tcl_DecrRefCount(listObj);
+    if (errorObj != NULL) {
+	Tcl_SetObjResult(interp, errorObj);
+	Tcl_DecrRefCount(errorObj);
+    }
+    return retVal;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsFilesystemObjCmd --
+ *
+ *	This procedure implements the "vfs::filesystem" command.  It is
+ *	used to mount/unmount particular interfaces to new filesystems,
+ *	or to query for what is mounted where.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Inserts or removes a filesystem from Tcl's stack.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsFilesystemObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int		objc;
+    Tcl_Obj	*CONST objv[];
+{
+    int index;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    static CONST char *optionStrings[] = {
+	"info", "internalerror", "mount", "unmount", 
+	"fullynormalize", "posixerror", "statbuf", "invalidate",
+	"stats", "trace", "statmany", "lstatmany", "sync", "prefetch", 
+	"spillsize", "memory", "memorylimit", NULL
+    };
+    
+    enum options {
+	VFS_INFO, VFS_INTERNAL_ERROR, VFS_MOUNT, VFS_UNMOUNT, 
+	VFS_NORMALIZE, VFS_POSIXERROR, VFS_STATBUF, VFS_INVALIDATE,
+	VFS_STATS, VFS_TRACE, VFS_STATMANY, VFS_LSTATMANY, VFS_SYNC,
+	VFS_PREFETCH, VFS_SPILLSIZE, VFS_MEMORY, VFS_MEMORYLIMIT
+    };
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], optionStrings, "option", 0,
+	    &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    switch ((enum options) index) {
+	case VFS_INTERNAL_ERROR: {
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?script?");
+		return TCL_ERROR;
+	    }
+	    if (objc == 2) {
+	        /* Return the current script */
+		if (tsdPtr->internalErrorScript != NULL) {
+		    Tcl_SetObjResult(interp, tsdPtr->internalErrorScript);
+		}
+	    } else {
+		/* Set the script */
+		int len;
+		if (tsdPtr->internalErrorScript != NULL) {
+		    Tcl_DecrRefCount(tsdPtr->internalErrorScript);
+		}
+		Tcl_GetStringFromObj(objv[2], &len);
+		if (len == 0) {
+		    /* Clear our script */
+		    tsdPtr->internalErrorScript = NULL;
+		} else {
+		    /* Set it */
+		    tsdPtr->internalErrorScript = objv[2];
+		    Tcl_IncrRefCount(tsdPtr->internalErrorScript);
+		}
+	    }
+	    return TCL_OK;
+	}
+	case VFS_POSIXERROR: {
+	    int posixError = -1;
+	    if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "errorcode");
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(NULL, objv[2], &posixError) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    Tcl_SetErrno(posixError);
+	    /*
+	     * This special error code propagate to the Tcl_Eval* calls in
+	     * other parts of the vfs C code to indicate a posix error
+	     * being raised by some vfs implementation.
+	     */
+	    return TCLVFS_POSIXERROR;
+	}
+	case VFS_STATBUF: {
+	    return VfsStatBufCmd(interp, objc-2, objv+2);
+	}
+	case VFS_STATMANY:
+	case VFS_LSTATMANY: {
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "dir names");
+		return TCL_ERROR;
+	    }
+	    return VfsStatManyCmd(interp, objv[2], objv[3], 
+				  (index == VFS_LSTATMANY));
+	}
+	case VFS_PREFETCH: {
+	    return VfsPrefetchCmd(interp, objc-2, objv+2);
+	}
+	case VFS_MEMORY: {
+	    return VfsMemoryCmd(interp, objc-2, objv+2);
+	}
+	case VFS_MEMORYLIMIT: {
+	    Tcl_WideInt limit;
+
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?bytes?");
+		return TCL_ERROR;
+	    }
+	    if (objc == 3) {
+		if (Tcl_GetWideIntFromObj(interp, objv[2], &limit) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if (limit < 0) {
+		    Tcl_AppendResult(interp, "bad memory limit \"", 
+				     Tcl_GetString(objv[2]), "\"", 
+				     (char *) NULL);
+		    return TCL_ERROR;
+		}
+		Tcl_MutexLock(&vfsSharedMutex);
+		vfsMemoryLimit = limit;
+		Tcl_MutexUnlock(&vfsSharedMutex);
+		VfsCacheTrim(tsdPtr, NULL);
+	    }
+	    Tcl_MutexLock(&vfsSharedMutex);
+	    limit = vfsMemoryLimit;
+	    Tcl_MutexUnlock(&vfsSharedMutex);
+	    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(limit));
+	    return TCL_OK;
+	}
+	case VFS_NORMALIZE: {
+	    Tcl_Obj *path;
+	    if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "path");
+		return TCL_ERROR;
+	    }
+	    path = VfsFullyNormalizePath(interp, objv[2]);
+	    if (path == NULL) {
+		Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+			"not a valid path \"", Tcl_GetString(objv[2]), 
+			"\"", (char *) NULL);
+	    } else {
+		Tcl_SetObjResult(interp, path);
+		Tcl_DecrRefCount(path);
+		return TCL_OK;
+	    }
+	}
+        case VFS_MOUNT: {
+	    int i, flags = 0, poolSize = 0;
+	    long cacheTtl = 0;
+	    Tcl_Obj *initScript = NULL;
+	    
+	    for (i = 2; i < objc - 2; i++) {
+		char *option = Tcl_GetString(objv[i]);
+		if (!strcmp("-volume", option)) {
+		    flags |= VFS_MOUNT_VOLUME;
+		} else if (!strcmp("-async", option)) {
+		    flags |= VFS_MOUNT_ASYNC;
+		} else if (!strcmp("-asyncclose", option)) {
+		    flags |= VFS_MOUNT_ASYNCCLOSE;
+		} else if (!strcmp("-shared", option)) {
+		    flags |= VFS_MOUNT_SHARED;
+		} else if (!strcmp("-pool", option) && i < objc - 3) {
+		    i++;
+		    if (Tcl_GetIntFromObj(NULL, objv[i], &poolSize) != TCL_OK
+			    || poolSize < 1) {
+			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+				"bad pool size \"", Tcl_GetString(objv[i]),
+				"\": must be a positive integer", 
+				(char *) NULL);
+			return TCL_ERROR;
+		    }
+		    /* Workers are only useful to other threads */
+		    flags |= VFS_MOUNT_SHARED;
+		} else if (!strcmp("-init", option) && i < objc - 3) {
+		    initScript = objv[++i];
+		} else if (!strcmp("-cache", option) && i < objc - 3) {
+		    i++;
+		    if (!strcmp("immutable", Tcl_GetString(objv[i]))) {
+			cacheTtl = VFS_CACHE_FOREVER;
+		    } else if (Tcl_GetLongFromObj(NULL, objv[i], &cacheTtl) 
+			       != TCL_OK || cacheTtl < 0) {
+			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+				"bad cache lifetime \"", Tcl_GetString(objv[i]),
+				"\": must be milliseconds or immutable", 
+				(char *) NULL);
+			return TCL_ERROR;
+		    }
+		} else {
+		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+			    "bad option \"", option,
+			    "\": must be -async, -asyncclose, -cache, -init, -pool, "
+			    "-shared or -volume", 
+			    (char *) NULL);
+		    return TCL_ERROR;
+		}
+	    }
+	    if (objc < 4 || i != objc - 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "mount ?-volume? ?-async? "
+			"?-asyncclose? ?-shared? "
+			"?-pool size ?-init script?? ?-cache ttl? "
+			"path cmd | -batch mounts");
+		return TCL_ERROR;
+	    }
+	    if (initScript != NULL && poolSize == 0) {
+		Tcl_SetResult(interp, "-init requires -pool", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if ((flags & VFS_MOUNT_ASYNCCLOSE) && poolSize > 0) {
+		/* The workers would not see the pending contents */
+		Tcl_SetResult(interp, "-asyncclose cannot be used with -pool", 
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (!strcmp("-batch", Tcl_GetString(objv[i]))) {
+		return VfsMountBatch(interp, objv[i+1], flags, cacheTtl, 
+				     poolSize, initScript);
+	    }
+	    return VfsMountOne(interp, objv[i], objv[i+1], flags, cacheTtl, 
+			       poolSize, initScript);
+	}
+	case VFS_INVALIDATE: {
+	    VfsNativeRep *nativeRep;
+	    VfsSharedMount *sharedPtr;
+	    int recursive = 0;
+	    
+	    if (objc == 4 
+		    && !strcmp("-recursive", Tcl_GetString(objv[3]))) {
+		recursive = 1;
+	    } else if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "path ?-recursive?");
+		return TCL_ERROR;
+	    }
+	    sharedPtr = VfsGetRemote(objv[2], 0);
+	    if (sharedPtr != NULL) {
+		/* The cache is kept by the owner */
+		VfsRemoteCall call;
+		VfsRemoteInit(&call, VFS_OP_INVALIDATE, sharedPtr, objv[2]);
+		call.intArg = recursive;
+		VfsRemoteDispatch(&call);
+		return TCL_OK;
+	    }
+	    /* Paths outside any caching mount have nothing to forget */
+	    nativeRep = VfsGetRelativePath(objv[2]);
+	    if (nativeRep != NULL) {
+		int len;
+		CONST char *relative;
+		relative = Tcl_GetStringFromObj(nativeRep->relativeObj, &len);
+		VfsCacheInvalidate(nativeRep->mountPtr, relative, len, 
+				   recursive);
+	    }
+	    return TCL_OK;
+	}
+	case VFS_INFO: {
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "path");
+		return TCL_ERROR;
+	    }
+	    if (objc == 2) {
+		Tcl_SetObjResult(interp, Vfs_ListMounts());
+	    } else {
+		Vfs_InterpCmd *val;
+		
+		val = Vfs_FindMount(objv[2], -1);
+		if (val == NULL) {
+		    Tcl_Obj *path;
+		    path = VfsFullyNormalizePath(interp, objv[2]);
+		    val = Vfs_FindMount(path, -1);
+		    Tcl_DecrRefCount(path);
+		    if (val == NULL) {
+			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+				"no such mount \"", Tcl_GetString(objv[2]), 
+				"\"", (char *) NULL);
+			return TCL_ERROR;
+		    }
+		}
+		Tcl_SetObjResult(interp, val->mountCmd);
+	    }
+	    break;
+	}
+	case VFS_UNMOUNT: {
+	    /* Deferred close callbacks may still need their mount */
+	    VfsCloseRun(tsdPtr, NULL);
+	    if (objc == 4 && !strcmp("-batch", Tcl_GetString(objv[2]))) {
+		return VfsUnmountBatch(interp, objv[3]);
+	    }
+	    if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "path | -batch paths");
+		return TCL_ERROR;
+	    }
+	    return Vfs_Unmount(interp, objv[2]);
+	}
+	case VFS_SYNC: {
+	    int len;
+	    CONST char *str;
+	    VfsMount *mountPtr = NULL;
+	    
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?path?");
+		return TCL_ERROR;
+	    }
+	    if (objc == 3) {
+		str = Tcl_GetStringFromObj(objv[2], &len);
+		mountPtr = VfsLookupMount(tsdPtr, str, len);
+		if (mountPtr == NULL) {
+		    Tcl_Obj *path = VfsFullyNormalizePath(interp, objv[2]);
+		    if (path != NULL) {
+			str = Tcl_GetStringFromObj(path, &len);
+			mountPtr = VfsLookupMount(tsdPtr, str, len);
+			Tcl_DecrRefCount(path);
+		    }
+		}
+		if (mountPtr == NULL) {
+		    Tcl_ResetResult(interp);
+		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+			    "no such mount \"", Tcl_GetString(objv[2]), 
+			    "\"", (char *) NULL);
+		    return TCL_ERROR;
+		}
+	    }
+	    return VfsCloseSync(interp, mountPtr);
+	}
+	case VFS_SPILLSIZE: {
+	    Tcl_WideInt spillSize;
+
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "?bytes?");
+		return TCL_ERROR;
+	    }
+	    if (objc == 3) {
+		if (Tcl_GetWideIntFromObj(interp, objv[2], 
+					  &spillSize) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if (spillSize < 0) {
+		    Tcl_AppendResult(interp, "bad spill size \"", 
+				     Tcl_GetString(objv[2]), "\"", 
+				     (char *) NULL);
+		    return TCL_ERROR;
+		}
+		tsdPtr->spillSize = spillSize;
+		tsdPtr->spillSizeSet = 1;
+	    }
+	    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(tsdPtr->spillSizeSet 
+		    ? tsdPtr->spillSize : VFS_SPILL_SIZE));
+	    return TCL_OK;
+	}
+	case VFS_STATS: {
+	    int reset = 0, len;
+	    CONST char *str;
+	    VfsMount *mountPtr;
+	    Tcl_Obj *resultPtr, *mountsPtr;
+	    
+	    if (objc == 4 && !strcmp("-enable", Tcl_GetString(objv[2]))) {
+		if (Tcl_GetBooleanFromObj(interp, objv[3], 
+			&tsdPtr->statsEnabled) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		return TCL_OK;
+	    }
+	    if (objc > 2 && !strcmp("-reset", Tcl_GetString(objv[objc-1]))) {
+		reset = 1;
+		objc--;
+	    }
+	    if (objc > 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, 
+			"?path? ?-reset? | -enable boolean");
+		return TCL_ERROR;
+	    }
+	    VfsCheckSharedMounts(tsdPtr);
+	    if (objc == 3) {
+		str = Tcl_GetStringFromObj(objv[2], &len);
+		mountPtr = VfsLookupMount(tsdPtr, str, len);
+		if (mountPtr == NULL) {
+		    Tcl_Obj *path = VfsFullyNormalizePath(interp, objv[2]);
+		    if (path != NULL) {
+			str = Tcl_GetStringFromObj(path, &len);
+			mountPtr = VfsLookupMount(tsdPtr, str, len);
+			Tcl_DecrRefCount(path);
+		    }
+		}
+		if (mountPtr == NULL) {
+		    Tcl_ResetResult(interp);
+		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+			    "no such mount \"", Tcl_GetString(objv[2]), 
+			    "\"", (char *) NULL);
+		    return TCL_ERROR;
+		}
+		Tcl_SetObjResult(interp, VfsStatsObj(mountPtr, reset));
+		return TCL_OK;
+	    }
+	    mountsPtr = Tcl_NewObj();
+	    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+		 mountPtr = mountPtr->nextMount) {
+		if (VfsLookupMount(tsdPtr, mountPtr->mountPoint, 
+			mountPtr->mountLen) != mountPtr) {
+		    /* Shadowed by a later mount of the same path */
+		    continue;
+		}
+		Tcl_ListObjAppendElement(NULL, mountsPtr, Tcl_NewStringObj(
+			mountPtr->mountPoint, mountPtr->mountLen));
+		Tcl_ListObjAppendElement(NULL, mountsPtr, 
+			VfsStatsObj(mountPtr, reset));
+	    }
+	    resultPtr = Tcl_NewObj();
+	    Tcl_ListObjAppendElement(NULL, resultPtr, 
+				     Tcl_NewStringObj("misses", -1));
+	    Tcl_ListObjAppendElement(NULL, resultPtr, 
+				     Tcl_NewLongObj(tsdPtr->lookupMisses));
+	    Tcl_ListObjAppendElement(NULL, resultPtr, 
+				     Tcl_NewStringObj("mounts", -1));
+	    Tcl_ListObjAppendElement(NULL, resultPtr, mountsPtr);
+	    if (reset) {
+		tsdPtr->lookupMisses = 0;
+	    }
+	    Tcl_SetObjResult(interp, resultPtr);
+	    break;
+	}
+	case VFS_TRACE: {
+	    int action, i, size = VFS_TRACE_SIZE;
+	    Tcl_WideInt threshold = 0;
+	    static CONST char *actionStrings[] = {
+		"dump", "start", "stop", NULL
+	    };
+	    enum actions {
+		VFS_TRACE_DUMP, VFS_TRACE_START, VFS_TRACE_STOP
+	    };
+	    static CONST char *switches[] = {
+		"-size", "-threshold", NULL
+	    };
+	    
+	    if (objc < 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, 
+			"start ?-threshold usec? ?-size n? | stop | dump");
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIndexFromObj(interp, objv[2], actionStrings, "action", 
+		    0, &action) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (action != VFS_TRACE_START) {
+		if (objc != 3) {
+		    Tcl_WrongNumArgs(interp, 3, objv, NULL);
+		    return TCL_ERROR;
+		}
+		if (action == VFS_TRACE_DUMP) {
+		    Tcl_SetObjResult(interp, VfsTraceDump(tsdPtr));
+		} else if (tsdPtr->tracePtr != NULL) {
+		    /* Keep what was recorded, for 'dump' */
+		    tsdPtr->tracePtr->active = 0;
+		}
+		return TCL_OK;
+	    }
+	    for (i = 3; i < objc; i += 2) {
+		int sw;
+		
+		if (Tcl_GetIndexFromObj(interp, objv[i], switches, "switch", 
+			0, &sw) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if (i + 1 == objc) {
+		    Tcl_ResetResult(interp);
+		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp), 
+			    "missing value for \"", Tcl_GetString(objv[i]), 
+			    "\"", (char *) NULL);
+		    return TCL_ERROR;
+		}
+		if (sw == 0) {
+		    if (Tcl_GetIntFromObj(interp, objv[i+1], &size) 
+			    != TCL_OK) {
+			return TCL_ERROR;
+		    }
+		    if (size <= 0) {
+			Tcl_SetResult(interp, "size must be positive", 
+				      TCL_STATIC);
+			return TCL_ERROR;
+		    }
+		} else if (Tcl_GetWideIntFromObj(interp, objv[i+1], 
+			&threshold) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+	    }
+	    VfsTraceStart(tsdPtr, size, threshold);
+	    break;
+	}
+    }
+    return TCL_OK;
+}
+
+/* Handle an error thrown by a tcl vfs implementation */
+static void
+VfsInternalError(Tcl_Interp* interp)
+{
+    if (interp != NULL) {
+	ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+	if (tsdPtr->internalErrorScript != NULL) {
+	    Tcl_EvalObjEx(interp, tsdPtr->internalErrorScript,
+			  TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+	}
+    }
+}
+
+/*
+ * Fully normalized paths are remembered for each absolute path that
+ * VfsFullyNormalizePath passed through on the way (the links of a
+ * chain all share the result), and for the directory of the last of
+ * those, so that other names in a directory reached through links
+ * only need their own last element looked at.  They are all forgotten
+ * whenever mounts change here or in another thread, as Tcl forgets
+ * the paths it has normalized, and once there are too many.
+ * 
+ * Links can be repointed without any mount changing, so each entry
+ * also keeps what lstat said of its path, and the target if it was a
+ * link, and is dropped when used if either is no longer so.  Since
+ * lstat follows every link but the last, that covers the links above
+ * the path too.
+ */
+
+#define VFS_NORM_CACHE_SIZE	1024
+
+typedef struct VfsNormEntry {
+    Tcl_Obj *resultPtr;   /* The fully normalized path */
+    int exists;           /* Could the path be lstat'd? */
+    Tcl_StatBuf statBuf;  /* If so, what that gave */
+    Tcl_Obj *linkPtr;     /* Its target if a link, else NULL */
+} VfsNormEntry;
+
+/* Fill in entryPtr's view of the path, other than its result */
+static void
+VfsNormCacheStat(CONST char *path, VfsNormEntry *entryPtr) {
+    Tcl_Obj *pathPtr = Tcl_NewStringObj(path, -1);
+
+    Tcl_IncrRefCount(pathPtr);
+    entryPtr->exists = (Tcl_FSLstat(pathPtr, &entryPtr->statBuf) == 0);
+    entryPtr->linkPtr = NULL;
+#ifdef S_ISLNK
+    if (entryPtr->exists && S_ISLNK(entryPtr->statBuf.st_mode)) {
+	entryPtr->linkPtr = Tcl_FSLink(pathPtr, NULL, 0);
+    }
+#endif
+    Tcl_DecrRefCount(pathPtr);
+}
+
+static void
+VfsNormEntryFree(VfsNormEntry *entryPtr) {
+    Tcl_DecrRefCount(entryPtr->resultPtr);
+    if (entryPtr->linkPtr != NULL) {
+	Tcl_DecrRefCount(entryPtr->linkPtr);
+    }
+    ckfree((char*) entryPtr);
+}
+
+static Tcl_Obj*
+VfsNormCacheGet(ThreadSpecificData *tsdPtr, CONST char *path) {
+    Tcl_HashEntry *hPtr;
+    VfsNormEntry *entryPtr, now;
+    int same;
+
+    if (tsdPtr->normCacheInit && tsdPtr->normEpoch != sharedMountEpoch) {
+	VfsNormCacheFlush(tsdPtr);
+    }
+    if (!tsdPtr->normCacheInit) {
+	return NULL;
+    }
+    hPtr = Tcl_FindHashEntry(&tsdPtr->normCache, path);
+    if (hPtr == NULL) {
+	return NULL;
+    }
+    entryPtr = (VfsNormEntry*) Tcl_GetHashValue(hPtr);
+    VfsNormCacheStat(path, &now);
+    same = (now.exists == entryPtr->exists);
+    if (same && now.exists) {
+	same = (now.statBuf.st_dev == entryPtr->statBuf.st_dev
+		&& now.statBuf.st_ino == entryPtr->statBuf.st_ino
+		&& now.statBuf.st_mtime == entryPtr->statBuf.st_mtime
+		&& now.statBuf.st_ctime == entryPtr->statBuf.st_ctime
+		&& (now.linkPtr == NULL) == (entryPtr->linkPtr == NULL)
+		&& (now.linkPtr == NULL 
+		    || !strcmp(Tcl_GetString(now.linkPtr), 
+			       Tcl_GetString(entryPtr->linkPtr))));
+    }
+    if (now.linkPtr != NULL) {
+	Tcl_DecrRefCount(now.linkPtr);
+    }
+    if (!same) {
+	VfsNormEntryFree(entryPtr);
+	Tcl_DeleteHashEntry(hPtr);
+	return NULL;
+    }
+    return entryPtr->resultPtr;
+}
+
+static void
+VfsNormCachePut(ThreadSpecificData *tsdPtr, CONST char *path, 
+		Tcl_Obj *resultPtr) {
+    Tcl_HashEntry *hPtr;
+    VfsNormEntry *entryPtr;
+    int isNew;
+
+    if (tsdPtr->normCacheInit 
+	    && (tsdPtr->normCache.numEntries >= VFS_NORM_CACHE_SIZE
+		|| tsdPtr->normEpoch != sharedMountEpoch)) {
+	VfsNormCacheFlush(tsdPtr);
+    }
+    if (!tsdPtr->normCacheInit) {
+	Tcl_InitHashTable(&tsdPtr->normCache, TCL_STRING_KEYS);
+	tsdPtr->normCacheInit = 1;
+	tsdPtr->normEpoch = sharedMountEpoch;
+    }
+    entryPtr = (VfsNormEntry*) ckalloc(sizeof(VfsNormEntry));
+    entryPtr->resultPtr = resultPtr;
+    Tcl_IncrRefCount(resultPtr);
+    VfsNormCacheStat(path, entryPtr);
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->normCache, path, &isNew);
+    if (!isNew) {
+	VfsNormEntryFree((VfsNormEntry*) Tcl_GetHashValue(hPtr));
+    }
+    Tcl_SetHashValue(hPtr, (ClientData) entryPtr);
+}
+
+static void
+VfsNormCacheFlush(ThreadSpecificData *tsdPtr) {
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    if (!tsdPtr->normCacheInit) {
+	return;
+    }
+    for (hPtr = Tcl_FirstHashEntry(&tsdPtr->normCache, &search);
+	 hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	VfsNormEntryFree((VfsNormEntry*) Tcl_GetHashValue(hPtr));
+    }
+    Tcl_DeleteHashTable(&tsdPtr->normCache);
+    tsdPtr->normCacheInit = 0;
+}
+
+/* 
+ * The length of the directory part of an absolute path, if the path
+ * ends in a name under it and neither has any '.' or '..' elements,
+ * else -1.
+ */
+static int
+VfsPlainDirLength(CONST char *path, int len) {
+    int i, start = 0, lastSep = -1;
+
+    for (i = 0; i <= len; i++) {
+	if (i < len && path[i] != '/') {
+	    continue;
+	}
+	if ((i - start == 1 && path[start] == '.') 
+		|| (i - start == 2 && path[start] == '.' 
+		    && path[start+1] == '.')) {
+	    return -1;
+	}
+	if (i < len) {
+	    lastSep = i;
+	}
+	start = i + 1;
+    }
+    if (lastSep < 0 || lastSep == len - 1) {
+	return -1;
+    }
+    return (lastSep == 0) ? 1 : lastSep;
+}
+
+/* Return fully normalized path owned by the caller */
+static Tcl_Obj*
+VfsFullyNormalizePath(Tcl_Interp *interp, Tcl_Obj *pathPtr) {
+    Tcl_Obj *path = NULL, *chainPtr, **chain;
+    Tcl_DString ds;
+    CONST char *str;
+    int counter = 0, len, dirLen, fromDir, numChain, i;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (Tcl_FSGetPathType(pathPtr) == TCL_PATH_ABSOLUTE) {
+	path = VfsNormCacheGet(tsdPtr, Tcl_GetString(pathPtr));
+	if (path != NULL) {
+	    Tcl_IncrRefCount(path);
+	    return path;
+	}
+    }
+
+    /* The absolute paths we pass through, which all share the result */
+    chainPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(chainPtr);
+    Tcl_IncrRefCount(pathPtr);
+    while (1) {
+	fromDir = 0;
+	if (Tcl_FSGetPathType(pathPtr) == TCL_PATH_ABSOLUTE) {
+	    str = Tcl_GetStringFromObj(pathPtr, &len);
+	    if (counter > 0 && (path = VfsNormCacheGet(tsdPtr, str)) != NULL) {
+		break;
+	    }
+	    Tcl_ListObjAppendElement(NULL, chainPtr, pathPtr);
+	    dirLen = VfsPlainDirLength(str, len);
+	    if (dirLen > 0) {
+		Tcl_Obj *dirPtr;
+
+		Tcl_DStringInit(&ds);
+		Tcl_DStringAppend(&ds, str, dirLen);
+		dirPtr = VfsNormCacheGet(tsdPtr, Tcl_DStringValue(&ds));
+		Tcl_DStringFree(&ds);
+		if (dirPtr != NULL) {
+		    /* Known directory, so only the name remains to resolve */
+		    Tcl_Obj *namePtr = Tcl_DuplicateObj(dirPtr);
+		    CONST char *dirStr = Tcl_GetStringFromObj(dirPtr, &i);
+
+		    if (i == 0 || dirStr[i-1] != '/') {
+			Tcl_AppendToObj(namePtr, "/", 1);
+		    }
+		    Tcl_AppendToObj(namePtr, str + dirLen + (dirLen > 1), -1);
+		    Tcl_IncrRefCount(namePtr);
+		    Tcl_DecrRefCount(pathPtr);
+		    pathPtr = namePtr;
+		    fromDir = 1;
+		    str = Tcl_GetStringFromObj(pathPtr, &len);
+		    if ((path = VfsNormCacheGet(tsdPtr, str)) != NULL) {
+			break;
+		    }
+		    Tcl_ListObjAppendElement(NULL, chainPtr, pathPtr);
+		}
+	    }
+	}
+	path = Tcl_FSLink(pathPtr,NULL,0);
+	if (path == NULL) {
+	    break;
+	}
+	fromDir = 0;
+	if (Tcl_FSGetPathType(path) != TCL_PATH_ABSOLUTE) {
+	    /* 
+	     * This is more complex, we need to find the path
+	     * relative to the original file, effectively:
+	     * 
+	     *  file join [file dirname $pathPtr] $path
+	     *  
+	     * or 
+	     * 
+	     *  file join $pathPtr .. $path
+	     *  
+	     * So...
+	     */
+	    Tcl_Obj *dotdotPtr, *joinedPtr;
+	    Tcl_Obj *joinElements[2];
+	    
+	    dotdotPtr = Tcl_NewStringObj("..",2);
+	    Tcl_IncrRefCount(dotdotPtr);
+	    
+	    joinElements[0] = dotdotPtr;
+	    joinElements[1] = path;
+
+	    joinedPtr = Tcl_FSJoinToPath(pathPtr, 2, joinElements);
+	    
+	    if (joinedPtr != NULL) {
+		Tcl_IncrRefCount(joinedPtr);
+		Tcl_DecrRefCount(path);
+		path = joinedPtr;
+	    } else {
+		/* We failed, and our action is undefined */
+	    }
+	    Tcl_DecrRefCount(dotdotPtr);
+	}
+	Tcl_DecrRefCount(pathPtr);
+	pathPtr = path;
+	path = NULL;
+	counter++;
+	if (counter > 10) {
+	    /* Too many links */
+	    Tcl_DecrRefCount(pathPtr);
+	    Tcl_DecrRefCount(chainPtr);
+	    return NULL;
+	}
+    }
+
+    if (path == NULL) {
+#if !defined(__WIN32__) && !defined(__APPLE__)
+	if (fromDir) {
+	    /* 
+	     * A name which is not a link, in a normalized directory, is
+	     * already normalized (where case is not folded).
+	     */
+	    path = pathPtr;
+	} else
+#endif
+	path = Tcl_FSGetNormalizedPath(interp, pathPtr);
+	if (path == NULL) {
+	    Tcl_DecrRefCount(pathPtr);
+	    Tcl_DecrRefCount(chainPtr);
+	    return NULL;
+	}
+	/* The directory of a name resolves to that of its result */
+	str = Tcl_GetStringFromObj(pathPtr, &len);
+	dirLen = VfsPlainDirLength(str, len);
+	if (dirLen > 0 && Tcl_FSGetPathType(pathPtr) == TCL_PATH_ABSOLUTE) {
+	    CONST char *normStr;
+	    int normLen, normDirLen;
+
+	    normStr = Tcl_GetStringFromObj(path, &normLen);
+	    normDirLen = VfsPlainDirLength(normStr, normLen);
+	    if (normDirLen > 0 && !strcmp(str + dirLen + (dirLen > 1), 
+		    normStr + normDirLen + (normDirLen > 1))) {
+		Tcl_DStringInit(&ds);
+		Tcl_DStringAppend(&ds, str, dirLen);
+		VfsNormCachePut(tsdPtr, Tcl_DStringValue(&ds), 
+			Tcl_NewStringObj(normStr, normDirLen));
+		Tcl_DStringFree(&ds);
+	    }
+	}
+    }
+    Tcl_IncrRefCount(path);
+    Tcl_ListObjGetElements(NULL, chainPtr, &numChain, &chain);
+    for (i = 0; i < numChain; i++) {
+	VfsNormCachePut(tsdPtr, Tcl_GetString(chain[i]), path);
+    }
+    Tcl_DecrRefCount(pathPtr);
+    Tcl_DecrRefCount(chainPtr);
+    return path;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsPathInFilesystem --
+ *
+ *	Check whether a path is in any of the mounted points in this
+ *	vfs.
+ *	
+ *	If it is in the vfs, set the clientData given to our private
+ *	internal representation for a vfs path.
+ *	
+ * Results:
+ *	Returns TCL_OK on success, or 'TCLVFS_POSIXERROR' on failure.
+ *	If Tcl is exiting, we always return a failure code.
+ *
+ * Side effects:
+ *	On success, we allocate some memory for our internal
+ *	representation structure.  Tcl will call us to free this
+ *	when necessary.
+ *
+ *----------------------------------------------------------------------
+ */
+static int 
+VfsPathInFilesystem(Tcl_Obj *pathPtr, ClientData *clientDataPtr) {
+    Tcl_Obj *normedObj;
+    int len, splitPosition;
+    char *normed;
+    VfsNativeRep *nativeRep;
+    VfsMount *mountPtr = NULL;
+    ThreadSpecificData *tsdPtr;
+    
+    if (TclInExit()) {
+	/* 
+	 * Even Tcl_FSGetNormalizedPath may fail due to lack of system
+	 * encodings, so we just say we can't handle anything if we are
+	 * in the middle of the exit sequence.  We could perhaps be
+	 * more subtle than this!
+	 */
+	return TCLVFS_POSIXERROR;
+    }
+
+    tsdPtr = TCL_TSD_INIT(&dataKey);
+    VfsCheckSharedMounts(tsdPtr);
+    if (tsdPtr->listOfMounts == NULL) {
+	/* Nothing is mounted in this thread */
+	return TCLVFS_POSIXERROR;
+    }
+
+    normedObj = Tcl_FSGetNormalizedPath(NULL, pathPtr);
+    if (normedObj == NULL) {
+        goto notFound;
+    }
+    normed = Tcl_GetStringFromObj(normedObj, &len);
+    splitPosition = len;
+
+    if (!VfsMayContainMount(tsdPtr, normed, len)) {
+	goto notFound;
+    }
+
+    /* 
+     * Find the most specific mount point for this path.
+     * Mount points are specified by unique strings, so
+     * we have to use a unique normalised path for the
+     * checks here.
+     * 
+     * Given mount points are paths, 'most specific' means
+     * longest path, so we scan from end to beginning
+     * checking for valid mount points at each separator.
+     */
+    while (1) {
+	/* 
+	 * We need this test here both for an empty string being
+	 * passed in above, and so that if we are testing a unix
+	 * absolute path /foo/bar we will come around the loop
+	 * with splitPosition at 0 for the last iteration, and we
+	 * must return then.
+	 */
+	if (splitPosition == 0) {
+	    goto notFound;
+	}
+	
+	/* Is the path up to 'splitPosition' a valid moint point? */
+	mountPtr = VfsLookupMount(tsdPtr, normed, splitPosition);
+	if (mountPtr != NULL) break;
+
+	while (normed[--splitPosition] != VFS_SEPARATOR) {
+	    if (splitPosition == 0) {
+		/* 
+		 * We've reached the beginning of the string without
+		 * finding a mount, so we've failed.
+		 */
+		goto notFound;
+	    }
+	}
+	
+	/* 
+	 * We now know that normed[splitPosition] is a separator.
+	 * However, we might have mounted a root filesystem with a
+	 * name (for example 'ftp://') which actually includes a
+	 * separator.  Therefore we test whether the path with
+	 * a separator is a mount point.
+	 * 
+	 * Since we must have decremented splitPosition at least once
+	 * already (above) 'splitPosition+1 <= len' so this won't
+	 * access invalid memory.
+	 */
+	mountPtr = VfsLookupMount(tsdPtr, normed, splitPosition+1);
+	if (mountPtr != NULL) {
+	    splitPosition++;
+	    break;
+	}
+    }
+    
+    /* 
+     * If we reach here we have a valid mount point, since the
+     * only way to escape the above loop is through a 'break' when
+     * a mountPtr is non-NULL.
+     */
+    nativeRep = VfsAllocNativeRep(tsdPtr);
+    nativeRep->splitPosition = splitPosition;
+    nativeRep->mountPtr = mountPtr;
+    *clientDataPtr = (ClientData)nativeRep;
+    if (tsdPtr->statsEnabled) {
+	VfsGetStats(mountPtr)->lookups++;
+    }
+    return TCL_OK;
+
+  notFound:
+    if (tsdPtr->statsEnabled) {
+	tsdPtr->lookupMisses++;
+    }
+    return TCLVFS_POSIXERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsAllocNativeRep --
+ *
+ *	Allocate a VfsNativeRep from the thread's free list, carving
+ *	a new slab of them when it is empty.  Path objects (and hence
+ *	their internal representations) never leave the thread which
+ *	created them, so no locking is needed.
+ *
+ * Results:
+ *	A structure with no cached root and relative parts.
+ *
+ * Side effects:
+ *	May allocate memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VfsNativeRep*
+VfsAllocNativeRep(ThreadSpecificData *tsdPtr)
+{
+    VfsNativeRep *nativeRep;
+
+    if (tsdPtr->freeNativeReps == NULL) {
+	VfsNativeRepSlab *slabPtr;
+	int i;
+
+	slabPtr = (VfsNativeRepSlab*) ckalloc(sizeof(VfsNativeRepSlab));
+	slabPtr->nextSlab = tsdPtr->nativeRepSlabs;
+	slabPtr->numLive = 0;
+	slabPtr->orphaned = 0;
+	tsdPtr->nativeRepSlabs = slabPtr;
+	for (i = VFS_NATIVEREP_SLAB_SIZE - 1; i >= 0; i--) {
+	    slabPtr->reps[i].slabPtr = slabPtr;
+	    slabPtr->reps[i].nextFree = tsdPtr->freeNativeReps;
+	    tsdPtr->freeNativeReps = &slabPtr->reps[i];
+	}
+    }
+    nativeRep = tsdPtr->freeNativeReps;
+    tsdPtr->freeNativeReps = nativeRep->nextFree;
+    nativeRep->slabPtr->numLive++;
+    nativeRep->rootObj = NULL;
+    nativeRep->relativeObj = NULL;
+    nativeRep->nextFree = NULL;
+    return nativeRep;
+}
+
+/* 
+ * Simple helper function to extract the native vfs representation of a
+ * path object, or NULL if no such representation exists.
+ */
+static VfsNativeRep* 
+VfsGetNativePath(Tcl_Obj* pathPtr) {
+    return (VfsNativeRep*) Tcl_FSGetInternalRep(pathPtr, &vfsFilesystem);
+}
+
+static void 
+VfsFreeInternalRep(ClientData clientData) {
+    VfsNativeRep *nativeRep = (VfsNativeRep*)clientData;
+    if (nativeRep != NULL) {
+	VfsNativeRepSlab *slabPtr = nativeRep->slabPtr;
+	ThreadSpecificData *tsdPtr;
+
+	if (nativeRep->rootObj != NULL) {
+	    Tcl_DecrRefCount(nativeRep->rootObj);
+	    Tcl_DecrRefCount(nativeRep->relativeObj);
+	}
+	slabPtr->numLive--;
+	if (slabPtr->orphaned) {
+	    /* The thread has exited, and its free list with it */
+	    if (slabPtr->numLive == 0) {
+		ckfree((char*)slabPtr);
+	    }
+	    return;
+	}
+	/* Return the structure to this thread's free list */
+	tsdPtr = TCL_TSD_INIT(&dataKey);
+	nativeRep->nextFree = tsdPtr->freeNativeReps;
+	tsdPtr->freeNativeReps = nativeRep;
+    }
+}
+
+static ClientData 
+VfsDupInternalRep(ClientData clientData) {
+    VfsNativeRep *original = (VfsNativeRep*)clientData;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    VfsNativeRep *nativeRep = VfsAllocNativeRep(tsdPtr);
+    nativeRep->splitPosition = original->splitPosition;
+    nativeRep->mountPtr = original->mountPtr;
+    if (original->rootObj != NULL) {
+	nativeRep->rootObj = original->rootObj;
+	nativeRep->relativeObj = original->relativeObj;
+	Tcl_IncrRefCount(nativeRep->rootObj);
+	Tcl_IncrRefCount(nativeRep->relativeObj);
+    }
+    
+    return (ClientData)nativeRep;
+}
+
+static Tcl_Obj* 
+VfsFilesystemPathType(Tcl_Obj *pathPtr) {
+    VfsNativeRep* nativeRep = VfsGetNativePath(pathPtr);
+    if (nativeRep == NULL) {
+	return NULL;
+    } else {
+	return nativeRep->mountPtr->interpCmd.mountCmd;
+    }
+}
+
+static Tcl_Obj*
+VfsFilesystemSeparator(Tcl_Obj* pathPtr) {
+    char sep=VFS_SEPARATOR;
+    return Tcl_NewStringObj(&sep,1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Metadata cache --
+ *
+ *	Mounts created with '-cache' remember the results of 'stat',
+ *	'access' and 'matchindirectory', including failed lookups, so
+ *	that repeated probes of the same paths do not call into Tcl.
+ *	Entries are keyed by the relative path passed to the handler
+ *	and hold only plain C data.  Anything which changes a path
+ *	through the mount drops the entries for that path and its
+ *	parent directory; 'vfs::filesystem invalidate' does so on
+ *	request.
+ *
+ *	Each entry is charged for the memory it takes, and is on the
+ *	thread's list of entries, most recently used first, so that
+ *	while the entries of all threads take more than
+ *	'vfs::filesystem memorylimit' allows, those least recently
+ *	used can be dropped (see VfsCacheTrim).
+ *
+ *----------------------------------------------------------------------
+ */
+
+typedef struct VfsCacheLink {
+    struct VfsCacheLink *prevPtr; /* Neighbours in the thread's list */
+    struct VfsCacheLink *nextPtr;
+    VfsMount *mountPtr;           /* Mount whose cache has the entry */
+    Tcl_HashEntry *hPtr;          /* ... and where */
+    int size;                     /* Bytes charged for it */
+} VfsCacheLink;
+
+typedef struct VfsCacheEntry {
+    VfsCacheLink link;            /* Must be first */
+    Tcl_WideInt stamp;            /* When the entry was created, in ms */
+    int haveStat;                 /* Is the stat result below known? */
+    int statErrno;                /* 0, or the posix error of the stat */
+    Tcl_StatBuf statBuf;
+    int accessKnown;              /* Bit (1<<mode) is set for each
+                                   * access mode looked up ... */
+    int accessDenied;             /* ... and here if it was refused. */
+} VfsCacheEntry;
+
+typedef struct VfsGlobCacheEntry {
+    VfsCacheLink link;            /* Must be first */
+    Tcl_WideInt stamp;
+    int length;
+    char result[4];               /* String form of the result list;
+                                   * actually 'length+1' bytes. */
+} VfsGlobCacheEntry;
+
+/* Information needed to drop cached results when a written file closes */
+typedef struct VfsCacheCloseInfo {
+    VfsMount *mountPtr;
+    Tcl_Obj *relativeObj;
+    VfsSharedMount *sharedPtr;    /* As for VfsChannelCleanupInfo */
+} VfsCacheCloseInfo;
+
+static Tcl_WideInt
+VfsCacheNow(void) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return ((Tcl_WideInt)now.sec) * 1000 + now.usec / 1000;
+}
+
+static int
+VfsCacheExpired(VfsMount *mountPtr, Tcl_WideInt stamp) {
+    return (mountPtr->cacheTtl != VFS_CACHE_FOREVER 
+	    && VfsCacheNow() - stamp >= mountPtr->cacheTtl);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCacheAdd --
+ *
+ *	Charge a new cache entry, held in the hash entry 'hPtr' of one
+ *	of a mount's caches, to the mount and put it at the head of
+ *	the thread's list.  Then trim the caches if they are over the
+ *	memory limit, though never dropping the new entry.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May free other entries of any mount of this thread, and ask
+ *	other threads to free some of theirs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsCacheAdd(VfsMount *mountPtr, Tcl_HashEntry *hPtr, VfsCacheLink *linkPtr,
+	    int size) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    linkPtr->mountPtr = mountPtr;
+    linkPtr->hPtr = hPtr;
+    linkPtr->size = size;
+    linkPtr->prevPtr = NULL;
+    linkPtr->nextPtr = tsdPtr->cacheHead;
+    if (tsdPtr->cacheHead != NULL) {
+	tsdPtr->cacheHead->prevPtr = linkPtr;
+    } else {
+	tsdPtr->cacheTail = linkPtr;
+    }
+    tsdPtr->cacheHead = linkPtr;
+    mountPtr->cacheBytes += size;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    VfsCacheCharge(tsdPtr, size);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    VfsCacheTrim(tsdPtr, linkPtr);
+}
+
+/* 
+ * Charge (or with a negative size, refund) this thread for cache
+ * entries, entering it among the threads which have some or taking
+ * it out.  The caller holds vfsSharedMutex.
+ */
+static void
+VfsCacheCharge(ThreadSpecificData *tsdPtr, Tcl_WideInt size) {
+    VfsCacheThread *threadPtr = &tsdPtr->cacheThread, **prevPtrPtr;
+
+    vfsCacheBytes += size;
+    threadPtr->bytes += size;
+    if (threadPtr->bytes > 0 && !threadPtr->linked && !tsdPtr->exiting) {
+	threadPtr->thread = Tcl_GetCurrentThread();
+	threadPtr->nextPtr = vfsCacheThreads;
+	vfsCacheThreads = threadPtr;
+	threadPtr->linked = 1;
+	vfsNumCacheThreads++;
+    } else if (threadPtr->linked 
+	    && (threadPtr->bytes == 0 || tsdPtr->exiting)) {
+	for (prevPtrPtr = &vfsCacheThreads; *prevPtrPtr != threadPtr; 
+	     prevPtrPtr = &(*prevPtrPtr)->nextPtr) {
+	    /* Empty loop body */
+	}
+	*prevPtrPtr = threadPtr->nextPtr;
+	threadPtr->linked = 0;
+	vfsNumCacheThreads--;
+    }
+}
+
+/* 
+ * Is this thread to trim its caches?  It is while those of all
+ * threads are over the memory limit and its own take more than an
+ * even share of it.  The caller holds vfsSharedMutex.
+ */
+static int
+VfsCacheOverShare(VfsCacheThread *threadPtr) {
+    return (vfsMemoryLimit > 0 && vfsCacheBytes > vfsMemoryLimit 
+	    && vfsNumCacheThreads > 0 
+	    && threadPtr->bytes > vfsMemoryLimit / vfsNumCacheThreads);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCacheTrim --
+ *
+ *	While the caches of all threads are over the memory limit, drop
+ *	this thread's least recently used entries (never 'keepPtr')
+ *	until it is within its share of the limit.  A thread only
+ *	drops its own entries, so any other still over its share is
+ *	then sent a VfsCacheTrimEvent to do the same; a busy thread
+ *	thus keeps its share rather than giving up all it has to an
+ *	idle one.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May free entries of any mount of this thread, and queue events
+ *	to other threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsCacheTrim(ThreadSpecificData *tsdPtr, VfsCacheLink *keepPtr) {
+    VfsCacheThread *threadPtr;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    while (VfsCacheOverShare(&tsdPtr->cacheThread) 
+	    && tsdPtr->cacheTail != NULL && tsdPtr->cacheTail != keepPtr) {
+	Tcl_MutexUnlock(&vfsSharedMutex);
+	VfsCacheDrop(tsdPtr->cacheTail);
+	Tcl_MutexLock(&vfsSharedMutex);
+    }
+    for (threadPtr = vfsCacheThreads; threadPtr != NULL; 
+	 threadPtr = threadPtr->nextPtr) {
+	if (threadPtr != &tsdPtr->cacheThread && !threadPtr->trimQueued 
+		&& VfsCacheOverShare(threadPtr)) {
+	    Tcl_Event *evPtr = (Tcl_Event*) ckalloc(sizeof(Tcl_Event));
+
+	    evPtr->proc = VfsCacheTrimEventProc;
+	    threadPtr->trimQueued = 1;
+	    Tcl_ThreadQueueEvent(threadPtr->thread, evPtr, TCL_QUEUE_TAIL);
+	    Tcl_ThreadAlert(threadPtr->thread);
+	}
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+/* Trim this thread's caches, as another thread has asked */
+static int
+VfsCacheTrimEventProc(Tcl_Event *evPtr, int flags) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    tsdPtr->cacheThread.trimQueued = 0;
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    VfsCacheTrim(tsdPtr, NULL);
+    return 1;
+}
+
+/* Move a cache entry which has been used to the head of the list */
+static void
+VfsCacheTouch(VfsCacheLink *linkPtr) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->cacheHead == linkPtr) {
+	return;
+    }
+    linkPtr->prevPtr->nextPtr = linkPtr->nextPtr;
+    if (linkPtr->nextPtr != NULL) {
+	linkPtr->nextPtr->prevPtr = linkPtr->prevPtr;
+    } else {
+	tsdPtr->cacheTail = linkPtr->prevPtr;
+    }
+    linkPtr->prevPtr = NULL;
+    linkPtr->nextPtr = tsdPtr->cacheHead;
+    tsdPtr->cacheHead->prevPtr = linkPtr;
+    tsdPtr->cacheHead = linkPtr;
+}
+
+/* Remove a cache entry from its mount's cache and free it */
+static void
+VfsCacheDrop(VfsCacheLink *linkPtr) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (linkPtr->prevPtr != NULL) {
+	linkPtr->prevPtr->nextPtr = linkPtr->nextPtr;
+    } else {
+	tsdPtr->cacheHead = linkPtr->nextPtr;
+    }
+    if (linkPtr->nextPtr != NULL) {
+	linkPtr->nextPtr->prevPtr = linkPtr->prevPtr;
+    } else {
+	tsdPtr->cacheTail = linkPtr->prevPtr;
+    }
+    linkPtr->mountPtr->cacheBytes -= linkPtr->size;
+    Tcl_MutexLock(&vfsSharedMutex);
+    VfsCacheCharge(tsdPtr, -linkPtr->size);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    Tcl_DeleteHashEntry(linkPtr->hPtr);
+    ckfree((char*)linkPtr);
+}
+
+/* 
+ * Find (or, if 'create' is set, make) the cache entry for a relative
+ * path in the given mount.  Expired entries are never returned.
+ */
+static VfsCacheEntry*
+VfsCacheLookup(VfsMount *mountPtr, Tcl_Obj *relativeObj, int create) {
+    Tcl_HashEntry *hPtr;
+    VfsCacheEntry *entryPtr;
+    int isNew;
+    
+    if (mountPtr->cacheTtl == 0) {
+	return NULL;
+    }
+    if (mountPtr->statCache == NULL) {
+	if (!create) {
+	    return NULL;
+	}
+	mountPtr->statCache = (Tcl_HashTable*) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(mountPtr->statCache, TCL_STRING_KEYS);
+    }
+    if (!create) {
+	hPtr = Tcl_FindHashEntry(mountPtr->statCache, 
+				 Tcl_GetString(relativeObj));
+	if (hPtr == NULL) {
+	    return NULL;
+	}
+	entryPtr = (VfsCacheEntry*) Tcl_GetHashValue(hPtr);
+	if (VfsCacheExpired(mountPtr, entryPtr->stamp)) {
+	    VfsCacheDrop(&entryPtr->link);
+	    return NULL;
+	}
+	VfsCacheTouch(&entryPtr->link);
+	return entryPtr;
+    }
+    hPtr = Tcl_CreateHashEntry(mountPtr->statCache, 
+			       Tcl_GetString(relativeObj), &isNew);
+    if (!isNew) {
+	entryPtr = (VfsCacheEntry*) Tcl_GetHashValue(hPtr);
+	VfsCacheTouch(&entryPtr->link);
+	if (!VfsCacheExpired(mountPtr, entryPtr->stamp)) {
+	    return entryPtr;
+	}
+	memset((char*)entryPtr + sizeof(VfsCacheLink), 0, 
+	       sizeof(VfsCacheEntry) - sizeof(VfsCacheLink));
+	entryPtr->stamp = VfsCacheNow();
+	return entryPtr;
+    }
+    entryPtr = (VfsCacheEntry*) ckalloc(sizeof(VfsCacheEntry));
+    memset(entryPtr, 0, sizeof(VfsCacheEntry));
+    entryPtr->stamp = VfsCacheNow();
+    Tcl_SetHashValue(hPtr, (ClientData)entryPtr);
+    VfsCacheAdd(mountPtr, hPtr, &entryPtr->link, (int) 
+	    (sizeof(VfsCacheEntry) + sizeof(Tcl_HashEntry) 
+	     + strlen(Tcl_GetString(relativeObj))));
+    return entryPtr;
+}
+
+/* Find the cache entry of a path, if it is in a caching mount */
+static VfsCacheEntry*
+VfsCacheFind(Tcl_Obj *pathPtr) {
+    VfsNativeRep *nativeRep = VfsGetRelativePath(pathPtr);
+    if (nativeRep == NULL || nativeRep->mountPtr->cacheTtl == 0) {
+	return NULL;
+    }
+    return VfsCacheLookup(nativeRep->mountPtr, nativeRep->relativeObj, 0);
+}
+
+/* 
+ * Build the key under which a 'matchindirectory' result is cached:
+ * the relative path of the directory, followed by the type, pattern
+ * and the directory as given, each NUL-separated.  The handler may
+ * build its results from the latter, so it is part of the key.
+ */
+static void
+VfsGlobCacheKey(Tcl_DString *dsPtr, Tcl_Obj *relativeObj, int type,
+		CONST char *pattern, Tcl_Obj *dirPtr) {
+    char buf[TCL_INTEGER_SPACE];
+    int len;
+    CONST char *str;
+
+    str = Tcl_GetStringFromObj(relativeObj, &len);
+    Tcl_DStringAppend(dsPtr, str, len + 1);
+    sprintf(buf, "%d", type);
+    Tcl_DStringAppend(dsPtr, buf, (int)strlen(buf) + 1);
+    if (pattern != NULL) {
+	Tcl_DStringAppend(dsPtr, pattern, -1);
+    }
+    Tcl_DStringAppend(dsPtr, "", 1);
+    str = Tcl_GetStringFromObj(dirPtr, &len);
+    Tcl_DStringAppend(dsPtr, str, len);
+}
+
+/* Does a cached relative path lie at or below 'relative'? */
+static int
+VfsCacheCovers(CONST char *key, CONST char *relative, int len) {
+    return (len == 0 || (strncmp(key, relative, (size_t)len) == 0 
+			 && (key[len] == '\0' || key[len] == VFS_SEPARATOR)));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCacheInvalidate --
+ *
+ *	Drop whatever is cached for a relative path in a mount, and
+ *	for its parent directory (whose listing and times will have
+ *	changed too).  If 'recursive' is set, everything below the
+ *	path goes as well.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Frees cache entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsCacheInvalidate(VfsMount *mountPtr, CONST char *relative, int len,
+		   int recursive) {
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    Tcl_DString parent;
+    int parentLen = -1;
+    
+    Tcl_DStringInit(&parent);
+    if (len > 0) {
+	parentLen = len;
+	while (parentLen > 0 && relative[parentLen-1] != VFS_SEPARATOR) {
+	    parentLen--;
+	}
+	if (parentLen > 0) {
+	    parentLen--;
+	}
+	Tcl_DStringAppend(&parent, relative, parentLen);
+    }
+    
+    if (mountPtr->statCache != NULL) {
+	if (recursive) {
+	    for (hPtr = Tcl_FirstHashEntry(mountPtr->statCache, &search);
+		 hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+		if (VfsCacheCovers(Tcl_GetHashKey(mountPtr->statCache, hPtr),
+				   relative, len)) {
+		    VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+		}
+	    }
+	} else {
+	    Tcl_DString key;
+	    Tcl_DStringInit(&key);
+	    Tcl_DStringAppend(&key, relative, len);
+	    hPtr = Tcl_FindHashEntry(mountPtr->statCache, 
+				     Tcl_DStringValue(&key));
+	    Tcl_DStringFree(&key);
+	    if (hPtr != NULL) {
+		VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+	    }
+	}
+	if (parentLen >= 0) {
+	    hPtr = Tcl_FindHashEntry(mountPtr->statCache, 
+				     Tcl_DStringValue(&parent));
+	    if (hPtr != NULL) {
+		VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+	    }
+	}
+    }
+    
+    if (mountPtr->globCache != NULL) {
+	for (hPtr = Tcl_FirstHashEntry(mountPtr->globCache, &search);
+	     hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	    /* The directory is the first NUL-terminated part of the key */
+	    CONST char *dir = hPtr->key.string;
+	    int dirLen = (int) strlen(dir);
+	    
+	    if ((dirLen == len && !strncmp(dir, relative, (size_t)len))
+		|| (parentLen >= 0 && dirLen == parentLen
+		    && !strcmp(dir, Tcl_DStringValue(&parent)))
+		|| (recursive && VfsCacheCovers(dir, relative, len))) {
+		VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+	    }
+	}
+    }
+    Tcl_DStringFree(&parent);
+}
+
+/* Free all cached results of a mount */
+static void
+VfsCacheFree(VfsMount *mountPtr) {
+    Tcl_HashTable *tables[2];
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    int i;
+    
+    tables[0] = mountPtr->statCache;
+    tables[1] = mountPtr->globCache;
+    for (i = 0; i < 2; i++) {
+	if (tables[i] == NULL) {
+	    continue;
+	}
+	for (hPtr = Tcl_FirstHashEntry(tables[i], &search);
+	     hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	    VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+	}
+	Tcl_DeleteHashTable(tables[i]);
+	ckfree((char*)tables[i]);
+    }
+    mountPtr->statCache = NULL;
+    mountPtr->globCache = NULL;
+}
+
+/* Drop cached results for the path of a callback which changes it */
+static void
+VfsCallbackInvalidate(VfsCallback *cbPtr, int recursive) {
+    VfsMount *mountPtr = cbPtr->mountPtr;
+    CONST char *relative;
+    int len;
+    
+    if (mountPtr->cacheTtl != 0) {
+	relative = Tcl_GetStringFromObj(VfsCallbackRelative(cbPtr), &len);
+	VfsCacheInvalidate(mountPtr, relative, len, recursive);
+    }
+}
+
+/* Close handler for files opened for writing in a caching mount */
+static void
+VfsCacheCloseProc(ClientData clientData) {
+    VfsCacheCloseInfo *infoPtr = (VfsCacheCloseInfo*)clientData;
+    CONST char *relative;
+    int len;
+    
+    if (infoPtr->sharedPtr != NULL && VfsRemoteClose(infoPtr->sharedPtr,
+	    VfsCacheCloseProc, clientData, NULL)) {
+	return;
+    }
+    relative = Tcl_GetStringFromObj(infoPtr->relativeObj, &len);
+    VfsCacheInvalidate(infoPtr->mountPtr, relative, len, 0);
+    Tcl_DecrRefCount(infoPtr->relativeObj);
+    VfsReleaseMount(infoPtr->mountPtr);
+    if (infoPtr->sharedPtr != NULL) {
+	VfsReleaseShared(infoPtr->sharedPtr);
+    }
+    ckfree((char*)infoPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Stat results --
+ *
+ *	A 'stat' handler may describe a file in one of three ways: as
+ *	a plain key/value list (the original protocol), as a dict, or
+ *	as a 'vfsstatbuf' object created by 'vfs::filesystem statbuf'.
+ *	The latter carries a ready-made Tcl_StatBuf which is copied
+ *	directly; dicts are probed only for the keys we understand.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *vfsStatFieldNames[] = {
+    "dev", "ino", "mode", "nlink", "uid", "gid", "size", 
+    "atime", "mtime", "ctime", "type", NULL
+};
+
+static void	       VfsFreeStatBuf(Tcl_Obj *objPtr);
+static void	       VfsDupStatBuf(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void	       VfsUpdateStringOfStatBuf(Tcl_Obj *objPtr);
+
+static Tcl_ObjType vfsStatBufType = {
+    "vfsstatbuf",		/* name */
+    VfsFreeStatBuf,		/* freeIntRepProc */
+    VfsDupStatBuf,		/* dupIntRepProc */
+    VfsUpdateStringOfStatBuf,	/* updateStringProc */
+    NULL			/* setFromAnyProc */
+};
+
+static void
+VfsFreeStatBuf(Tcl_Obj *objPtr) {
+    ckfree((char*)objPtr->internalRep.otherValuePtr);
+}
+
+static void
+VfsDupStatBuf(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr) {
+    Tcl_StatBuf *bufPtr = (Tcl_StatBuf*)ckalloc(sizeof(Tcl_StatBuf));
+    memcpy(bufPtr, srcPtr->internalRep.otherValuePtr, sizeof(Tcl_StatBuf));
+    dupPtr->internalRep.otherValuePtr = (VOID*)bufPtr;
+    dupPtr->typePtr = &vfsStatBufType;
+}
+
+/* The string form is a key/value list in the original protocol */
+static void
+VfsUpdateStringOfStatBuf(Tcl_Obj *objPtr) {
+    Tcl_StatBuf *bufPtr = (Tcl_StatBuf*)objPtr->internalRep.otherValuePtr;
+    Tcl_Obj *listPtr = Tcl_NewObj();
+    CONST char *type = NULL;
+    char *str;
+    int len;
+
+#define VfsStatAppend(name, valueObj) \
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj(name, -1)); \
+    Tcl_ListObjAppendElement(NULL, listPtr, valueObj)
+
+    VfsStatAppend("dev", Tcl_NewLongObj((long)bufPtr->st_dev));
+    VfsStatAppend("ino", Tcl_NewLongObj((long)bufPtr->st_ino));
+    VfsStatAppend("mode", Tcl_NewIntObj((int)(bufPtr->st_mode & 07777)));
+    VfsStatAppend("nlink", Tcl_NewLongObj((long)bufPtr->st_nlink));
+    VfsStatAppend("uid", Tcl_NewLongObj((long)bufPtr->st_uid));
+    VfsStatAppend("gid", Tcl_NewLongObj((long)bufPtr->st_gid));
+    VfsStatAppend("size", Tcl_NewWideIntObj((Tcl_WideInt)bufPtr->st_size));
+    VfsStatAppend("atime", Tcl_NewLongObj((long)bufPtr->st_atime));
+    VfsStatAppend("mtime", Tcl_NewLongObj((long)bufPtr->st_mtime));
+    VfsStatAppend("ctime", Tcl_NewLongObj((long)bufPtr->st_ctime));
+    if (S_ISDIR(bufPtr->st_mode)) {
+	type = "directory";
+    } else if (S_ISREG(bufPtr->st_mode)) {
+	type = "file";
+#ifdef S_ISLNK
+    } else if (S_ISLNK(bufPtr->st_mode)) {
+	type = "link";
+#endif
+    }
+    if (type != NULL) {
+	VfsStatAppend("type", Tcl_NewStringObj(type, -1));
+    }
+#undef VfsStatAppend
+
+    str = Tcl_GetStringFromObj(listPtr, &len);
+    objPtr->bytes = ckalloc((unsigned) len + 1);
+    memcpy(objPtr->bytes, str, (size_t) len + 1);
+    objPtr->length = len;
+    Tcl_DecrRefCount(listPtr);
+}
+
+/* Look up a stat key; returns -1 for keys we ignore */
+static int
+VfsStatFieldIndex(Tcl_Obj *fieldPtr) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    Tcl_HashEntry *hPtr;
+
+    if (!tsdPtr->statKeysInit) {
+	int i, dummy;
+	Tcl_InitHashTable(&tsdPtr->statKeyTable, TCL_STRING_KEYS);
+	for (i = 0; i < VFS_STAT_COUNT; i++) {
+	    hPtr = Tcl_CreateHashEntry(&tsdPtr->statKeyTable, 
+				       vfsStatFieldNames[i], &dummy);
+	    Tcl_SetHashValue(hPtr, (ClientData)(size_t)i);
+	    tsdPtr->statKeyObjs[i] = Tcl_NewStringObj(vfsStatFieldNames[i], -1);
+	    Tcl_IncrRefCount(tsdPtr->statKeyObjs[i]);
+	}
+	tsdPtr->statKeysInit = 1;
+    }
+    if (fieldPtr == NULL) {
+	return -1;
+    }
+    hPtr = Tcl_FindHashEntry(&tsdPtr->statKeyTable, Tcl_GetString(fieldPtr));
+    if (hPtr == NULL) {
+	return -1;
+    }
+    return (int)(size_t)Tcl_GetHashValue(hPtr);
+}
+
+/* Store one stat field into bufPtr */
+static int
+VfsSetStatField(Tcl_Interp *interp, int field, Tcl_Obj *val, 
+		Tcl_StatBuf *bufPtr) {
+    long v;
+    
+    switch (field) {
+	case VFS_STAT_MODE: {
+	    int mode;
+	    if (Tcl_GetIntFromObj(interp, val, &mode) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    bufPtr->st_mode |= mode;
+	    return TCL_OK;
+	}
+	case VFS_STAT_SIZE: {
+	    Tcl_WideInt size;
+	    if (Tcl_GetWideIntFromObj(interp, val, &size) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    bufPtr->st_size = size;
+	    return TCL_OK;
+	}
+	case VFS_STAT_TYPE: {
+	    char *str = Tcl_GetString(val);
+	    if (!strcmp(str,"directory")) {
+		bufPtr->st_mode |= S_IFDIR;
+	    } else if (!strcmp(str,"file")) {
+		bufPtr->st_mode |= S_IFREG;
+#ifdef S_ISLNK
+	    } else if (!strcmp(str,"link")) {
+		bufPtr->st_mode |= S_IFLNK;
+#endif
+	    } else {
+		/* 
+		 * Do nothing.  This means we do not currently
+		 * support anything except files and directories
+		 */
+	    }
+	    return TCL_OK;
+	}
+    }
+    
+    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    switch (field) {
+	case VFS_STAT_DEV:   bufPtr->st_dev = v; break;
+	case VFS_STAT_INO:   bufPtr->st_ino = (unsigned short)v; break;
+	case VFS_STAT_NLINK: bufPtr->st_nlink = (short)v; break;
+	case VFS_STAT_UID:   bufPtr->st_uid = (short)v; break;
+	case VFS_STAT_GID:   bufPtr->st_gid = (short)v; break;
+	case VFS_STAT_ATIME: bufPtr->st_atime = v; break;
+	case VFS_STAT_MTIME: bufPtr->st_mtime = v; break;
+	case VFS_STAT_CTIME: bufPtr->st_ctime = v; break;
+    }
+    return TCL_OK;
+}
+
+/* Fill bufPtr from a key/value list held in objv */
+static int
+VfsStatFromList(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+		Tcl_StatBuf *bufPtr) {
+    if (objc & 1) {
+	/* It is odd! */
+	if (interp != NULL) {
+	    Tcl_SetResult(interp, "stat list must have an even number of elements",
+			  TCL_STATIC);
+	}
+	return TCL_ERROR;
+    }
+    /* 
+     * The st_mode field is set part by the 'mode'
+     * and part by the 'type' stat fields.
+     */
+    memset(bufPtr, 0, sizeof(Tcl_StatBuf));
+    while (objc > 0) {
+	int field;
+	objc -= 2;
+	field = VfsStatFieldIndex(objv[objc]);
+	if (field < 0) {
+	    /* Ignore additional stat arguments */
+	    continue;
+	}
+	if (VfsSetStatField(interp, field, objv[objc+1], bufPtr) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+    return TCL_OK;
+}
+
+/* Fill bufPtr from any of the stat result forms described above */
+static int
+VfsStatFromObj(Tcl_Interp *interp, Tcl_Obj *resPtr, Tcl_StatBuf *bufPtr) {
+    static CONST Tcl_ObjType *dictTypePtr = NULL;
+    int objc;
+    Tcl_Obj **objv;
+    
+    if (resPtr->typePtr == &vfsStatBufType) {
+	memcpy(bufPtr, resPtr->internalRep.otherValuePtr, sizeof(Tcl_StatBuf));
+	return TCL_OK;
+    }
+    if (dictTypePtr == NULL) {
+	dictTypePtr = Tcl_GetObjType("dict");
+    }
+    if (dictTypePtr != NULL && resPtr->typePtr == dictTypePtr) {
+	ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+	int field;
+	
+	VfsStatFieldIndex(NULL);
+	memset(bufPtr, 0, sizeof(Tcl_StatBuf));
+	for (field = 0; field < VFS_STAT_COUNT; field++) {
+	    Tcl_Obj *val;
+	    if (Tcl_DictObjGet(interp, resPtr, tsdPtr->statKeyObjs[field], 
+			       &val) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (val != NULL 
+		&& VfsSetStatField(interp, field, val, bufPtr) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	}
+	return TCL_OK;
+    }
+    if (Tcl_ListObjGetElements(interp, resPtr, &objc, &objv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    return VfsStatFromList(interp, objc, objv, bufPtr);
+}
+
+/* Implements 'vfs::filesystem statbuf ?key value ...?' */
+static int
+VfsStatBufCmd(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+    Tcl_StatBuf buf;
+    
+    if (VfsStatFromList(interp, objc, objv, &buf) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, VfsNewStatBufObj(&buf));
+    return TCL_OK;
+}
+
+/* A new object holding a copy of a stat buffer */
+Tcl_Obj*
+VfsNewStatBufObj(Tcl_StatBuf *bufPtr) {
+    Tcl_StatBuf *copyPtr = (Tcl_StatBuf*)ckalloc(sizeof(Tcl_StatBuf));
+    Tcl_Obj *resPtr;
+
+    memcpy(copyPtr, bufPtr, sizeof(Tcl_StatBuf));
+    resPtr = Tcl_NewObj();
+    Tcl_InvalidateStringRep(resPtr);
+    resPtr->internalRep.otherValuePtr = (VOID*)copyPtr;
+    resPtr->typePtr = &vfsStatBufType;
+    return resPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsStatManyCmd --
+ *
+ *	Implements 'vfs::filesystem statmany dir names' (and, with
+ *	'lstat' set, 'lstatmany').  Names in the same Tcl-implemented
+ *	mount as 'dir', which are single path elements whose stat is
+ *	not already cached, are given to the handler in one
+ *	'statmany' call.  Any error from it is taken to mean it has no
+ *	such subcommand (handlers commonly report ENOENT for what they
+ *	do not know), and then, as for all other names, each path is
+ *	stat'ed in the usual way.
+ *
+ * Results:
+ *	A standard Tcl result.  The interpreter's result is a dict from
+ *	each name which exists to its stat, as returned by
+ *	'vfs::filesystem statbuf', in the order given.
+ *
+ * Side effects:
+ *	The results are cached, as for single stats.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define VFS_STATMANY_BATCH	0
+#define VFS_STATMANY_OK		1
+#define VFS_STATMANY_FAIL	2
+
+static int
+VfsStatManyCmd(Tcl_Interp *interp, Tcl_Obj *dirPtr, Tcl_Obj *namesPtr, 
+	       int lstat) {
+    VfsCallback cb;
+    Tcl_SavedResult savedResult;
+    Tcl_HashTable batchTable;
+    Tcl_HashEntry *hPtr;
+    VfsNativeRep *nativeRep;
+    VfsMount *mountPtr = NULL;
+    Tcl_Obj **names, **pathPtrs, *batchPtr, *resultPtr;
+    Tcl_StatBuf *bufs;
+    char *states;
+    int numNames, numBatch = 0, i, isNew;
+
+    if (Tcl_ListObjGetElements(interp, namesPtr, &numNames, &names) 
+	    != TCL_OK) {
+	return TCL_ERROR;
+    }
+    /* Keep the names safe from anything the handler might do */
+    namesPtr = Tcl_DuplicateObj(namesPtr);
+    Tcl_IncrRefCount(namesPtr);
+    Tcl_ListObjGetElements(NULL, namesPtr, &numNames, &names);
+
+    nativeRep = VfsGetRelativePath(dirPtr);
+    if (nativeRep != NULL && nativeRep->mountPtr->driverPtr == NULL 
+	    && !nativeRep->mountPtr->isProxy) {
+	mountPtr = nativeRep->mountPtr;
+    }
+    pathPtrs = (Tcl_Obj**) ckalloc(sizeof(Tcl_Obj*) * (numNames + 1));
+    bufs = (Tcl_StatBuf*) ckalloc(sizeof(Tcl_StatBuf) * (numNames + 1));
+    states = ckalloc((unsigned) numNames + 1);
+    batchPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(batchPtr);
+    Tcl_InitHashTable(&batchTable, TCL_STRING_KEYS);
+
+    for (i = 0; i < numNames; i++) {
+	CONST char *name = Tcl_GetString(names[i]);
+	VfsCacheEntry *cachePtr;
+
+	pathPtrs[i] = Tcl_FSJoinToPath(dirPtr, 1, &names[i]);
+	Tcl_IncrRefCount(pathPtrs[i]);
+	states[i] = VFS_STATMANY_FAIL;
+	if (mountPtr != NULL && *name != '\0' && strchr(name, '/') == NULL
+		&& strcmp(name, ".") && strcmp(name, "..")
+		&& (nativeRep = VfsGetRelativePath(pathPtrs[i])) != NULL
+		&& nativeRep->mountPtr == mountPtr) {
+	    cachePtr = VfsCacheLookup(mountPtr, nativeRep->relativeObj, 0);
+	    if (cachePtr == NULL || !cachePtr->haveStat) {
+		hPtr = Tcl_CreateHashEntry(&batchTable, name, &isNew);
+		if (isNew) {
+		    Tcl_SetHashValue(hPtr, (ClientData)(size_t)i);
+		    Tcl_ListObjAppendElement(NULL, batchPtr, names[i]);
+		    states[i] = VFS_STATMANY_BATCH;
+		    numBatch++;
+		    continue;
+		}
+	    }
+	}
+	if ((lstat ? Tcl_FSLstat(pathPtrs[i], &bufs[i]) 
+		   : Tcl_FSStat(pathPtrs[i], &bufs[i])) == 0) {
+	    states[i] = VFS_STATMANY_OK;
+	}
+    }
+
+    if (numBatch > 0 && VfsCallbackInit(&cb, VFS_OP_STATMANY, dirPtr) 
+	    == TCL_OK) {
+	Tcl_Interp *cbInterp = cb.interp;
+	int returnVal, objc, fallback;
+	Tcl_Obj **objv;
+
+	VfsCallbackAppend(&cb, batchPtr);
+	Tcl_SaveResult(cbInterp, &savedResult);
+	returnVal = VfsCallbackEval(&cb);
+	fallback = (returnVal != TCL_OK);
+	if (returnVal == TCL_OK) {
+	    resultPtr = Tcl_GetObjResult(cbInterp);
+	    if (Tcl_ListObjGetElements(NULL, resultPtr, &objc, &objv) 
+		    != TCL_OK || (objc & 1)) {
+		fallback = 1;
+		objc = 0;
+	    }
+	    for (i = 0; i < objc; i += 2) {
+		int index;
+
+		hPtr = Tcl_FindHashEntry(&batchTable, Tcl_GetString(objv[i]));
+		if (hPtr == NULL) {
+		    continue;
+		}
+		index = (int)(size_t) Tcl_GetHashValue(hPtr);
+		if (states[index] == VFS_STATMANY_BATCH && VfsStatFromObj(NULL,
+			objv[i+1], &bufs[index]) == TCL_OK) {
+		    states[index] = VFS_STATMANY_OK;
+		}
+	    }
+	}
+	Tcl_RestoreResult(cbInterp, &savedResult);
+	VfsCallbackStats(&cb, returnVal);
+
+	/* What the handler did not find does not exist */
+	for (i = 0; i < numNames && !fallback; i++) {
+	    VfsCacheEntry *cachePtr;
+
+	    if (states[i] == VFS_STATMANY_FAIL) {
+		continue;
+	    }
+	    nativeRep = VfsGetRelativePath(pathPtrs[i]);
+	    if (nativeRep == NULL || nativeRep->mountPtr != cb.mountPtr) {
+		continue;
+	    }
+	    cachePtr = VfsCacheLookup(cb.mountPtr, nativeRep->relativeObj, 1);
+	    if (cachePtr == NULL) {
+		continue;
+	    }
+	    cachePtr->haveStat = 1;
+	    if (states[i] == VFS_STATMANY_BATCH) {
+		cachePtr->statErrno = ENOENT;
+	    } else {
+		cachePtr->statErrno = 0;
+		memcpy(&cachePtr->statBuf, &bufs[i], sizeof(Tcl_StatBuf));
+	    }
+	}
+	VfsCallbackFree(&cb);
+	if (!fallback) {
+	    numBatch = 0;
+	}
+    }
+    
+    resultPtr = Tcl_NewObj();
+    for (i = 0; i < numNames; i++) {
+	if (states[i] == VFS_STATMANY_BATCH) {
+	    if (numBatch > 0 && (lstat ? Tcl_FSLstat(pathPtrs[i], &bufs[i]) 
+				 : Tcl_FSStat(pathPtrs[i], &bufs[i])) == 0) {
+		states[i] = VFS_STATMANY_OK;
+	    }
+	}
+	if (states[i] == VFS_STATMANY_OK) {
+	    Tcl_ListObjAppendElement(NULL, resultPtr, names[i]);
+	    Tcl_ListObjAppendElement(NULL, resultPtr, 
+				     VfsNewStatBufObj(&bufs[i]));
+	}
+	Tcl_DecrRefCount(pathPtrs[i]);
+    }
+    Tcl_DeleteHashTable(&batchTable);
+    Tcl_DecrRefCount(batchPtr);
+    Tcl_DecrRefCount(namesPtr);
+    ckfree((char*)pathPtrs);
+    ckfree((char*)bufs);
+    ckfree(states);
+    Tcl_SetObjResult(interp, resultPtr);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsPrefetchCmd --
+ *
+ *	Implements 'vfs::filesystem prefetch ?-glob? ?-command cmd?
+ *	path ?path ...?' and 'vfs::filesystem prefetch -wait ?-timeout
+ *	ms? token'.
+ *	The paths (or, with -glob, the paths matching each pattern) in
+ *	each mount are given to its handler in one 'prefetch' call,
+ *	with a completion prefix, or to its driver's prefetchProc.  A
+ *	handler which returns true has started work in the background,
+ *	and promises to call the prefix, with an error message if it
+ *	failed, once it has finished.  Any other result, errors
+ *	included, means it has done all it is going to, so handlers
+ *	without the subcommand need nothing.  Paths outside virtual
+ *	filesystems, or in mounts of other threads, are ignored.
+ *
+ * Results:
+ *	A standard Tcl result: a token for '-wait', or for -wait the
+ *	list of error messages once every handler has finished (empty
+ *	if they were given to the -command), or an error if that has
+ *	not happened within the timeout.
+ *
+ * Side effects:
+ *	Whatever the handlers do.  The -command prefix is called, with
+ *	the list of error messages appended, from the event loop once
+ *	they have all finished.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsPrefetchCmd(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+    VfsPrefetch *prefetchPtr;
+    VfsNativeRep *nativeRep;
+    Tcl_HashTable mountTable;
+    Tcl_HashEntry *hPtr;
+    Tcl_Obj *commandPtr = NULL, *pathsPtr, **paths, *listPtr;
+    Tcl_Obj *mountsPtr;
+    int glob = 0, i, numPaths, isNew, id;
+    char buf[16 + TCL_INTEGER_SPACE];
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!tsdPtr->prefetchInit) {
+	Tcl_InitHashTable(&tsdPtr->prefetchTable, TCL_ONE_WORD_KEYS);
+	Tcl_InitHashTable(&tsdPtr->prefetchCalls, TCL_ONE_WORD_KEYS);
+	tsdPtr->prefetchInit = 1;
+    }
+
+    if ((objc == 2 || (objc == 4 && !strcmp(Tcl_GetString(objv[1]), 
+	    "-timeout"))) && !strcmp(Tcl_GetString(objv[0]), "-wait")) {
+	CONST char *token = Tcl_GetString(objv[objc-1]);
+	Tcl_Obj *resultPtr;
+	Tcl_TimerToken timer = NULL;
+	int timeout, timedOut = 0;
+
+	if (objc == 4 && (Tcl_GetIntFromObj(interp, objv[2], &timeout) 
+		!= TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	if (strncmp(token, "prefetch", 8) || Tcl_GetInt(NULL, token + 8, &id)
+		!= TCL_OK || id <= 0 || id > tsdPtr->prefetchIds) {
+	    Tcl_AppendResult(interp, "bad prefetch token \"", token, "\"",
+			     (char *) NULL);
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tsdPtr->prefetchTable, (char*)(size_t)id);
+	if (hPtr == NULL) {
+	    /* Finished, and any messages reported already */
+	    return TCL_OK;
+	}
+	prefetchPtr = (VfsPrefetch*) Tcl_GetHashValue(hPtr);
+	prefetchPtr->waiters++;
+	if (objc == 4 && !prefetchPtr->finished) {
+	    timer = Tcl_CreateTimerHandler(timeout, VfsPrefetchTimeout, 
+					   (ClientData) &timedOut);
+	}
+	while (!prefetchPtr->finished && !timedOut) {
+	    Tcl_DoOneEvent(TCL_ALL_EVENTS);
+	}
+	if (timer != NULL && !timedOut) {
+	    Tcl_DeleteTimerHandler(timer);
+	}
+	if (!prefetchPtr->finished) {
+	    /* VfsPrefetchIdleProc frees it once the handlers are done */
+	    prefetchPtr->waiters--;
+	    Tcl_AppendResult(interp, "timed out waiting for prefetch \"", 
+			     token, "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	resultPtr = prefetchPtr->errors;
+	Tcl_IncrRefCount(resultPtr);
+	if (--prefetchPtr->waiters == 0) {
+	    VfsPrefetchFree(tsdPtr, prefetchPtr);
+	}
+	Tcl_SetObjResult(interp, resultPtr);
+	Tcl_DecrRefCount(resultPtr);
+	return TCL_OK;
+    }
+
+    for (i = 0; i < objc; i++) {
+	CONST char *opt = Tcl_GetString(objv[i]);
+	if (!strcmp(opt, "-glob")) {
+	    glob = 1;
+	} else if (!strcmp(opt, "-command") && i + 1 < objc) {
+	    commandPtr = objv[++i];
+	} else if (!strcmp(opt, "--")) {
+	    i++;
+	    break;
+	} else {
+	    break;
+	}
+    }
+    if (i == objc) {
+	Tcl_WrongNumArgs(interp, 2, objv - 2, 
+		"?-glob? ?-command cmd? path ?path ...? | -wait token");
+	return TCL_ERROR;
+    }
+
+    pathsPtr = Tcl_NewListObj(objc - i, objv + i);
+    Tcl_IncrRefCount(pathsPtr);
+    if (glob) {
+	Tcl_Obj *patternsPtr = pathsPtr, **patterns, *globv[4];
+	int numPatterns, j;
+
+	pathsPtr = Tcl_NewObj();
+	Tcl_IncrRefCount(pathsPtr);
+	Tcl_ListObjGetElements(NULL, patternsPtr, &numPatterns, &patterns);
+	globv[0] = Tcl_NewStringObj("::glob", -1);
+	globv[1] = Tcl_NewStringObj("-nocomplain", -1);
+	globv[2] = Tcl_NewStringObj("--", -1);
+	for (j = 0; j < 3; j++) {
+	    Tcl_IncrRefCount(globv[j]);
+	}
+	for (j = 0; j < numPatterns; j++) {
+	    globv[3] = patterns[j];
+	    if (Tcl_EvalObjv(interp, 4, globv, 0) != TCL_OK) {
+		break;
+	    }
+	    Tcl_ListObjAppendList(NULL, pathsPtr, Tcl_GetObjResult(interp));
+	}
+	for (i = 0; i < 3; i++) {
+	    Tcl_DecrRefCount(globv[i]);
+	}
+	Tcl_DecrRefCount(patternsPtr);
+	if (j < numPatterns) {
+	    Tcl_DecrRefCount(pathsPtr);
+	    return TCL_ERROR;
+	}
+	Tcl_ResetResult(interp);
+    }
+
+    /* Gather the relative paths of each mount, in order */
+    Tcl_InitHashTable(&mountTable, TCL_ONE_WORD_KEYS);
+    mountsPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(mountsPtr);
+    Tcl_ListObjGetElements(NULL, pathsPtr, &numPaths, &paths);
+    for (i = 0; i < numPaths; i++) {
+	nativeRep = VfsGetRelativePath(paths[i]);
+	if (nativeRep == NULL || nativeRep->mountPtr->isProxy) {
+	    continue;
+	}
+	hPtr = Tcl_CreateHashEntry(&mountTable, 
+				   (char*) nativeRep->mountPtr, &isNew);
+	if (isNew) {
+	    listPtr = Tcl_NewObj();
+	    Tcl_SetHashValue(hPtr, (ClientData) listPtr);
+	    Tcl_ListObjAppendElement(NULL, mountsPtr, 
+		    Tcl_DuplicateObj(nativeRep->rootObj));
+	    Tcl_ListObjAppendElement(NULL, mountsPtr, listPtr);
+	} else {
+	    listPtr = (Tcl_Obj*) Tcl_GetHashValue(hPtr);
+	}
+	Tcl_ListObjAppendElement(NULL, listPtr, nativeRep->relativeObj);
+    }
+    Tcl_DeleteHashTable(&mountTable);
+    Tcl_DecrRefCount(pathsPtr);
+
+    id = ++tsdPtr->prefetchIds;
+    prefetchPtr = (VfsPrefetch*) ckalloc(sizeof(VfsPrefetch));
+    prefetchPtr->id = id;
+    /* Held, and kept, until every handler has been called */
+    prefetchPtr->pending = 1;
+    prefetchPtr->waiters = 1;
+    prefetchPtr->finished = 0;
+    prefetchPtr->interp = interp;
+    prefetchPtr->command = commandPtr;
+    if (commandPtr != NULL) {
+	Tcl_IncrRefCount(commandPtr);
+    }
+    prefetchPtr->errors = Tcl_NewObj();
+    Tcl_IncrRefCount(prefetchPtr->errors);
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->prefetchTable, (char*)(size_t)id,
+			       &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData) prefetchPtr);
+
+    Tcl_ListObjGetElements(NULL, mountsPtr, &numPaths, &paths);
+    for (i = 0; i + 1 < numPaths; i += 2) {
+	VfsCallback cb;
+	Tcl_SavedResult savedResult;
+	Tcl_Interp *cbInterp;
+	VfsPrefetchCall *callPtr;
+	Tcl_Obj *donePtr;
+	int returnVal, serial, started = 0;
+
+	if (VfsCallbackInit(&cb, VFS_OP_PREFETCH, paths[i]) != TCL_OK) {
+	    continue;
+	}
+	cbInterp = cb.interp;
+	VfsCallbackAppend(&cb, paths[i+1]);
+	Tcl_SaveResult(cbInterp, &savedResult);
+	if (cb.mountPtr->driverPtr != NULL) {
+	    Vfs_PrefetchProc *prefetchProc = 
+		    VfsDriverProc(cb.mountPtr, prefetchProc);
+	    returnVal = (prefetchProc == NULL) ? TCL_OK 
+		    : prefetchProc(VfsDriverArgs(&cb), paths[i+1]);
+	    Tcl_RestoreResult(cbInterp, &savedResult);
+	    VfsCallbackStats(&cb, returnVal);
+	    VfsCallbackFree(&cb);
+	    continue;
+	}
+
+	serial = ++tsdPtr->prefetchCount;
+	callPtr = (VfsPrefetchCall*) ckalloc(sizeof(VfsPrefetchCall));
+	callPtr->prefetchPtr = prefetchPtr;
+	callPtr->interp = cbInterp;
+	callPtr->running = 1;
+	callPtr->done = 0;
+	hPtr = Tcl_CreateHashEntry(&tsdPtr->prefetchCalls, 
+				   (char*)(size_t)serial, &isNew);
+	Tcl_SetHashValue(hPtr, (ClientData) callPtr);
+	prefetchPtr->pending++;
+
+	donePtr = Tcl_NewStringObj("::vfs::PrefetchDone", -1);
+	donePtr = Tcl_NewListObj(1, &donePtr);
+	Tcl_ListObjAppendElement(NULL, donePtr, Tcl_NewIntObj(serial));
+	VfsCallbackAppend(&cb, donePtr);
+	returnVal = VfsCallbackEval(&cb);
+	if (returnVal == TCL_OK && Tcl_GetBooleanFromObj(NULL, 
+		Tcl_GetObjResult(cbInterp), &started) != TCL_OK) {
+	    started = 0;
+	}
+	Tcl_RestoreResult(cbInterp, &savedResult);
+	VfsCallbackStats(&cb, returnVal);
+	VfsCallbackFree(&cb);
+
+	/* The call may have been discarded along with its interpreter */
+	hPtr = Tcl_FindHashEntry(&tsdPtr->prefetchCalls, 
+				 (char*)(size_t)serial);
+	if (hPtr == NULL) {
+	    continue;
+	}
+	callPtr->running = 0;
+	if (started && !callPtr->done) {
+	    continue;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	ckfree((char*)callPtr);
+	if (--prefetchPtr->pending == 0) {
+	    Tcl_DoWhenIdle(VfsPrefetchIdleProc, (ClientData) prefetchPtr);
+	}
+    }
+    Tcl_DecrRefCount(mountsPtr);
+
+    if (--prefetchPtr->waiters == 0 && prefetchPtr->finished) {
+	/* Discarded by a handler deleting this interpreter */
+	VfsPrefetchFree(tsdPtr, prefetchPtr);
+    } else if (--prefetchPtr->pending == 0) {
+	Tcl_DoWhenIdle(VfsPrefetchIdleProc, (ClientData) prefetchPtr);
+    }
+    sprintf(buf, "prefetch%d", id);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(buf, -1));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemoryCmd --
+ *
+ *	This procedure implements 'vfs::filesystem memory ?path?',
+ *	whose arguments are given.  It reports, for the mount at
+ *	'path', or for each mount of this thread, how much memory it
+ *	holds: 'cache' for the results the package has cached,
+ *	'memchan' for the memory channels opened through it which are
+ *	still open, and 'pending' for the contents kept for deferred
+ *	close callbacks, followed by whatever the mount's handler adds.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Calls the 'memory' handler of each mount.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMemoryCmd(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]) {
+    VfsMount *mountPtr;
+    Tcl_Obj *resultPtr, *mountsPtr, **mounts;
+    CONST char *str;
+    int len, i;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (objc > 1) {
+	Tcl_WrongNumArgs(interp, 2, objv - 2, "?path?");
+	return TCL_ERROR;
+    }
+    if (objc == 1) {
+	str = Tcl_GetStringFromObj(objv[0], &len);
+	mountPtr = VfsLookupMount(tsdPtr, str, len);
+	if (mountPtr == NULL) {
+	    Tcl_Obj *path = VfsFullyNormalizePath(interp, objv[0]);
+	    if (path != NULL) {
+		str = Tcl_GetStringFromObj(path, &len);
+		mountPtr = VfsLookupMount(tsdPtr, str, len);
+		Tcl_DecrRefCount(path);
+	    }
+	}
+	if (mountPtr == NULL || mountPtr->isProxy) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "no such mount \"", 
+			     Tcl_GetString(objv[0]), "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	resultPtr = VfsMemoryReport(Tcl_NewStringObj(mountPtr->mountPoint, 
+						     mountPtr->mountLen));
+	Tcl_SetObjResult(interp, resultPtr != NULL ? resultPtr : Tcl_NewObj());
+	return TCL_OK;
+    }
+
+    /* Handlers may unmount, so take the list of mounts first */
+    mountsPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(mountsPtr);
+    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+	 mountPtr = mountPtr->nextMount) {
+	if (!mountPtr->isProxy) {
+	    Tcl_ListObjAppendElement(NULL, mountsPtr, 
+		    Tcl_NewStringObj(mountPtr->mountPoint, mountPtr->mountLen));
+	}
+    }
+    resultPtr = Tcl_NewObj();
+    Tcl_ListObjGetElements(NULL, mountsPtr, &len, &mounts);
+    for (i = 0; i < len; i++) {
+	Tcl_Obj *reportPtr = VfsMemoryReport(mounts[i]);
+	if (reportPtr != NULL) {
+	    Tcl_ListObjAppendElement(NULL, resultPtr, mounts[i]);
+	    Tcl_ListObjAppendElement(NULL, resultPtr, reportPtr);
+	}
+    }
+    Tcl_DecrRefCount(mountsPtr);
+    Tcl_SetObjResult(interp, resultPtr);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemoryReport --
+ *
+ *	Work out what 'vfs::filesystem memory' reports for the mount
+ *	whose root is 'pathPtr'.  A handler which fails, or returns
+ *	something other than a list of names and sizes, adds nothing.
+ *
+ * Results:
+ *	A new list, or NULL if there is no longer such a mount.
+ *
+ * Side effects:
+ *	Calls the mount's 'memory' handler.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+VfsMemoryReport(Tcl_Obj *pathPtr) {
+    VfsCallback cb;
+    VfsMount *mountPtr;
+    VfsMemChannel *memPtr;
+    VfsPendingClose *pendPtr;
+    Tcl_SavedResult savedResult;
+    Tcl_Obj *resultPtr;
+    Tcl_WideInt bytes;
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+    int returnVal, length;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    Tcl_IncrRefCount(pathPtr);
+    returnVal = VfsCallbackInit(&cb, VFS_OP_MEMORY, pathPtr);
+    Tcl_DecrRefCount(pathPtr);
+    if (returnVal != TCL_OK) {
+	return NULL;
+    }
+    mountPtr = cb.mountPtr;
+    resultPtr = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("cache", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, 
+			     Tcl_NewWideIntObj(mountPtr->cacheBytes));
+
+    bytes = 0;
+    Tcl_MutexLock(&vfsSharedMutex);
+    for (memPtr = vfsMemChannels; memPtr != NULL; memPtr = memPtr->nextPtr) {
+	if (memPtr->mountPtr == mountPtr && memPtr->owner == self) {
+	    bytes += memPtr->capacity;
+	}
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    Tcl_ListObjAppendElement(NULL, resultPtr, 
+			     Tcl_NewStringObj("memchan", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewWideIntObj(bytes));
+
+    bytes = 0;
+    for (pendPtr = tsdPtr->pendingCloses; pendPtr != NULL; 
+	 pendPtr = pendPtr->nextPtr) {
+	if (pendPtr->mountPtr == mountPtr && pendPtr->dataObj != NULL) {
+	    Tcl_GetByteArrayFromObj(pendPtr->dataObj, &length);
+	    bytes += length;
+	}
+    }
+    Tcl_ListObjAppendElement(NULL, resultPtr, 
+			     Tcl_NewStringObj("pending", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewWideIntObj(bytes));
+
+    Tcl_SaveResult(cb.interp, &savedResult);
+    if (mountPtr->driverPtr != NULL) {
+	Vfs_MemoryProc *memoryProc = VfsDriverProc(mountPtr, memoryProc);
+	returnVal = TCL_OK;
+	if (memoryProc != NULL) {
+	    Tcl_Obj *listPtr = Tcl_NewObj();
+
+	    Tcl_IncrRefCount(listPtr);
+	    returnVal = memoryProc(VfsDriverArgs(&cb), listPtr);
+	    if (returnVal == TCL_OK) {
+		Tcl_SetObjResult(cb.interp, listPtr);
+	    }
+	    Tcl_DecrRefCount(listPtr);
+	}
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
+    if (returnVal == TCL_OK) {
+	Tcl_Obj **elements;
+	int numElements, i;
+	Tcl_WideInt size;
+
+	if (Tcl_ListObjGetElements(NULL, Tcl_GetObjResult(cb.interp), 
+		&numElements, &elements) == TCL_OK && numElements % 2 == 0) {
+	    for (i = 0; i < numElements; i += 2) {
+		if (Tcl_GetWideIntFromObj(NULL, elements[i+1], &size) 
+			!= TCL_OK) {
+		    break;
+		}
+	    }
+	    if (i == numElements) {
+		/* Copied, since the handler's objects may be its own */
+		for (i = 0; i < numElements; i++) {
+		    Tcl_ListObjAppendElement(NULL, resultPtr, 
+			    Tcl_DuplicateObj(elements[i]));
+		}
+	    }
+	}
+    }
+    Tcl_RestoreResult(cb.interp, &savedResult);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+    return resultPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsPrefetchDoneObjCmd --
+ *
+ *	This procedure implements the internal "vfs::PrefetchDone"
+ *	command, the completion prefix given to a handler's 'prefetch'
+ *	subcommand: 'serial ?message?'.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Once no handler of the prefetch is still at work, its -command
+ *	is scheduled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsPrefetchDoneObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    int serial;
+    Tcl_HashEntry *hPtr = NULL;
+    VfsPrefetchCall *callPtr;
+    VfsPrefetch *prefetchPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (objc != 2 && objc != 3) {
+	Tcl_WrongNumArgs(interp, 1, objv, "serial ?message?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[1], &serial) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (tsdPtr->prefetchInit) {
+	hPtr = Tcl_FindHashEntry(&tsdPtr->prefetchCalls, 
+				 (char*)(size_t)serial);
+    }
+    if (hPtr == NULL) {
+	/* Already done, or given up */
+	return TCL_OK;
+    }
+    callPtr = (VfsPrefetchCall*) Tcl_GetHashValue(hPtr);
+    prefetchPtr = callPtr->prefetchPtr;
+    if (objc == 3) {
+	Tcl_ListObjAppendElement(NULL, prefetchPtr->errors, objv[2]);
+    }
+    if (callPtr->running) {
+	/* VfsPrefetchCmd finishes it when the handler returns */
+	callPtr->done = 1;
+	return TCL_OK;
+    }
+    Tcl_DeleteHashEntry(hPtr);
+    ckfree((char*)callPtr);
+    if (--prefetchPtr->pending == 0) {
+	Tcl_DoWhenIdle(VfsPrefetchIdleProc, (ClientData) prefetchPtr);
+    }
+    return TCL_OK;
+}
+
+/* Run the -command of a prefetch whose handlers have all finished */
+static void
+VfsPrefetchIdleProc(ClientData clientData) {
+    VfsPrefetch *prefetchPtr = (VfsPrefetch*) clientData;
+    Tcl_Interp *interp = prefetchPtr->interp;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    prefetchPtr->finished = 1;
+    if (prefetchPtr->command != NULL && !Tcl_InterpDeleted(interp)) {
+	Tcl_Obj *cmdPtr = Tcl_DuplicateObj(prefetchPtr->command);
+
+	/* Kept while the command runs, as it may delete the interp */
+	prefetchPtr->waiters++;
+	Tcl_IncrRefCount(cmdPtr);
+	Tcl_Preserve((ClientData) interp);
+	if (Tcl_ListObjAppendElement(interp, cmdPtr, prefetchPtr->errors)
+		!= TCL_OK || Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) 
+		!= TCL_OK) {
+	    Tcl_BackgroundError(interp);
+	}
+	Tcl_Release((ClientData) interp);
+	Tcl_DecrRefCount(cmdPtr);
+	prefetchPtr->waiters--;
+    }
+    if (prefetchPtr->waiters > 0) {
+	/* The last of them frees it */
+	return;
+    }
+    if (prefetchPtr->command == NULL) {
+	int numErrors;
+
+	Tcl_ListObjLength(NULL, prefetchPtr->errors, &numErrors);
+	if (numErrors > 0) {
+	    /* Kept for 'prefetch -wait', as nothing else has seen them */
+	    return;
+	}
+    }
+    VfsPrefetchFree(tsdPtr, prefetchPtr);
+}
+
+/* End a 'prefetch -wait -timeout' */
+static void
+VfsPrefetchTimeout(ClientData clientData) {
+    *((int *) clientData) = 1;
+}
+
+static void
+VfsPrefetchFree(ThreadSpecificData *tsdPtr, VfsPrefetch *prefetchPtr) {
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_FindHashEntry(&tsdPtr->prefetchTable, 
+			     (char*)(size_t)prefetchPtr->id);
+    if (hPtr != NULL) {
+	Tcl_DeleteHashEntry(hPtr);
+    }
+    if (prefetchPtr->command != NULL) {
+	Tcl_DecrRefCount(prefetchPtr->command);
+    }
+    Tcl_DecrRefCount(prefetchPtr->errors);
+    ckfree((char*)prefetchPtr);
+}
+
+/* 
+ * Give up on the handlers running in an interpreter which is being
+ * deleted (or, if NULL, in any, as the thread exits), and forget the
+ * prefetches asked for there.
+ */
+static void
+VfsPrefetchDiscard(ThreadSpecificData *tsdPtr, Tcl_Interp *interp) {
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    VfsPrefetchCall *callPtr;
+    VfsPrefetch *prefetchPtr;
+
+    if (!tsdPtr->prefetchInit) {
+	return;
+    }
+    for (hPtr = Tcl_FirstHashEntry(&tsdPtr->prefetchCalls, &search);
+	 hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	callPtr = (VfsPrefetchCall*) Tcl_GetHashValue(hPtr);
+	prefetchPtr = callPtr->prefetchPtr;
+	if (interp != NULL && callPtr->interp != interp 
+		&& prefetchPtr->interp != interp) {
+	    continue;
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	ckfree((char*)callPtr);
+	Tcl_ListObjAppendElement(NULL, prefetchPtr->errors,
+		Tcl_NewStringObj("interpreter deleted", -1));
+	if (--prefetchPtr->pending == 0) {
+	    Tcl_DoWhenIdle(VfsPrefetchIdleProc, (ClientData) prefetchPtr);
+	}
+    }
+    for (hPtr = Tcl_FirstHashEntry(&tsdPtr->prefetchTable, &search);
+	 hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	prefetchPtr = (VfsPrefetch*) Tcl_GetHashValue(hPtr);
+	if (interp != NULL && prefetchPtr->interp != interp) {
+	    continue;
+	}
+	/* Nothing is left to wait for, and nowhere to report it */
+	if (prefetchPtr->command != NULL) {
+	    Tcl_DecrRefCount(prefetchPtr->command);
+	    prefetchPtr->command = NULL;
+	}
+	if (prefetchPtr->pending == 0 && !prefetchPtr->finished) {
+	    Tcl_CancelIdleCall(VfsPrefetchIdleProc, (ClientData) prefetchPtr);
+	}
+	prefetchPtr->finished = 1;
+	if (prefetchPtr->waiters == 0) {
+	    VfsPrefetchFree(tsdPtr, prefetchPtr);
+	}
+    }
+}
+
+static int
+VfsStat(pathPtr, bufPtr)
+    Tcl_Obj *pathPtr;		/* Path of file to stat (in current CP). */
+    Tcl_StatBuf *bufPtr;	/* Filled with results of stat call. */
+{
+    VfsCallback cb;
+    Tcl_SavedResult savedResult;
+    int returnVal;
+    Tcl_Interp* interp;
+    VfsCacheEntry *cachePtr;
+    VfsSharedMount *sharedPtr;
+    
+    sharedPtr = VfsGetRemote(pathPtr, 1);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_STAT, sharedPtr, pathPtr);
+	call.statBufPtr = bufPtr;
+	return VfsRemoteDispatch(&call);
+    }
+
+    cachePtr = VfsCacheFind(pathPtr);
+    if (cachePtr != NULL && cachePtr->haveStat) {
+	if (cachePtr->statErrno == 0) {
+	    memcpy(bufPtr, &cachePtr->statBuf, sizeof(Tcl_StatBuf));
+	    return TCL_OK;
+	}
+	Tcl_SetErrno(cachePtr->statErrno);
+	return TCLVFS_POSIXERROR;
+    }
+    
+    if (VfsCallbackInit(&cb, VFS_OP_STAT, pathPtr) != TCL_OK) {
+	return TCLVFS_POSIXERROR;
+    }
+    interp = cb.interp;
+
+    Tcl_SaveResult(interp, &savedResult);
+    /* Now we execute this mount point's callback. */
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_StatProc *statProc = VfsDriverProc(cb.mountPtr, statProc);
+	memset(bufPtr, 0, sizeof(Tcl_StatBuf));
+	returnVal = (statProc == NULL) ? VfsNoDriverProc() 
+		: statProc(VfsDriverArgs(&cb), bufPtr);
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+	if (returnVal == TCL_OK) {
+	    returnVal = VfsStatFromObj(interp, Tcl_GetObjResult(interp), 
+				       bufPtr);
+	}
+    }
+    if (returnVal == TCL_OK || returnVal == TCLVFS_POSIXERROR) {
+	int posixError = (returnVal == TCL_OK ? 0 : Tcl_GetErrno());
+	cachePtr = VfsCacheLookup(cb.mountPtr, VfsCallbackRelative(&cb), 1);
+	if (cachePtr != NULL) {
+	    cachePtr->haveStat = 1;
+	    if (returnVal == TCL_OK) {
+		cachePtr->statErrno = 0;
+		memcpy(&cachePtr->statBuf, bufPtr, sizeof(Tcl_StatBuf));
+	    } else {
+		cachePtr->statErrno = (posixError != 0 ? posixError : ENOENT);
+	    }
+	}
+    }
+    
+    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
+	VfsInternalError(interp);
+    }
+
+    Tcl_RestoreResult(interp, &savedResult);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+    
+    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
+	Tcl_SetErrno(ENOENT);
+        return TCLVFS_POSIXERROR;
+    } else {
+	return returnVal;
+    }
+}
+
+static int
+VfsAccess(pathPtr, mode)
+    Tcl_Obj *pathPtr;		/* Path of file to access (in current CP). */
+    int mode;                   /* Permission setting. */
+{
+    VfsCallback cb;
+    Tcl_SavedResult savedResult;
+    int returnVal;
+    Tcl_Interp* interp;
+    VfsCacheEntry *cachePtr = NULL;
+    int modeBit = ((mode & ~7) ? 0 : (1 << mode));
+    VfsSharedMount *sharedPtr;
+    
+    sharedPtr = VfsGetRemote(pathPtr, 1);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_ACCESS, sharedPtr, pathPtr);
+	call.intArg = mode;
+	return VfsRemoteDispatch(&call);
+    }
+
+    if (modeBit) {
+	cachePtr = VfsCacheFind(pathPtr);
+    }
+    if (cachePtr != NULL) {
+	if (cachePtr->accessKnown & modeBit) {
+	    returnVal = (cachePtr->accessDenied & modeBit) ? -1 : TCL_OK;
+	    goto done;
+	}
+	/* A path known not to exist cannot be accessed either */
+	if (cachePtr->haveStat && cachePtr->statErrno == ENOENT) {
+	    returnVal = -1;
+	    goto done;
+	}
+    }
+    
+    if (VfsCallbackInit(&cb, VFS_OP_ACCESS, pathPtr) != TCL_OK) {
+	return TCLVFS_POSIXERROR;
+    }
+    interp = cb.interp;
+
+    VfsCallbackAppend(&cb, VfsIntObj(mode));
+    /* Now we execute this mount point's callback. */
+    Tcl_SaveResult(interp, &savedResult);
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_AccessProc *accessProc = VfsDriverProc(cb.mountPtr, accessProc);
+	returnVal = (accessProc == NULL) ? VfsNoDriverProc() 
+		: accessProc(VfsDriverArgs(&cb), mode);
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
+    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
+	VfsInternalError(interp);
+    } else if (modeBit) {
+	cachePtr = VfsCacheLookup(cb.mountPtr, VfsCallbackRelative(&cb), 1);
+	if (cachePtr != NULL) {
+	    cachePtr->accessKnown |= modeBit;
+	    if (returnVal != TCL_OK) {
+		cachePtr->accessDenied |= modeBit;
+	    }
+	}
+    }
+    Tcl_RestoreResult(interp, &savedResult);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+
+  done:
+    if (returnVal != 0) {
+	Tcl_SetErrno(ENOENT);
+	return TCLVFS_POSIXERROR;
+    } else {
+	return returnVal;
+    }
+}
+
+/* 
+ * Return the (per-thread shared) mode string for an 'open' callback.
+ */
+static Tcl_Obj*
+VfsGetMode(int mode) {
+    static CONST char *modeStrings[] = {"", "r", "w", "a", "w+", "a+"};
+    int index = 0;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (mode & O_RDONLY) {
+        index = 1;
+    } else if (mode & O_WRONLY || mode & O_RDWR) {
+	if (mode & O_TRUNC) {
+	    index = 2;
+	} else {
+	    index = 3;
+	}
+	if (mode & O_RDWR) {
+	    index += 2;
+	}
+    }
+    if (tsdPtr->modeObjs[index] == NULL) {
+	tsdPtr->modeObjs[index] = Tcl_NewStringObj(modeStrings[index], -1);
+	Tcl_IncrRefCount(tsdPtr->modeObjs[index]);
+    }
+    return tsdPtr->modeObjs[index];
+}
+
+/* 
+ * Return an object for a 'matchindirectory' pattern.  Globs tend to
+ * use the same pattern over and over, so we keep the last one.
+ */
+static Tcl_Obj*
+VfsPatternObj(CONST char *pattern) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (pattern == NULL) {
+	if (tsdPtr->emptyObj == NULL) {
+	    tsdPtr->emptyObj = Tcl_NewObj();
+	    Tcl_IncrRefCount(tsdPtr->emptyObj);
+	}
+	return tsdPtr->emptyObj;
+    }
+    if (tsdPtr->patternObj == NULL 
+	    || strcmp(Tcl_GetString(tsdPtr->patternObj), pattern)) {
+	if (tsdPtr->patternObj != NULL) {
+	    Tcl_DecrRefCount(tsdPtr->patternObj);
+	}
+	tsdPtr->patternObj = Tcl_NewStringObj(pattern, -1);
+	Tcl_IncrRefCount(tsdPtr->patternObj);
+    }
+    return tsdPtr->patternObj;
+}
+
+static Tcl_Channel
+VfsOpenFileChannel(cmdInterp, pathPtr, mode, permissions)
+    Tcl_Interp *cmdInterp;              /* Interpreter for error reporting;
+					 * can be NULL. */
+    Tcl_Obj *pathPtr;                   /* Name of file to open. */
+    int mode;             		/* POSIX open mode. */
+    int permissions;                    /* If the open involves creating a
+					 * file, with what modes to create
+					 * it? */
+{
+    Tcl_Channel chan = NULL;
+    VfsCallback cb;
+    VfsMount *mountPtr = NULL;
+    Tcl_Obj *closeCallback = NULL;
+    Tcl_Obj *rootObj = NULL, *relativeObj = NULL;
+    VfsCacheCloseInfo *cacheClosePtr = NULL;
+    int isDriver, isData = 0;
+    Tcl_SavedResult savedResult;
+    int returnVal;
+    Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
+    
+    sharedPtr = VfsGetRemote(pathPtr, (mode & (O_WRONLY|O_RDWR)) == 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_OPEN, sharedPtr, pathPtr);
+	call.intArg = mode;
+	call.permissions = permissions;
+	if (VfsRemoteDispatch(&call) == TCL_OK) {
+	    /* The owner has cut it out of its thread for us */
+	    Tcl_SpliceChannel(call.chan);
+	    chan = call.chan;
+	} else if (cmdInterp != NULL) {
+	    Tcl_ResetResult(cmdInterp);
+	    if (call.resultStr != NULL) {
+		Tcl_AppendResult(cmdInterp, call.resultStr, (char *) NULL);
+	    } else {
+		Tcl_AppendResult(cmdInterp, "couldn't open \"", 
+				 Tcl_GetString(pathPtr), "\": ",
+				 Tcl_PosixError(cmdInterp), (char *) NULL);
+	    }
+	}
+	if (call.resultStr != NULL) {
+	    ckfree(call.resultStr);
+	}
+	return chan;
+    }
+
+    if ((mode & (O_WRONLY|O_RDWR|O_TRUNC|O_CREAT)) == 0) {
+	/* Read what was written before its close callback has run */
+	VfsPendingClose *pendPtr = VfsCloseFind(pathPtr);
+	if (pendPtr != NULL) {
+	    return VfsNewMemChannel(pendPtr->dataObj, pendPtr->spillPtr, 
+				    TCL_READABLE, NULL);
+	}
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_OPEN, pathPtr) != TCL_OK) {
+	return NULL;
+    }
+    interp = cb.interp;
+
+    VfsCallbackAppend(&cb, VfsGetMode(mode));
+    VfsCallbackAppend(&cb, VfsIntObj(permissions));
+    Tcl_SaveResult(interp, &savedResult);
+    /* Now we execute this mount point's callback. */
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_OpenProc *openProc = VfsDriverProc(cb.mountPtr, openProc);
+	returnVal = (openProc == NULL) ? VfsNoDriverProc() 
+		: openProc(VfsDriverArgs(&cb), mode, permissions, &chan);
+	if (returnVal == TCL_OK && chan == NULL) {
+	    returnVal = TCL_ERROR;
+	}
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
+    if (returnVal == TCL_OK && cb.mountPtr->driverPtr != NULL) {
+	/* The driver's channel is ready for use as it is */
+	Tcl_RestoreResult(interp, &savedResult);
+    } else if (returnVal == TCL_OK) {
+	int reslen, first = 1;
+	Tcl_Obj *resultObj, **elements;
+	/* 
+	 * There may be file channel leaks on these two 
+	 * error conditions, if the open command actually
+	 * created a channel, but then passed us a bogus list.
+	 */
+	resultObj =  Tcl_GetObjResult(interp);
+	if ((Tcl_ListObjGetElements(interp, resultObj, &reslen, &elements) 
+		== TCL_ERROR) || (reslen == 0)) {
+	    returnVal = TCL_ERROR;
+	} else if (!strcmp(Tcl_GetString(elements[0]), "-data")) {
+	    /* The contents of a read-only file, for us to make a channel */
+	    if (reslen < 2 || reslen > 3 || (mode & (O_WRONLY|O_RDWR))) {
+		returnVal = TCL_ERROR;
+	    } else {
+		chan = VfsNewMemChannel(elements[1], NULL, TCL_READABLE, 
+					NULL);
+		isData = 1;
+		first = 2;
+	    }
+	} else if (reslen > 2) {
+	    returnVal = TCL_ERROR;
+	} else {
+	    chan = Tcl_GetChannel(interp, Tcl_GetString(elements[0]), 0);
+	    if (chan == NULL) {
+	        returnVal = TCL_ERROR;
+	    }
+	}
+	if (chan != NULL && reslen > first) {
+	    closeCallback = elements[first];
+	    Tcl_IncrRefCount(closeCallback);
+	}
+	Tcl_RestoreResult(interp, &savedResult);
+    } else {
+	/* Leave an error message if the cmdInterp is non NULL */
+	if (cmdInterp != NULL) {
+	    if (returnVal == TCLVFS_POSIXERROR) {
+		Tcl_ResetResult(cmdInterp);
+		Tcl_AppendResult(cmdInterp, "couldn't open \"", 
+				 Tcl_GetString(pathPtr), "\": ",
+				 Tcl_PosixError(cmdInterp), (char *) NULL);
+	    } else {
+		Tcl_Obj* error = Tcl_GetObjResult(interp);
+		/* 
+		 * Copy over the error message to cmdInterp,
+		 * duplicating it in case of threading issues.
+		 */
+		Tcl_SetObjResult(cmdInterp, Tcl_DuplicateObj(error));
+	    }
+	} else {
+	    /* Report any error, since otherwise it is lost */
+	    if (returnVal != TCLVFS_POSIXERROR) {
+		VfsInternalError(interp);
+	    }
+	}
+	if (interp == cmdInterp) {
+	    /* 
+	     * We want our error message to propagate up,
+	     * so we want to forget this result
+	     */
+	    Tcl_DiscardResult(&savedResult);
+	} else {
+	    Tcl_RestoreResult(interp, &savedResult);
+	}
+    }
+
+    if (mode & (O_WRONLY|O_RDWR)) {
+	/* Cached results for this file are stale now, and again on close */
+	VfsCallbackInvalidate(&cb, 0);
+	if (chan != NULL && cb.mountPtr->cacheTtl != 0) {
+	    cacheClosePtr = (VfsCacheCloseInfo*) 
+		    ckalloc(sizeof(VfsCacheCloseInfo));
+	    cacheClosePtr->mountPtr = cb.mountPtr;
+	    cacheClosePtr->mountPtr->refCount++;
+	    cacheClosePtr->relativeObj = VfsCallbackRelative(&cb);
+	    Tcl_IncrRefCount(cacheClosePtr->relativeObj);
+	    cacheClosePtr->sharedPtr = VfsServingShared();
+	}
+    }
+    if (chan != NULL && Tcl_GetChannelType(chan) == &vfsMemChannelType) {
+	VfsMemTrack(chan, cb.mountPtr);
+    }
+    isDriver = (cb.mountPtr->driverPtr != NULL);
+    if (closeCallback != NULL && chan != NULL) {
+	/* Kept for the statistics and trace of the close callback */
+	mountPtr = cb.mountPtr;
+	mountPtr->refCount++;
+	rootObj = VfsCallbackRoot(&cb);
+	relativeObj = VfsCallbackRelative(&cb);
+	Tcl_IncrRefCount(rootObj);
+	Tcl_IncrRefCount(relativeObj);
+    }
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+
+    if (chan != NULL && !isDriver && !isData) {
+	/*
+	 * We got the Channel from some Tcl code.  This means it was
+	 * registered with the interpreter.  But we want a pristine
+	 * channel which hasn't been registered with anyone.  We use
+	 * Tcl_DetachChannel to do this for us.  We must use the
+	 * correct interpreter.
+	 */
+	if (Tcl_IsStandardChannel(chan)) {
+	    /*
+	     * If we have somehow ended up with a VFS channel being a std
+	     * channel, it is likely auto-inherited, which we need to reverse.
+	     * [Bug 1468291]
+	     */
+	    if (chan == Tcl_GetStdChannel(TCL_STDIN)) {
+		Tcl_SetStdChannel(NULL, TCL_STDIN);
+	    } else if (chan == Tcl_GetStdChannel(TCL_STDOUT)) {
+		Tcl_SetStdChannel(NULL, TCL_STDOUT);
+	    } else if (chan == Tcl_GetStdChannel(TCL_STDERR)) {
+		Tcl_SetStdChannel(NULL, TCL_STDERR);
+	    }
+	    Tcl_UnregisterChannel(NULL, chan);
+	}
+	Tcl_DetachChannel(interp, chan);
+    }
+    if (chan != NULL && closeCallback != NULL) {
+	VfsChannelCleanupInfo *channelRet = NULL;
+	channelRet = (VfsChannelCleanupInfo*) 
+			ckalloc(sizeof(VfsChannelCleanupInfo));
+	channelRet->channel = chan;
+	channelRet->interp = interp;
+	channelRet->closeCallback = closeCallback;
+	channelRet->sharedPtr = VfsServingShared();
+	channelRet->mountPtr = mountPtr;
+	channelRet->rootObj = rootObj;
+	channelRet->relativeObj = relativeObj;
+	/* The channelRet structure will be freed in the callback */
+	Tcl_CreateCloseHandler(chan, &VfsCloseProc, 
+			       (ClientData)channelRet);
+    }
+    if (cacheClosePtr != NULL) {
+	Tcl_CreateCloseHandler(chan, &VfsCacheCloseProc, 
+			       (ClientData)cacheClosePtr);
+    }
+    return chan;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemchanObjCmd --
+ *
+ *	This procedure implements the "vfs::memchan" command, which
+ *	makes a new, empty, read-write memory channel: 
+ *	'?-spillsize bytes? ?filename?'.  The optional filename is
+ *	accepted for compatibility with the script-level
+ *	implementations this replaces, and is ignored.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Registers a new channel in the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMemchanObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    Tcl_Channel chan;
+    Tcl_WideInt spillSize = -1;
+
+    if (objc >= 3 && !strcmp(Tcl_GetString(objv[1]), "-spillsize")) {
+	if (Tcl_GetWideIntFromObj(interp, objv[2], &spillSize) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (spillSize < 0) {
+	    Tcl_AppendResult(interp, "bad spill size \"", 
+			     Tcl_GetString(objv[2]), "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	objc -= 2;
+	objv += 2;
+    }
+    if (objc > 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "?-spillsize bytes? ?filename?");
+	return TCL_ERROR;
+    }
+    chan = VfsNewMemChannel(Tcl_NewObj(), NULL, TCL_READABLE | TCL_WRITABLE, 
+			    NULL);
+    if (spillSize >= 0) {
+	VfsMemChannel *memPtr = 
+		(VfsMemChannel*) Tcl_GetChannelInstanceData(chan);
+	memPtr->spillSize = spillSize;
+    }
+    Tcl_RegisterChannel(interp, chan);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_GetChannelName(chan), -1));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemdataObjCmd --
+ *
+ *	This procedure implements the "vfs::memdata" command, which
+ *	returns the entire contents of a memory channel, whatever its
+ *	position and translation, without copying them.  It is meant
+ *	for close callbacks, which would otherwise seek back to the
+ *	start and read everything that was written.  The contents of a
+ *	channel which has spilled are read back from its file.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Flushes the channel.  Until the result is released, the next
+ *	write to the channel copies its contents.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMemdataObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    Tcl_Channel chan;
+    int mode;
+    VfsMemChannel *memPtr;
+    Tcl_Obj *dataObj;
+    unsigned char *bytes;
+
+    if (objc != 2) {
+	Tcl_WrongNumArgs(interp, 1, objv, "channel");
+	return TCL_ERROR;
+    }
+    chan = Tcl_GetChannel(interp, Tcl_GetString(objv[1]), &mode);
+    if (chan == NULL) {
+	return TCL_ERROR;
+    }
+    if (Tcl_GetChannelType(chan) != &vfsMemChannelType) {
+	Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[1]), 
+			 "\" is not a memory channel", (char *) NULL);
+	return TCL_ERROR;
+    }
+    if ((mode & TCL_WRITABLE) && Tcl_Flush(chan) != TCL_OK) {
+	Tcl_AppendResult(interp, "error flushing \"", Tcl_GetString(objv[1]), 
+			 "\": ", Tcl_PosixError(interp), (char *) NULL);
+	return TCL_ERROR;
+    }
+    memPtr = (VfsMemChannel*) Tcl_GetChannelInstanceData(chan);
+    if (memPtr->spillPtr == NULL) {
+	Tcl_SetObjResult(interp, memPtr->dataObj);
+	return TCL_OK;
+    }
+    if (memPtr->spillPtr->length > INT_MAX) {
+	Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[1]), 
+			 "\" is too large to read into memory", (char *) NULL);
+	return TCL_ERROR;
+    }
+    dataObj = Tcl_NewObj();
+    bytes = Tcl_SetByteArrayLength(dataObj, (int) memPtr->spillPtr->length);
+    if (VfsSpillRead(memPtr->spillPtr, (char*) bytes, 
+		     (int) memPtr->spillPtr->length, 0) 
+	    != (int) memPtr->spillPtr->length) {
+	Tcl_DecrRefCount(dataObj);
+	Tcl_AppendResult(interp, "error reading \"", Tcl_GetString(objv[1]), 
+			 "\": ", Tcl_PosixError(interp), (char *) NULL);
+	return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, dataObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsNewMemChannel --
+ *
+ *	Make a memory channel over the bytes of an object, or those in
+ *	'spillPtr' if that is not NULL: read-only, for those returned
+ *	by an open handler with '-data', or read-write, for
+ *	'vfs::memchan'.  The channel is given a new name unless 'name'
+ *	is not NULL.
+ *
+ * Results:
+ *	A new channel, not registered in any interpreter.
+ *
+ * Side effects:
+ *	Holds a reference to the object, or the spill, until the
+ *	channel is closed; if the object is shared and the channel is
+ *	for another thread, it gets its own copy.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Channel
+VfsNewMemChannel(Tcl_Obj *dataObj, VfsSpill *spillPtr, int mode, 
+		 CONST char *name) {
+    VfsMemChannel *memPtr;
+    unsigned char *bytes;
+    int length = 0;
+    char channelName[16 + TCL_INTEGER_SPACE];
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    memPtr = (VfsMemChannel*) ckalloc(sizeof(VfsMemChannel));
+    if (spillPtr != NULL) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	spillPtr->refCount++;
+	Tcl_MutexUnlock(&vfsSharedMutex);
+	dataObj = NULL;
+    } else {
+	bytes = Tcl_GetByteArrayFromObj(dataObj, &length);
+	if (Tcl_IsShared(dataObj) && tsdPtr->servingPtr != NULL) {
+	    /* Objects cannot be shared between threads */
+	    dataObj = Tcl_NewByteArrayObj(bytes, length);
+	}
+	Tcl_IncrRefCount(dataObj);
+    }
+    memPtr->dataObj = dataObj;
+    memPtr->capacity = length;
+    memPtr->spillPtr = spillPtr;
+    memPtr->spillSize = 0;
+    if (mode & TCL_WRITABLE) {
+	memPtr->spillSize = (tsdPtr->spillSizeSet ? tsdPtr->spillSize 
+			     : VFS_SPILL_SIZE);
+    }
+    memPtr->position = 0;
+    memPtr->interest = 0;
+    memPtr->closed = 0;
+    memPtr->mountPtr = NULL;
+    /* 
+     * Names are never reused, so that a deferred close callback can
+     * safely give a new channel the name of the one it was made for.
+     */
+    if (name == NULL) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	sprintf(channelName, "vfsmem%lu", ++memChannelCount);
+	Tcl_MutexUnlock(&vfsSharedMutex);
+	name = channelName;
+    }
+    memPtr->channel = Tcl_CreateChannel(&vfsMemChannelType, name, 
+					(ClientData) memPtr, mode);
+    return memPtr->channel;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemReserve --
+ *
+ *	Make sure a read-write memory channel's object is its own and
+ *	holds at least 'length' bytes, any new ones being zero.
+ *
+ * Results:
+ *	The object's bytes.
+ *
+ * Side effects:
+ *	May copy the object, or grow its allocation to at least twice
+ *	the size.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned char*
+VfsMemReserve(VfsMemChannel *memPtr, int length) {
+    unsigned char *bytes;
+    int oldLength;
+
+    bytes = Tcl_GetByteArrayFromObj(memPtr->dataObj, &oldLength);
+    if (Tcl_IsShared(memPtr->dataObj)) {
+	Tcl_Obj *dataObj = Tcl_DuplicateObj(memPtr->dataObj);
+	
+	Tcl_IncrRefCount(dataObj);
+	Tcl_DecrRefCount(memPtr->dataObj);
+	memPtr->dataObj = dataObj;
+	memPtr->capacity = oldLength;
+    }
+    if (length <= oldLength) {
+	return Tcl_GetByteArrayFromObj(memPtr->dataObj, &oldLength);
+    }
+    if (length > memPtr->capacity) {
+	/* 
+	 * Tcl only ever allocates exactly what is asked for, so ask
+	 * for more and then give it back.
+	 */
+	int capacity = memPtr->capacity * 2;
+
+	if (capacity < length || capacity < 0) {
+	    capacity = length;
+	}
+	Tcl_SetByteArrayLength(memPtr->dataObj, capacity);
+	memPtr->capacity = capacity;
+    }
+    bytes = Tcl_SetByteArrayLength(memPtr->dataObj, length);
+    memset(bytes + oldLength, 0, (size_t) (length - oldLength));
+    return bytes;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemSpill --
+ *
+ *	Move the contents of a read-write memory channel which is about
+ *	to grow beyond its spill size to a temporary file.
+ *
+ * Results:
+ *	TCL_OK, or TCL_ERROR if no file could be made or written, in
+ *	which case the channel just stays in memory.
+ *
+ * Side effects:
+ *	Releases the channel's object.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsMemSpill(VfsMemChannel *memPtr) {
+    VfsSpill *spillPtr;
+    unsigned char *bytes;
+    int length;
+
+    spillPtr = VfsSpillCreate();
+    if (spillPtr != NULL) {
+	bytes = Tcl_GetByteArrayFromObj(memPtr->dataObj, &length);
+	if (VfsSpillWrite(spillPtr, (CONST char*) bytes, length, 0) 
+		!= length) {
+	    VfsSpillRelease(spillPtr);
+	    spillPtr = NULL;
+	}
+    }
+    if (spillPtr == NULL) {
+	/* Don't try again */
+	memPtr->spillSize = 0;
+	return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(memPtr->dataObj);
+    memPtr->dataObj = NULL;
+    memPtr->capacity = 0;
+    memPtr->spillPtr = spillPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMemTrack --
+ *
+ *	Note that a memory channel was opened through a mount, so that
+ *	its memory is counted for the mount, in this thread, until it
+ *	is closed or the mount goes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Puts the channel on the list of vfsMemChannels.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsMemTrack(Tcl_Channel chan, VfsMount *mountPtr) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) Tcl_GetChannelInstanceData(chan);
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    if (memPtr->mountPtr != NULL) {
+	VfsMemUnlink(memPtr);
+    }
+    memPtr->mountPtr = mountPtr;
+    memPtr->owner = Tcl_GetCurrentThread();
+    memPtr->prevPtr = NULL;
+    memPtr->nextPtr = vfsMemChannels;
+    if (vfsMemChannels != NULL) {
+	vfsMemChannels->prevPtr = memPtr;
+    }
+    vfsMemChannels = memPtr;
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+/* Take a channel off the list; vfsSharedMutex must be held */
+static void
+VfsMemUnlink(VfsMemChannel *memPtr) {
+    if (memPtr->prevPtr != NULL) {
+	memPtr->prevPtr->nextPtr = memPtr->nextPtr;
+    } else {
+	vfsMemChannels = memPtr->nextPtr;
+    }
+    if (memPtr->nextPtr != NULL) {
+	memPtr->nextPtr->prevPtr = memPtr->prevPtr;
+    }
+    memPtr->mountPtr = NULL;
+}
+
+/* A mount is being freed: stop counting its channels */
+static void
+VfsMemForget(VfsMount *mountPtr) {
+    VfsMemChannel *memPtr, *nextPtr;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    for (memPtr = vfsMemChannels; memPtr != NULL; memPtr = nextPtr) {
+	nextPtr = memPtr->nextPtr;
+	if (memPtr->mountPtr == mountPtr) {
+	    VfsMemUnlink(memPtr);
+	}
+    }
+    Tcl_MutexUnlock(&vfsSharedMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsSpillCreate --
+ *
+ *	Make a new, empty spill file: an anonymous file in the
+ *	directory named by TMPDIR (or the system's temporary directory)
+ *	where the kernel can make one, otherwise a file there which is
+ *	unlinked at once.  Either way, the space is given back as soon
+ *	as the file is closed, whatever happens to the process.
+ *
+ * Results:
+ *	The spill, with a reference count of 1, or NULL (with errno
+ *	set) if there is none.
+ *
+ * Side effects:
+ *	Opens a file descriptor.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VfsSpill*
+VfsSpillCreate(void) {
+#ifdef VFS_SPILL
+    VfsSpill *spillPtr;
+    CONST char *dir = getenv("TMPDIR");
+    int fd = -1;
+
+    if (dir == NULL || *dir == '\0') {
+	dir = P_tmpdir;
+    }
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#endif
+    if (fd < 0) {
+	Tcl_DString template;
+
+	Tcl_DStringInit(&template);
+	Tcl_DStringAppend(&template, dir, -1);
+	Tcl_DStringAppend(&template, "/vfsspillXXXXXX", -1);
+	fd = mkstemp(Tcl_DStringValue(&template));
+	if (fd >= 0) {
+	    unlink(Tcl_DStringValue(&template));
+	}
+	Tcl_DStringFree(&template);
+	if (fd < 0) {
+	    return NULL;
+	}
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    spillPtr = (VfsSpill*) ckalloc(sizeof(VfsSpill));
+    spillPtr->fd = fd;
+    spillPtr->length = 0;
+    spillPtr->refCount = 1;
+    return spillPtr;
+#else
+    Tcl_SetErrno(ENOTSUP);
+    return NULL;
+#endif
+}
+
+static void
+VfsSpillRelease(VfsSpill *spillPtr) {
+    int refCount;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    refCount = --spillPtr->refCount;
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    if (refCount == 0) {
+#ifdef VFS_SPILL
+	close(spillPtr->fd);
+#endif
+	ckfree((char*)spillPtr);
+    }
+}
+
+/* 
+ * Make sure a channel which has spilled has its file to itself, before
+ * writing to it, by copying the file if need be.
+ */
+static int
+VfsSpillOwn(VfsMemChannel *memPtr) {
+    VfsSpill *spillPtr, *oldPtr = memPtr->spillPtr;
+    Tcl_WideInt offset;
+    char buf[16384];
+    int shared, n;
+
+    Tcl_MutexLock(&vfsSharedMutex);
+    shared = (oldPtr->refCount > 1);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    if (!shared) {
+	return TCL_OK;
+    }
+    spillPtr = VfsSpillCreate();
+    if (spillPtr == NULL) {
+	return TCL_ERROR;
+    }
+    for (offset = 0; offset < oldPtr->length; offset += n) {
+	n = sizeof(buf);
+	if (n > oldPtr->length - offset) {
+	    n = (int) (oldPtr->length - offset);
+	}
+	n = VfsSpillRead(oldPtr, buf, n, offset);
+	if (n <= 0 || VfsSpillWrite(spillPtr, buf, n, offset) != n) {
+	    if (n == 0) {
+		Tcl_SetErrno(EIO);
+	    }
+	    VfsSpillRelease(spillPtr);
+	    return TCL_ERROR;
+	}
+    }
+    memPtr->spillPtr = spillPtr;
+    VfsSpillRelease(oldPtr);
+    return TCL_OK;
+}
+
+/* 
+ * Read up to 'toRead' bytes at 'offset', returning how many were read
+ * (fewer only at the end of the file), or -1 with errno set.
+ */
+static int
+VfsSpillRead(VfsSpill *spillPtr, char *buf, int toRead, 
+	     Tcl_WideInt offset) {
+#ifdef VFS_SPILL
+    int done = 0;
+
+    while (done < toRead) {
+	ssize_t n = pread(spillPtr->fd, buf + done, (size_t) (toRead - done),
+			  (off_t) (offset + done));
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n < 0) {
+	    return -1;
+	}
+	if (n == 0) {
+	    break;
+	}
+	done += (int) n;
+    }
+    return done;
+#else
+    Tcl_SetErrno(ENOTSUP);
+    return -1;
+#endif
+}
+
+/* 
+ * Write 'toWrite' bytes at 'offset', returning that, or -1 with errno
+ * set, and note where the file now ends.
+ */
+static int
+VfsSpillWrite(VfsSpill *spillPtr, CONST char *buf, int toWrite, 
+	      Tcl_WideInt offset) {
+#ifdef VFS_SPILL
+    int done = 0;
+
+    while (done < toWrite) {
+	ssize_t n = pwrite(spillPtr->fd, buf + done, 
+			   (size_t) (toWrite - done), (off_t) (offset + done));
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n < 0) {
+	    return -1;
+	}
+	done += (int) n;
+    }
+    if (offset + done > spillPtr->length) {
+	spillPtr->length = offset + done;
+    }
+    return done;
+#else
+    Tcl_SetErrno(ENOTSUP);
+    return -1;
+#endif
+}
+
+static int
+VfsMemClose(ClientData instanceData, Tcl_Interp *interp) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+
+    if (memPtr->interest) {
+	VfsReadySet(memPtr->channel, 0, 0);
+    }
+    memPtr->closed = 1;
+    if (memPtr->mountPtr != NULL) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	if (memPtr->mountPtr != NULL) {
+	    VfsMemUnlink(memPtr);
+	}
+	Tcl_MutexUnlock(&vfsSharedMutex);
+    }
+    if (memPtr->spillPtr != NULL) {
+	VfsSpillRelease(memPtr->spillPtr);
+    } else {
+	Tcl_DecrRefCount(memPtr->dataObj);
+    }
+    Tcl_EventuallyFree((ClientData) memPtr, TCL_DYNAMIC);
+    return 0;
+}
+
+static int
+VfsMemInput(ClientData instanceData, char *buf, int toRead, 
+	    int *errorCodePtr) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+    unsigned char *bytes;
+    int length;
+
+    if (memPtr->spillPtr != NULL) {
+	int n = VfsSpillRead(memPtr->spillPtr, buf, toRead, 
+			     memPtr->position);
+	if (n < 0) {
+	    *errorCodePtr = Tcl_GetErrno();
+	    return -1;
+	}
+	memPtr->position += n;
+	return n;
+    }
+    bytes = Tcl_GetByteArrayFromObj(memPtr->dataObj, &length);
+    if (memPtr->position >= length) {
+	return 0;
+    }
+    if (toRead > length - memPtr->position) {
+	toRead = length - (int) memPtr->position;
+    }
+    memcpy(buf, bytes + memPtr->position, (size_t) toRead);
+    memPtr->position += toRead;
+    return toRead;
+}
+
+/* Only called for read-write channels */
+static int
+VfsMemOutput(ClientData instanceData, CONST char *buf, int toWrite, 
+	     int *errorCodePtr) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+    unsigned char *bytes;
+    int length;
+
+    if (memPtr->spillPtr == NULL && memPtr->spillSize > 0
+	    && memPtr->position + toWrite > memPtr->spillSize) {
+	VfsMemSpill(memPtr);
+    }
+    if (memPtr->spillPtr != NULL) {
+	if (VfsSpillOwn(memPtr) != TCL_OK 
+		|| VfsSpillWrite(memPtr->spillPtr, buf, toWrite, 
+				 memPtr->position) < 0) {
+	    *errorCodePtr = Tcl_GetErrno();
+	    return -1;
+	}
+	memPtr->position += toWrite;
+	return toWrite;
+    }
+    if (memPtr->position > INT_MAX - toWrite) {
+	*errorCodePtr = EFBIG;
+	return -1;
+    }
+    Tcl_GetByteArrayFromObj(memPtr->dataObj, &length);
+    if (memPtr->position + toWrite > length) {
+	length = (int) memPtr->position + toWrite;
+    }
+    bytes = VfsMemReserve(memPtr, length);
+    memcpy(bytes + memPtr->position, buf, (size_t) toWrite);
+    memPtr->position += toWrite;
+    return toWrite;
+}
+
+static Tcl_WideInt
+VfsMemWideSeek(ClientData instanceData, Tcl_WideInt offset, int seekMode, 
+	       int *errorCodePtr) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+    Tcl_WideInt position, length;
+    int writable = (Tcl_GetChannelMode(memPtr->channel) & TCL_WRITABLE);
+
+    if (memPtr->spillPtr != NULL) {
+	length = memPtr->spillPtr->length;
+    } else {
+	int len;
+
+	Tcl_GetByteArrayFromObj(memPtr->dataObj, &len);
+	length = len;
+    }
+    switch (seekMode) {
+	case SEEK_SET:
+	    position = offset;
+	    break;
+	case SEEK_CUR:
+	    position = memPtr->position + offset;
+	    break;
+	case SEEK_END:
+	    position = length + offset;
+	    break;
+	default:
+	    position = -1;
+	    break;
+    }
+    if (position < 0) {
+	*errorCodePtr = EINVAL;
+	return -1;
+    }
+    if (position <= length || !writable) {
+	memPtr->position = position;
+	return position;
+    }
+
+    /* Seeking past the end of a writable channel extends it */
+    if (memPtr->spillPtr == NULL && memPtr->spillSize > 0 
+	    && position > memPtr->spillSize) {
+	VfsMemSpill(memPtr);
+    }
+    if (memPtr->spillPtr != NULL) {
+#ifdef VFS_SPILL
+	if (VfsSpillOwn(memPtr) != TCL_OK 
+		|| ftruncate(memPtr->spillPtr->fd, (off_t) position) != 0) {
+	    *errorCodePtr = Tcl_GetErrno();
+	    return -1;
+	}
+	memPtr->spillPtr->length = position;
+#endif
+    } else if (position > INT_MAX) {
+	*errorCodePtr = EINVAL;
+	return -1;
+    } else {
+	VfsMemReserve(memPtr, (int) position);
+    }
+    memPtr->position = position;
+    return position;
+}
+
+static int
+VfsMemSeek(ClientData instanceData, long offset, int seekMode, 
+	   int *errorCodePtr) {
+    Tcl_WideInt position = VfsMemWideSeek(instanceData, 
+	    (Tcl_WideInt) offset, seekMode, errorCodePtr);
+
+    if (position > (Tcl_WideInt) INT_MAX) {
+	*errorCodePtr = EOVERFLOW;
+	return -1;
+    }
+    return (int) position;
+}
+
+static int
+VfsMemSetOption(ClientData instanceData, Tcl_Interp *interp, 
+		CONST char *optionName, CONST char *value) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+    Tcl_WideInt spillSize;
+    Tcl_Obj *valueObj;
+    int result;
+
+    if (strcmp(optionName, "-spillsize") != 0) {
+	return Tcl_BadChannelOption(interp, optionName, "spillsize");
+    }
+    valueObj = Tcl_NewStringObj(value, -1);
+    result = Tcl_GetWideIntFromObj(interp, valueObj, &spillSize);
+    Tcl_DecrRefCount(valueObj);
+    if (result != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (spillSize < 0) {
+	if (interp != NULL) {
+	    Tcl_AppendResult(interp, "bad spill size \"", value, "\"", 
+			     (char *) NULL);
+	}
+	return TCL_ERROR;
+    }
+    /* Once spilled, the contents stay in the file */
+    if (memPtr->spillPtr == NULL 
+	    && (Tcl_GetChannelMode(memPtr->channel) & TCL_WRITABLE)) {
+	memPtr->spillSize = spillSize;
+    }
+    return TCL_OK;
+}
+
+static int
+VfsMemGetOption(ClientData instanceData, Tcl_Interp *interp, 
+		CONST char *optionName, Tcl_DString *dsPtr) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+    static CONST char *options[] = {
+	"-length", "-allocated", "-spillsize", "-spilled", NULL
+    };
+    Tcl_WideInt values[4];
+    Tcl_Obj *valueObj;
+    int i;
+
+    if (memPtr->spillPtr != NULL) {
+	values[0] = memPtr->spillPtr->length;
+	values[1] = 0;
+    } else {
+	int length;
+
+	Tcl_GetByteArrayFromObj(memPtr->dataObj, &length);
+	values[0] = length;
+	values[1] = (memPtr->capacity > length ? memPtr->capacity : length);
+    }
+    values[2] = memPtr->spillSize;
+    values[3] = (memPtr->spillPtr != NULL);
+    for (i = 0; options[i] != NULL; i++) {
+	if (optionName != NULL && strcmp(optionName, options[i]) != 0) {
+	    continue;
+	}
+	valueObj = Tcl_NewWideIntObj(values[i]);
+	if (optionName == NULL) {
+	    Tcl_DStringAppendElement(dsPtr, options[i]);
+	    Tcl_DStringAppendElement(dsPtr, Tcl_GetString(valueObj));
+	} else {
+	    Tcl_DStringAppend(dsPtr, Tcl_GetString(valueObj), -1);
+	}
+	Tcl_DecrRefCount(valueObj);
+	if (optionName != NULL) {
+	    return TCL_OK;
+	}
+    }
+    if (optionName != NULL) {
+	return Tcl_BadChannelOption(interp, optionName, 
+				    "length allocated spillsize spilled");
+    }
+    return TCL_OK;
+}
+
+/* There is always something to read (or end of file), and room to write */
+static void
+VfsMemWatch(ClientData instanceData, int mask) {
+    VfsMemChannel *memPtr = (VfsMemChannel*) instanceData;
+
+    memPtr->interest = mask & (TCL_READABLE | TCL_WRITABLE);
+    VfsReadySet(memPtr->channel, memPtr->interest, 0);
+}
+
+static int
+VfsMemGetHandle(ClientData instanceData, int direction, 
+		ClientData *handlePtr) {
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsReadySet --
+ *
+ *	Records that the always ready channel 'chan' is watched for the
+ *	events in 'mask', or, if that is 0, that it no longer is.  If
+ *	'closeHandler' is set, the channel's closing also removes it.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Creates our event source the first time it is needed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsReadySet(Tcl_Channel chan, int mask, int closeHandler) {
+    Tcl_HashEntry *hPtr;
+    VfsReadyChannel *readyPtr;
+    int isNew;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (mask == 0) {
+	if (!tsdPtr->readyInit) {
+	    return;
+	}
+	hPtr = Tcl_FindHashEntry(&tsdPtr->readyTable, (char*) chan);
+	if (hPtr == NULL) {
+	    return;
+	}
+	readyPtr = (VfsReadyChannel*) Tcl_GetHashValue(hPtr);
+	if (readyPtr->closeHandler) {
+	    Tcl_DeleteCloseHandler(chan, VfsReadyClosed, (ClientData) chan);
+	}
+	Tcl_DeleteHashEntry(hPtr);
+	ckfree((char*)readyPtr);
+	return;
+    }
+    if (!tsdPtr->readyInit) {
+	if (tsdPtr->exiting) {
+	    return;
+	}
+	Tcl_InitHashTable(&tsdPtr->readyTable, TCL_ONE_WORD_KEYS);
+	Tcl_CreateEventSource(VfsReadySetupProc, VfsReadyCheckProc, NULL);
+	tsdPtr->readyInit = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->readyTable, (char*) chan, &isNew);
+    if (isNew) {
+	readyPtr = (VfsReadyChannel*) ckalloc(sizeof(VfsReadyChannel));
+	readyPtr->channel = chan;
+	readyPtr->queued = 0;
+	readyPtr->closeHandler = 0;
+	Tcl_SetHashValue(hPtr, (ClientData) readyPtr);
+    } else {
+	readyPtr = (VfsReadyChannel*) Tcl_GetHashValue(hPtr);
+    }
+    readyPtr->mask = mask;
+    if (closeHandler && !readyPtr->closeHandler) {
+	Tcl_CreateCloseHandler(chan, VfsReadyClosed, (ClientData) chan);
+	readyPtr->closeHandler = 1;
+    }
+}
+
+/* The channel is being closed, and its close handler is already gone */
+static void
+VfsReadyClosed(ClientData clientData) {
+    Tcl_HashEntry *hPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!tsdPtr->readyInit) {
+	return;
+    }
+    hPtr = Tcl_FindHashEntry(&tsdPtr->readyTable, (char*) clientData);
+    if (hPtr != NULL) {
+	ckfree((char*) Tcl_GetHashValue(hPtr));
+	Tcl_DeleteHashEntry(hPtr);
+    }
+}
+
+/* Don't let the notifier block while a ready channel is watched */
+static void
+VfsReadySetupProc(ClientData clientData, int flags) {
+    Tcl_Time blockTime = {0, 0};
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if ((flags & TCL_FILE_EVENTS) && tsdPtr->readyInit 
+	    && tsdPtr->readyTable.numEntries > 0) {
+	Tcl_SetMaxBlockTime(&blockTime);
+    }
+}
+
+/* Queue an event for each watched channel which doesn't have one yet */
+static void
+VfsReadyCheckProc(ClientData clientData, int flags) {
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!(flags & TCL_FILE_EVENTS) || !tsdPtr->readyInit) {
+	return;
+    }
+    for (hPtr = Tcl_FirstHashEntry(&tsdPtr->readyTable, &search); 
+	 hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	VfsReadyChannel *readyPtr = (VfsReadyChannel*) Tcl_GetHashValue(hPtr);
+	VfsReadyEvent *evPtr;
+
+	if (readyPtr->queued) {
+	    continue;
+	}
+	evPtr = (VfsReadyEvent*) ckalloc(sizeof(VfsReadyEvent));
+	evPtr->header.proc = VfsReadyEventProc;
+	evPtr->channel = readyPtr->channel;
+	Tcl_QueueEvent((Tcl_Event*) evPtr, TCL_QUEUE_TAIL);
+	readyPtr->queued = 1;
+    }
+}
+
+/* 
+ * Notify the channel of an event, unless it has stopped being watched
+ * (and perhaps been closed) since the event was queued.
+ */
+static int
+VfsReadyEventProc(Tcl_Event *evPtr, int flags) {
+    Tcl_Channel chan = ((VfsReadyEvent*)evPtr)->channel;
+    Tcl_HashEntry *hPtr;
+    VfsReadyChannel *readyPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+	return 0;
+    }
+    if (!tsdPtr->readyInit) {
+	return 1;
+    }
+    hPtr = Tcl_FindHashEntry(&tsdPtr->readyTable, (char*) chan);
+    if (hPtr == NULL) {
+	return 1;
+    }
+    readyPtr = (VfsReadyChannel*) Tcl_GetHashValue(hPtr);
+    readyPtr->queued = 0;
+    Tcl_NotifyChannel(chan, readyPtr->mask);
+    return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsChannelReadyObjCmd --
+ *
+ *	This procedure implements the internal "vfs::ChannelReady"
+ *	command, 'channel eventspec', which the handler of a reflected
+ *	channel that is always ready calls from its 'watch' method,
+ *	with that method's list of events, to have those events
+ *	notified for as long as they are watched.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	See VfsReadySet.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsChannelReadyObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    static CONST char *events[] = { "read", "write", NULL };
+    Tcl_Channel chan;
+    Tcl_Obj **eventObjs;
+    int i, index, eventCount, mask = 0;
+
+    if (objc != 3) {
+	Tcl_WrongNumArgs(interp, 1, objv, "channel eventspec");
+	return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[2], &eventCount, 
+			       &eventObjs) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    for (i = 0; i < eventCount; i++) {
+	if (Tcl_GetIndexFromObj(interp, eventObjs[i], events, "event", 
+				0, &index) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	mask |= (index == 0 ? TCL_READABLE : TCL_WRITABLE);
+    }
+    chan = Tcl_GetChannel(interp, Tcl_GetString(objv[1]), NULL);
+    if (chan == NULL) {
+	if (mask == 0) {
+	    /* Already closed, so nothing to stop */
+	    Tcl_ResetResult(interp);
+	    return TCL_OK;
+	}
+	return TCL_ERROR;
+    }
+    VfsReadySet(chan, mask, 1);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCloseDefer --
+ *
+ *	Called instead of the close callback of a memory channel from
+ *	an -asyncclose mount, to queue the callback, with the contents
+ *	of the channel, until the thread is idle.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Takes over, or frees, everything in 'channelRet'.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsCloseDefer(VfsChannelCleanupInfo *channelRet) {
+    VfsMemChannel *memPtr;
+    VfsPendingClose *pendPtr;
+    CONST char *name, *relative;
+    int len;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    /* Tcl has not yet flushed what is buffered */
+    Tcl_Flush(channelRet->channel);
+    memPtr = (VfsMemChannel*) Tcl_GetChannelInstanceData(channelRet->channel);
+    name = Tcl_GetChannelName(channelRet->channel);
+    pendPtr = (VfsPendingClose*) ckalloc(sizeof(VfsPendingClose));
+    pendPtr->mountPtr = channelRet->mountPtr;
+    pendPtr->closeCallback = channelRet->closeCallback;
+    pendPtr->rootObj = channelRet->rootObj;
+    pendPtr->relativeObj = channelRet->relativeObj;
+    pendPtr->dataObj = memPtr->dataObj;
+    if (pendPtr->dataObj != NULL) {
+	Tcl_IncrRefCount(pendPtr->dataObj);
+    }
+    pendPtr->spillPtr = memPtr->spillPtr;
+    if (pendPtr->spillPtr != NULL) {
+	Tcl_MutexLock(&vfsSharedMutex);
+	pendPtr->spillPtr->refCount++;
+	Tcl_MutexUnlock(&vfsSharedMutex);
+    }
+    pendPtr->channelName = ckalloc(1 + (unsigned) strlen(name));
+    strcpy(pendPtr->channelName, name);
+    pendPtr->nextPtr = NULL;
+    relative = Tcl_GetStringFromObj(pendPtr->relativeObj, &len);
+    VfsCacheInvalidate(pendPtr->mountPtr, relative, len, 0);
+
+    if (tsdPtr->pendingCloses == NULL) {
+	tsdPtr->pendingTail = &tsdPtr->pendingCloses;
+    }
+    *tsdPtr->pendingTail = pendPtr;
+    tsdPtr->pendingTail = &pendPtr->nextPtr;
+    if (!tsdPtr->closeIdle) {
+	tsdPtr->closeIdle = 1;
+	Tcl_DoWhenIdle(VfsCloseIdleProc, NULL);
+    }
+
+    if (channelRet->sharedPtr != NULL) {
+	VfsReleaseShared(channelRet->sharedPtr);
+    }
+    ckfree((char*)channelRet);
+}
+
+/* 
+ * Take the first deferred close callback of a mount (of any mount, if
+ * NULL) off the queue, or return NULL if there is none.
+ */
+static VfsPendingClose*
+VfsCloseTake(ThreadSpecificData *tsdPtr, VfsMount *mountPtr) {
+    VfsPendingClose **linkPtr, *pendPtr;
+
+    for (linkPtr = &tsdPtr->pendingCloses; (pendPtr = *linkPtr) != NULL;
+	 linkPtr = &pendPtr->nextPtr) {
+	if (mountPtr == NULL || pendPtr->mountPtr == mountPtr) {
+	    *linkPtr = pendPtr->nextPtr;
+	    if (tsdPtr->pendingTail == &pendPtr->nextPtr) {
+		tsdPtr->pendingTail = linkPtr;
+	    }
+	    return pendPtr;
+	}
+    }
+    return NULL;
+}
+
+/* Remember why a deferred close callback failed */
+static void
+VfsCloseFailed(ThreadSpecificData *tsdPtr, VfsPendingClose *pendPtr,
+	       Tcl_Obj *messagePtr) {
+    Tcl_Obj *pathPtr;
+    int len;
+
+    pathPtr = Tcl_DuplicateObj(pendPtr->rootObj);
+    Tcl_GetStringFromObj(pendPtr->relativeObj, &len);
+    if (len > 0) {
+	CONST char *root = Tcl_GetStringFromObj(pathPtr, &len);
+	if (len == 0 || root[len-1] != '/') {
+	    Tcl_AppendToObj(pathPtr, "/", 1);
+	}
+	Tcl_AppendObjToObj(pathPtr, pendPtr->relativeObj);
+    }
+    if (tsdPtr->closeErrors == NULL) {
+	tsdPtr->closeErrors = Tcl_NewObj();
+	Tcl_IncrRefCount(tsdPtr->closeErrors);
+    }
+    Tcl_ListObjAppendElement(NULL, tsdPtr->closeErrors, pathPtr);
+    Tcl_ListObjAppendElement(NULL, tsdPtr->closeErrors, 
+	    Tcl_NewStringObj(Tcl_GetString(messagePtr), -1));
+}
+
+static void
+VfsCloseFree(VfsPendingClose *pendPtr) {
+    Tcl_DecrRefCount(pendPtr->closeCallback);
+    Tcl_DecrRefCount(pendPtr->rootObj);
+    Tcl_DecrRefCount(pendPtr->relativeObj);
+    if (pendPtr->dataObj != NULL) {
+	Tcl_DecrRefCount(pendPtr->dataObj);
+    }
+    if (pendPtr->spillPtr != NULL) {
+	VfsSpillRelease(pendPtr->spillPtr);
+    }
+    VfsReleaseMount(pendPtr->mountPtr);
+    ckfree(pendPtr->channelName);
+    ckfree((char*)pendPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCloseRunOne --
+ *
+ *	Run a deferred close callback, which has been taken off the
+ *	queue, on a new memory channel with the name and contents of
+ *	the one which was closed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Whatever the callback does.  A failure is remembered for
+ *	'vfs::filesystem sync'.  Frees 'pendPtr'.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsCloseRunOne(ThreadSpecificData *tsdPtr, VfsPendingClose *pendPtr) {
+    VfsMount *mountPtr = pendPtr->mountPtr;
+    Tcl_Interp *interp = mountPtr->interpCmd.interp;
+    Tcl_SavedResult savedResult;
+    Tcl_Channel chan;
+    Tcl_Time start;
+    Tcl_WideInt bytes = -1;
+    CONST char *relative;
+    int returnVal, timed, len;
+
+    Tcl_Preserve((ClientData) interp);
+    Tcl_SaveResult(interp, &savedResult);
+    chan = VfsNewMemChannel(pendPtr->dataObj, pendPtr->spillPtr, 
+			    TCL_READABLE | TCL_WRITABLE, pendPtr->channelName);
+    Tcl_RegisterChannel(interp, chan);
+    /* Where the channel was left when it was closed */
+    Tcl_Seek(chan, 0, SEEK_END);
+
+    timed = VfsTiming(tsdPtr);
+    if (timed) {
+	bytes = Tcl_Tell(chan);
+	Tcl_GetTime(&start);
+    }
+    if (VfsProbeEnabled(callback__entry)) {
+	VfsProbe3(callback__entry, "close", Tcl_GetString(pendPtr->rootObj), 
+		  Tcl_GetString(pendPtr->relativeObj));
+    }
+    tsdPtr->closeRunning++;
+    returnVal = Tcl_EvalObjEx(interp, pendPtr->closeCallback, 
+			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    tsdPtr->closeRunning--;
+    if (VfsProbeEnabled(callback__return)) {
+	VfsProbe4(callback__return, "close", Tcl_GetString(pendPtr->rootObj), 
+		  Tcl_GetString(pendPtr->relativeObj), returnVal);
+    }
+    if (timed) {
+	VfsTimingRecord(mountPtr, VFS_STATS_CLOSE, returnVal, &start, 
+			pendPtr->rootObj, pendPtr->relativeObj, bytes);
+    }
+    if (returnVal != TCL_OK) {
+	VfsCloseFailed(tsdPtr, pendPtr, Tcl_GetObjResult(interp));
+    }
+    /* Unless the callback closed it itself */
+    if (Tcl_GetChannel(interp, pendPtr->channelName, NULL) == chan) {
+	Tcl_UnregisterChannel(interp, chan);
+    }
+    Tcl_RestoreResult(interp, &savedResult);
+    Tcl_Release((ClientData) interp);
+
+    /* What was cached about the file may have changed again */
+    relative = Tcl_GetStringFromObj(pendPtr->relativeObj, &len);
+    VfsCacheInvalidate(mountPtr, relative, len, 0);
+    VfsCloseFree(pendPtr);
+}
+
+/* Run the next deferred close callback, when the thread is idle */
+static void
+VfsCloseIdleProc(ClientData clientData) {
+    VfsPendingClose *pendPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    tsdPtr->closeIdle = 0;
+    if (tsdPtr->closeRunning) {
+	/* Called from the event loop of a running callback; wait */
+	pendPtr = NULL;
+    } else {
+	pendPtr = VfsCloseTake(tsdPtr, NULL);
+    }
+    if (pendPtr != NULL) {
+	VfsCloseRunOne(tsdPtr, pendPtr);
+    }
+    if (tsdPtr->pendingCloses != NULL && !tsdPtr->closeIdle) {
+	tsdPtr->closeIdle = 1;
+	Tcl_DoWhenIdle(VfsCloseIdleProc, NULL);
+    }
+}
+
+/* 
+ * Run all the deferred close callbacks of a mount (of every mount, if
+ * NULL) now, in order, unless one is already running.
+ */
+static void
+VfsCloseRun(ThreadSpecificData *tsdPtr, VfsMount *mountPtr) {
+    VfsPendingClose *pendPtr;
+
+    while (!tsdPtr->closeRunning 
+	   && (pendPtr = VfsCloseTake(tsdPtr, mountPtr)) != NULL) {
+	VfsCloseRunOne(tsdPtr, pendPtr);
+    }
+}
+
+/* 
+ * The latest deferred close callback for a path, whose contents a
+ * reader should be given, or NULL if there is none.
+ */
+static VfsPendingClose*
+VfsCloseFind(Tcl_Obj *pathPtr) {
+    VfsNativeRep *nativeRep;
+    VfsPendingClose *pendPtr, *foundPtr = NULL;
+    CONST char *relative;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->pendingCloses == NULL) {
+	return NULL;
+    }
+    nativeRep = VfsGetRelativePath(pathPtr);
+    if (nativeRep == NULL) {
+	return NULL;
+    }
+    relative = Tcl_GetString(nativeRep->relativeObj);
+    for (pendPtr = tsdPtr->pendingCloses; pendPtr != NULL; 
+	 pendPtr = pendPtr->nextPtr) {
+	if (pendPtr->mountPtr == nativeRep->mountPtr 
+		&& !strcmp(Tcl_GetString(pendPtr->relativeObj), relative)) {
+	    foundPtr = pendPtr;
+	}
+    }
+    return foundPtr;
+}
+
+/* 
+ * Must the deferred close callbacks of a mount run before an
+ * operation on the given path there?  Listings of a directory wait
+ * for those of files inside it, copies and renames for all of them,
+ * and anything else for those of the same file.
+ */
+static int
+VfsCloseConflict(ThreadSpecificData *tsdPtr, VfsMount *mountPtr, int op,
+		 Tcl_Obj *relativeObj) {
+    VfsPendingClose *pendPtr;
+    CONST char *relative, *other;
+    int len;
+
+    relative = Tcl_GetStringFromObj(relativeObj, &len);
+    for (pendPtr = tsdPtr->pendingCloses; pendPtr != NULL; 
+	 pendPtr = pendPtr->nextPtr) {
+	if (pendPtr->mountPtr != mountPtr) {
+	    continue;
 	}
-	case VFS_INFO: {
-	    if (objc > 3) {
-		Tcl_WrongNumArgs(interp, 2, objv, "path");
-		return TCL_ERROR;
-	    }
-	    if (objc == 2) {
-		Tcl_SetObjResult(interp, Vfs_ListMounts());
-	    } else {
-		Vfs_InterpCmd *val;
-		
-		val = Vfs_FindMount(objv[2], -1);
-		if (val == NULL) {
-		    Tcl_Obj *path;
-		    path = VfsFullyNormalizePath(interp, objv[2]);
-		    val = Vfs_FindMount(path, -1);
-		    Tcl_DecrRefCount(path);
-		    if (val == NULL) {
-			Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-				"no such mount \"", Tcl_GetString(objv[2]), 
-				"\"", (char *) NULL);
-			return TCL_ERROR;
-		    }
+	other = Tcl_GetString(pendPtr->relativeObj);
+	switch (op) {
+	    case VFS_OP_MATCHINDIRECTORY:
+	    case VFS_OP_STATMANY:
+	    case VFS_OP_REMOVEDIRECTORY:
+		if (len == 0 || (!strncmp(other, relative, (size_t) len) 
+				 && other[len] == '/')) {
+		    return 1;
 		}
-		Tcl_SetObjResult(interp, val->mountCmd);
-	    }
-	    break;
-	}
-	case VFS_UNMOUNT: {
-	    if (objc != 3) {
-		Tcl_WrongNumArgs(interp, 2, objv, "path");
-		return TCL_ERROR;
-	    }
-	    if (Vfs_RemoveMount(objv[2], interp) == TCL_ERROR) {
-		Tcl_Obj *path;
-		int retVal;
-		path = VfsFullyNormalizePath(interp, objv[2]);
-		retVal = Vfs_RemoveMount(path, interp);
-		Tcl_DecrRefCount(path);
-		if (retVal == TCL_ERROR) {
-		    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-			    "no such mount \"", Tcl_GetString(objv[2]), 
-			    "\"", (char *) NULL);
-		    return TCL_ERROR;
+		break;
+	    case VFS_OP_COPYFILE:
+	    case VFS_OP_RENAMEFILE:
+	    case VFS_OP_COPYDIRECTORY:
+		return 1;
+	    default:
+		if (!strcmp(other, relative)) {
+		    return 1;
 		}
-	    }
-	    return TCL_OK;
 	}
     }
-    return TCL_OK;
+    return 0;
 }
-
-/* Handle an error thrown by a tcl vfs implementation */
+
+/* 
+ * Drop the deferred close callbacks of an interpreter's mounts, as it
+ * is being deleted and cannot run them.
+ */
 static void
-VfsInternalError(Tcl_Interp* interp)
-{
-    if (interp != NULL) {
-	ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
-	if (tsdPtr->internalErrorScript != NULL) {
-	    Tcl_EvalObjEx(interp, tsdPtr->internalErrorScript,
-			  TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-	}
-    }
-}
-
-/* Return fully normalized path owned by the caller */
-static Tcl_Obj*
-VfsFullyNormalizePath(Tcl_Interp *interp, Tcl_Obj *pathPtr) {
-    Tcl_Obj *path;
-    int counter = 0;
+VfsCloseDiscard(ThreadSpecificData *tsdPtr, Tcl_Interp *interp) {
+    VfsPendingClose **linkPtr, *pendPtr;
+    Tcl_Obj *messagePtr;
 
-    Tcl_IncrRefCount(pathPtr);
-    while (1) {
-	path = Tcl_FSLink(pathPtr,NULL,0);
-	if (path == NULL) {
-	    break;
+    messagePtr = Tcl_NewStringObj("interpreter deleted", -1);
+    Tcl_IncrRefCount(messagePtr);
+    linkPtr = &tsdPtr->pendingCloses;
+    while ((pendPtr = *linkPtr) != NULL) {
+	if (interp != NULL && pendPtr->mountPtr->interpCmd.interp != interp) {
+	    linkPtr = &pendPtr->nextPtr;
+	    continue;
 	}
-	if (Tcl_FSGetPathType(path) != TCL_PATH_ABSOLUTE) {
-	    /* 
-	     * This is more complex, we need to find the path
-	     * relative to the original file, effectively:
-	     * 
-	     *  file join [file dirname $pathPtr] $path
-	     *  
-	     * or 
-	     * 
-	     *  file join $pathPtr .. $path
-	     *  
-	     * So...
-	     */
-	    Tcl_Obj *dotdotPtr, *joinedPtr;
-	    Tcl_Obj *joinElements[2];
-	    
-	    dotdotPtr = Tcl_NewStringObj("..",2);
-	    Tcl_IncrRefCount(dotdotPtr);
-	    
-	    joinElements[0] = dotdotPtr;
-	    joinElements[1] = path;
-
-	    joinedPtr = Tcl_FSJoinToPath(pathPtr, 2, joinElements);
-	    
-	    if (joinedPtr != NULL) {
-		Tcl_IncrRefCount(joinedPtr);
-		Tcl_DecrRefCount(path);
-		path = joinedPtr;
-	    } else {
-		/* We failed, and our action is undefined */
-	    }
-	    Tcl_DecrRefCount(dotdotPtr);
+	*linkPtr = pendPtr->nextPtr;
+	if (tsdPtr->pendingTail == &pendPtr->nextPtr) {
+	    tsdPtr->pendingTail = linkPtr;
 	}
-	Tcl_DecrRefCount(pathPtr);
-	pathPtr = path;
-	counter++;
-	if (counter > 10) {
-	    /* Too many links */
-	    Tcl_DecrRefCount(pathPtr);
-	    return NULL;
+	if (interp != NULL) {
+	    VfsCloseFailed(tsdPtr, pendPtr, messagePtr);
 	}
+	VfsCloseFree(pendPtr);
     }
-    path = Tcl_FSGetNormalizedPath(interp, pathPtr);
-    Tcl_IncrRefCount(path);
-    Tcl_DecrRefCount(pathPtr);
-    return path;
+    Tcl_DecrRefCount(messagePtr);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * VfsPathInFilesystem --
+ * VfsCloseSync --
+ *
+ *	Carry out 'vfs::filesystem sync': run the deferred close
+ *	callbacks of a mount (or of every mount, if NULL) and report
+ *	those which have failed since the last sync.
  *
- *	Check whether a path is in any of the mounted points in this
- *	vfs.
- *	
- *	If it is in the vfs, set the clientData given to our private
- *	internal representation for a vfs path.
- *	
  * Results:
- *	Returns TCL_OK on success, or 'TCLVFS_POSIXERROR' on failure.
- *	If Tcl is exiting, we always return a failure code.
+ *	A standard Tcl result; the error message has a line for each
+ *	failure.
  *
  * Side effects:
- *	On success, we allocate some memory for our internal
- *	representation structure.  Tcl will call us to free this
- *	when necessary.
+ *	Whatever the callbacks do.
  *
  *----------------------------------------------------------------------
  */
-static int 
-VfsPathInFilesystem(Tcl_Obj *pathPtr, ClientData *clientDataPtr) {
-    Tcl_Obj *normedObj;
-    int len, splitPosition;
-    char *normed;
-    VfsNativeRep *nativeRep;
-    Vfs_InterpCmd *interpCmd = NULL;
-    
-    if (TclInExit()) {
+
+static int
+VfsCloseSync(Tcl_Interp *interp, VfsMount *mountPtr) {
+    Tcl_Obj **errv, *keptPtr, *messagePtr = NULL;
+    int errc, i, len;
+    CONST char *path;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    VfsCloseRun(tsdPtr, mountPtr);
+    if (tsdPtr->closeErrors == NULL) {
+	return TCL_OK;
+    }
+    keptPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(keptPtr);
+    Tcl_ListObjGetElements(NULL, tsdPtr->closeErrors, &errc, &errv);
+    for (i = 0; i + 1 < errc; i += 2) {
+	path = Tcl_GetStringFromObj(errv[i], &len);
+	if (mountPtr != NULL && !(len >= mountPtr->mountLen 
+		&& !strncmp(path, mountPtr->mountPoint, 
+			    (size_t) mountPtr->mountLen)
+		&& (len == mountPtr->mountLen || path[mountPtr->mountLen] == '/'
+		    || mountPtr->mountPoint[mountPtr->mountLen-1] == '/'))) {
+	    Tcl_ListObjAppendElement(NULL, keptPtr, errv[i]);
+	    Tcl_ListObjAppendElement(NULL, keptPtr, errv[i+1]);
+	    continue;
+	}
+	if (messagePtr == NULL) {
+	    messagePtr = Tcl_NewObj();
+	} else {
+	    Tcl_AppendToObj(messagePtr, "\n", 1);
+	}
+	Tcl_AppendStringsToObj(messagePtr, "couldn't close \"", path, "\": ",
+		Tcl_GetString(errv[i+1]), (char *) NULL);
+    }
+    Tcl_DecrRefCount(tsdPtr->closeErrors);
+    tsdPtr->closeErrors = keptPtr;
+    if (messagePtr != NULL) {
+	Tcl_SetObjResult(interp, messagePtr);
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/* 
+ * IMPORTANT: This procedure must *not* modify the interpreter's result
+ * this leads to the objResultPtr being corrupted (somehow), and curious
+ * crashes in the future (which are very hard to debug ;-).
+ * 
+ * This is particularly important since we are evaluating arbitrary
+ * Tcl code in the callback.
+ * 
+ * Also note we are relying on the close-callback to occur just before
+ * the channel is about to be properly closed, but after all output
+ * has been flushed.  That way we can, in the callback, read in the
+ * entire contents of the channel and, say, compress it for storage
+ * into a tclkit or zip archive.
+ */
+static void 
+VfsCloseProc(ClientData clientData) {
+    VfsChannelCleanupInfo * channelRet = (VfsChannelCleanupInfo*) clientData;
+    int returnVal, timed;
+    Tcl_Time start;
+    Tcl_WideInt bytes = -1;
+    ThreadSpecificData *tsdPtr;
+    Tcl_SavedResult savedResult;
+    Tcl_Channel chan = channelRet->channel;
+    Tcl_Interp * interp = channelRet->interp;
+
+    if (channelRet->sharedPtr != NULL && VfsRemoteClose(channelRet->sharedPtr,
+	    VfsCloseProc, clientData, chan)) {
+	/* Opened for another thread, which is closing it */
+	return;
+    }
+    if (channelRet->mountPtr->asyncClose 
+	    && Tcl_GetChannelType(chan) == &vfsMemChannelType) {
+	VfsCloseDefer(channelRet);
+	return;
+    }
+
+    Tcl_SaveResult(interp, &savedResult);
+
+    /* 
+     * The interpreter needs to know about the channel, else the Tcl
+     * callback will fail, so we register the channel (this allows
+     * the Tcl code to use the channel's string-name).
+     */
+    if (!Tcl_IsStandardChannel(chan)) {
+	Tcl_RegisterChannel(interp, chan);
+    }
+
+    if (!(Tcl_GetChannelMode(chan) & TCL_READABLE)) {
 	/* 
-	 * Even Tcl_FSGetNormalizedPath may fail due to lack of system
-	 * encodings, so we just say we can't handle anything if we are
-	 * in the middle of the exit sequence.  We could perhaps be
-	 * more subtle than this!
+	 * We need to make this channel readable, since tclvfs
+	 * documents that close callbacks are allowed to read
+	 * from the channels we create.
 	 */
-	return TCLVFS_POSIXERROR;
+	
+	/* Currently if we reach here we have a bug */
+    }
+    
+    tsdPtr = TCL_TSD_INIT(&dataKey);
+    timed = VfsTiming(tsdPtr);
+    if (timed) {
+	bytes = Tcl_Tell(chan);
+	Tcl_GetTime(&start);
+    }
+    if (VfsProbeEnabled(callback__entry)) {
+	VfsProbe3(callback__entry, "close", 
+		  Tcl_GetString(channelRet->rootObj), 
+		  Tcl_GetString(channelRet->relativeObj));
     }
+    returnVal = Tcl_EvalObjEx(interp, channelRet->closeCallback, 
+		  TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    if (VfsProbeEnabled(callback__return)) {
+	VfsProbe4(callback__return, "close", 
+		  Tcl_GetString(channelRet->rootObj), 
+		  Tcl_GetString(channelRet->relativeObj), returnVal);
+    }
+    if (timed) {
+	VfsTimingRecord(channelRet->mountPtr, VFS_STATS_CLOSE, returnVal, 
+		&start, channelRet->rootObj, channelRet->relativeObj, bytes);
+    }
+    if (returnVal != TCL_OK) {
+	VfsInternalError(interp);
+    }
+    Tcl_DecrRefCount(channelRet->closeCallback);
+
+    /* 
+     * More complications; we can't just unregister the channel,
+     * because it is in the middle of being cleaned up, and the cleanup
+     * code doesn't like a channel to be closed again while it is
+     * already being closed.  So, we do the same trick as above to
+     * unregister it without cleanup.
+     */
+    if (!Tcl_IsStandardChannel(chan)) {
+	Tcl_DetachChannel(interp, chan);
+    }
+
+    Tcl_RestoreResult(interp, &savedResult);
+    Tcl_DecrRefCount(channelRet->rootObj);
+    Tcl_DecrRefCount(channelRet->relativeObj);
+    VfsReleaseMount(channelRet->mountPtr);
+    if (channelRet->sharedPtr != NULL) {
+	VfsReleaseShared(channelRet->sharedPtr);
+    }
+    ckfree((char*)channelRet);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsMatchStatResult --
+ *
+ *	A matchindirectory handler may return '-stat {path info ...}'
+ *	instead of a plain list of paths, where each 'info' is either a
+ *	type word ('file', 'directory', ...) or a full stat result in any
+ *	of the forms a stat handler may return.  Filter such a result by
+ *	the requested types here, as vfs::matchCorrectTypes would have
+ *	done by probing each path, and seed the stat cache with any full
+ *	stat results.
+ *
+ * Results:
+ *	A standard Tcl result.  The interpreter's result is replaced by
+ *	the plain list of matching paths, or an error message.  A plain
+ *	result is left alone.
+ *
+ * Side effects:
+ *	May add entries to the mount's stat cache.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    normedObj = Tcl_FSGetNormalizedPath(NULL, pathPtr);
-    if (normedObj == NULL) {
-        return TCLVFS_POSIXERROR;
+static int
+VfsMatchStatResult(VfsCallback *cbPtr, int type)
+{
+    Tcl_Interp *interp = cbPtr->interp;
+    Tcl_Obj *resPtr = Tcl_GetObjResult(interp);
+    Tcl_Obj **objv, **infov, *listPtr;
+    int objc, infoc, i;
+    int wantAll, wantFiles, wantDirs;
+
+    if (Tcl_ListObjGetElements(NULL, resPtr, &objc, &objv) != TCL_OK
+	    || objc != 2 || strcmp(Tcl_GetString(objv[0]), "-stat") != 0) {
+	return TCL_OK;
     }
-    normed = Tcl_GetStringFromObj(normedObj, &len);
-    splitPosition = len;
+    if (Tcl_ListObjGetElements(interp, objv[1], &infoc, &infov) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (infoc % 2) {
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(
+		"-stat result must be a list of paths and their types", -1));
+	return TCL_ERROR;
+    }
+    wantFiles = (type == 0) || (type & TCL_GLOB_TYPE_FILE);
+    wantDirs = (type == 0) || (type & TCL_GLOB_TYPE_DIR);
+    wantAll = wantFiles && wantDirs;
 
-    /* 
-     * Find the most specific mount point for this path.
-     * Mount points are specified by unique strings, so
-     * we have to use a unique normalised path for the
-     * checks here.
-     * 
-     * Given mount points are paths, 'most specific' means
-     * longest path, so we scan from end to beginning
-     * checking for valid mount points at each separator.
-     */
-    while (1) {
-	/* 
-	 * We need this test here both for an empty string being
-	 * passed in above, and so that if we are testing a unix
-	 * absolute path /foo/bar we will come around the loop
-	 * with splitPosition at 0 for the last iteration, and we
-	 * must return then.
-	 */
-	if (splitPosition == 0) {
-	    return TCLVFS_POSIXERROR;
+    listPtr = Tcl_NewObj();
+    Tcl_IncrRefCount(listPtr);
+    for (i = 0; i < infoc; i += 2) {
+	Tcl_Obj *infoPtr = infov[i+1];
+	Tcl_StatBuf buf;
+	int isStat, isDir, isFile, len;
+
+	isStat = (infoPtr->typePtr == &vfsStatBufType);
+	if (!isStat) {
+	    if (Tcl_ListObjLength(interp, infoPtr, &len) != TCL_OK) {
+		goto error;
+	    }
+	    isStat = (len != 1);
 	}
-	
-	/* Is the path up to 'splitPosition' a valid moint point? */
-	interpCmd = Vfs_FindMount(normedObj, splitPosition);
-	if (interpCmd != NULL) break;
+	if (isStat) {
+	    VfsNativeRep *nativeRep;
+	    VfsCacheEntry *cachePtr;
 
-	while (normed[--splitPosition] != VFS_SEPARATOR) {
-	    if (splitPosition == 0) {
-		/* 
-		 * We've reached the beginning of the string without
-		 * finding a mount, so we've failed.
-		 */
-		return TCLVFS_POSIXERROR;
+	    memset(&buf, 0, sizeof(Tcl_StatBuf));
+	    if (VfsStatFromObj(interp, infoPtr, &buf) != TCL_OK) {
+		goto error;
+	    }
+	    isDir = S_ISDIR(buf.st_mode);
+	    isFile = S_ISREG(buf.st_mode);
+	    nativeRep = VfsGetRelativePath(infov[i]);
+	    if (nativeRep != NULL && nativeRep->mountPtr == cbPtr->mountPtr) {
+		cachePtr = VfsCacheLookup(cbPtr->mountPtr,
+					  nativeRep->relativeObj, 1);
+		if (cachePtr != NULL) {
+		    cachePtr->haveStat = 1;
+		    cachePtr->statErrno = 0;
+		    memcpy(&cachePtr->statBuf, &buf, sizeof(Tcl_StatBuf));
+		}
 	    }
+	} else {
+	    CONST char *typeName = Tcl_GetString(infoPtr);
+	    isDir = (strcmp(typeName, "directory") == 0);
+	    isFile = (strcmp(typeName, "file") == 0);
 	}
-	
-	/* 
-	 * We now know that normed[splitPosition] is a separator.
-	 * However, we might have mounted a root filesystem with a
-	 * name (for example 'ftp://') which actually includes a
-	 * separator.  Therefore we test whether the path with
-	 * a separator is a mount point.
-	 * 
-	 * Since we must have decremented splitPosition at least once
-	 * already (above) 'splitPosition+1 <= len' so this won't
-	 * access invalid memory.
-	 */
-	interpCmd = Vfs_FindMount(normedObj, splitPosition+1);
-	if (interpCmd != NULL) {
-	    splitPosition++;
-	    break;
+	if (wantAll || (isFile && wantFiles) || (isDir && wantDirs)) {
+	    Tcl_ListObjAppendElement(NULL, listPtr, infov[i]);
 	}
     }
-    
-    /* 
-     * If we reach here we have a valid mount point, since the
-     * only way to escape the above loop is through a 'break' when
-     * an interpCmd is non-NULL.
-     */
-    nativeRep = (VfsNativeRep*) ckalloc(sizeof(VfsNativeRep));
-    nativeRep->splitPosition = splitPosition;
-    nativeRep->fsCmd = interpCmd;
-    *clientDataPtr = (ClientData)nativeRep;
+    Tcl_SetObjResult(interp, listPtr);
+    Tcl_DecrRefCount(listPtr);
     return TCL_OK;
-}
 
-/* 
- * Simple helper function to extract the native vfs representation of a
- * path object, or NULL if no such representation exists.
- */
-static VfsNativeRep* 
-VfsGetNativePath(Tcl_Obj* pathPtr) {
-    return (VfsNativeRep*) Tcl_FSGetInternalRep(pathPtr, &vfsFilesystem);
+  error:
+    Tcl_DecrRefCount(listPtr);
+    return TCL_ERROR;
 }
 
-static void 
-VfsFreeInternalRep(ClientData clientData) {
-    VfsNativeRep *nativeRep = (VfsNativeRep*)clientData;
-    if (nativeRep != NULL) {
-	/* Free the native memory allocation */
-	ckfree((char*)nativeRep);
-    }
-}
+static int
+VfsMatchInDirectory(
+    Tcl_Interp *cmdInterp,	/* Interpreter to receive error msgs. */
+    Tcl_Obj *returnPtr,		/* Object to receive results. */
+    Tcl_Obj *dirPtr,	        /* Contains path to directory to search. */
+    CONST char *pattern,	/* Pattern to match against. */
+    Tcl_GlobTypeData *types)	/* Object containing list of acceptable types.
+				 * May be NULL. */
+{
+    if ((types != NULL) && (types->type & TCL_GLOB_TYPE_MOUNT)) {
+	VfsMount *mountIter;
+	int len;
+	CONST char *prefix;
+	Tcl_HashEntry *hPtr;
+	VfsKey key;
+	ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
 
-static ClientData 
-VfsDupInternalRep(ClientData clientData) {
-    VfsNativeRep *original = (VfsNativeRep*)clientData;
+	if (tsdPtr->listOfMounts == NULL) {
+	    return TCL_OK;
+	}
 
-    VfsNativeRep *nativeRep = (VfsNativeRep*) ckalloc(sizeof(VfsNativeRep));
-    nativeRep->splitPosition = original->splitPosition;
-    nativeRep->fsCmd = original->fsCmd;
-    
-    return (ClientData)nativeRep;
-}
+	prefix = Tcl_GetStringFromObj(Tcl_FSGetNormalizedPath(NULL, dirPtr), 
+				      &len);
+	if (prefix[len-1] == '/') {
+	    /* 
+	     * It's a root directory; we must subtract one for
+	     * our comparisons below
+	     */
+	    len--;
+	}
 
-static Tcl_Obj* 
-VfsFilesystemPathType(Tcl_Obj *pathPtr) {
-    VfsNativeRep* nativeRep = VfsGetNativePath(pathPtr);
-    if (nativeRep == NULL) {
-	return NULL;
+	/* 
+	 * Build list of mounts.  Only those directly inside this
+	 * directory are chained together under its key.
+	 */
+	key.string = prefix;
+	key.length = len;
+	hPtr = Tcl_FindHashEntry(&tsdPtr->dirTable, (char*)&key);
+	if (hPtr == NULL) {
+	    return TCL_OK;
+	}
+	mountIter = (VfsMount*) Tcl_GetHashValue(hPtr);
+	while (mountIter != NULL) {
+	    if (Tcl_StringCaseMatch(mountIter->mountPoint+len+1, pattern, 0)) {
+		Tcl_Obj* mount = Tcl_NewStringObj(mountIter->mountPoint, 
+						  mountIter->mountLen);
+		Tcl_ListObjAppendElement(NULL, returnPtr, mount);
+	    }
+	    mountIter = mountIter->nextSibling;
+	}
+	return TCL_OK;
     } else {
-	return nativeRep->fsCmd->mountCmd;
-    }
-}
+	VfsCallback cb;
+	Tcl_SavedResult savedResult;
+	int returnVal;
+	Tcl_Interp* interp;
+	int type = 0;
+	Tcl_Obj *vfsResultPtr = NULL;
+	VfsNativeRep *nativeRep;
+	Tcl_DString cacheKey;
+	int cacheable = 0;
+	VfsSharedMount *sharedPtr;
+	
+	if (types != NULL) {
+	    type = types->type;
+	}
+	
+	sharedPtr = VfsGetRemote(dirPtr, 1);
+	if (sharedPtr != NULL) {
+	    VfsRemoteCall call;
+	    VfsRemoteInit(&call, VFS_OP_MATCHINDIRECTORY, sharedPtr, dirPtr);
+	    call.strArg = pattern;
+	    call.haveTypes = (types != NULL);
+	    call.intArg = type;
+	    returnVal = VfsRemoteDispatch(&call);
+	    if (call.resultStr != NULL) {
+		vfsResultPtr = Tcl_NewStringObj(call.resultStr, -1);
+		ckfree(call.resultStr);
+		Tcl_IncrRefCount(vfsResultPtr);
+		if (returnVal == TCL_OK) {
+		    returnVal = Tcl_ListObjAppendList(cmdInterp, returnPtr, 
+						      vfsResultPtr);
+		} else if (cmdInterp != NULL) {
+		    Tcl_SetObjResult(cmdInterp, vfsResultPtr);
+		}
+		Tcl_DecrRefCount(vfsResultPtr);
+	    }
+	    return returnVal;
+	}
+	
+	nativeRep = VfsGetRelativePath(dirPtr);
+	if (nativeRep != NULL && nativeRep->mountPtr->cacheTtl != 0
+		&& (types == NULL || types->macType == NULL)) {
+	    VfsMount *mountPtr = nativeRep->mountPtr;
+	    Tcl_HashEntry *hPtr = NULL;
+	    VfsKey key;
+	    
+	    cacheable = 1;
+	    Tcl_DStringInit(&cacheKey);
+	    VfsGlobCacheKey(&cacheKey, nativeRep->relativeObj, type, 
+			    pattern, dirPtr);
+	    if (mountPtr->globCache != NULL) {
+		key.string = Tcl_DStringValue(&cacheKey);
+		key.length = Tcl_DStringLength(&cacheKey);
+		hPtr = Tcl_FindHashEntry(mountPtr->globCache, (char*)&key);
+	    }
+	    if (hPtr != NULL) {
+		VfsGlobCacheEntry *globPtr;
+		
+		globPtr = (VfsGlobCacheEntry*) Tcl_GetHashValue(hPtr);
+		if (!VfsCacheExpired(mountPtr, globPtr->stamp)) {
+		    Tcl_Obj *resultPtr;
+		    
+		    VfsCacheTouch(&globPtr->link);
+		    Tcl_DStringFree(&cacheKey);
+		    resultPtr = Tcl_NewStringObj(globPtr->result, 
+						 globPtr->length);
+		    Tcl_IncrRefCount(resultPtr);
+		    returnVal = Tcl_ListObjAppendList(cmdInterp, returnPtr, 
+						      resultPtr);
+		    Tcl_DecrRefCount(resultPtr);
+		    return returnVal;
+		}
+		VfsCacheDrop(&globPtr->link);
+	    }
+	}
+	
+	if (VfsCallbackInit(&cb, VFS_OP_MATCHINDIRECTORY, dirPtr) != TCL_OK) {
+	    if (cacheable) {
+		Tcl_DStringFree(&cacheKey);
+	    }
+	    return TCLVFS_POSIXERROR;
+	}
+	interp = cb.interp;
 
-static Tcl_Obj*
-VfsFilesystemSeparator(Tcl_Obj* pathPtr) {
-    char sep=VFS_SEPARATOR;
-    return Tcl_NewStringObj(&sep,1);
+	VfsCallbackAppend(&cb, VfsPatternObj(pattern));
+	VfsCallbackAppend(&cb, VfsIntObj(type));
+	Tcl_SaveResult(interp, &savedResult);
+	/* Now we execute this mount point's callback. */
+	if (cb.mountPtr->driverPtr != NULL) {
+	    Vfs_MatchInDirectoryProc *matchProc = 
+		    VfsDriverProc(cb.mountPtr, matchInDirectoryProc);
+	    if (matchProc == NULL) {
+		returnVal = VfsNoDriverProc();
+	    } else {
+		vfsResultPtr = Tcl_NewObj();
+		Tcl_IncrRefCount(vfsResultPtr);
+		returnVal = matchProc(VfsDriverArgs(&cb), pattern, type, 
+				      vfsResultPtr);
+		if (returnVal != TCL_OK) {
+		    Tcl_DecrRefCount(vfsResultPtr);
+		    vfsResultPtr = NULL;
+		}
+	    }
+	} else {
+	    returnVal = VfsCallbackEval(&cb);
+	    if (returnVal == TCL_OK) {
+		returnVal = VfsMatchStatResult(&cb, type);
+	    }
+	}
+	if (returnVal != TCLVFS_POSIXERROR && vfsResultPtr == NULL) {
+	    /* 
+	     * Keep the result alive past the restore below; we never
+	     * modify it, so there is no need to copy it.
+	     */
+	    vfsResultPtr = Tcl_GetObjResult(interp);
+	    Tcl_IncrRefCount(vfsResultPtr);
+	}
+	if (cacheable) {
+	    if (returnVal == TCL_OK) {
+		VfsMount *mountPtr = cb.mountPtr;
+		VfsGlobCacheEntry *globPtr;
+		Tcl_HashEntry *hPtr;
+		VfsKey key;
+		CONST char *str;
+		int len, isNew;
+		
+		if (mountPtr->globCache == NULL) {
+		    mountPtr->globCache = (Tcl_HashTable*) 
+			    ckalloc(sizeof(Tcl_HashTable));
+		    Tcl_InitCustomHashTable(mountPtr->globCache, 
+					    TCL_CUSTOM_TYPE_KEYS, &vfsKeyType);
+		}
+		str = Tcl_GetStringFromObj(vfsResultPtr, &len);
+		globPtr = (VfsGlobCacheEntry*) 
+			ckalloc(sizeof(VfsGlobCacheEntry) + (unsigned) len);
+		globPtr->stamp = VfsCacheNow();
+		globPtr->length = len;
+		memcpy(globPtr->result, str, (size_t) len + 1);
+		key.string = Tcl_DStringValue(&cacheKey);
+		key.length = Tcl_DStringLength(&cacheKey);
+		hPtr = Tcl_CreateHashEntry(mountPtr->globCache, (char*)&key, 
+					   &isNew);
+		if (!isNew) {
+		    VfsCacheDrop((VfsCacheLink*) Tcl_GetHashValue(hPtr));
+		    hPtr = Tcl_CreateHashEntry(mountPtr->globCache, 
+					       (char*)&key, &isNew);
+		}
+		Tcl_SetHashValue(hPtr, (ClientData)globPtr);
+		VfsCacheAdd(mountPtr, hPtr, &globPtr->link, (int)
+			(sizeof(VfsGlobCacheEntry) + sizeof(Tcl_HashEntry)
+			 + len + key.length));
+	    }
+	    Tcl_DStringFree(&cacheKey);
+	}
+	Tcl_RestoreResult(interp, &savedResult);
+	VfsCallbackStats(&cb, returnVal);
+	VfsCallbackFree(&cb);
+
+	if (vfsResultPtr != NULL) {
+	    if (returnVal == TCL_OK) {
+		Tcl_ListObjAppendList(cmdInterp, returnPtr, vfsResultPtr);
+	    } else if (cmdInterp != NULL) {
+		Tcl_SetObjResult(cmdInterp, vfsResultPtr);
+	    }
+	    Tcl_DecrRefCount(vfsResultPtr);
+	}
+	return returnVal;
+    }
 }
 
 static int
-VfsStat(pathPtr, bufPtr)
-    Tcl_Obj *pathPtr;		/* Path of file to stat (in current CP). */
-    Tcl_StatBuf *bufPtr;	/* Filled with results of stat call. */
+VfsDeleteFile(
+    Tcl_Obj *pathPtr)		/* Pathname of file to be removed */
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "stat", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_DELETEFILE, sharedPtr, pathPtr);
+	return VfsRemoteDispatch(&call);
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_DELETEFILE, pathPtr) != TCL_OK) {
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_SaveResult(interp, &savedResult);
     /* Now we execute this mount point's callback. */
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal == TCL_OK) {
-	int statListLength;
-	Tcl_Obj* resPtr = Tcl_GetObjResult(interp);
-	if (Tcl_ListObjLength(interp, resPtr, &statListLength) == TCL_ERROR) {
-	    returnVal = TCL_ERROR;
-	} else if (statListLength & 1) {
-	    /* It is odd! */
-	    returnVal = TCL_ERROR;
-	} else {
-	    /* 
-	     * The st_mode field is set part by the 'mode'
-	     * and part by the 'type' stat fields.
-	     */
-	    bufPtr->st_mode = 0;
-	    while (statListLength > 0) {
-		Tcl_Obj *field, *val;
-		char *fieldName;
-		statListLength -= 2;
-		Tcl_ListObjIndex(interp, resPtr, statListLength, &field);
-		Tcl_ListObjIndex(interp, resPtr, statListLength+1, &val);
-		fieldName = Tcl_GetString(field);
-		if (!strcmp(fieldName,"dev")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_dev = v;
-		} else if (!strcmp(fieldName,"ino")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_ino = (unsigned short)v;
-		} else if (!strcmp(fieldName,"mode")) {
-		    int v;
-		    if (Tcl_GetIntFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_mode |= v;
-		} else if (!strcmp(fieldName,"nlink")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_nlink = (short)v;
-		} else if (!strcmp(fieldName,"uid")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_uid = (short)v;
-		} else if (!strcmp(fieldName,"gid")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_gid = (short)v;
-		} else if (!strcmp(fieldName,"size")) {
-		    Tcl_WideInt v;
-		    if (Tcl_GetWideIntFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_size = v;
-		} else if (!strcmp(fieldName,"atime")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_atime = v;
-		} else if (!strcmp(fieldName,"mtime")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_mtime = v;
-		} else if (!strcmp(fieldName,"ctime")) {
-		    long v;
-		    if (Tcl_GetLongFromObj(interp, val, &v) != TCL_OK) {
-			returnVal = TCL_ERROR;
-			break;
-		    }
-		    bufPtr->st_ctime = v;
-		} else if (!strcmp(fieldName,"type")) {
-		    char *str;
-		    str = Tcl_GetString(val);
-		    if (!strcmp(str,"directory")) {
-			bufPtr->st_mode |= S_IFDIR;
-		    } else if (!strcmp(str,"file")) {
-			bufPtr->st_mode |= S_IFREG;
-#ifdef S_ISLNK
-		    } else if (!strcmp(str,"link")) {
-			bufPtr->st_mode |= S_IFLNK;
-#endif
-		    } else {
-			/* 
-			 * Do nothing.  This means we do not currently
-			 * support anything except files and directories
-			 */
-		    }
-		} else {
-		    /* Ignore additional stat arguments */
-		}
-	    }
-	}
+    Tcl_SaveResult(interp, &savedResult);
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_DeleteFileProc *deleteFileProc = VfsDriverProc(cb.mountPtr, deleteFileProc);
+	returnVal = (deleteFileProc == NULL) ? VfsNoDriverProc() 
+		: deleteFileProc(VfsDriverArgs(&cb));
+    } else {
+	returnVal = VfsCallbackEval(&cb);
     }
-    
     if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
 	VfsInternalError(interp);
     }
-
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
-    
-    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
-	Tcl_SetErrno(ENOENT);
-        return TCLVFS_POSIXERROR;
-    } else {
-	return returnVal;
-    }
+    VfsCallbackInvalidate(&cb, 0);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+    return returnVal;
 }
 
 static int
-VfsAccess(pathPtr, mode)
-    Tcl_Obj *pathPtr;		/* Path of file to access (in current CP). */
-    int mode;                   /* Permission setting. */
+VfsCreateDirectory(
+    Tcl_Obj *pathPtr)		/* Pathname of directory to create */
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "access", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_CREATEDIRECTORY, sharedPtr, pathPtr);
+	return VfsRemoteDispatch(&call);
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_CREATEDIRECTORY, pathPtr) != TCL_OK) {
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(mode));
     /* Now we execute this mount point's callback. */
     Tcl_SaveResult(interp, &savedResult);
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_CreateDirectoryProc *createDirectoryProc = VfsDriverProc(cb.mountPtr, createDirectoryProc);
+	returnVal = (createDirectoryProc == NULL) ? VfsNoDriverProc() 
+		: createDirectoryProc(VfsDriverArgs(&cb));
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
     if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
 	VfsInternalError(interp);
     }
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
+    VfsCallbackInvalidate(&cb, 0);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+    return returnVal;
+}
 
-    if (returnVal != 0) {
-	Tcl_SetErrno(ENOENT);
-	return TCLVFS_POSIXERROR;
+static int
+VfsRemoveDirectory(
+    Tcl_Obj *pathPtr,		/* Pathname of directory to be removed
+				 * (UTF-8). */
+    int recursive,		/* If non-zero, removes directories that
+				 * are nonempty.  Otherwise, will only remove
+				 * empty directories. */
+    Tcl_Obj **errorPtr)	        /* Location to store name of file
+				 * causing error. */
+{
+    VfsCallback cb;
+    Tcl_SavedResult savedResult;
+    int returnVal;
+    Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
+    
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_REMOVEDIRECTORY, sharedPtr, pathPtr);
+	call.intArg = recursive;
+	returnVal = VfsRemoteDispatch(&call);
     } else {
-	return returnVal;
-    }
-}
+	if (VfsCallbackInit(&cb, VFS_OP_REMOVEDIRECTORY, pathPtr) != TCL_OK) {
+	    return TCLVFS_POSIXERROR;
+	}
+	interp = cb.interp;
 
-static Tcl_Obj*
-VfsGetMode(int mode) {
-    Tcl_Obj *ret = Tcl_NewObj();
-    if (mode & O_RDONLY) {
-        Tcl_AppendToObj(ret, "r", 1);
-    } else if (mode & O_WRONLY || mode & O_RDWR) {
-	if (mode & O_TRUNC) {
-	    Tcl_AppendToObj(ret, "w", 1);
+	VfsCallbackAppend(&cb, VfsIntObj(recursive));
+	/* Now we execute this mount point's callback. */
+	Tcl_SaveResult(interp, &savedResult);
+	if (cb.mountPtr->driverPtr != NULL) {
+	    Vfs_RemoveDirectoryProc *removeDirectoryProc = VfsDriverProc(cb.mountPtr, removeDirectoryProc);
+	    returnVal = (removeDirectoryProc == NULL) ? VfsNoDriverProc() 
+		    : removeDirectoryProc(VfsDriverArgs(&cb), recursive);
 	} else {
-	    Tcl_AppendToObj(ret, "a", 1);
+	    returnVal = VfsCallbackEval(&cb);
 	}
-	if (mode & O_RDWR) {
-	    Tcl_AppendToObj(ret, "+", 1);
+	if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
+	    VfsInternalError(interp);
 	}
+	Tcl_RestoreResult(interp, &savedResult);
+	VfsCallbackInvalidate(&cb, recursive);
+	VfsCallbackStats(&cb, returnVal);
+	VfsCallbackFree(&cb);
+    }
+
+    if (returnVal == TCL_ERROR) {
+	/* Assume there was a problem with the directory being non-empty */
+        if (errorPtr != NULL) {
+            *errorPtr = pathPtr;
+	    Tcl_IncrRefCount(*errorPtr);
+        }
+	Tcl_SetErrno(EEXIST);
     }
-    return ret;
+    return returnVal;
 }
 
-static Tcl_Channel
-VfsOpenFileChannel(cmdInterp, pathPtr, mode, permissions)
-    Tcl_Interp *cmdInterp;              /* Interpreter for error reporting;
-					 * can be NULL. */
-    Tcl_Obj *pathPtr;                   /* Name of file to open. */
-    int mode;             		/* POSIX open mode. */
-    int permissions;                    /* If the open involves creating a
-					 * file, with what modes to create
-					 * it? */
+static int
+VfsCopyFile(
+    Tcl_Obj *srcPathPtr,	/* Pathname of file to be copied */
+    Tcl_Obj *destPathPtr)	/* Pathname of file to copy to */
 {
-    Tcl_Channel chan = NULL;
-    Tcl_Obj *mountCmd = NULL;
-    Tcl_Obj *closeCallback = NULL;
-    Tcl_SavedResult savedResult;
-    int returnVal;
-    Tcl_Interp* interp;
-    
-    mountCmd = VfsBuildCommandForPath(&interp, "open", pathPtr);
-    if (mountCmd == NULL) {
-	return NULL;
-    }
+    return VfsCopyOrRename(VFS_OP_COPYFILE, srcPathPtr, destPathPtr, NULL);
+}
 
-    Tcl_ListObjAppendElement(interp, mountCmd, VfsGetMode(mode));
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(permissions));
-    Tcl_SaveResult(interp, &savedResult);
-    /* Now we execute this mount point's callback. */
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal == TCL_OK) {
-	int reslen;
-	Tcl_Obj *resultObj;
-	/* 
-	 * There may be file channel leaks on these two 
-	 * error conditions, if the open command actually
-	 * created a channel, but then passed us a bogus list.
-	 */
-	resultObj =  Tcl_GetObjResult(interp);
-	if ((Tcl_ListObjLength(interp, resultObj, &reslen) == TCL_ERROR) 
-	  || (reslen > 2) || (reslen == 0)) {
-	    returnVal = TCL_ERROR;
-	} else {
-	    Tcl_Obj *element;
-	    Tcl_ListObjIndex(interp, resultObj, 0, &element);
-	    chan = Tcl_GetChannel(interp, Tcl_GetString(element), 0);
-	    
-	    if (chan == NULL) {
-	        returnVal = TCL_ERROR;
-	    } else {
-		if (reslen == 2) {
-		    Tcl_ListObjIndex(interp, resultObj, 1, &element);
-		    closeCallback = element;
-		    Tcl_IncrRefCount(closeCallback);
-		}
-	    }
+static int
+VfsRenameFile(
+    Tcl_Obj *srcPathPtr,	/* Pathname of file or dir to be renamed */
+    Tcl_Obj *destPathPtr)	/* New pathname of file or directory */
+{
+    return VfsCopyOrRename(VFS_OP_RENAMEFILE, srcPathPtr, destPathPtr, NULL);
+}
+
+static int
+VfsCopyDirectory(
+    Tcl_Obj *srcPathPtr,	/* Pathname of directory to be copied */
+    Tcl_Obj *destPathPtr,	/* Pathname of target directory */
+    Tcl_Obj **errorPtr)		/* Location to store name of file
+				 * causing error. */
+{
+    return VfsCopyOrRename(VFS_OP_COPYDIRECTORY, srcPathPtr, destPathPtr, 
+			   errorPtr);
+}
+
+#ifdef VFS_MEMFD_LOAD
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsLoadFile --
+ *
+ *	Load a shared library from a mount, by reading it into a
+ *	memory file (or finding one already holding the same bytes)
+ *	and passing /proc/self/fd/N to the native filesystem's load
+ *	proc.  This avoids writing a temporary copy, which costs disk
+ *	writes and fails where the temporary directory is noexec.
+ *
+ * Results:
+ *	A standard Tcl result, with the handle and unload proc of the
+ *	native filesystem.  If no memory file can be made, fails with
+ *	EXDEV, so that Tcl falls back to a temporary copy.
+ *
+ * Side effects:
+ *	May add to 'loadedLibs'.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsLoadFile(Tcl_Interp *interp, Tcl_Obj *pathPtr, Tcl_LoadHandle *handlePtr,
+	    Tcl_FSUnloadFileProc **unloadProcPtr, int flags) {
+    Tcl_Channel chan;
+    CONST86 Tcl_Filesystem *fsPtr;
+    Tcl_Obj *fdPathPtr;
+    Tcl_WideUInt hash;
+    VfsLoadedLib *libPtr;
+    char *buffer = NULL, fdPath[32];
+    int size = 0, avail = 0, got, fd = -1, i, result;
+
+    chan = Tcl_FSOpenFileChannel(interp, pathPtr, "r", 0);
+    if (chan == NULL) {
+	return TCL_ERROR;
+    }
+    Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    do {
+	if (avail - size < VFS_LOAD_CHUNK) {
+	    avail = (avail == 0) ? VFS_LOAD_CHUNK : 2 * avail;
+	    buffer = ckrealloc(buffer, (unsigned) avail);
 	}
-	Tcl_RestoreResult(interp, &savedResult);
-    } else {
-	/* Leave an error message if the cmdInterp is non NULL */
-	if (cmdInterp != NULL) {
-	    if (returnVal == TCLVFS_POSIXERROR) {
-		Tcl_ResetResult(cmdInterp);
-		Tcl_AppendResult(cmdInterp, "couldn't open \"", 
-				 Tcl_GetString(pathPtr), "\": ",
-				 Tcl_PosixError(cmdInterp), (char *) NULL);
-	    } else {
-		Tcl_Obj* error = Tcl_GetObjResult(interp);
-		/* 
-		 * Copy over the error message to cmdInterp,
-		 * duplicating it in case of threading issues.
-		 */
-		Tcl_SetObjResult(cmdInterp, Tcl_DuplicateObj(error));
-	    }
-	} else {
-	    /* Report any error, since otherwise it is lost */
-	    if (returnVal != TCLVFS_POSIXERROR) {
-		VfsInternalError(interp);
+	got = Tcl_Read(chan, buffer + size, avail - size);
+	if (got < 0) {
+	    if (interp != NULL) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "error reading \"", 
+			Tcl_GetString(pathPtr), "\": ", 
+			Tcl_PosixError(interp), (char *) NULL);
 	    }
+	    Tcl_Close(NULL, chan);
+	    ckfree(buffer);
+	    return TCL_ERROR;
 	}
-	if (interp == cmdInterp) {
-	    /* 
-	     * We want our error message to propagate up,
-	     * so we want to forget this result
-	     */
-	    Tcl_DiscardResult(&savedResult);
-	} else {
-	    Tcl_RestoreResult(interp, &savedResult);
-	}
+	size += got;
+    } while (got > 0);
+    Tcl_Close(NULL, chan);
+
+    hash = ((Tcl_WideUInt) 0xcbf29ce4 << 32) | 0x84222325;
+    for (i = 0; i < size; i++) {
+	hash = (hash ^ (unsigned char) buffer[i]) 
+		* (((Tcl_WideUInt) 1 << 40) | 0x1b3);
     }
 
-    Tcl_DecrRefCount(mountCmd);
+    Tcl_MutexLock(&vfsLoadMutex);
+    for (libPtr = loadedLibs; libPtr != NULL; libPtr = libPtr->nextPtr) {
+	if (libPtr->hash == hash && libPtr->size == size) {
+	    void *map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, 
+			     libPtr->fd, 0);
 
-    if (chan != NULL) {
-	/*
-	 * We got the Channel from some Tcl code.  This means it was
-	 * registered with the interpreter.  But we want a pristine
-	 * channel which hasn't been registered with anyone.  We use
-	 * Tcl_DetachChannel to do this for us.  We must use the
-	 * correct interpreter.
-	 */
-	if (Tcl_IsStandardChannel(chan)) {
-	    /*
-	     * If we have somehow ended up with a VFS channel being a std
-	     * channel, it is likely auto-inherited, which we need to reverse.
-	     * [Bug 1468291]
-	     */
-	    if (chan == Tcl_GetStdChannel(TCL_STDIN)) {
-		Tcl_SetStdChannel(NULL, TCL_STDIN);
-	    } else if (chan == Tcl_GetStdChannel(TCL_STDOUT)) {
-		Tcl_SetStdChannel(NULL, TCL_STDOUT);
-	    } else if (chan == Tcl_GetStdChannel(TCL_STDERR)) {
-		Tcl_SetStdChannel(NULL, TCL_STDERR);
+	    if (map != MAP_FAILED) {
+		if (memcmp(map, buffer, (size_t) size) == 0) {
+		    fd = libPtr->fd;
+		}
+		munmap(map, (size_t) size);
+	    }
+	    if (fd != -1) {
+		break;
 	    }
-	    Tcl_UnregisterChannel(NULL, chan);
 	}
-	Tcl_DetachChannel(interp, chan);
+    }
+    if (fd == -1) {
+	CONST char *tail = strrchr(Tcl_GetString(pathPtr), '/');
+	int written = 0;
 
-	if (closeCallback != NULL) {
-	    VfsChannelCleanupInfo *channelRet = NULL;
-	    channelRet = (VfsChannelCleanupInfo*) 
-			    ckalloc(sizeof(VfsChannelCleanupInfo));
-	    channelRet->channel = chan;
-	    channelRet->interp = interp;
-	    channelRet->closeCallback = closeCallback;
-	    /* The channelRet structure will be freed in the callback */
-	    Tcl_CreateCloseHandler(chan, &VfsCloseProc, 
-				   (ClientData)channelRet);
+	fd = (int) syscall(SYS_memfd_create, 
+			   (tail == NULL) ? "vfs" : tail + 1, MFD_CLOEXEC);
+	while (fd != -1 && written < size) {
+	    got = write(fd, buffer + written, (size_t) (size - written));
+	    if (got > 0) {
+		written += got;
+	    } else if (got < 0 && errno != EINTR) {
+		close(fd);
+		fd = -1;
+	    }
+	}
+	if (fd != -1) {
+	    libPtr = (VfsLoadedLib*) ckalloc(sizeof(VfsLoadedLib));
+	    libPtr->hash = hash;
+	    libPtr->size = size;
+	    libPtr->fd = fd;
+	    libPtr->nextPtr = loadedLibs;
+	    loadedLibs = libPtr;
 	}
     }
-    return chan;
+    Tcl_MutexUnlock(&vfsLoadMutex);
+    ckfree(buffer);
+
+    if (fd == -1) {
+	Tcl_SetErrno(EXDEV);
+	return TCL_ERROR;
+    }
+    sprintf(fdPath, "/proc/self/fd/%d", fd);
+    fdPathPtr = Tcl_NewStringObj(fdPath, -1);
+    Tcl_IncrRefCount(fdPathPtr);
+    fsPtr = Tcl_FSGetFileSystemForPath(fdPathPtr);
+    if (fsPtr == NULL || fsPtr->loadFileProc == NULL 
+	    || fsPtr == &vfsFilesystem) {
+	Tcl_SetErrno(EXDEV);
+	result = TCL_ERROR;
+    } else {
+	result = ((VfsLoadFileProc2 *) fsPtr->loadFileProc)(interp, 
+		fdPathPtr, handlePtr, unloadProcPtr, flags);
+    }
+    Tcl_DecrRefCount(fdPathPtr);
+    return result;
 }
+#endif /* VFS_MEMFD_LOAD */
 
-/* 
- * IMPORTANT: This procedure must *not* modify the interpreter's result
- * this leads to the objResultPtr being corrupted (somehow), and curious
- * crashes in the future (which are very hard to debug ;-).
- * 
- * This is particularly important since we are evaluating arbitrary
- * Tcl code in the callback.
- * 
- * Also note we are relying on the close-callback to occur just before
- * the channel is about to be properly closed, but after all output
- * has been flushed.  That way we can, in the callback, read in the
- * entire contents of the channel and, say, compress it for storage
- * into a tclkit or zip archive.
+#ifdef VFS_USDT
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsProbeFs --
+ *
+ *	Fire the fs__entry probe for an operation on a path or, if
+ *	'isReturn' is set, the fs__return probe with its result.  Only
+ *	called while the probe is enabled.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May split the path into its root and relative parts.
+ *
+ *----------------------------------------------------------------------
  */
-static void 
-VfsCloseProc(ClientData clientData) {
-    VfsChannelCleanupInfo * channelRet = (VfsChannelCleanupInfo*) clientData;
-    int returnVal;
-    Tcl_SavedResult savedResult;
-    Tcl_Channel chan = channelRet->channel;
-    Tcl_Interp * interp = channelRet->interp;
 
-    Tcl_SaveResult(interp, &savedResult);
+static void
+VfsProbeFs(int isReturn, int op, Tcl_Obj *pathPtr, int result) {
+    VfsNativeRep *nativeRep = VfsGetRelativePath(pathPtr);
+    CONST char *mount = NULL, *relative = NULL;
 
-    /* 
-     * The interpreter needs to know about the channel, else the Tcl
-     * callback will fail, so we register the channel (this allows
-     * the Tcl code to use the channel's string-name).
-     */
-    if (!Tcl_IsStandardChannel(chan)) {
-	Tcl_RegisterChannel(interp, chan);
+    if (nativeRep != NULL) {
+	mount = Tcl_GetString(nativeRep->rootObj);
+	relative = Tcl_GetString(nativeRep->relativeObj);
+    }
+    if (isReturn) {
+	VfsProbe4(fs__return, vfsOpNames[op], mount, relative, result);
+    } else {
+	VfsProbe3(fs__entry, vfsOpNames[op], mount, relative);
     }
+}
 
-    if (!(Tcl_GetChannelMode(chan) & TCL_READABLE)) {
-	/* 
-	 * We need to make this channel readable, since tclvfs
-	 * documents that close callbacks are allowed to read
-	 * from the channels we create.
-	 */
-	
-	/* Currently if we reach here we have a bug */
+#define VfsProbeEntry(op, pathPtr) \
+    if (VfsProbeEnabled(fs__entry)) { \
+	VfsProbeFs(0, (op), (pathPtr), 0); \
     }
-    
-    returnVal = Tcl_EvalObjEx(interp, channelRet->closeCallback, 
-		  TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal != TCL_OK) {
-	VfsInternalError(interp);
+#define VfsProbeReturn(op, pathPtr, result) \
+    if (VfsProbeEnabled(fs__return)) { \
+	VfsProbeFs(1, (op), (pathPtr), (result)); \
     }
-    Tcl_DecrRefCount(channelRet->closeCallback);
 
-    /* 
-     * More complications; we can't just unregister the channel,
-     * because it is in the middle of being cleaned up, and the cleanup
-     * code doesn't like a channel to be closed again while it is
-     * already being closed.  So, we do the same trick as above to
-     * unregister it without cleanup.
-     */
-    if (!Tcl_IsStandardChannel(chan)) {
-	Tcl_DetachChannel(interp, chan);
-    }
+static int
+VfsProbedStat(Tcl_Obj *pathPtr, Tcl_StatBuf *bufPtr) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_STAT, pathPtr);
+    result = VfsStat(pathPtr, bufPtr);
+    VfsProbeReturn(VFS_OP_STAT, pathPtr, result);
+    return result;
+}
+
+static int
+VfsProbedAccess(Tcl_Obj *pathPtr, int mode) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_ACCESS, pathPtr);
+    result = VfsAccess(pathPtr, mode);
+    VfsProbeReturn(VFS_OP_ACCESS, pathPtr, result);
+    return result;
+}
+
+static Tcl_Channel
+VfsProbedOpenFileChannel(Tcl_Interp *cmdInterp, Tcl_Obj *pathPtr, 
+			 int mode, int permissions) {
+    Tcl_Channel chan;
+
+    VfsProbeEntry(VFS_OP_OPEN, pathPtr);
+    chan = VfsOpenFileChannel(cmdInterp, pathPtr, mode, permissions);
+    VfsProbeReturn(VFS_OP_OPEN, pathPtr, (chan == NULL) ? -1 : 0);
+    return chan;
+}
+
+static int
+VfsProbedMatchInDirectory(Tcl_Interp *cmdInterp, Tcl_Obj *returnPtr, 
+	Tcl_Obj *dirPtr, CONST char *pattern, Tcl_GlobTypeData *types) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_MATCHINDIRECTORY, dirPtr);
+    result = VfsMatchInDirectory(cmdInterp, returnPtr, dirPtr, pattern, 
+				 types);
+    VfsProbeReturn(VFS_OP_MATCHINDIRECTORY, dirPtr, 
+		   (result == TCL_OK) ? 0 : -1);
+    return result;
+}
+
+static int
+VfsProbedDeleteFile(Tcl_Obj *pathPtr) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_DELETEFILE, pathPtr);
+    result = VfsDeleteFile(pathPtr);
+    VfsProbeReturn(VFS_OP_DELETEFILE, pathPtr, result);
+    return result;
+}
+
+static int
+VfsProbedCreateDirectory(Tcl_Obj *pathPtr) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_CREATEDIRECTORY, pathPtr);
+    result = VfsCreateDirectory(pathPtr);
+    VfsProbeReturn(VFS_OP_CREATEDIRECTORY, pathPtr, result);
+    return result;
+}
+
+static int
+VfsProbedRemoveDirectory(Tcl_Obj *pathPtr, int recursive, 
+			 Tcl_Obj **errorPtr) {
+    int result;
 
-    Tcl_RestoreResult(interp, &savedResult);
-    ckfree((char*)channelRet);
+    VfsProbeEntry(VFS_OP_REMOVEDIRECTORY, pathPtr);
+    result = VfsRemoveDirectory(pathPtr, recursive, errorPtr);
+    VfsProbeReturn(VFS_OP_REMOVEDIRECTORY, pathPtr, result);
+    return result;
+}
+
+static CONST char * CONST86 *
+VfsProbedFileAttrStrings(Tcl_Obj *pathPtr, Tcl_Obj **objPtrRef) {
+    CONST char * CONST86 *result;
+
+    VfsProbeEntry(VFS_OP_FILEATTRIBUTES, pathPtr);
+    result = VfsFileAttrStrings(pathPtr, objPtrRef);
+    VfsProbeReturn(VFS_OP_FILEATTRIBUTES, pathPtr, 
+		   (result == NULL && *objPtrRef == NULL) ? -1 : 0);
+    return result;
 }
 
 static int
-VfsMatchInDirectory(
-    Tcl_Interp *cmdInterp,	/* Interpreter to receive error msgs. */
-    Tcl_Obj *returnPtr,		/* Object to receive results. */
-    Tcl_Obj *dirPtr,	        /* Contains path to directory to search. */
-    CONST char *pattern,	/* Pattern to match against. */
-    Tcl_GlobTypeData *types)	/* Object containing list of acceptable types.
-				 * May be NULL. */
-{
-    if ((types != NULL) && (types->type & TCL_GLOB_TYPE_MOUNT)) {
-	VfsMount *mountIter;
-	int len;
-	CONST char *prefix;
-	ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+VfsProbedFileAttrsGet(Tcl_Interp *cmdInterp, int index, Tcl_Obj *pathPtr,
+		      Tcl_Obj **objPtrRef) {
+    int result;
 
-	prefix = Tcl_GetStringFromObj(Tcl_FSGetNormalizedPath(NULL, dirPtr), 
-				      &len);
-	if (prefix[len-1] == '/') {
-	    /* 
-	     * It's a root directory; we must subtract one for
-	     * our comparisons below
-	     */
-	    len--;
-	}
+    VfsProbeEntry(VFS_OP_FILEATTRIBUTES, pathPtr);
+    result = VfsFileAttrsGet(cmdInterp, index, pathPtr, objPtrRef);
+    VfsProbeReturn(VFS_OP_FILEATTRIBUTES, pathPtr, 
+		   (result == TCL_OK) ? 0 : -1);
+    return result;
+}
 
-	/* Build list of mounts */
-	mountIter = tsdPtr->listOfMounts;
-	while (mountIter != NULL) {
-	    if (mountIter->mountLen > (len+1) 
-		&& !strncmp(mountIter->mountPoint, prefix, (size_t)len) 
-		&& mountIter->mountPoint[len] == '/'
-		&& strchr(mountIter->mountPoint+len+1, '/') == NULL
-		&& Tcl_StringCaseMatch(mountIter->mountPoint+len+1, 
-				       pattern, 0)) {
-		Tcl_Obj* mount = Tcl_NewStringObj(mountIter->mountPoint, 
-						  mountIter->mountLen);
-		Tcl_ListObjAppendElement(NULL, returnPtr, mount);
-	    }
-	    mountIter = mountIter->nextMount;
-	}
-	return TCL_OK;
-    } else {
-	Tcl_Obj *mountCmd = NULL;
-	Tcl_SavedResult savedResult;
-	int returnVal;
-	Tcl_Interp* interp;
-	int type = 0;
-	Tcl_Obj *vfsResultPtr = NULL;
-	
-	mountCmd = VfsBuildCommandForPath(&interp, "matchindirectory", dirPtr);
-	if (mountCmd == NULL) {
-	    return TCLVFS_POSIXERROR;
-	}
+static int
+VfsProbedFileAttrsSet(Tcl_Interp *cmdInterp, int index, Tcl_Obj *pathPtr,
+		      Tcl_Obj *objPtr) {
+    int result;
 
-	if (types != NULL) {
-	    type = types->type;
-	}
+    VfsProbeEntry(VFS_OP_FILEATTRIBUTES, pathPtr);
+    result = VfsFileAttrsSet(cmdInterp, index, pathPtr, objPtr);
+    VfsProbeReturn(VFS_OP_FILEATTRIBUTES, pathPtr, 
+		   (result == TCL_OK) ? 0 : -1);
+    return result;
+}
 
-	if (pattern == NULL) {
-	    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewObj());
-	} else {
-	    Tcl_ListObjAppendElement(interp, mountCmd, 
-				     Tcl_NewStringObj(pattern,-1));
-	}
-	Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(type));
-	Tcl_SaveResult(interp, &savedResult);
-	/* Now we execute this mount point's callback. */
-	returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-				  TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-	if (returnVal != TCLVFS_POSIXERROR) {
-	    vfsResultPtr = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
-	}
-	Tcl_RestoreResult(interp, &savedResult);
-	Tcl_DecrRefCount(mountCmd);
+static int
+VfsProbedUtime(Tcl_Obj *pathPtr, struct utimbuf *tval) {
+    int result;
 
-	if (vfsResultPtr != NULL) {
-	    if (returnVal == TCL_OK) {
-		Tcl_IncrRefCount(vfsResultPtr);
-		Tcl_ListObjAppendList(cmdInterp, returnPtr, vfsResultPtr);
-		Tcl_DecrRefCount(vfsResultPtr);
-	    } else {
-		if (cmdInterp != NULL) {
-		    Tcl_SetObjResult(cmdInterp, vfsResultPtr);
-		} else {
-		    Tcl_DecrRefCount(vfsResultPtr);
-		}
-	    }
-	}
-	return returnVal;
-    }
+    VfsProbeEntry(VFS_OP_UTIME, pathPtr);
+    result = VfsUtime(pathPtr, tval);
+    VfsProbeReturn(VFS_OP_UTIME, pathPtr, result);
+    return result;
 }
 
+/* Copies and renames are reported against their source path */
+
 static int
-VfsDeleteFile(
-    Tcl_Obj *pathPtr)		/* Pathname of file to be removed */
-{
-    Tcl_Obj *mountCmd = NULL;
-    Tcl_SavedResult savedResult;
-    int returnVal;
-    Tcl_Interp* interp;
-    
-    mountCmd = VfsBuildCommandForPath(&interp, "deletefile", pathPtr);
-    if (mountCmd == NULL) {
-	return TCLVFS_POSIXERROR;
-    }
+VfsProbedCopyFile(Tcl_Obj *srcPathPtr, Tcl_Obj *destPathPtr) {
+    int result;
 
-    /* Now we execute this mount point's callback. */
-    Tcl_SaveResult(interp, &savedResult);
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
-	VfsInternalError(interp);
-    }
-    Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
-    return returnVal;
+    VfsProbeEntry(VFS_OP_COPYFILE, srcPathPtr);
+    result = VfsCopyFile(srcPathPtr, destPathPtr);
+    VfsProbeReturn(VFS_OP_COPYFILE, srcPathPtr, result);
+    return result;
 }
 
 static int
-VfsCreateDirectory(
-    Tcl_Obj *pathPtr)		/* Pathname of directory to create */
-{
-    Tcl_Obj *mountCmd = NULL;
-    Tcl_SavedResult savedResult;
-    int returnVal;
-    Tcl_Interp* interp;
-    
-    mountCmd = VfsBuildCommandForPath(&interp, "createdirectory", pathPtr);
-    if (mountCmd == NULL) {
-	return TCLVFS_POSIXERROR;
-    }
+VfsProbedRenameFile(Tcl_Obj *srcPathPtr, Tcl_Obj *destPathPtr) {
+    int result;
 
-    /* Now we execute this mount point's callback. */
-    Tcl_SaveResult(interp, &savedResult);
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
-	VfsInternalError(interp);
-    }
-    Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
-    return returnVal;
+    VfsProbeEntry(VFS_OP_RENAMEFILE, srcPathPtr);
+    result = VfsRenameFile(srcPathPtr, destPathPtr);
+    VfsProbeReturn(VFS_OP_RENAMEFILE, srcPathPtr, result);
+    return result;
 }
 
 static int
-VfsRemoveDirectory(
-    Tcl_Obj *pathPtr,		/* Pathname of directory to be removed
-				 * (UTF-8). */
-    int recursive,		/* If non-zero, removes directories that
-				 * are nonempty.  Otherwise, will only remove
-				 * empty directories. */
-    Tcl_Obj **errorPtr)	        /* Location to store name of file
-				 * causing error. */
-{
-    Tcl_Obj *mountCmd = NULL;
+VfsProbedCopyDirectory(Tcl_Obj *srcPathPtr, Tcl_Obj *destPathPtr, 
+		       Tcl_Obj **errorPtr) {
+    int result;
+
+    VfsProbeEntry(VFS_OP_COPYDIRECTORY, srcPathPtr);
+    result = VfsCopyDirectory(srcPathPtr, destPathPtr, errorPtr);
+    VfsProbeReturn(VFS_OP_COPYDIRECTORY, srcPathPtr, result);
+    return result;
+}
+#endif /* VFS_USDT */
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsCopyOrRename --
+ *
+ *	Offer a copy or rename to the mount holding both paths, as
+ *	
+ *	<mountcmd> copyfile|renamefile|copydirectory root relative \
+ *	  actualpath destrelative destactualpath
+ *	
+ *	so that a filesystem which can do this itself (a server-side
+ *	copy, or just relinking an entry) need not have Tcl read and
+ *	rewrite every byte.  Handlers are not obliged to support these:
+ *	if the paths are in different mounts, or the handler raises a
+ *	Tcl error or reports EXDEV, ENOTSUP or ENOSYS, we report EXDEV
+ *	and Tcl falls back on its generic implementation.
+ *
+ * Results:
+ *	TCL_OK on success, TCLVFS_POSIXERROR with errno EXDEV if Tcl
+ *	should fall back, or TCL_ERROR with errno set if the handler
+ *	reported any other posix error.
+ *
+ * Side effects:
+ *	Whatever the handler does.  Cached results for both paths are
+ *	discarded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsCopyOrRename(int op, Tcl_Obj *srcPathPtr, Tcl_Obj *destPathPtr,
+		Tcl_Obj **errorPtr) {
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
-    int returnVal;
+    VfsNativeRep *nativeRep;
+    VfsMount *destMountPtr;
+    Tcl_Obj *destRelative;
+    int returnVal, recursive, fallback, err = 0;
     Tcl_Interp* interp;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "removedirectory", pathPtr);
-    if (mountCmd == NULL) {
+    nativeRep = VfsGetRelativePath(destPathPtr);
+    if (nativeRep == NULL) {
+	Tcl_SetErrno(EXDEV);
+	return TCLVFS_POSIXERROR;
+    }
+    destMountPtr = nativeRep->mountPtr;
+    destRelative = nativeRep->relativeObj;
+    Tcl_IncrRefCount(destRelative);
+    
+    nativeRep = VfsGetRelativePath(srcPathPtr);
+    if (nativeRep != NULL && nativeRep->mountPtr == destMountPtr
+	    && VfsGetRemote(srcPathPtr, 0) != NULL) {
+	VfsRemoteCall call;
+	
+	Tcl_DecrRefCount(destRelative);
+	VfsRemoteInit(&call, op, destMountPtr->sharedPtr, srcPathPtr);
+	call.destPath = Tcl_GetString(destPathPtr);
+	returnVal = VfsRemoteDispatch(&call);
+	if (returnVal == TCL_ERROR && errorPtr != NULL) {
+	    *errorPtr = srcPathPtr;
+	    Tcl_IncrRefCount(*errorPtr);
+	}
+	return returnVal;
+    }
+    if (nativeRep == NULL || nativeRep->mountPtr != destMountPtr
+	    || VfsCallbackInit(&cb, op, srcPathPtr) != TCL_OK) {
+	Tcl_DecrRefCount(destRelative);
+	Tcl_SetErrno(EXDEV);
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(recursive));
+    VfsCallbackAppend(&cb, destRelative);
+    VfsCallbackAppend(&cb, destPathPtr);
     /* Now we execute this mount point's callback. */
     Tcl_SaveResult(interp, &savedResult);
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
-	VfsInternalError(interp);
+    if (cb.mountPtr->driverPtr != NULL) {
+	switch (op) {
+	    case VFS_OP_COPYFILE: {
+		Vfs_CopyFileProc *copyFileProc = 
+			VfsDriverProc(cb.mountPtr, copyFileProc);
+		returnVal = (copyFileProc == NULL) ? VfsNoDriverProc()
+			: copyFileProc(VfsDriverArgs(&cb), destRelative, 
+				       destPathPtr);
+		break;
+	    }
+	    case VFS_OP_RENAMEFILE: {
+		Vfs_RenameFileProc *renameFileProc = 
+			VfsDriverProc(cb.mountPtr, renameFileProc);
+		returnVal = (renameFileProc == NULL) ? VfsNoDriverProc()
+			: renameFileProc(VfsDriverArgs(&cb), destRelative, 
+					 destPathPtr);
+		break;
+	    }
+	    default: {
+		Vfs_CopyDirectoryProc *copyDirectoryProc = 
+			VfsDriverProc(cb.mountPtr, copyDirectoryProc);
+		returnVal = (copyDirectoryProc == NULL) ? VfsNoDriverProc()
+			: copyDirectoryProc(VfsDriverArgs(&cb), destRelative, 
+					    destPathPtr);
+		break;
+	    }
+	}
+    } else {
+	returnVal = VfsCallbackEval(&cb);
     }
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
 
-    if (returnVal == TCL_ERROR) {
-	/* Assume there was a problem with the directory being non-empty */
-        if (errorPtr != NULL) {
-            *errorPtr = pathPtr;
+    /* 
+     * Any Tcl error is taken to mean the handler has no such
+     * subcommand, so it is not reported.
+     */
+    fallback = (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR);
+    if (returnVal == TCLVFS_POSIXERROR) {
+	err = Tcl_GetErrno();
+	if (err == EXDEV || err == ENOSYS
+#ifdef ENOTSUP
+		|| err == ENOTSUP
+#endif
+		) {
+	    fallback = 1;
+	}
+    }
+    
+    if (!fallback && cb.mountPtr->cacheTtl != 0) {
+	CONST char *relative;
+	int len;
+	
+	recursive = (op != VFS_OP_COPYFILE);
+	if (op == VFS_OP_RENAMEFILE) {
+	    VfsCallbackInvalidate(&cb, recursive);
+	}
+	relative = Tcl_GetStringFromObj(destRelative, &len);
+	VfsCacheInvalidate(cb.mountPtr, relative, len, recursive);
+    }
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
+    Tcl_DecrRefCount(destRelative);
+
+    if (fallback) {
+	Tcl_SetErrno(EXDEV);
+	return TCLVFS_POSIXERROR;
+    }
+    if (returnVal == TCLVFS_POSIXERROR) {
+	/* 
+	 * A genuine failure, which must not look like the -1 with
+	 * which we ask Tcl to fall back.
+	 */
+	if (errorPtr != NULL) {
+	    *errorPtr = srcPathPtr;
 	    Tcl_IncrRefCount(*errorPtr);
-        }
-	Tcl_SetErrno(EEXIST);
+	}
+	Tcl_SetErrno(err);
+	return TCL_ERROR;
     }
-    return returnVal;
+    return TCL_OK;
 }
 
 static CONST char * CONST86 *
@@ -1681,31 +9225,61 @@ VfsFileAttrStrings(pathPtr, objPtrRef)
     Tcl_Obj* pathPtr;
     Tcl_Obj** objPtrRef;
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "fileattributes", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_FILEATTRIBUTES, sharedPtr, pathPtr);
+	*objPtrRef = NULL;
+	if (VfsRemoteDispatch(&call) == TCL_OK) {
+	    *objPtrRef = Tcl_NewStringObj(call.resultStr, -1);
+	}
+	if (call.resultStr != NULL) {
+	    ckfree(call.resultStr);
+	}
+	return NULL;
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_FILEATTRIBUTES, pathPtr) != TCL_OK) {
 	*objPtrRef = NULL;
 	return NULL;
     }
+    interp = cb.interp;
 
     Tcl_SaveResult(interp, &savedResult);
     /* Now we execute this mount point's callback. */
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    *objPtrRef = NULL;
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_FileAttrStringsProc *fileAttrStringsProc = 
+		VfsDriverProc(cb.mountPtr, fileAttrStringsProc);
+	if (fileAttrStringsProc == NULL) {
+	    /* No attributes */
+	    *objPtrRef = Tcl_NewObj();
+	    returnVal = TCL_OK;
+	} else {
+	    returnVal = fileAttrStringsProc(VfsDriverArgs(&cb), objPtrRef);
+	}
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+	if (returnVal == TCL_OK) {
+	    *objPtrRef = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+	}
+    }
     if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
 	VfsInternalError(interp);
     }
-    if (returnVal == TCL_OK) {
-	*objPtrRef = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
-    } else {
+    if (returnVal != TCL_OK && *objPtrRef != NULL) {
+	Tcl_DecrRefCount(*objPtrRef);
 	*objPtrRef = NULL;
     }
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
     return NULL;
 }
 
@@ -1716,26 +9290,56 @@ VfsFileAttrsGet(cmdInterp, index, pathPtr, objPtrRef)
     Tcl_Obj *pathPtr;		/* filename we are operating on. */
     Tcl_Obj **objPtrRef;	/* for output. */
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "fileattributes", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_FILEATTRSGET, sharedPtr, pathPtr);
+	call.intArg = index;
+	returnVal = VfsRemoteDispatch(&call);
+	*objPtrRef = NULL;
+	if (returnVal == TCL_OK) {
+	    *objPtrRef = Tcl_NewStringObj(call.resultStr, -1);
+	} else if (cmdInterp != NULL && call.resultStr != NULL) {
+	    Tcl_SetObjResult(cmdInterp, Tcl_NewStringObj(call.resultStr, -1));
+	}
+	if (call.resultStr != NULL) {
+	    ckfree(call.resultStr);
+	}
+	return returnVal;
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_FILEATTRIBUTES, pathPtr) != TCL_OK) {
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(index));
+    VfsCallbackAppend(&cb, VfsIntObj(index));
     Tcl_SaveResult(interp, &savedResult);
     /* Now we execute this mount point's callback. */
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-    if (returnVal != TCLVFS_POSIXERROR) {
-	*objPtrRef = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_FileAttrsGetProc *fileAttrsGetProc = 
+		VfsDriverProc(cb.mountPtr, fileAttrsGetProc);
+	*objPtrRef = NULL;
+	returnVal = (fileAttrsGetProc == NULL) ? VfsNoDriverProc() 
+		: fileAttrsGetProc(VfsDriverArgs(&cb), index, objPtrRef);
+	if (returnVal == TCL_ERROR) {
+	    *objPtrRef = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+	}
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+	if (returnVal != TCLVFS_POSIXERROR) {
+	    *objPtrRef = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
+	}
     }
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
     
     if (returnVal != TCLVFS_POSIXERROR) {
 	if (returnVal == TCL_OK) {
@@ -1771,29 +9375,55 @@ VfsFileAttrsSet(cmdInterp, index, pathPtr, objPtr)
     Tcl_Obj *pathPtr;		/* filename we are operating on. */
     Tcl_Obj *objPtr;		/* for input. */
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
     Tcl_Obj *errorPtr = NULL;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "fileattributes", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_FILEATTRSSET, sharedPtr, pathPtr);
+	call.intArg = index;
+	call.strArg = Tcl_GetString(objPtr);
+	returnVal = VfsRemoteDispatch(&call);
+	if (call.resultStr != NULL) {
+	    if (cmdInterp != NULL) {
+		Tcl_SetObjResult(cmdInterp, 
+				 Tcl_NewStringObj(call.resultStr, -1));
+	    }
+	    ckfree(call.resultStr);
+	}
+	return returnVal;
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_FILEATTRIBUTES, pathPtr) != TCL_OK) {
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewIntObj(index));
-    Tcl_ListObjAppendElement(interp, mountCmd, objPtr);
+    VfsCallbackAppend(&cb, VfsIntObj(index));
+    VfsCallbackAppend(&cb, objPtr);
     Tcl_SaveResult(interp, &savedResult);
     /* Now we execute this mount point's callback. */
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_FileAttrsSetProc *fileAttrsSetProc = 
+		VfsDriverProc(cb.mountPtr, fileAttrsSetProc);
+	returnVal = (fileAttrsSetProc == NULL) ? VfsNoDriverProc() 
+		: fileAttrsSetProc(VfsDriverArgs(&cb), index, objPtr);
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
     if (returnVal != TCLVFS_POSIXERROR && returnVal != TCL_OK) {
 	errorPtr = Tcl_DuplicateObj(Tcl_GetObjResult(interp));
     }
 
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
+    VfsCallbackInvalidate(&cb, 0);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
     
     if (cmdInterp != NULL) {
 	if (returnVal == TCLVFS_POSIXERROR) {
@@ -1819,27 +9449,44 @@ VfsUtime(pathPtr, tval)
     Tcl_Obj* pathPtr;
     struct utimbuf *tval;
 {
-    Tcl_Obj *mountCmd = NULL;
+    VfsCallback cb;
     Tcl_SavedResult savedResult;
     int returnVal;
     Tcl_Interp* interp;
+    VfsSharedMount *sharedPtr;
     
-    mountCmd = VfsBuildCommandForPath(&interp, "utime", pathPtr);
-    if (mountCmd == NULL) {
+    sharedPtr = VfsGetRemote(pathPtr, 0);
+    if (sharedPtr != NULL) {
+	VfsRemoteCall call;
+	VfsRemoteInit(&call, VFS_OP_UTIME, sharedPtr, pathPtr);
+	call.tval = tval;
+	return VfsRemoteDispatch(&call);
+    }
+
+    if (VfsCallbackInit(&cb, VFS_OP_UTIME, pathPtr) != TCL_OK) {
 	return TCLVFS_POSIXERROR;
     }
+    interp = cb.interp;
 
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewLongObj(tval->actime));
-    Tcl_ListObjAppendElement(interp, mountCmd, Tcl_NewLongObj(tval->modtime));
+    VfsCallbackAppend(&cb, Tcl_NewLongObj(tval->actime));
+    VfsCallbackAppend(&cb, Tcl_NewLongObj(tval->modtime));
     /* Now we execute this mount point's callback. */
     Tcl_SaveResult(interp, &savedResult);
-    returnVal = Tcl_EvalObjEx(interp, mountCmd, 
-			      TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
+    if (cb.mountPtr->driverPtr != NULL) {
+	Vfs_UtimeProc *utimeProc = VfsDriverProc(cb.mountPtr, utimeProc);
+	returnVal = (utimeProc == NULL) ? VfsNoDriverProc() 
+		: utimeProc(VfsDriverArgs(&cb), (long) tval->actime, 
+		(long) tval->modtime);
+    } else {
+	returnVal = VfsCallbackEval(&cb);
+    }
     if (returnVal != TCL_OK && returnVal != TCLVFS_POSIXERROR) {
 	VfsInternalError(interp);
     }
     Tcl_RestoreResult(interp, &savedResult);
-    Tcl_DecrRefCount(mountCmd);
+    VfsCallbackInvalidate(&cb, 0);
+    VfsCallbackStats(&cb, returnVal);
+    VfsCallbackFree(&cb);
 
     return returnVal;
 }
@@ -1850,6 +9497,7 @@ VfsListVolumes(void)
     Tcl_Obj *retVal;
     ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
 
+    VfsCheckSharedMounts(tsdPtr);
     if (tsdPtr->vfsVolumes != NULL) {
 	Tcl_IncrRefCount(tsdPtr->vfsVolumes);
 	retVal = tsdPtr->vfsVolumes;
@@ -1921,24 +9569,90 @@ Vfs_RemoveVolume(volume)
 	}
     }
 
-    return TCL_ERROR;
+    return TCL_ERROR;
+}
+
+
+/* The result of an operation a mount's driver does not implement */
+static int
+VfsNoDriverProc(void) {
+    Tcl_SetErrno(ENOSYS);
+    return TCLVFS_POSIXERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsGetRelativePath --
+ *
+ *	Find the native representation of a path in one of our
+ *	mounts, making sure its root and relative parts (as passed to
+ *	the mount's command) have been split off and cached.
+ *
+ * Results:
+ *	The native representation, or NULL if the path is not ours.
+ *
+ * Side effects:
+ *	May normalize the path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VfsNativeRep*
+VfsGetRelativePath(Tcl_Obj *pathPtr) {
+    VfsNativeRep *nativeRep;
+
+    nativeRep = VfsGetNativePath(pathPtr);
+    if (nativeRep == NULL) {
+	return NULL;
+    }
+    
+    if (nativeRep->rootObj == NULL) {
+	Tcl_Obj *normed;
+	char *normedString;
+	int len, splitPosition;
+
+	normed = Tcl_FSGetNormalizedPath(NULL, pathPtr);
+	/* Normalizing may have replaced the internal representation */
+	nativeRep = VfsGetNativePath(pathPtr);
+	if (normed == NULL || nativeRep == NULL) {
+	    return NULL;
+	}
+	normedString = Tcl_GetStringFromObj(normed, &len);
+	splitPosition = nativeRep->splitPosition;
+	if (splitPosition == len) {
+	    nativeRep->rootObj = normed;
+	    nativeRep->relativeObj = Tcl_NewStringObj("",0);
+	} else {
+	    nativeRep->rootObj = Tcl_NewStringObj(normedString,splitPosition);
+	    if ((normedString[splitPosition] != VFS_SEPARATOR) 
+		|| (VFS_SEPARATOR ==':')) {
+		/* This will occur if we mount 'ftp://' */
+		splitPosition--;
+	    }
+	    nativeRep->relativeObj = Tcl_NewStringObj(
+		    normedString+splitPosition+1, len-splitPosition-1);
+	}
+	Tcl_IncrRefCount(nativeRep->rootObj);
+	Tcl_IncrRefCount(nativeRep->relativeObj);
+    }
+
+    return nativeRep;
 }
 
-
 /*
  *----------------------------------------------------------------------
  *
- * VfsBuildCommandForPath --
+ * VfsCallbackInit --
  *
- *	Given a path object which we know belongs to the vfs, and a 
- *	command string (one of the standard filesystem operations
- *	"stat", "matchindirectory" etc), build the standard vfs
- *	Tcl command and arguments to carry out that operation.
- *	
- *	If the command is successfully built, it is returned to the
- *	caller with a refCount of 1.  The caller also needs to know
- *	which Tcl interpreter to evaluate the command in; this
- *	is returned in the 'iRef' provided.
+ *	Given a path object which we know belongs to the vfs, and an
+ *	operation (one of the standard filesystem operations "stat",
+ *	"matchindirectory" etc), prepare the standard vfs Tcl command
+ *	and arguments to carry out that operation.  Callers may then
+ *	add further arguments with VfsCallbackAppend, evaluate it with
+ *	VfsCallbackEval, and must finally call VfsCallbackFree.  The
+ *	interpreter in which the command is evaluated is returned in
+ *	cbPtr->interp.
  *	
  *	Each mount-point dictates a command prefix to use for a 
  *	particular file.  We start with that and then add 4 parameters,
@@ -1971,74 +9685,623 @@ Vfs_RemoveVolume(volume)
  *	<mountcmd> "matchindirectory" ftp:// ftp.scriptics.com \
  *	  ftp://ftp.scriptics.com
  *	  
+ *	Nothing is allocated in the common case: the command words are
+ *	placed in the mount's own 'objv' array, the operation name is
+ *	interned, and the root and relative objects are cached in the
+ *	path's internal representation.
  *	
  * Results:
- *	Returns a list containing the command, or NULL if an
- *	error occurred.  If the interpreter for this vfs command
- *	is in the process of being deleted, we always return NULL.
+ *	TCL_OK, or TCL_ERROR if the path is not in the vfs, the mount
+ *	command is not a valid list, or the interpreter for this vfs
+ *	command is in the process of being deleted.
  *
  * Side effects:
- *	None except memory allocation.
+ *	Holds references to the mount and each word of the command
+ *	until VfsCallbackFree is called.
  *
  *----------------------------------------------------------------------
  */
 
-static Tcl_Obj* 
-VfsBuildCommandForPath(Tcl_Interp **iRef, CONST char* cmd, Tcl_Obj *pathPtr) {
-    Tcl_Obj *normed;
-    Tcl_Obj *mountCmd;
-    int len;
-    int splitPosition;
-    int dummyLen;
+static int
+VfsCallbackInit(VfsCallback *cbPtr, int op, Tcl_Obj *pathPtr) {
     VfsNativeRep *nativeRep;
-    Tcl_Interp *interp;
-    
-    char *normedString;
+    VfsMount *mountPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
 
-    nativeRep = VfsGetNativePath(pathPtr);
+    nativeRep = VfsGetRelativePath(pathPtr);
     if (nativeRep == NULL) {
-	return NULL;
+	return TCL_ERROR;
     }
-    
-    interp = nativeRep->fsCmd->interp;
-    
-    if (Tcl_InterpDeleted(interp)) {
-        return NULL;
+
+    mountPtr = nativeRep->mountPtr;
+    if (mountPtr->objv == NULL || mountPtr->interpCmd.interp == NULL
+	    || Tcl_InterpDeleted(mountPtr->interpCmd.interp)) {
+        return TCL_ERROR;
     }
-    
-    splitPosition = nativeRep->splitPosition;
-    normed = Tcl_FSGetNormalizedPath(NULL, pathPtr);
-    normedString = Tcl_GetStringFromObj(normed, &len);
-    
-    mountCmd = Tcl_DuplicateObj(nativeRep->fsCmd->mountCmd);
-    Tcl_IncrRefCount(mountCmd);
-    if (Tcl_ListObjLength(NULL, mountCmd, &dummyLen) == TCL_ERROR) {
-	Tcl_DecrRefCount(mountCmd);
-	return NULL;
+
+    if (tsdPtr->pendingCloses != NULL && !tsdPtr->closeRunning
+	    && VfsCloseConflict(tsdPtr, mountPtr, op, nativeRep->relativeObj)) {
+	/* The handler must see what was written to files closed earlier */
+	VfsCloseRun(tsdPtr, mountPtr);
+	nativeRep = VfsGetRelativePath(pathPtr);
+	if (nativeRep == NULL) {
+	    return TCL_ERROR;
+	}
+	mountPtr = nativeRep->mountPtr;
+	if (mountPtr->objv == NULL || mountPtr->interpCmd.interp == NULL
+		|| Tcl_InterpDeleted(mountPtr->interpCmd.interp)) {
+	    return TCL_ERROR;
+	}
+    }
+
+    if (tsdPtr->opNames[op] == NULL) {
+	tsdPtr->opNames[op] = Tcl_NewStringObj(vfsOpNames[op], -1);
+	Tcl_IncrRefCount(tsdPtr->opNames[op]);
+    }
+
+    cbPtr->interp = mountPtr->interpCmd.interp;
+    cbPtr->mountPtr = mountPtr;
+    mountPtr->refCount++;
+    if (!mountPtr->objvInUse) {
+	cbPtr->objv = mountPtr->objv;
+	mountPtr->objvInUse = 1;
+    } else {
+	/* We are being re-entered from one of this mount's callbacks */
+	cbPtr->objv = (Tcl_Obj**) ckalloc(sizeof(Tcl_Obj*) 
+		* (mountPtr->prefixObjc + VFS_STD_ARGS + VFS_MAX_EXTRA_ARGS));
+	memcpy(cbPtr->objv, mountPtr->objv, 
+	       sizeof(Tcl_Obj*) * mountPtr->prefixObjc);
+    }
+    cbPtr->objc = mountPtr->prefixObjc;
+    cbPtr->op = op;
+    cbPtr->timed = VfsTiming(tsdPtr);
+    if (cbPtr->timed) {
+	Tcl_GetTime(&cbPtr->start);
+    }
+
+    /* 
+     * The path's internal representation (and hence the cached root
+     * and relative objects) may be discarded while the callback runs,
+     * so each of these holds its own reference.
+     */
+    VfsCallbackAppend(cbPtr, tsdPtr->opNames[op]);
+    VfsCallbackAppend(cbPtr, nativeRep->rootObj);
+    VfsCallbackAppend(cbPtr, nativeRep->relativeObj);
+    VfsCallbackAppend(cbPtr, pathPtr);
+    return TCL_OK;
+}
+
+/* Add one more argument to a callback, which we keep a reference to */
+static void
+VfsCallbackAppend(VfsCallback *cbPtr, Tcl_Obj *objPtr) {
+    if (cbPtr->objc < cbPtr->mountPtr->prefixObjc 
+		      + VFS_STD_ARGS + VFS_MAX_EXTRA_ARGS) {
+	Tcl_IncrRefCount(objPtr);
+	cbPtr->objv[cbPtr->objc++] = objPtr;
+    } else {
+	/* Can only happen through a bug in this file */
+	Tcl_Panic("too many arguments for vfs callback");
+    }
+}
+
+/* 
+ * Evaluate a callback in its interpreter at global level.  The caller
+ * is responsible for saving and restoring the interpreter's result.
+ */
+static int
+VfsCallbackEval(VfsCallback *cbPtr) {
+    int returnVal;
+
+    if (VfsProbeEnabled(callback__entry)) {
+	VfsProbe3(callback__entry, vfsOpNames[cbPtr->op], 
+		  Tcl_GetString(VfsCallbackRoot(cbPtr)), 
+		  Tcl_GetString(VfsCallbackRelative(cbPtr)));
     }
-    Tcl_ListObjAppendElement(NULL, mountCmd, Tcl_NewStringObj(cmd,-1));
-    if (splitPosition == len) {
-	Tcl_ListObjAppendElement(NULL, mountCmd, normed);
-	Tcl_ListObjAppendElement(NULL, mountCmd, Tcl_NewStringObj("",0));
+    if (cbPtr->mountPtr->isAsync) {
+	returnVal = VfsAsyncEval(cbPtr);
     } else {
-	Tcl_ListObjAppendElement(NULL, mountCmd, 
-		Tcl_NewStringObj(normedString,splitPosition));
-	if ((normedString[splitPosition] != VFS_SEPARATOR) 
-	    || (VFS_SEPARATOR ==':')) {
-	    /* This will occur if we mount 'ftp://' */
-	    splitPosition--;
+	returnVal = Tcl_EvalObjv(cbPtr->interp, cbPtr->objc, cbPtr->objv, 
+				 TCL_EVAL_GLOBAL);
+    }
+    if (VfsProbeEnabled(callback__return)) {
+	VfsProbe4(callback__return, vfsOpNames[cbPtr->op], 
+		  Tcl_GetString(VfsCallbackRoot(cbPtr)), 
+		  Tcl_GetString(VfsCallbackRelative(cbPtr)), returnVal);
+    }
+    return returnVal;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsAsyncEval --
+ *
+ *	Evaluate the callback of an -async mount as the body of a new
+ *	coroutine, so that its handler may yield while it waits for
+ *	I/O.  Until the coroutine has returned, this thread services
+ *	its event loop, which is where whatever the handler waits for
+ *	resumes it.  The Tcl_Filesystem function we were called from
+ *	cannot itself return early, so other filesystem calls made from
+ *	those events nest inside this one.  Without coroutines (before
+ *	Tcl 8.6) the callback is evaluated as usual.
+ *
+ * Results:
+ *	The return code of the handler, with its result in the
+ *	interpreter, and for TCLVFS_POSIXERROR, its errno restored.
+ *
+ * Side effects:
+ *	Whatever the handler and the events serviced do.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsAsyncEval(VfsCallback *cbPtr) {
+    Tcl_Interp *interp = cbPtr->interp;
+    VfsAsyncCall call;
+    Tcl_CmdInfo info;
+    Tcl_HashEntry *hPtr;
+    Tcl_Obj **objv, *nameObj;
+    char name[40];
+    int key, isNew, returnVal;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (!Tcl_GetCommandInfo(interp, "::coroutine", &info)) {
+	return Tcl_EvalObjv(interp, cbPtr->objc, cbPtr->objv, 
+			    TCL_EVAL_GLOBAL);
+    }
+    if (!tsdPtr->asyncInit) {
+	Tcl_InitHashTable(&tsdPtr->asyncTable, TCL_ONE_WORD_KEYS);
+	tsdPtr->asyncLambda = Tcl_NewStringObj("{key args} {"
+		"::vfs::AsyncReturn $key "
+		"[catch {uplevel #0 $args} result options] $result $options}",
+		-1);
+	Tcl_IncrRefCount(tsdPtr->asyncLambda);
+	tsdPtr->asyncInit = 1;
+    }
+    memset(&call, 0, sizeof(VfsAsyncCall));
+    key = ++tsdPtr->asyncCount;
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->asyncTable, (char*)(size_t)key, 
+			       &isNew);
+    Tcl_SetHashValue(hPtr, (ClientData)&call);
+    sprintf(name, "::vfs::async%d", key);
+    nameObj = Tcl_NewStringObj(name, -1);
+
+    /* coroutine name apply lambda key callback... */
+    objv = (Tcl_Obj**) ckalloc(sizeof(Tcl_Obj*) * (cbPtr->objc + 5));
+    objv[0] = Tcl_NewStringObj("::coroutine", -1);
+    objv[1] = nameObj;
+    objv[2] = Tcl_NewStringObj("::apply", -1);
+    objv[3] = tsdPtr->asyncLambda;
+    objv[4] = Tcl_NewIntObj(key);
+    memcpy(objv + 5, cbPtr->objv, sizeof(Tcl_Obj*) * cbPtr->objc);
+    Tcl_IncrRefCount(objv[0]);
+    Tcl_IncrRefCount(objv[1]);
+    Tcl_IncrRefCount(objv[2]);
+    Tcl_IncrRefCount(objv[4]);
+
+    Tcl_Preserve((ClientData) interp);
+    returnVal = Tcl_EvalObjv(interp, cbPtr->objc + 5, objv, 
+			     TCL_EVAL_GLOBAL);
+    if (!call.done && (returnVal == TCL_OK 
+		       || Tcl_GetCommandInfo(interp, name, &info))) {
+	/* It has yielded */
+	while (!call.done) {
+	    if (Tcl_InterpDeleted(interp) 
+		    || !Tcl_GetCommandInfo(interp, name, &info)) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(
+			"vfs handler coroutine deleted before it returned", 
+			-1));
+		returnVal = TCL_ERROR;
+		break;
+	    }
+	    Tcl_DoOneEvent(TCL_ALL_EVENTS);
 	}
-	Tcl_ListObjAppendElement(NULL, mountCmd, 
-		Tcl_NewStringObj(normedString+splitPosition+1,
-				 len-splitPosition-1));
     }
-    Tcl_ListObjAppendElement(NULL, mountCmd, pathPtr);
+    if (call.done) {
+	Tcl_SetObjResult(interp, call.resultPtr);
+	returnVal = call.code;
+	if (returnVal == TCL_ERROR) {
+	    Tcl_Obj **optv;
+	    int optc, i;
 
-    if (iRef != NULL) {
-        *iRef = interp;
+	    if (Tcl_ListObjGetElements(NULL, call.optionsPtr, &optc, &optv)
+		    == TCL_OK) {
+		for (i = 0; i + 1 < optc; i += 2) {
+		    if (!strcmp(Tcl_GetString(optv[i]), "-errorcode")) {
+			Tcl_SetObjErrorCode(interp, optv[i+1]);
+		    }
+		}
+	    }
+	} else if (returnVal == TCLVFS_POSIXERROR) {
+	    Tcl_SetErrno(call.errNum);
+	}
+	Tcl_DecrRefCount(call.resultPtr);
+	Tcl_DecrRefCount(call.optionsPtr);
+    } else {
+	/* It failed to start, or went away */
+	Tcl_DeleteHashEntry(hPtr);
     }
-    
-    return mountCmd;
+    Tcl_Release((ClientData) interp);
+
+    Tcl_DecrRefCount(objv[0]);
+    Tcl_DecrRefCount(objv[1]);
+    Tcl_DecrRefCount(objv[2]);
+    Tcl_DecrRefCount(objv[4]);
+    ckfree((char*)objv);
+    return returnVal;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsAsyncReturnObjCmd --
+ *
+ *	This procedure implements the internal "vfs::AsyncReturn"
+ *	command, with which the coroutine started by VfsAsyncEval
+ *	hands back the outcome of its handler: 'key code result
+ *	options'.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Ends the wait in VfsAsyncEval.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsAsyncReturnObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    int key, code, errNum = Tcl_GetErrno();
+    Tcl_HashEntry *hPtr = NULL;
+    VfsAsyncCall *callPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (objc != 5) {
+	Tcl_WrongNumArgs(interp, 1, objv, "key code result options");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[1], &key) != TCL_OK
+	    || Tcl_GetIntFromObj(interp, objv[2], &code) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (tsdPtr->asyncInit) {
+	hPtr = Tcl_FindHashEntry(&tsdPtr->asyncTable, (char*)(size_t)key);
+    }
+    if (hPtr == NULL) {
+	/* Nobody is waiting any more */
+	return TCL_OK;
+    }
+    callPtr = (VfsAsyncCall*) Tcl_GetHashValue(hPtr);
+    Tcl_DeleteHashEntry(hPtr);
+    callPtr->done = 1;
+    callPtr->code = code;
+    callPtr->errNum = errNum;
+    callPtr->resultPtr = objv[3];
+    Tcl_IncrRefCount(callPtr->resultPtr);
+    callPtr->optionsPtr = objv[4];
+    Tcl_IncrRefCount(callPtr->optionsPtr);
+    return TCL_OK;
+}
+
+/* Release everything held by a callback */
+static void
+VfsCallbackFree(VfsCallback *cbPtr) {
+    VfsMount *mountPtr = cbPtr->mountPtr;
+    int i;
+
+    for (i = mountPtr->prefixObjc; i < cbPtr->objc; i++) {
+	Tcl_DecrRefCount(cbPtr->objv[i]);
+    }
+    if (cbPtr->objv == mountPtr->objv) {
+	mountPtr->objvInUse = 0;
+    } else {
+	ckfree((char*)cbPtr->objv);
+    }
+    VfsReleaseMount(mountPtr);
+}
+
+/* 
+ * Count a callback in its mount's statistics and the thread's trace,
+ * if they are being kept.
+ */
+static void
+VfsCallbackStats(VfsCallback *cbPtr, int returnVal) {
+    if (cbPtr->timed) {
+	VfsTimingRecord(cbPtr->mountPtr, cbPtr->op, returnVal, &cbPtr->start,
+		VfsCallbackRoot(cbPtr), VfsCallbackRelative(cbPtr), -1);
+	cbPtr->timed = 0;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsTimingRecord --
+ *
+ *	Note that a callback which started at '*startPtr' has returned
+ *	'returnVal', in the statistics of its mount and in the trace
+ *	of this thread, whichever are being kept.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	May overwrite the oldest record of the trace.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsTimingRecord(VfsMount *mountPtr, int op, int returnVal, 
+		Tcl_Time *startPtr, Tcl_Obj *rootObj, Tcl_Obj *relativeObj,
+		Tcl_WideInt bytes) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+    VfsTrace *tracePtr = tsdPtr->tracePtr;
+    VfsTraceRecord *recPtr;
+    Tcl_Time now;
+    Tcl_WideInt elapsed;
+
+    Tcl_GetTime(&now);
+    elapsed = ((Tcl_WideInt) (now.sec - startPtr->sec)) * 1000000
+	    + (now.usec - startPtr->usec);
+    if (elapsed < 0) {
+	/* The clock was set back */
+	elapsed = 0;
+    }
+    if (tsdPtr->statsEnabled) {
+	VfsStatsRecord(mountPtr, op, returnVal, elapsed);
+    }
+    if (tracePtr == NULL || !tracePtr->active 
+	    || elapsed < tracePtr->threshold) {
+	return;
+    }
+    recPtr = &tracePtr->records[tracePtr->count++ % tracePtr->size];
+    if (recPtr->relativeObj != NULL) {
+	Tcl_DecrRefCount(recPtr->rootObj);
+	Tcl_DecrRefCount(recPtr->relativeObj);
+    }
+    recPtr->start = *startPtr;
+    recPtr->duration = elapsed;
+    recPtr->bytes = bytes;
+    recPtr->op = op;
+    recPtr->code = returnVal;
+    recPtr->rootObj = rootObj;
+    recPtr->relativeObj = relativeObj;
+    Tcl_IncrRefCount(rootObj);
+    Tcl_IncrRefCount(relativeObj);
+}
+
+static VfsMountStats*
+VfsGetStats(VfsMount *mountPtr) {
+    if (mountPtr->statsPtr == NULL) {
+	mountPtr->statsPtr = (VfsMountStats*) ckalloc(sizeof(VfsMountStats));
+	memset(mountPtr->statsPtr, 0, sizeof(VfsMountStats));
+    }
+    return mountPtr->statsPtr;
+}
+
+/* Count a callback which took 'elapsed' microseconds */
+static void
+VfsStatsRecord(VfsMount *mountPtr, int op, int returnVal, 
+	       Tcl_WideInt elapsed) {
+    VfsOpStats *opPtr;
+    Tcl_WideInt bits;
+    int bucket = 0;
+
+    opPtr = &VfsGetStats(mountPtr)->ops[op];
+    for (bits = elapsed; bits > 0 && bucket < VFS_STATS_BUCKETS - 1; 
+	 bits >>= 1) {
+	bucket++;
+    }
+    opPtr->calls++;
+    if (returnVal == TCLVFS_POSIXERROR) {
+	opPtr->posixErrors++;
+    } else if (returnVal != TCL_OK) {
+	opPtr->errors++;
+    }
+    opPtr->time += elapsed;
+    opPtr->histogram[bucket]++;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsStatsObj --
+ *
+ *	Describe a mount's statistics for 'vfs::filesystem stats', as
+ *	a dictionary with the keys 'lookups' and 'operations', the
+ *	latter mapping the name of each operation used to a dictionary
+ *	of 'calls', 'errors', 'posixerrors', 'time' and 'histogram'.
+ *
+ * Results:
+ *	A new object.
+ *
+ * Side effects:
+ *	If 'reset' is set, the statistics are cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+VfsStatsObj(VfsMount *mountPtr, int reset) {
+    VfsMountStats *statsPtr = mountPtr->statsPtr;
+    Tcl_Obj *resultPtr, *opsPtr;
+    int op, i;
+
+    resultPtr = Tcl_NewObj();
+    opsPtr = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("lookups", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, 
+	    Tcl_NewLongObj(statsPtr == NULL ? 0 : statsPtr->lookups));
+    Tcl_ListObjAppendElement(NULL, resultPtr, 
+			     Tcl_NewStringObj("operations", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, opsPtr);
+    if (statsPtr == NULL) {
+	return resultPtr;
+    }
+    for (op = 0; op < VFS_STATS_OPS; op++) {
+	VfsOpStats *opPtr = &statsPtr->ops[op];
+	Tcl_Obj *opObj, *histObj;
+	
+	if (opPtr->calls == 0) {
+	    continue;
+	}
+	opObj = Tcl_NewObj();
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("calls", -1));
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewLongObj(opPtr->calls));
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("errors", -1));
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewLongObj(opPtr->errors));
+	Tcl_ListObjAppendElement(NULL, opObj, 
+				 Tcl_NewStringObj("posixerrors", -1));
+	Tcl_ListObjAppendElement(NULL, opObj, 
+				 Tcl_NewLongObj(opPtr->posixErrors));
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("time", -1));
+	Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewWideIntObj(opPtr->time));
+	histObj = Tcl_NewObj();
+	for (i = 0; i < VFS_STATS_BUCKETS; i++) {
+	    Tcl_ListObjAppendElement(NULL, histObj, 
+				     Tcl_NewLongObj(opPtr->histogram[i]));
+	}
+	Tcl_ListObjAppendElement(NULL, opObj, 
+				 Tcl_NewStringObj("histogram", -1));
+	Tcl_ListObjAppendElement(NULL, opObj, histObj);
+	Tcl_ListObjAppendElement(NULL, opsPtr, Tcl_NewStringObj(
+		(op == VFS_STATS_CLOSE) ? "close" : vfsOpNames[op], -1));
+	Tcl_ListObjAppendElement(NULL, opsPtr, opObj);
+    }
+    if (reset) {
+	memset(statsPtr, 0, sizeof(VfsMountStats));
+    }
+    return resultPtr;
+}
+
+/* Start tracing afresh, discarding what was recorded before */
+static void
+VfsTraceStart(ThreadSpecificData *tsdPtr, int size, Tcl_WideInt threshold) {
+    VfsTrace *tracePtr;
+
+    VfsTraceFree(tsdPtr);
+    tracePtr = (VfsTrace*) ckalloc(sizeof(VfsTrace));
+    tracePtr->active = 1;
+    tracePtr->size = size;
+    tracePtr->count = 0;
+    tracePtr->threshold = threshold;
+    tracePtr->records = (VfsTraceRecord*) 
+	    ckalloc(size * sizeof(VfsTraceRecord));
+    memset(tracePtr->records, 0, size * sizeof(VfsTraceRecord));
+    tsdPtr->tracePtr = tracePtr;
+}
+
+static void
+VfsTraceFree(ThreadSpecificData *tsdPtr) {
+    VfsTrace *tracePtr = tsdPtr->tracePtr;
+    int i;
+
+    if (tracePtr == NULL) {
+	return;
+    }
+    for (i = 0; i < tracePtr->size; i++) {
+	if (tracePtr->records[i].relativeObj != NULL) {
+	    Tcl_DecrRefCount(tracePtr->records[i].rootObj);
+	    Tcl_DecrRefCount(tracePtr->records[i].relativeObj);
+	}
+    }
+    ckfree((char*)tracePtr->records);
+    ckfree((char*)tracePtr);
+    tsdPtr->tracePtr = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsTraceDump --
+ *
+ *	Describe the callbacks recorded by this thread's trace, oldest
+ *	first, for 'vfs::filesystem trace dump'.  Each is a dictionary
+ *	of 'op', 'mount', 'path' (relative to the mount), 'start' (in
+ *	microseconds since the epoch), 'duration' (in microseconds),
+ *	'code' (0 for success, -1 for a posix error, otherwise a Tcl
+ *	return code) and, for close callbacks, 'bytes'.
+ *
+ * Results:
+ *	A new list object.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+VfsTraceDump(ThreadSpecificData *tsdPtr) {
+    VfsTrace *tracePtr = tsdPtr->tracePtr;
+    Tcl_Obj *resultPtr = Tcl_NewObj();
+    long i;
+
+    if (tracePtr == NULL) {
+	return resultPtr;
+    }
+    i = tracePtr->count - tracePtr->size;
+    if (i < 0) {
+	i = 0;
+    }
+    for (; i < tracePtr->count; i++) {
+	VfsTraceRecord *recPtr = &tracePtr->records[i % tracePtr->size];
+	Tcl_Obj *recObj = Tcl_NewObj();
+
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj("op", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj(
+		(recPtr->op == VFS_STATS_CLOSE) ? "close" 
+		: vfsOpNames[recPtr->op], -1));
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj("mount", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, recPtr->rootObj);
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj("path", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, recPtr->relativeObj);
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj("start", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewWideIntObj(
+		((Tcl_WideInt) recPtr->start.sec) * 1000000 
+		+ recPtr->start.usec));
+	Tcl_ListObjAppendElement(NULL, recObj, 
+				 Tcl_NewStringObj("duration", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, 
+				 Tcl_NewWideIntObj(recPtr->duration));
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewStringObj("code", -1));
+	Tcl_ListObjAppendElement(NULL, recObj, Tcl_NewIntObj(recPtr->code));
+	if (recPtr->bytes >= 0) {
+	    Tcl_ListObjAppendElement(NULL, recObj, 
+				     Tcl_NewStringObj("bytes", -1));
+	    Tcl_ListObjAppendElement(NULL, recObj, 
+				     Tcl_NewWideIntObj(recPtr->bytes));
+	}
+	Tcl_ListObjAppendElement(NULL, resultPtr, recObj);
+    }
+    return resultPtr;
+}
+
+/*
+ * Return an integer object for a callback argument.  Small values
+ * are shared from a per-thread table.
+ */
+static Tcl_Obj*
+VfsIntObj(int value) {
+    ThreadSpecificData *tsdPtr;
+
+    if (value < 0 || value >= VFS_SMALL_INTS) {
+	return Tcl_NewIntObj(value);
+    }
+    tsdPtr = TCL_TSD_INIT(&dataKey);
+    if (tsdPtr->smallInts[value] == NULL) {
+	tsdPtr->smallInts[value] = Tcl_NewIntObj(value);
+	Tcl_IncrRefCount(tsdPtr->smallInts[value]);
+    }
+    return tsdPtr->smallInts[value];
 }
 
 static void 
@@ -2050,7 +10313,43 @@ VfsExitProc(ClientData clientData)
 static void
 VfsThreadExitProc(ClientData clientData)
 {
+    int i;
+    VfsMount *mountPtr, *nextPtr;
     ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    /* 
+     * Drop our proxies, withdraw whatever we still share, and fail
+     * anything other threads are waiting for us to do.
+     */
+    tsdPtr->exiting = 1;
+    for (mountPtr = tsdPtr->listOfMounts; mountPtr != NULL; 
+	 mountPtr = nextPtr) {
+	nextPtr = mountPtr->nextMount;
+	if (mountPtr->isProxy) {
+	    VfsUnlinkMount(tsdPtr, mountPtr);
+	} else if (mountPtr->sharedPtr != NULL) {
+	    VfsUnshareMount(mountPtr->sharedPtr);
+	    VfsPoolStop(mountPtr->sharedPtr->poolPtr);
+	}
+    }
+    Tcl_DeleteEvents(VfsRemoteCancel, NULL);
+    Tcl_MutexLock(&vfsSharedMutex);
+    VfsCacheCharge(tsdPtr, 0);
+    Tcl_MutexUnlock(&vfsSharedMutex);
+    VfsCloseDiscard(tsdPtr, NULL);
+    if (tsdPtr->closeIdle) {
+	Tcl_CancelIdleCall(VfsCloseIdleProc, NULL);
+	tsdPtr->closeIdle = 0;
+    }
+    if (tsdPtr->closeErrors != NULL) {
+	Tcl_DecrRefCount(tsdPtr->closeErrors);
+	tsdPtr->closeErrors = NULL;
+    }
+    VfsTraceFree(tsdPtr);
+    if (tsdPtr->proxyInterp != NULL) {
+	Tcl_DeleteInterp(tsdPtr->proxyInterp);
+	tsdPtr->proxyInterp = NULL;
+    }
     /*
      * This is probably no longer needed, because each individual
      * interp's cleanup will trigger removal of all volumes which
@@ -2064,4 +10363,88 @@ VfsThreadExitProc(ClientData clientData)
 	Tcl_DecrRefCount(tsdPtr->internalErrorScript);
 	tsdPtr->internalErrorScript = NULL;
     }
+    for (i = 0; i < VFS_OP_COUNT; i++) {
+	if (tsdPtr->opNames[i] != NULL) {
+	    Tcl_DecrRefCount(tsdPtr->opNames[i]);
+	    tsdPtr->opNames[i] = NULL;
+	}
+    }
+    for (i = 0; i < VFS_SMALL_INTS; i++) {
+	if (tsdPtr->smallInts[i] != NULL) {
+	    Tcl_DecrRefCount(tsdPtr->smallInts[i]);
+	    tsdPtr->smallInts[i] = NULL;
+	}
+    }
+    for (i = 0; i < 6; i++) {
+	if (tsdPtr->modeObjs[i] != NULL) {
+	    Tcl_DecrRefCount(tsdPtr->modeObjs[i]);
+	    tsdPtr->modeObjs[i] = NULL;
+	}
+    }
+    if (tsdPtr->emptyObj != NULL) {
+	Tcl_DecrRefCount(tsdPtr->emptyObj);
+	tsdPtr->emptyObj = NULL;
+    }
+    if (tsdPtr->patternObj != NULL) {
+	Tcl_DecrRefCount(tsdPtr->patternObj);
+	tsdPtr->patternObj = NULL;
+    }
+    VfsNormCacheFlush(tsdPtr);
+    if (tsdPtr->readyInit) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hPtr;
+
+	Tcl_DeleteEventSource(VfsReadySetupProc, VfsReadyCheckProc, NULL);
+	for (hPtr = Tcl_FirstHashEntry(&tsdPtr->readyTable, &search); 
+	     hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	    VfsReadyChannel *readyPtr = 
+		    (VfsReadyChannel*) Tcl_GetHashValue(hPtr);
+	    if (readyPtr->closeHandler) {
+		Tcl_DeleteCloseHandler(readyPtr->channel, VfsReadyClosed, 
+				       (ClientData) readyPtr->channel);
+	    }
+	    ckfree((char*)readyPtr);
+	}
+	Tcl_DeleteHashTable(&tsdPtr->readyTable);
+	tsdPtr->readyInit = 0;
+    }
+    if (tsdPtr->prefetchInit) {
+	VfsPrefetchDiscard(tsdPtr, NULL);
+	Tcl_DeleteHashTable(&tsdPtr->prefetchTable);
+	Tcl_DeleteHashTable(&tsdPtr->prefetchCalls);
+	tsdPtr->prefetchInit = 0;
+    }
+    if (tsdPtr->asyncInit) {
+	Tcl_DeleteHashTable(&tsdPtr->asyncTable);
+	Tcl_DecrRefCount(tsdPtr->asyncLambda);
+	tsdPtr->asyncInit = 0;
+    }
+    /* 
+     * Path objects which outlive this handler may still hold native
+     * reps, whose slabs are orphaned, to be freed by VfsFreeInternalRep
+     * once the last of them goes.
+     */
+    while (tsdPtr->nativeRepSlabs != NULL) {
+	VfsNativeRepSlab *slabPtr = tsdPtr->nativeRepSlabs;
+	tsdPtr->nativeRepSlabs = slabPtr->nextSlab;
+	if (slabPtr->numLive == 0) {
+	    ckfree((char*)slabPtr);
+	} else {
+	    slabPtr->orphaned = 1;
+	}
+    }
+    tsdPtr->freeNativeReps = NULL;
+    if (tsdPtr->statKeysInit) {
+	for (i = 0; i < VFS_STAT_COUNT; i++) {
+	    Tcl_DecrRefCount(tsdPtr->statKeyObjs[i]);
+	}
+	Tcl_DeleteHashTable(&tsdPtr->statKeyTable);
+	tsdPtr->statKeysInit = 0;
+    }
+    if (tsdPtr->mountTablesInit) {
+	Tcl_DeleteHashTable(&tsdPtr->mountTable);
+	Tcl_DeleteHashTable(&tsdPtr->rootTable);
+	Tcl_DeleteHashTable(&tsdPtr->dirTable);
+	tsdPtr->mountTablesInit = 0;
+    }
 }
@@ -0,0 +1,166 @@
+/*
+ * vfs.h --
+ *
+ *	Public interface of the Vfs extension, through which compiled
+ *	extensions can mount filesystems implemented in C.  Such a
+ *	mount is described by a Vfs_Driver table, whose functions are
+ *	called directly instead of evaluating a Tcl command, but which
+ *	otherwise shares the mount table, volume handling, caching
+ *	and interpreter cleanup of script-level mounts.
+ *
+ *	Extensions should call Vfs_InitStubs and link against the
+ *	vfs stub library, just as for Tcl itself.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef _VFS_H
+#define _VFS_H
+
+#include <tcl.h>
+
+#ifdef BUILD_vfs
+#undef TCL_STORAGE_CLASS
+#define TCL_STORAGE_CLASS DLLEXPORT
+#endif
+
+/*
+ * Driver functions return TCL_OK on success, TCL_ERROR (with a message
+ * left in 'interp') if something went wrong in the driver itself, or
+ * TCLVFS_POSIXERROR after calling Tcl_SetErrno() to report an ordinary
+ * filesystem error such as ENOENT.  The same values may be returned
+ * by a Tcl handler through 'vfs::filesystem posixerror'.
+ */
+
+#define TCLVFS_POSIXERROR (-1)
+
+/*
+ * Each function receives the driver's clientData and the interpreter
+ * which mounted it, followed by the same 'root', 'relative' and
+ * 'actualpath' arguments a Tcl handler is given (see vfs-fsapi), and
+ * then the arguments specific to the operation.
+ */
+
+#define VFS_DRIVER_ARGS \
+    ClientData clientData, Tcl_Interp *interp, Tcl_Obj *rootPtr, \
+    Tcl_Obj *relativePtr, Tcl_Obj *pathPtr
+
+typedef int (Vfs_StatProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_StatBuf *bufPtr));
+typedef int (Vfs_AccessProc) _ANSI_ARGS_((VFS_DRIVER_ARGS, int mode));
+/*
+ * Open the file with the given POSIX open mode, leaving a channel not
+ * registered in any interpreter in *chanPtr.
+ */
+typedef int (Vfs_OpenProc) _ANSI_ARGS_((VFS_DRIVER_ARGS, int mode,
+	int permissions, Tcl_Channel *chanPtr));
+/*
+ * Append the matching paths (built from pathPtr) to the unshared list
+ * resultPtr.  'types' is a mask of TCL_GLOB_TYPE_* values, or 0.
+ */
+typedef int (Vfs_MatchInDirectoryProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	CONST char *pattern, int types, Tcl_Obj *resultPtr));
+typedef int (Vfs_CreateDirectoryProc) _ANSI_ARGS_((VFS_DRIVER_ARGS));
+typedef int (Vfs_RemoveDirectoryProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	int recursive));
+typedef int (Vfs_DeleteFileProc) _ANSI_ARGS_((VFS_DRIVER_ARGS));
+/*
+ * Leave a new list of the names of the attributes a path supports in
+ * *namesPtr; the attributes are then referred to by their index.
+ */
+typedef int (Vfs_FileAttrStringsProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj **namesPtr));
+typedef int (Vfs_FileAttrsGetProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	int index, Tcl_Obj **valuePtr));
+typedef int (Vfs_FileAttrsSetProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	int index, Tcl_Obj *valuePtr));
+typedef int (Vfs_UtimeProc) _ANSI_ARGS_((VFS_DRIVER_ARGS, long actime,
+	long modtime));
+/*
+ * Copy or rename a path to another path in the same mount, given by
+ * its relative and actual paths (the root being the same).  Report
+ * EXDEV or ENOSYS to have Tcl do the work through the other functions.
+ */
+typedef int (Vfs_CopyFileProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj *destRelativePtr, Tcl_Obj *destPathPtr));
+typedef int (Vfs_RenameFileProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj *destRelativePtr, Tcl_Obj *destPathPtr));
+typedef int (Vfs_CopyDirectoryProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj *destRelativePtr, Tcl_Obj *destPathPtr));
+/*
+ * A hint that the files in the list 'namesPtr', given by their paths
+ * relative to the mount ('relativePtr' being empty), will soon be
+ * read.  The driver may start loading them in the background, but
+ * should return promptly; the result is ignored.
+ */
+typedef int (Vfs_PrefetchProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj *namesPtr));
+/*
+ * Append to the unshared list 'resultPtr' a name and size, in bytes,
+ * for each kind of memory the mount holds, for 'vfs::filesystem
+ * memory'.
+ */
+typedef int (Vfs_MemoryProc) _ANSI_ARGS_((VFS_DRIVER_ARGS,
+	Tcl_Obj *resultPtr));
+/* Called once the mount has gone and no call into the driver is active */
+typedef void (Vfs_UnmountProc) _ANSI_ARGS_((ClientData clientData));
+
+/*
+ * A table of driver functions.  Any function may be NULL, in which
+ * case the operation fails with ENOSYS (or, for attributes, there are
+ * none, and copies and renames are done by Tcl).  New functions will only ever be added at the end, and the
+ * package looks at no more than 'structureLength' bytes, so drivers
+ * built against an older vfs.h keep working.
+ */
+
+typedef struct Vfs_Driver {
+    CONST char *typeName;	/* Reported by 'file system' and
+				 * 'vfs::filesystem info'. */
+    int structureLength;	/* sizeof(Vfs_Driver) */
+    Vfs_StatProc *statProc;
+    Vfs_AccessProc *accessProc;
+    Vfs_OpenProc *openProc;
+    Vfs_MatchInDirectoryProc *matchInDirectoryProc;
+    Vfs_CreateDirectoryProc *createDirectoryProc;
+    Vfs_RemoveDirectoryProc *removeDirectoryProc;
+    Vfs_DeleteFileProc *deleteFileProc;
+    Vfs_FileAttrStringsProc *fileAttrStringsProc;
+    Vfs_FileAttrsGetProc *fileAttrsGetProc;
+    Vfs_FileAttrsSetProc *fileAttrsSetProc;
+    Vfs_UtimeProc *utimeProc;
+    Vfs_UnmountProc *unmountProc;
+    Vfs_CopyFileProc *copyFileProc;
+    Vfs_RenameFileProc *renameFileProc;
+    Vfs_CopyDirectoryProc *copyDirectoryProc;
+    Vfs_PrefetchProc *prefetchProc;
+    Vfs_MemoryProc *memoryProc;
+} Vfs_Driver;
+
+/* Flags for Vfs_Mount */
+
+#define VFS_MOUNT_VOLUME	(1<<0)	/* Also register a new volume */
+#define VFS_MOUNT_SHARED	(1<<1)	/* Visible in all threads, which
+					 * forward calls to this one */
+#define VFS_MOUNT_THREADSAFE	(1<<2)	/* Visible in all threads, which
+					 * call the driver directly */
+
+/* Lifetimes of cached results, in milliseconds, for Vfs_Mount */
+
+#define VFS_CACHE_NONE		0
+#define VFS_CACHE_FOREVER	(-1)
+
+#include "vfsDecls.h"
+
+#ifdef USE_VFS_STUBS
+EXTERN CONST char *	Vfs_InitStubs _ANSI_ARGS_((Tcl_Interp *interp,
+			    CONST char *version, int exact));
+#else
+#define Vfs_InitStubs(interp, version, exact) \
+    Tcl_PkgRequire(interp, "vfs", version, exact)
+#endif
+
+#undef TCL_STORAGE_CLASS
+#define TCL_STORAGE_CLASS DLLIMPORT
+
+#endif /* _VFS_H */
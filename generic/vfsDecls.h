@@ -0,0 +1,79 @@
+/*
+ * vfsDecls.h --
+ *
+ *	Declarations of functions in the platform independent public
+ *	Vfs API.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef _VFSDECLS
+#define _VFSDECLS
+
+/*
+ * WARNING: This file is automatically generated by the tools/genStubs.tcl
+ * script.  Any modifications to the function declarations below should be
+ * made in the generic/vfs.decls script.
+ */
+
+/* !BEGIN!: Do not edit below this line. */
+
+/*
+ * Exported function declarations:
+ */
+
+/* 0 */
+EXTERN int		Vfs_Mount _ANSI_ARGS_((Tcl_Interp *interp,
+				Tcl_Obj *mountPoint, int flags,
+				long cacheTtl, CONST Vfs_Driver *driverPtr,
+				ClientData clientData));
+/* 1 */
+EXTERN int		Vfs_Unmount _ANSI_ARGS_((Tcl_Interp *interp,
+				Tcl_Obj *mountPoint));
+/* 2 */
+EXTERN int		Vfs_GetMount _ANSI_ARGS_((Tcl_Obj *mountPoint,
+				CONST Vfs_Driver **driverPtrPtr,
+				ClientData *clientDataPtr));
+
+typedef struct VfsStubs {
+    int magic;
+    struct VfsStubHooks *hooks;
+
+    int (*vfs_Mount) _ANSI_ARGS_((Tcl_Interp *interp, Tcl_Obj *mountPoint, int flags, long cacheTtl, CONST Vfs_Driver *driverPtr, ClientData clientData)); /* 0 */
+    int (*vfs_Unmount) _ANSI_ARGS_((Tcl_Interp *interp, Tcl_Obj *mountPoint)); /* 1 */
+    int (*vfs_GetMount) _ANSI_ARGS_((Tcl_Obj *mountPoint, CONST Vfs_Driver **driverPtrPtr, ClientData *clientDataPtr)); /* 2 */
+} VfsStubs;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern CONST VfsStubs *vfsStubsPtr;
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(USE_VFS_STUBS) && !defined(USE_VFS_STUB_PROCS)
+
+/*
+ * Inline function declarations:
+ */
+
+#ifndef Vfs_Mount
+#define Vfs_Mount \
+	(vfsStubsPtr->vfs_Mount) /* 0 */
+#endif
+#ifndef Vfs_Unmount
+#define Vfs_Unmount \
+	(vfsStubsPtr->vfs_Unmount) /* 1 */
+#endif
+#ifndef Vfs_GetMount
+#define Vfs_GetMount \
+	(vfsStubsPtr->vfs_GetMount) /* 2 */
+#endif
+
+#endif /* defined(USE_VFS_STUBS) && !defined(USE_VFS_STUB_PROCS) */
+
+/* !END!: Do not edit above this line. */
+
+#endif /* _VFSDECLS */
@@ -0,0 +1,25 @@
+/*
+ * vfsInt.h --
+ *
+ *	Declarations shared between the source files of the Vfs
+ *	extension, which are not part of its public interface (see
+ *	vfs.h).
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef _VFSINT_H
+#define _VFSINT_H
+
+#include <tcl.h>
+
+/* vfs.c */
+extern Tcl_Obj*		VfsNewStatBufObj _ANSI_ARGS_((Tcl_StatBuf *bufPtr));
+
+/* vfsZip.c */
+extern int		VfsZipIndexObjCmd _ANSI_ARGS_((ClientData dummy,
+			    Tcl_Interp *interp, int objc, 
+			    Tcl_Obj *CONST objv[]));
+
+#endif /* _VFSINT_H */
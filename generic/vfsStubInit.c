@@ -0,0 +1,28 @@
+/*
+ * vfsStubInit.c --
+ *
+ *	This file contains the initializers for the Vfs stub vectors.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#include "vfs.h"
+
+/*
+ * WARNING: The contents of this file is automatically generated by the
+ * tools/genStubs.tcl script. Any modifications to the function declarations
+ * below should be made in the generic/vfs.decls script.
+ */
+
+/* !BEGIN!: Do not edit below this line. */
+
+VfsStubs vfsStubs = {
+    TCL_STUB_MAGIC,
+    NULL,
+    Vfs_Mount, /* 0 */
+    Vfs_Unmount, /* 1 */
+    Vfs_GetMount, /* 2 */
+};
+
+/* !END!: Do not edit above this line. */
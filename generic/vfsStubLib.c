@@ -0,0 +1,67 @@
+/*
+ * vfsStubLib.c --
+ *
+ *	Stub object that will be statically linked into extensions that
+ *	want to access Vfs.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef USE_TCL_STUBS
+#define USE_TCL_STUBS
+#endif
+#ifndef USE_VFS_STUBS
+#define USE_VFS_STUBS
+#endif
+#undef USE_VFS_STUB_PROCS
+
+#include "vfs.h"
+
+CONST VfsStubs *vfsStubsPtr = NULL;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Vfs_InitStubs --
+ *
+ *	Loads the Vfs package and checks that its stubs table is
+ *	usable.  This must be called before any of the Vfs_ functions.
+ *
+ * Results:
+ *	The actual version of Vfs which satisfies the request, or
+ *	NULL (with an error message in 'interp') if there is none.
+ *
+ * Side effects:
+ *	Sets the stub table pointer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef Vfs_InitStubs
+#undef Vfs_InitStubs
+#endif
+
+CONST char *
+Vfs_InitStubs(interp, version, exact)
+    Tcl_Interp *interp;
+    CONST char *version;
+    int exact;
+{
+    CONST char *actualVersion;
+    ClientData clientData = NULL;
+
+    actualVersion = Tcl_PkgRequireEx(interp, "vfs", version, exact,
+				     &clientData);
+    if (actualVersion == NULL) {
+	return NULL;
+    }
+    if (clientData == NULL
+	    || ((CONST VfsStubs *) clientData)->magic != TCL_STUB_MAGIC) {
+	Tcl_AppendResult(interp, "this implementation of vfs does not ",
+			 "support stubs", (char *) NULL);
+	return NULL;
+    }
+    vfsStubsPtr = (CONST VfsStubs *) clientData;
+    return actualVersion;
+}
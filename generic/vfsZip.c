@@ -0,0 +1,1205 @@
+/*
+ * vfsZip.c --
+ *
+ *	The internal 'vfs::ZipIndex' command, which reads the central
+ *	directory of a zip archive into an index kept in C, through
+ *	which zipvfs.tcl looks up the entries of the archives it has
+ *	mounted.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h>
+#endif
+#include <tcl.h>
+/* Required to access the 'stat' structure fields */
+#include "tclInt.h"
+#include "tclPort.h"
+#include "vfsInt.h"
+
+/*
+ * The central directory of a zip archive, read by 'vfs::ZipIndex open'
+ * for zipvfs.tcl.  Each entry, and each directory which is only implied
+ * by the names of others, is a VfsZipEntry whose strings are kept in a
+ * single pool.  Names are found through an open-addressed hash table
+ * of their lower case forms, and the entries of each directory are
+ * listed together in the order of those, so that a glob pattern
+ * starting with literal text only looks at the entries it can match.
+ * The index is freed when its channel is closed.
+ */
+
+typedef struct VfsZipEntry {
+    Tcl_WideInt offset;   /* Of the local header, or -1 if implied */
+    unsigned int crc, csize, size;
+    int atx;              /* External attributes, as in zip::stat */
+    unsigned short vem, ver, flags, method, disk, attr;
+    unsigned short dosDate, dosTime;
+    int name, nameLen;    /* Name in the pool, without trailing '/' */
+    int key, keyLen;      /* The same in lower case */
+    int nameTail, keyTail;  /* Where the last element of each starts */
+    int extra, extraLen;  /* Raw extra field in the pool */
+    int comment, commentLen;
+    int children, numChildren;  /* Range of VfsZipIndex.children */
+    unsigned short depth; /* Number of path elements */
+    unsigned char isDir;
+    unsigned char live;   /* Not replaced by a later entry of that name */
+} VfsZipEntry;
+
+typedef struct VfsZipIndex {
+    Tcl_Channel channel;
+    VfsZipEntry *entries; /* The first is the root */
+    int numEntries, maxEntries;
+    char *pool;
+    int poolSize, maxPool;
+    int *buckets;         /* 1 + entry, or 0 if empty */
+    int numKeys;
+    unsigned int mask;    /* Number of buckets - 1 */
+    int *children;        /* Entries, grouped by directory */
+    int numChildren;
+} VfsZipIndex;
+
+/* For ordering the entries of each directory */
+typedef struct VfsZipSortItem {
+    int parent;
+    CONST char *tail;
+    int tailLen;
+    int entry;
+} VfsZipSortItem;
+
+/* How much of the end of an archive is read at a time to find its end */
+#define VFS_ZIP_CHUNK 65536
+
+/* Little-endian fields of zip headers */
+#define VfsZipShort(p) \
+    ((unsigned short)((p)[0] | ((p)[1] << 8)))
+#define VfsZipLong(p) \
+    ((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8) \
+	| ((unsigned int)(p)[2] << 16) | ((unsigned int)(p)[3] << 24))
+
+/* Each thread's indexes, by channel */
+typedef struct ThreadSpecificData {
+    int zipInit;
+    Tcl_HashTable zipTable;   /* Tcl_Channel -> VfsZipIndex */
+} ThreadSpecificData;
+static Tcl_ThreadDataKey dataKey;
+
+static VfsZipIndex*    VfsZipGet(Tcl_Interp *interp, Tcl_Obj *chanObj);
+static int             VfsZipRead(Tcl_Interp *interp, Tcl_Channel chan);
+static int             VfsZipParse(Tcl_Interp *interp, VfsZipIndex *indexPtr,
+				   unsigned char *cd, int cdLen, int numItems,
+				   Tcl_WideInt base);
+static int             VfsZipAddEntry(VfsZipIndex *indexPtr);
+static int             VfsZipAddString(VfsZipIndex *indexPtr, 
+					CONST char *str, int len);
+static void            VfsZipImply(VfsZipIndex *indexPtr, int entry);
+static unsigned int    VfsZipHash(CONST char *key, int len);
+static void            VfsZipInsert(VfsZipIndex *indexPtr, int entry);
+static int             VfsZipFind(VfsZipIndex *indexPtr, CONST char *key,
+				  int len);
+static int             VfsZipLookup(VfsZipIndex *indexPtr, CONST char *path,
+				    int len);
+static int             VfsZipDirLen(CONST char *path, int len);
+static int             VfsZipTailStart(CONST char *path, int len);
+static int             VfsZipDepth(CONST char *path, int len);
+static int             VfsZipCompare(CONST VOID *first, CONST VOID *second);
+static void            VfsZipLink(VfsZipIndex *indexPtr);
+static int             VfsZipPrefixCompare(VfsZipIndex *indexPtr, int child,
+					   CONST char *prefix, int len);
+static int             VfsZipMatchRange(VfsZipIndex *indexPtr, int entry,
+					CONST char *pattern, int *lastPtr);
+static int             VfsZipMatch(VfsZipIndex *indexPtr, int child, 
+				   CONST char *pattern);
+static Tcl_Obj*        VfsZipStatBuf(VfsZipIndex *indexPtr, int entry);
+static Tcl_Obj*        VfsZipStatList(VfsZipIndex *indexPtr, int entry);
+static Tcl_WideInt     VfsZipDosTime(unsigned short date, 
+				     unsigned short time);
+static void            VfsZipFree(VfsZipIndex *indexPtr);
+static Tcl_CloseProc   VfsZipClosed;
+static Tcl_ExitProc    VfsZipThreadExit;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsZipIndexObjCmd --
+ *
+ *	This procedure implements the internal "vfs::ZipIndex" command,
+ *	with which zipvfs.tcl reads the central directory of the zip
+ *	archive open on a channel, and then looks up its entries:
+ *
+ *	    open channel
+ *	    exists channel path
+ *	    stat channel path		(the list zip::stat sets)
+ *	    statbuf channel path	(for the handler's 'stat')
+ *	    getdir channel path ?pattern?
+ *	    match channel path actualpath pattern
+ *				(for the handler's 'matchindirectory')
+ *	    statmany channel dir names
+ *	    size channel
+ *
+ *	Paths are relative to the root of the archive, and are compared
+ *	without regard to case.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	'open' reads the archive, and replaces any index the channel
+ *	already had.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VfsZipIndexObjCmd(dummy, interp, objc, objv)
+    ClientData dummy;
+    Tcl_Interp *interp;
+    int objc;
+    Tcl_Obj *CONST objv[];
+{
+    static CONST char *options[] = {
+	"open", "exists", "stat", "statbuf", "getdir", "match", 
+	"statmany", "size", NULL
+    };
+    enum options {
+	ZIP_OPEN, ZIP_EXISTS, ZIP_STAT, ZIP_STATBUF, ZIP_GETDIR, ZIP_MATCH,
+	ZIP_STATMANY, ZIP_SIZE
+    };
+    VfsZipIndex *indexPtr;
+    VfsZipEntry *ePtr;
+    Tcl_Obj *resultPtr;
+    CONST char *path, *pattern;
+    int index, entry, len, child, last;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 1, objv, "option channel ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0, 
+			    &index) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (index == ZIP_OPEN) {
+	Tcl_Channel chan;
+
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "channel");
+	    return TCL_ERROR;
+	}
+	chan = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), NULL);
+	if (chan == NULL) {
+	    return TCL_ERROR;
+	}
+	return VfsZipRead(interp, chan);
+    }
+    indexPtr = VfsZipGet(interp, objv[2]);
+    if (indexPtr == NULL) {
+	return TCL_ERROR;
+    }
+
+    switch ((enum options) index) {
+	case ZIP_EXISTS: {
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "channel path");
+		return TCL_ERROR;
+	    }
+	    path = Tcl_GetStringFromObj(objv[3], &len);
+	    Tcl_SetObjResult(interp, 
+		    Tcl_NewBooleanObj(VfsZipLookup(indexPtr, path, len) >= 0));
+	    return TCL_OK;
+	}
+	case ZIP_STAT:
+	case ZIP_STATBUF: {
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "channel path");
+		return TCL_ERROR;
+	    }
+	    path = Tcl_GetStringFromObj(objv[3], &len);
+	    entry = VfsZipLookup(indexPtr, path, len);
+	    if (entry < 0) {
+		Tcl_AppendResult(interp, "could not read \"", path, 
+			"\": no such file or directory", (char *) NULL);
+		return TCL_ERROR;
+	    }
+	    Tcl_SetObjResult(interp, (index == ZIP_STAT) 
+		    ? VfsZipStatList(indexPtr, entry) 
+		    : VfsZipStatBuf(indexPtr, entry));
+	    return TCL_OK;
+	}
+	case ZIP_GETDIR: {
+	    if (objc != 4 && objc != 5) {
+		Tcl_WrongNumArgs(interp, 2, objv, "channel path ?pattern?");
+		return TCL_ERROR;
+	    }
+	    path = Tcl_GetStringFromObj(objv[3], &len);
+	    pattern = (objc == 5) ? Tcl_GetString(objv[4]) : "*";
+	    entry = VfsZipLookup(indexPtr, path, len);
+	    resultPtr = Tcl_NewObj();
+	    if (entry < 0 || indexPtr->entries[entry].numChildren == 0) {
+		Tcl_SetObjResult(interp, resultPtr);
+		return TCL_OK;
+	    }
+	    ePtr = &indexPtr->entries[entry];
+	    if (*pattern == '\0') {
+		/* Only asking whether it is a directory with entries */
+		Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj(
+			indexPtr->pool + ePtr->key, ePtr->keyLen));
+		Tcl_SetObjResult(interp, resultPtr);
+		return TCL_OK;
+	    }
+	    for (child = VfsZipMatchRange(indexPtr, entry, pattern, &last); 
+		 child < last; child++) {
+		if (VfsZipMatch(indexPtr, child, pattern)) {
+		    ePtr = &indexPtr->entries[indexPtr->children[child]];
+		    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj(
+			    indexPtr->pool + ePtr->name + ePtr->nameTail, 
+			    ePtr->nameLen - ePtr->nameTail));
+		}
+	    }
+	    Tcl_SetObjResult(interp, resultPtr);
+	    return TCL_OK;
+	}
+	case ZIP_MATCH: {
+	    Tcl_Obj *listPtr;
+	    CONST char *actual;
+	    int actualLen;
+
+	    if (objc != 6) {
+		Tcl_WrongNumArgs(interp, 2, objv, 
+				 "channel path actualpath pattern");
+		return TCL_ERROR;
+	    }
+	    path = Tcl_GetStringFromObj(objv[3], &len);
+	    actual = Tcl_GetStringFromObj(objv[4], &actualLen);
+	    pattern = Tcl_GetString(objv[5]);
+	    entry = VfsZipLookup(indexPtr, path, len);
+	    resultPtr = Tcl_NewObj();
+	    listPtr = Tcl_NewObj();
+	    if (*pattern == '\0') {
+		/* Asking whether the path itself exists */
+		if (entry < 0) {
+		    Tcl_SetObjResult(interp, resultPtr);
+		    return TCL_OK;
+		}
+		Tcl_ListObjAppendElement(NULL, listPtr, objv[4]);
+		Tcl_ListObjAppendElement(NULL, listPtr, 
+					 VfsZipStatBuf(indexPtr, entry));
+	    } else if (entry >= 0) {
+		for (child = VfsZipMatchRange(indexPtr, entry, pattern, &last);
+		     child < last; child++) {
+		    Tcl_Obj *pathPtr;
+		    int i = indexPtr->children[child];
+
+		    if (!VfsZipMatch(indexPtr, child, pattern)) {
+			continue;
+		    }
+		    ePtr = &indexPtr->entries[i];
+		    pathPtr = Tcl_NewStringObj(actual, actualLen);
+		    if (actualLen > 0 && actual[actualLen-1] != '/') {
+			Tcl_AppendToObj(pathPtr, "/", 1);
+		    }
+		    Tcl_AppendToObj(pathPtr, 
+			    indexPtr->pool + ePtr->name + ePtr->nameTail, 
+			    ePtr->nameLen - ePtr->nameTail);
+		    Tcl_ListObjAppendElement(NULL, listPtr, pathPtr);
+		    Tcl_ListObjAppendElement(NULL, listPtr, 
+					     VfsZipStatBuf(indexPtr, i));
+		}
+	    }
+	    /* Hand back the stats, so that no callback per entry is needed */
+	    Tcl_ListObjAppendElement(NULL, resultPtr, 
+				     Tcl_NewStringObj("-stat", -1));
+	    Tcl_ListObjAppendElement(NULL, resultPtr, listPtr);
+	    Tcl_SetObjResult(interp, resultPtr);
+	    return TCL_OK;
+	}
+	case ZIP_STATMANY: {
+	    Tcl_Obj **names;
+	    Tcl_DString ds;
+	    int i, numNames;
+
+	    if (objc != 5) {
+		Tcl_WrongNumArgs(interp, 2, objv, "channel dir names");
+		return TCL_ERROR;
+	    }
+	    if (Tcl_ListObjGetElements(interp, objv[4], &numNames, 
+				       &names) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    path = Tcl_GetStringFromObj(objv[3], &len);
+	    resultPtr = Tcl_NewObj();
+	    Tcl_DStringInit(&ds);
+	    for (i = 0; i < numNames; i++) {
+		Tcl_DStringSetLength(&ds, 0);
+		if (len > 0) {
+		    Tcl_DStringAppend(&ds, path, len);
+		    Tcl_DStringAppend(&ds, "/", 1);
+		}
+		Tcl_DStringAppend(&ds, Tcl_GetString(names[i]), -1);
+		entry = VfsZipLookup(indexPtr, Tcl_DStringValue(&ds), 
+				     Tcl_DStringLength(&ds));
+		if (entry >= 0) {
+		    Tcl_ListObjAppendElement(NULL, resultPtr, names[i]);
+		    Tcl_ListObjAppendElement(NULL, resultPtr, 
+					     VfsZipStatBuf(indexPtr, entry));
+		}
+	    }
+	    Tcl_DStringFree(&ds);
+	    Tcl_SetObjResult(interp, resultPtr);
+	    return TCL_OK;
+	}
+	case ZIP_SIZE: {
+	    if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "channel");
+		return TCL_ERROR;
+	    }
+	    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)
+		    sizeof(VfsZipIndex) 
+		    + indexPtr->maxEntries * sizeof(VfsZipEntry)
+		    + indexPtr->maxPool 
+		    + (indexPtr->mask + 1) * sizeof(int)
+		    + indexPtr->numChildren * sizeof(int)));
+	    return TCL_OK;
+	}
+	case ZIP_OPEN: {
+	    /* Handled above */
+	    break;
+	}
+    }
+    return TCL_OK;
+}
+
+/* The index of the channel named by 'chanObj', or NULL and an error */
+static VfsZipIndex*
+VfsZipGet(Tcl_Interp *interp, Tcl_Obj *chanObj) {
+    Tcl_Channel chan;
+    Tcl_HashEntry *hPtr = NULL;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    chan = Tcl_GetChannel(interp, Tcl_GetString(chanObj), NULL);
+    if (chan == NULL) {
+	return NULL;
+    }
+    if (tsdPtr->zipInit) {
+	hPtr = Tcl_FindHashEntry(&tsdPtr->zipTable, (char*) chan);
+    }
+    if (hPtr == NULL) {
+	Tcl_AppendResult(interp, "channel \"", Tcl_GetString(chanObj), 
+			 "\" has no zip index", (char *) NULL);
+	return NULL;
+    }
+    return (VfsZipIndex*) Tcl_GetHashValue(hPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsZipRead --
+ *
+ *	Find the end of central directory record of the zip archive
+ *	open on 'chan', whose translation must be binary, and index
+ *	the central directory it describes.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Moves the channel's access point.  The index is kept for the
+ *	channel until it is closed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsZipRead(Tcl_Interp *interp, Tcl_Channel chan) {
+    VfsZipIndex *indexPtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_Obj *limitObj;
+    Tcl_WideInt end, limit, at, from, found = -1, base, start;
+    unsigned char *buf;
+    unsigned int cdSize, cdOffset;
+    int len = 0, i = 0, numItems, isNew, result;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    end = Tcl_Seek(chan, 0, SEEK_END);
+    if (end < 0) {
+	Tcl_AppendResult(interp, "error seeking: ", Tcl_PosixError(interp), 
+			 (char *) NULL);
+	return TCL_ERROR;
+    }
+    limit = end;
+    limitObj = Tcl_GetVar2Ex(interp, "::zip::max_header_seek", NULL, 
+			     TCL_GLOBAL_ONLY);
+    if (limitObj != NULL 
+	    && Tcl_GetWideIntFromObj(NULL, limitObj, &at) == TCL_OK 
+	    && at < limit) {
+	limit = at;
+    }
+
+    /*
+     * The record is looked for backwards from the end, since there may
+     * be a comment after it, and so that an archive stored in this one
+     * without compression is not mistaken for it.  Each chunk overlaps
+     * the one after, so that no record is split between them.
+     */
+    buf = (unsigned char*) ckalloc(VFS_ZIP_CHUNK + 21);
+    at = 0;
+    while (found < 0 && at < limit) {
+	at += VFS_ZIP_CHUNK;
+	if (at > limit) {
+	    at = limit;
+	}
+	from = end - at;
+	len = (end - from < VFS_ZIP_CHUNK + 21) 
+		? (int) (end - from) : VFS_ZIP_CHUNK + 21;
+	if (Tcl_Seek(chan, from, SEEK_SET) < 0 
+		|| Tcl_Read(chan, (char*) buf, len) != len) {
+	    ckfree((char*) buf);
+	    Tcl_AppendResult(interp, "error reading: ", 
+			     Tcl_PosixError(interp), (char *) NULL);
+	    return TCL_ERROR;
+	}
+	for (i = len - 22; i >= 0; i--) {
+	    if (buf[i] == 'P' && !memcmp(buf + i, "PK\05\06", 4)) {
+		found = from + i;
+		break;
+	    }
+	}
+    }
+    if (found < 0) {
+	ckfree((char*) buf);
+	Tcl_SetResult(interp, "no header found", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    numItems = VfsZipShort(buf + i + 8);
+    cdSize = VfsZipLong(buf + i + 12);
+    cdOffset = VfsZipLong(buf + i + 16);
+    ckfree((char*) buf);
+
+    /* Allow for data before the archive, as in an executable */
+    base = found - (Tcl_WideInt) cdSize - (Tcl_WideInt) cdOffset;
+    if (base < 0) {
+	base = 0;
+    }
+    start = base + cdOffset;
+    if (found - start > INT_MAX) {
+	Tcl_SetResult(interp, "central directory too large", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    len = (found > start) ? (int) (found - start) : 0;
+    buf = (unsigned char*) ckalloc((unsigned) len + 1);
+    if (Tcl_Seek(chan, start, SEEK_SET) < 0 
+	    || Tcl_Read(chan, (char*) buf, len) != len) {
+	ckfree((char*) buf);
+	Tcl_AppendResult(interp, "error reading: ", Tcl_PosixError(interp), 
+			 (char *) NULL);
+	return TCL_ERROR;
+    }
+
+    indexPtr = (VfsZipIndex*) ckalloc(sizeof(VfsZipIndex));
+    memset(indexPtr, 0, sizeof(VfsZipIndex));
+    indexPtr->channel = chan;
+    /* The root, whose key is empty */
+    VfsZipAddEntry(indexPtr);
+    indexPtr->entries[0].offset = -1;
+    indexPtr->entries[0].isDir = 1;
+    indexPtr->entries[0].live = 1;
+    VfsZipInsert(indexPtr, 0);
+    result = VfsZipParse(interp, indexPtr, buf, len, numItems, base);
+    ckfree((char*) buf);
+    if (result != TCL_OK) {
+	VfsZipFree(indexPtr);
+	return TCL_ERROR;
+    }
+    VfsZipLink(indexPtr);
+
+    if (!tsdPtr->zipInit) {
+	Tcl_InitHashTable(&tsdPtr->zipTable, TCL_ONE_WORD_KEYS);
+	Tcl_CreateThreadExitHandler(VfsZipThreadExit, NULL);
+	tsdPtr->zipInit = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&tsdPtr->zipTable, (char*) chan, &isNew);
+    if (!isNew) {
+	VfsZipIndex *oldPtr = (VfsZipIndex*) Tcl_GetHashValue(hPtr);
+	Tcl_DeleteCloseHandler(chan, VfsZipClosed, (ClientData) oldPtr);
+	VfsZipFree(oldPtr);
+    }
+    Tcl_SetHashValue(hPtr, (ClientData) indexPtr);
+    Tcl_CreateCloseHandler(chan, VfsZipClosed, (ClientData) indexPtr);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsZipParse --
+ *
+ *	Add the 'numItems' file headers of the central directory held
+ *	in 'cd' to the index, together with the directories their
+ *	names imply.  Names are decoded and trimmed as zip::TOC did,
+ *	and a later entry of the same name replaces an earlier one.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Fills in the entries, pool and hash table of the index.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsZipParse(Tcl_Interp *interp, VfsZipIndex *indexPtr, unsigned char *cd,
+	    int cdLen, int numItems, Tcl_WideInt base) {
+    Tcl_Encoding utf8, latin1;
+    Tcl_DString ds;
+    int i, pos = 0, result = TCL_OK;
+
+    utf8 = Tcl_GetEncoding(NULL, "utf-8");
+    latin1 = Tcl_GetEncoding(NULL, "iso8859-1");
+    for (i = 0; i < numItems; i++) {
+	unsigned char *p = cd + pos;
+	VfsZipEntry *ePtr;
+	Tcl_Encoding encoding;
+	CONST char *str;
+	int flen, elen, clen, entry, len, nameLen, keyLen;
+
+	if (pos + 46 > cdLen || memcmp(p, "PK\01\02", 4)) {
+	    char hex[9];
+	    int j, n = (cdLen - pos < 4) ? cdLen - pos : 4;
+
+	    for (j = 0; j < n; j++) {
+		sprintf(hex + 2*j, "%02x", p[j]);
+	    }
+	    hex[2*n] = '\0';
+	    Tcl_AppendResult(interp, "bad central header: ", hex, 
+			     (char *) NULL);
+	    result = TCL_ERROR;
+	    break;
+	}
+	flen = VfsZipShort(p + 28);
+	elen = VfsZipShort(p + 30);
+	clen = VfsZipShort(p + 32);
+	if (pos + 46 + flen + elen + clen > cdLen) {
+	    Tcl_SetResult(interp, "truncated central directory", TCL_STATIC);
+	    result = TCL_ERROR;
+	    break;
+	}
+	pos += 46 + flen + elen + clen;
+	encoding = (VfsZipShort(p + 8) & (1 << 11)) ? utf8 : latin1;
+
+	/* As 'string trimleft $name ./' and 'string trimright $name /' */
+	Tcl_ExternalToUtfDString(encoding, (char*) p + 46, flen, &ds);
+	str = Tcl_DStringValue(&ds);
+	len = Tcl_DStringLength(&ds);
+	while (len > 0 && (*str == '.' || *str == '/')) {
+	    str++;
+	    len--;
+	}
+	nameLen = len;
+	while (nameLen > 0 && str[nameLen-1] == '/') {
+	    nameLen--;
+	}
+	if (nameLen == 0) {
+	    Tcl_DStringFree(&ds);
+	    continue;
+	}
+
+	entry = VfsZipAddEntry(indexPtr);
+	ePtr = &indexPtr->entries[entry];
+	ePtr->vem = VfsZipShort(p + 4);
+	ePtr->ver = VfsZipShort(p + 6);
+	ePtr->flags = VfsZipShort(p + 8);
+	ePtr->method = VfsZipShort(p + 10);
+	ePtr->dosTime = VfsZipShort(p + 12);
+	ePtr->dosDate = VfsZipShort(p + 14);
+	ePtr->crc = VfsZipLong(p + 16);
+	ePtr->csize = VfsZipLong(p + 20);
+	ePtr->size = VfsZipLong(p + 24);
+	ePtr->disk = VfsZipShort(p + 34);
+	ePtr->attr = VfsZipShort(p + 36);
+	ePtr->atx = (int) VfsZipLong(p + 38);
+	ePtr->offset = base + (Tcl_WideInt) (unsigned long) VfsZipLong(p + 42);
+	ePtr->isDir = ((ePtr->atx & 16) != 0) 
+		|| ((ePtr->atx >> 16) & 0x4000) != 0;
+	ePtr->depth = (unsigned short) VfsZipDepth(str, nameLen);
+	ePtr->live = 1;
+
+	ePtr->name = VfsZipAddString(indexPtr, str, nameLen);
+	ePtr->nameLen = nameLen;
+	ePtr->nameTail = VfsZipTailStart(str, nameLen);
+	Tcl_DStringSetLength(&ds, (int) (str - Tcl_DStringValue(&ds)) 
+			     + nameLen);
+	keyLen = Tcl_UtfToLower((char*) str);
+	if (keyLen == nameLen 
+		&& !memcmp(str, indexPtr->pool + ePtr->name, nameLen)) {
+	    ePtr->key = ePtr->name;
+	} else {
+	    ePtr->key = VfsZipAddString(indexPtr, str, keyLen);
+	}
+	ePtr->keyLen = keyLen;
+	ePtr->keyTail = VfsZipTailStart(str, keyLen);
+	Tcl_DStringFree(&ds);
+
+	ePtr->extra = VfsZipAddString(indexPtr, (char*) p + 46 + flen, elen);
+	ePtr->extraLen = elen;
+	Tcl_ExternalToUtfDString(encoding, (char*) p + 46 + flen + elen, 
+				 clen, &ds);
+	ePtr->comment = VfsZipAddString(indexPtr, Tcl_DStringValue(&ds), 
+					Tcl_DStringLength(&ds));
+	ePtr->commentLen = Tcl_DStringLength(&ds);
+	Tcl_DStringFree(&ds);
+
+	VfsZipInsert(indexPtr, entry);
+	VfsZipImply(indexPtr, entry);
+    }
+    Tcl_FreeEncoding(utf8);
+    Tcl_FreeEncoding(latin1);
+    return result;
+}
+
+/*
+ * Add the directories implied by the name of an entry which are not
+ * in the index yet, as zip::FAKEDIR did.  They share its strings.
+ */
+static void
+VfsZipImply(VfsZipIndex *indexPtr, int entry) {
+    VfsZipEntry *ePtr = &indexPtr->entries[entry];
+    int name = ePtr->name, nameLen = ePtr->nameLen;
+    int key = ePtr->key, keyLen = ePtr->keyLen;
+
+    while (1) {
+	nameLen = VfsZipDirLen(indexPtr->pool + name, nameLen);
+	keyLen = VfsZipDirLen(indexPtr->pool + key, keyLen);
+	if (nameLen == 0 || keyLen == 0 
+		|| VfsZipFind(indexPtr, indexPtr->pool + key, keyLen) >= 0) {
+	    /* Its parents are there too */
+	    break;
+	}
+	entry = VfsZipAddEntry(indexPtr);
+	ePtr = &indexPtr->entries[entry];
+	ePtr->offset = -1;
+	ePtr->isDir = 1;
+	ePtr->live = 1;
+	ePtr->name = name;
+	ePtr->nameLen = nameLen;
+	ePtr->nameTail = VfsZipTailStart(indexPtr->pool + name, nameLen);
+	ePtr->key = key;
+	ePtr->keyLen = keyLen;
+	ePtr->keyTail = VfsZipTailStart(indexPtr->pool + key, keyLen);
+	ePtr->depth = (unsigned short) VfsZipDepth(indexPtr->pool + key, 
+						   keyLen);
+	VfsZipInsert(indexPtr, entry);
+    }
+}
+
+/* Add a zeroed entry, returning its index */
+static int
+VfsZipAddEntry(VfsZipIndex *indexPtr) {
+    if (indexPtr->numEntries == indexPtr->maxEntries) {
+	indexPtr->maxEntries = indexPtr->maxEntries ? 
+		2 * indexPtr->maxEntries : 64;
+	indexPtr->entries = (VfsZipEntry*) ckrealloc(
+		(char*) indexPtr->entries, 
+		indexPtr->maxEntries * sizeof(VfsZipEntry));
+    }
+    memset(&indexPtr->entries[indexPtr->numEntries], 0, sizeof(VfsZipEntry));
+    return indexPtr->numEntries++;
+}
+
+/* Copy a string to the pool, returning its offset there */
+static int
+VfsZipAddString(VfsZipIndex *indexPtr, CONST char *str, int len) {
+    int offset = indexPtr->poolSize;
+
+    if (offset + len > indexPtr->maxPool) {
+	while (offset + len > indexPtr->maxPool) {
+	    indexPtr->maxPool = indexPtr->maxPool ? 
+		    2 * indexPtr->maxPool : 4096;
+	}
+	indexPtr->pool = ckrealloc(indexPtr->pool, 
+				   (unsigned) indexPtr->maxPool);
+    }
+    memcpy(indexPtr->pool + offset, str, (size_t) len);
+    indexPtr->poolSize += len;
+    return offset;
+}
+
+/* FNV-1a */
+static unsigned int
+VfsZipHash(CONST char *key, int len) {
+    unsigned int hash = 2166136261U;
+
+    while (len-- > 0) {
+	hash = (hash ^ (unsigned char) *key++) * 16777619U;
+    }
+    return hash;
+}
+
+/* Add an entry to the hash table, replacing any of the same key */
+static void
+VfsZipInsert(VfsZipIndex *indexPtr, int entry) {
+    VfsZipEntry *ePtr;
+    CONST char *key;
+    unsigned int i;
+    int other;
+
+    if (2 * (indexPtr->numKeys + 1) > (int) (indexPtr->mask + 1)) {
+	int *oldBuckets = indexPtr->buckets;
+	unsigned int oldSize = oldBuckets ? indexPtr->mask + 1 : 0, j;
+
+	indexPtr->mask = oldSize ? 2 * oldSize - 1 : 63;
+	indexPtr->buckets = (int*) ckalloc((indexPtr->mask + 1) * sizeof(int));
+	memset(indexPtr->buckets, 0, (indexPtr->mask + 1) * sizeof(int));
+	for (j = 0; j < oldSize; j++) {
+	    if (oldBuckets[j] != 0) {
+		ePtr = &indexPtr->entries[oldBuckets[j] - 1];
+		i = VfsZipHash(indexPtr->pool + ePtr->key, ePtr->keyLen) 
+			& indexPtr->mask;
+		while (indexPtr->buckets[i] != 0) {
+		    i = (i + 1) & indexPtr->mask;
+		}
+		indexPtr->buckets[i] = oldBuckets[j];
+	    }
+	}
+	if (oldBuckets != NULL) {
+	    ckfree((char*) oldBuckets);
+	}
+    }
+
+    ePtr = &indexPtr->entries[entry];
+    key = indexPtr->pool + ePtr->key;
+    i = VfsZipHash(key, ePtr->keyLen) & indexPtr->mask;
+    while ((other = indexPtr->buckets[i]) != 0) {
+	VfsZipEntry *otherPtr = &indexPtr->entries[other - 1];
+
+	if (otherPtr->keyLen == ePtr->keyLen 
+		&& !memcmp(indexPtr->pool + otherPtr->key, key, 
+			   (size_t) ePtr->keyLen)) {
+	    otherPtr->live = 0;
+	    indexPtr->buckets[i] = entry + 1;
+	    return;
+	}
+	i = (i + 1) & indexPtr->mask;
+    }
+    indexPtr->buckets[i] = entry + 1;
+    indexPtr->numKeys++;
+}
+
+/* The entry with the given lower case key, or -1 */
+static int
+VfsZipFind(VfsZipIndex *indexPtr, CONST char *key, int len) {
+    unsigned int i = VfsZipHash(key, len) & indexPtr->mask;
+    int entry;
+
+    while ((entry = indexPtr->buckets[i]) != 0) {
+	VfsZipEntry *ePtr = &indexPtr->entries[entry - 1];
+
+	if (ePtr->keyLen == len 
+		&& !memcmp(indexPtr->pool + ePtr->key, key, (size_t) len)) {
+	    return entry - 1;
+	}
+	i = (i + 1) & indexPtr->mask;
+    }
+    return -1;
+}
+
+/* The entry for a path, in any case, or -1; "" and "." are the root */
+static int
+VfsZipLookup(VfsZipIndex *indexPtr, CONST char *path, int len) {
+    Tcl_DString ds;
+    int entry;
+
+    if (len == 0 || (len == 1 && *path == '.')) {
+	return 0;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, path, len);
+    len = Tcl_UtfToLower(Tcl_DStringValue(&ds));
+    entry = VfsZipFind(indexPtr, Tcl_DStringValue(&ds), len);
+    Tcl_DStringFree(&ds);
+    return entry;
+}
+
+/* Length of the directory part of a path, as 'file dirname', or 0 */
+static int
+VfsZipDirLen(CONST char *path, int len) {
+    while (len > 0 && path[len-1] != '/') {
+	len--;
+    }
+    while (len > 0 && path[len-1] == '/') {
+	len--;
+    }
+    return len;
+}
+
+/* Where the last element of a path starts */
+static int
+VfsZipTailStart(CONST char *path, int len) {
+    while (len > 0 && path[len-1] != '/') {
+	len--;
+    }
+    return len;
+}
+
+/* Number of elements in a path, as 'llength [file split $path]' */
+static int
+VfsZipDepth(CONST char *path, int len) {
+    int i, depth = 0;
+
+    for (i = 0; i < len; i++) {
+	if (path[i] != '/' && (i == 0 || path[i-1] == '/')) {
+	    depth++;
+	}
+    }
+    return depth;
+}
+
+/* Order entries by directory, and then by the lower case last element */
+static int
+VfsZipCompare(CONST VOID *first, CONST VOID *second) {
+    CONST VfsZipSortItem *a = (CONST VfsZipSortItem*) first;
+    CONST VfsZipSortItem *b = (CONST VfsZipSortItem*) second;
+    int cmp;
+
+    if (a->parent != b->parent) {
+	return (a->parent < b->parent) ? -1 : 1;
+    }
+    cmp = memcmp(a->tail, b->tail, 
+		 (size_t) (a->tailLen < b->tailLen ? a->tailLen : b->tailLen));
+    return cmp ? cmp : a->tailLen - b->tailLen;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsZipLink --
+ *
+ *	Once all entries are in the index, list those of each directory
+ *	together, in order, and give the arrays their final size.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Sets the children of each entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VfsZipLink(VfsZipIndex *indexPtr) {
+    VfsZipSortItem *items;
+    int i, n = 0;
+
+    items = (VfsZipSortItem*) ckalloc(indexPtr->numEntries 
+				      * sizeof(VfsZipSortItem));
+    for (i = 1; i < indexPtr->numEntries; i++) {
+	VfsZipEntry *ePtr = &indexPtr->entries[i];
+	CONST char *key = indexPtr->pool + ePtr->key;
+	int parent;
+
+	if (!ePtr->live) {
+	    continue;
+	}
+	parent = VfsZipFind(indexPtr, key, VfsZipDirLen(key, ePtr->keyLen));
+	items[n].parent = (parent < 0) ? 0 : parent;
+	items[n].tail = key + ePtr->keyTail;
+	items[n].tailLen = ePtr->keyLen - ePtr->keyTail;
+	items[n].entry = i;
+	n++;
+    }
+    qsort(items, (size_t) n, sizeof(VfsZipSortItem), VfsZipCompare);
+    indexPtr->children = (int*) ckalloc((unsigned) (n + 1) * sizeof(int));
+    indexPtr->numChildren = n;
+    for (i = 0; i < n; i++) {
+	VfsZipEntry *parentPtr = &indexPtr->entries[items[i].parent];
+
+	if (parentPtr->numChildren++ == 0) {
+	    parentPtr->children = i;
+	}
+	indexPtr->children[i] = items[i].entry;
+    }
+    ckfree((char*) items);
+
+    indexPtr->maxEntries = indexPtr->numEntries;
+    indexPtr->entries = (VfsZipEntry*) ckrealloc((char*) indexPtr->entries, 
+	    indexPtr->maxEntries * sizeof(VfsZipEntry));
+    if (indexPtr->poolSize > 0) {
+	indexPtr->maxPool = indexPtr->poolSize;
+	indexPtr->pool = ckrealloc(indexPtr->pool, 
+				   (unsigned) indexPtr->maxPool);
+    }
+}
+
+/* Compare the last element of a child with a lower case prefix */
+static int
+VfsZipPrefixCompare(VfsZipIndex *indexPtr, int child, CONST char *prefix,
+		    int len) {
+    VfsZipEntry *ePtr = &indexPtr->entries[indexPtr->children[child]];
+    int tailLen = ePtr->keyLen - ePtr->keyTail;
+    int cmp = memcmp(indexPtr->pool + ePtr->key + ePtr->keyTail, prefix, 
+		     (size_t) (tailLen < len ? tailLen : len));
+
+    if (cmp == 0 && tailLen < len) {
+	cmp = -1;
+    }
+    return cmp;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VfsZipMatchRange --
+ *
+ *	Find the children of an entry which may match a glob pattern:
+ *	all of them, unless the pattern starts with literal text, in
+ *	which case only those starting with that, in any case, which
+ *	are found by binary search.
+ *
+ * Results:
+ *	The first position in the index's children array, with the one
+ *	after the last left in *lastPtr.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VfsZipMatchRange(VfsZipIndex *indexPtr, int entry, CONST char *pattern,
+		 int *lastPtr) {
+    VfsZipEntry *ePtr = &indexPtr->entries[entry];
+    int first = ePtr->children, last = first + ePtr->numChildren;
+    int len = (int) strcspn(pattern, "*?[\\");
+
+    if (len > 0 && first < last) {
+	Tcl_DString ds;
+	CONST char *prefix;
+	int lo = first, hi = last;
+
+	Tcl_DStringInit(&ds);
+	Tcl_DStringAppend(&ds, pattern, len);
+	len = Tcl_UtfToLower(Tcl_DStringValue(&ds));
+	prefix = Tcl_DStringValue(&ds);
+	while (lo < hi) {
+	    int mid = lo + (hi - lo) / 2;
+	    if (VfsZipPrefixCompare(indexPtr, mid, prefix, len) < 0) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	first = lo;
+	hi = last;
+	while (lo < hi) {
+	    int mid = lo + (hi - lo) / 2;
+	    if (VfsZipPrefixCompare(indexPtr, mid, prefix, len) == 0) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	last = lo;
+	Tcl_DStringFree(&ds);
+    }
+    *lastPtr = last;
+    return first;
+}
+
+/* Does the last element of a child match the pattern, in any case? */
+static int
+VfsZipMatch(VfsZipIndex *indexPtr, int child, CONST char *pattern) {
+    VfsZipEntry *ePtr = &indexPtr->entries[indexPtr->children[child]];
+    Tcl_DString ds;
+    int match;
+
+    if (pattern[0] == '*' && pattern[1] == '\0') {
+	return 1;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, indexPtr->pool + ePtr->name + ePtr->nameTail, 
+		      ePtr->nameLen - ePtr->nameTail);
+    match = Tcl_StringCaseMatch(Tcl_DStringValue(&ds), pattern, 1);
+    Tcl_DStringFree(&ds);
+    return match;
+}
+
+/*
+ * The stat of an entry, as vfs::zip::stat made it from zip::stat.
+ * Archives made on other systems, or by Fossil, may claim sockets,
+ * devices or fifos, which are reported as plain files, and a mode of
+ * all ones is taken to be a directory.
+ */
+static Tcl_Obj*
+VfsZipStatBuf(VfsZipIndex *indexPtr, int entry) {
+    VfsZipEntry *ePtr = &indexPtr->entries[entry];
+    Tcl_StatBuf buf;
+    Tcl_WideInt mtime = 0;
+    int mode = 0777;
+
+    memset(&buf, 0, sizeof(Tcl_StatBuf));
+    if (ePtr->offset >= 0) {
+	mode = (ePtr->atx >> 16) & 0xffff;
+	switch (mode & 0xf000) {
+	    case 0xc000: case 0x6000: case 0x2000: case 0x1000:
+		mode &= 0x0fff;
+		break;
+	}
+	if (mode == 0xffff) {
+	    mode = 0x41ff;
+	}
+	mtime = VfsZipDosTime(ePtr->dosDate, ePtr->dosTime);
+	buf.st_size = ePtr->size;
+    }
+    buf.st_mode = mode | (ePtr->isDir ? S_IFDIR : S_IFREG);
+    buf.st_ino = (unsigned short) ePtr->offset;
+    buf.st_dev = -1;
+    buf.st_nlink = 1;
+    buf.st_uid = (short) -1;
+    buf.st_gid = (short) -1;
+    buf.st_atime = buf.st_mtime = buf.st_ctime = (time_t) mtime;
+    return VfsNewStatBufObj(&buf);
+}
+
+/* The key/value list zip::stat sets its array from */
+static Tcl_Obj*
+VfsZipStatList(VfsZipIndex *indexPtr, int entry) {
+    VfsZipEntry *ePtr = &indexPtr->entries[entry];
+    CONST char *pool = indexPtr->pool;
+    Tcl_Obj *listPtr = Tcl_NewObj();
+    Tcl_WideInt mtime = 0;
+
+#define VfsZipAppend(name, valueObj) \
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj(name, -1)); \
+    Tcl_ListObjAppendElement(NULL, listPtr, valueObj)
+
+    VfsZipAppend("name", Tcl_NewStringObj(pool + ePtr->name, ePtr->nameLen));
+    VfsZipAppend("type", Tcl_NewStringObj(ePtr->isDir 
+					  ? "directory" : "file", -1));
+    if (ePtr->offset >= 0) {
+	mtime = VfsZipDosTime(ePtr->dosDate, ePtr->dosTime);
+	VfsZipAppend("vem", Tcl_NewIntObj(ePtr->vem));
+	VfsZipAppend("ver", Tcl_NewIntObj(ePtr->ver));
+	VfsZipAppend("flags", Tcl_NewIntObj(ePtr->flags));
+	VfsZipAppend("method", Tcl_NewIntObj(ePtr->method));
+	VfsZipAppend("crc", Tcl_NewWideIntObj(ePtr->crc));
+	VfsZipAppend("csize", Tcl_NewWideIntObj(ePtr->csize));
+	VfsZipAppend("size", Tcl_NewWideIntObj(ePtr->size));
+	VfsZipAppend("mode", Tcl_NewIntObj((ePtr->atx >> 16) & 0xffff));
+	VfsZipAppend("extra", Tcl_NewByteArrayObj(
+		(unsigned char*) pool + ePtr->extra, ePtr->extraLen));
+	VfsZipAppend("comment", Tcl_NewStringObj(pool + ePtr->comment, 
+						 ePtr->commentLen));
+	VfsZipAppend("disk", Tcl_NewIntObj(ePtr->disk));
+	VfsZipAppend("attr", Tcl_NewIntObj(ePtr->attr));
+	VfsZipAppend("atx", Tcl_NewIntObj(ePtr->atx));
+	VfsZipAppend("ino", Tcl_NewWideIntObj(ePtr->offset));
+    } else {
+	VfsZipAppend("size", Tcl_NewIntObj(0));
+	VfsZipAppend("mode", Tcl_NewIntObj(0777));
+	VfsZipAppend("ino", Tcl_NewIntObj(-1));
+    }
+    VfsZipAppend("depth", Tcl_NewIntObj(ePtr->depth));
+    VfsZipAppend("mtime", Tcl_NewWideIntObj(mtime));
+    VfsZipAppend("atime", Tcl_NewWideIntObj(mtime));
+    VfsZipAppend("ctime", Tcl_NewWideIntObj(mtime));
+    VfsZipAppend("dev", Tcl_NewIntObj(-1));
+    VfsZipAppend("uid", Tcl_NewIntObj(-1));
+    VfsZipAppend("gid", Tcl_NewIntObj(-1));
+    VfsZipAppend("nlink", Tcl_NewIntObj(1));
+#undef VfsZipAppend
+    return listPtr;
+}
+
+/*
+ * Seconds since the epoch of an MS-DOS date and time, taken as UTC
+ * as zip::DosTime does, with out of range fields brought into range.
+ */
+static Tcl_WideInt
+VfsZipDosTime(unsigned short date, unsigned short time) {
+    int sec = (time & 0x1f) * 2, min = (time >> 5) & 0x3f;
+    int hour = (time >> 11) & 0x1f;
+    int mday = date & 0x1f, mon = (date >> 5) & 0xf;
+    int year = ((date >> 9) & 0x7f) + 1980;
+    Tcl_WideInt days;
+
+    if (sec > 59) sec = 59;
+    if (min > 59) min = 59;
+    if (hour > 23) hour = 23;
+    if (mday < 1) mday = 1;
+    if (mon < 1) mon = 1;
+    if (mon > 12) mon = 12;
+
+    /*
+     * Days from 1 March 1600, so that leap days come last in the year,
+     * and the years counted are never negative for the divisions below
+     */
+    if (mon <= 2) {
+	year--;
+	mon += 12;
+    }
+    year -= 1600;
+    days = 365 * (Tcl_WideInt) year + year / 4 - year / 100 + year / 400
+	    + (153 * (mon - 3) + 2) / 5 + mday - 1;
+    /* ... and then from 1 January 1970 */
+    days -= 135080;
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+static void
+VfsZipFree(VfsZipIndex *indexPtr) {
+    if (indexPtr->entries != NULL) {
+	ckfree((char*) indexPtr->entries);
+    }
+    if (indexPtr->pool != NULL) {
+	ckfree(indexPtr->pool);
+    }
+    if (indexPtr->buckets != NULL) {
+	ckfree((char*) indexPtr->buckets);
+    }
+    if (indexPtr->children != NULL) {
+	ckfree((char*) indexPtr->children);
+    }
+    ckfree((char*) indexPtr);
+}
+
+/* The channel of an index is being closed */
+static void
+VfsZipClosed(ClientData clientData) {
+    VfsZipIndex *indexPtr = (VfsZipIndex*) clientData;
+    Tcl_HashEntry *hPtr;
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->zipInit) {
+	hPtr = Tcl_FindHashEntry(&tsdPtr->zipTable, 
+				 (char*) indexPtr->channel);
+	if (hPtr != NULL) {
+	    Tcl_DeleteHashEntry(hPtr);
+	}
+    }
+    VfsZipFree(indexPtr);
+}
+
+/* Free the indexes left when the thread exits */
+static void
+VfsZipThreadExit(ClientData clientData) {
+    ThreadSpecificData *tsdPtr = TCL_TSD_INIT(&dataKey);
+
+    if (tsdPtr->zipInit) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hPtr;
+
+	for (hPtr = Tcl_FirstHashEntry(&tsdPtr->zipTable, &search); 
+	     hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+	    VfsZipIndex *indexPtr = (VfsZipIndex*) Tcl_GetHashValue(hPtr);
+	    Tcl_DeleteCloseHandler(indexPtr->channel, VfsZipClosed, 
+				   (ClientData) indexPtr);
+	    VfsZipFree(indexPtr);
+	}
+	Tcl_DeleteHashTable(&tsdPtr->zipTable);
+	tsdPtr->zipInit = 0;
+    }
+}
@@ -26,10 +26,12 @@
 #	Core is 2.7, this v2.6.8 has defaultKeepalive 1 and different
 #	default -useragent.
 # 2.6.9 Merged fix for zlib crc check on 64bit systems.
+# 2.6.10 Synchronous requests made from a handler of a vfs mounted with
+#	-async yield to the event loop instead of using vwait.
 
 package require Tcl 8.4
 # keep this in sync with pkgIndex.tcl
-package provide http 2.6.9
+package provide http 2.6.10
 
 namespace eval http {
     # Allow resourcing to not clobber existing data
@@ -1258,8 +1260,16 @@ proc http::wait {token} {
     upvar 0 $token state
 
     if {![info exists state(status)] || $state(status) eq ""} {
-	# We must wait on the original variable name, not the upvar alias
-	vwait ${token}(status)
+	# We must wait on the original variable name, not the upvar alias.
+	# In a handler of a vfs mounted with -async, which runs as a
+	# coroutine, vfs::asyncWait yields rather than blocking other
+	# events in a nested vwait.
+	if {[llength [info commands ::vfs::AsyncCoroutine]] \
+		&& [::vfs::AsyncCoroutine] ne ""} {
+	    ::vfs::asyncWait ${token}(status)
+	} else {
+	    vwait ${token}(status)
+	}
     }
 
     return [status $token]
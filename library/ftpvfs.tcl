@@ -125,20 +125,14 @@ proc vfs::ftp::open {fd name mode permissions} {
     ::vfs::log "open $name $mode $permissions"
     # return a list of two elements:
     # 1. first element is the Tcl channel name which has been opened
+    #    (or -data and the contents of a file opened read-only)
     # 2. second element (optional) is a command to evaluate when
     #    the channel is closed.
     switch -glob -- $mode {
 	"" -
 	"r" {
 	    ftp::Get $fd $name -variable tmp
-
-	    set filed [vfs::memchan]
-	    fconfigure $filed -translation binary
-	    puts -nonewline $filed $tmp
-
-	    fconfigure $filed -translation auto
-	    seek $filed 0
-	    return [list $filed]
+	    return [list -data $tmp]
 	}
 	"a" {
 	    # Try to append nothing to the file
@@ -211,6 +205,17 @@ proc vfs::ftp::cachedList {fd dir} {
     return $listing
 }
 
+# For 'vfs::filesystem memory'.  The listings are not kept per site,
+# so each mount reports all of them.
+proc vfs::ftp::memory {fd path} {
+    variable cacheList
+    set bytes 0
+    foreach {dir listing} [array get cacheList] {
+	incr bytes [expr {[string length $dir] + [string length $listing]}]
+    }
+    return [list listings $bytes]
+}
+
 # Currently returns a list of name and a list of other
 # information.  The other information is currently a 
 # list of:
@@ -239,22 +244,14 @@ proc vfs::ftp::_parseListLine {line} {
 
 proc vfs::ftp::matchindirectory {fd path actualpath pattern type} {
     ::vfs::log "matchindirectory $fd $path $actualpath $pattern $type"
+    # Return the type of each path, known from its permissions, and
+    # leave the filtering by 'type' to the vfs package.
     set res [list]
     if {![string length $pattern]} {
 	# matching a single file
 	set ftpInfo [_findFtpInfo $fd $path]
 	if {$ftpInfo != ""} {
-	    # Now check if types match
-	    set perms [lindex $ftpInfo 0]
-	    if {[string index $perms 0] == "d"} {
-		if {[::vfs::matchDirectories $type]} {
-		    lappend res $actualpath
-		}
-	    } else {
-		if {[::vfs::matchFiles $type]} {
-		    lappend res $actualpath
-		}
-	    }
+	    lappend res $actualpath [_typeFromPerms [lindex $ftpInfo 0]]
 	}
     } else {
 	# matching all files in the given directory
@@ -266,21 +263,20 @@ proc vfs::ftp::matchindirectory {fd path actualpath pattern type} {
 	    if {![string match $pattern $name]} {
 		continue 
 	    } 
-	    if {[::vfs::matchDirectories $type]} {
-		if {[string index $perms 0] == "d"} {
-		    lappend res [file join $actualpath $name]
-		}
-	    }
-	    if {[::vfs::matchFiles $type]} {
-		if {[string index $perms 0] != "d"} {
-		    lappend res [file join $actualpath $name]
-		}
-	    }
-	    
+	    lappend res [file join $actualpath $name] \
+		[_typeFromPerms [lindex $perms 0]]
 	}
     }
  
-    return $res
+    return [list -stat $res]
+}
+
+proc vfs::ftp::_typeFromPerms {perms} {
+    if {[string index $perms 0] == "d"} {
+	return directory
+    } else {
+	return file
+    }
 }
 
 proc vfs::ftp::createdirectory {fd name} {
@@ -73,7 +73,9 @@ proc vfs::http::Mount {dirurl local args} {
     }
     ::vfs::log "http $dirurl ($parts(url)) mounted at $local"
     # Pass headers along as they may include authentication
-    vfs::filesystem mount $local \
+    # Requests are made through vfs::geturl, so -async lets the handler
+    # wait for them without blocking other events
+    vfs::filesystem mount -async $local \
 	[list vfs::http::handler $parts(url) $headers $parts(file)]
     # Register command to unmount - headers not needed
     vfs::RegisterMount $local [list ::vfs::http::Unmount $parts(url)]
@@ -291,8 +293,7 @@ proc vfs::http::urlname {name} {
 proc vfs::http::geturl {url args} {
     # a wrapper around http::geturl that handles 404 or !ok status check
     # returns error on no success, or a fully ready http token otherwise
-    set token [eval [linsert $args 0 ::http::geturl $url]]
-    http::wait $token
+    set token [eval [linsert $args 0 ::vfs::geturl $url]]
 
     if {[http::ncode $token] == 404 || [http::status $token] ne "ok"} {
 	# 404 Not Found
@@ -350,21 +351,22 @@ proc vfs::http::open {dirurl headers name mode permissions} {
     ::vfs::log "open $name $mode $permissions ($urlname)"
     # return a list of two elements:
     # 1. first element is the Tcl channel name which has been opened
+    #    (or -data and the contents of a file opened read-only)
     # 2. second element (optional) is a command to evaluate when
     #    the channel is closed.
     switch -glob -- $mode {
 	"" -
 	"r" {
+	    variable prefetched
+	    if {[info exists prefetched($dirurl$urlname)]} {
+		set data $prefetched($dirurl$urlname)
+		unset prefetched($dirurl$urlname)
+		return [list -data $data]
+	    }
 	    set token [geturl "$dirurl$urlname" -headers $headers]
-	    set filed [vfs::memchan]
-	    fconfigure $filed -translation binary
-	    puts -nonewline $filed [::http::data $token]
+	    set data [::http::data $token]
 	    http::cleanup $token
-
-	    fconfigure $filed -translation auto
-	    seek $filed 0
-	    # XXX: the close command should free vfs::memchan somehow??
-	    return [list $filed]
+	    return [list -data $data]
 	}
 	"a" -
 	"w*" {
@@ -376,6 +378,55 @@ proc vfs::http::open {dirurl headers name mode permissions} {
     }
 }
 
+# Start fetching files which are about to be read, all at once,
+# keeping them until they are opened
+proc vfs::http::prefetch {dirurl headers name names done} {
+    variable prefetching
+    variable requests
+    # Held until every request has been made
+    set prefetching($done) 1
+    foreach name $names {
+	set url $dirurl[urlname $name]
+	set key [list $done $url]
+	if {[info exists requests($key)]} {
+	    continue
+	}
+	set requests($key) 1
+	incr prefetching($done)
+	if {[catch {::http::geturl $url -headers $headers \
+		-command [list ::vfs::http::Prefetched $key]}]} {
+	    # http may or may not have called back already
+	    Prefetched $key
+	}
+    }
+    if {[incr prefetching($done) -1] == 0} {
+	unset prefetching($done)
+	return 0
+    }
+    return 1
+}
+
+proc vfs::http::Prefetched {key {token ""}} {
+    variable prefetching
+    variable prefetched
+    variable requests
+    if {$token ne ""} {
+	if {[http::status $token] eq "ok" && [http::ncode $token] == 200} {
+	    set prefetched([lindex $key 1]) [http::data $token]
+	}
+	http::cleanup $token
+    }
+    if {![info exists requests($key)]} {
+	return
+    }
+    unset requests($key)
+    set done [lindex $key 0]
+    if {[incr prefetching($done) -1] == 0} {
+	unset prefetching($done)
+	eval $done
+    }
+}
+
 proc vfs::http::matchindirectory {dirurl headers path actualpath pattern type} {
     ::vfs::log "matchindirectory $path $pattern $type"
     set res [list]
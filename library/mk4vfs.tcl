@@ -170,21 +170,11 @@ namespace eval vfs::mk4 {
 		      set fd [mk::channel $sb(ino) contents r]
 		      set fd [vfs::zstream decompress $fd $sb(csize) $sb(size)]
 		    } else {
-		      set fd [vfs::memchan]
-		      fconfigure $fd -translation binary
 		      set s [mk::get $sb(ino) contents]
-		      puts -nonewline $fd [vfs::zip -mode decompress $s]
-
-		      fconfigure $fd -translation auto
-		      seek $fd 0
+		      return [list -data [vfs::zip -mode decompress $s]]
 		    }
 		} elseif { $::mk4vfs::direct } {
-		    set fd [vfs::memchan]
-		    fconfigure $fd -translation binary
-		    puts -nonewline $fd [mk::get $sb(ino) contents]
-
-		    fconfigure $fd -translation auto
-		    seek $fd 0
+		    return [list -data [mk::get $sb(ino) contents]]
 		} else {
 		    set fd [mk::channel $sb(ino) contents r]
 		}
@@ -300,7 +290,7 @@ namespace eval vfs::mk4 {
 namespace eval mk4vfs {
     variable compress 1     ;# HACK - needs to be part of "Super-Block"
     variable flush    5000  ;# Auto-Commit frequency
-    variable direct   0	    ;# read through a memchan, or from Mk4tcl if zero
+    variable direct   0	    ;# read into memory, or from Mk4tcl if zero
     variable zstreamed 0    ;# decompress on the fly (needs zlib 1.1)
 
     namespace eval v {
@@ -367,6 +357,19 @@ namespace eval mk4vfs {
 	mk::file close $db
     }
 
+    # For 'vfs::filesystem memory'
+    proc memory {db path} {
+	set res {}
+	foreach {name pattern} [list cache $db,* fcache $db.*] {
+	    set bytes 0
+	    foreach {key value} [array get v::$name $pattern] {
+		incr bytes [expr {[string length $key] + [string length $value]}]
+	    }
+	    lappend res $name $bytes
+	}
+	return $res
+    }
+
     proc stat {db path {arr ""}} {
 	set sp [::file split $path]
 	set tail [lindex $sp end]
@@ -473,9 +476,7 @@ namespace eval mk4vfs {
 	mk::set $cur size -1 date [clock seconds]
 	flush $fd
 	if { [string match *z* $mode] } {
-	    fconfigure $fd -translation binary
-	    seek $fd 0
-	    set data [read $fd]
+	    set data [vfs::memdata $fd]
 	    set cdata [vfs::zip -mode compress $data]
 	    set len [string length $data]
 	    set clen [string length $cdata]
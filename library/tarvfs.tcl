@@ -24,7 +24,9 @@ namespace eval vfs::tar {}
 
 proc vfs::tar::Mount {tarfile local} {
     set fd [vfs::tar::_open [::file normalize $tarfile]]
-    vfs::filesystem mount $local [list ::vfs::tar::handler $fd]
+    # Archives are read-only, so their metadata can be cached for good
+    vfs::filesystem mount -cache immutable $local \
+	[list ::vfs::tar::handler $fd]
     # Register command to unmount
     vfs::RegisterMount $local [list ::vfs::tar::Unmount $fd]
     return $fd
@@ -45,6 +47,16 @@ proc vfs::tar::handler {tarfd cmd root relative actualpath args} {
     }
 }
 
+# Report the size of the table of contents, for 'vfs::filesystem memory'
+proc vfs::tar::memory {tarfd path} {
+    upvar #0 vfs::tar::$tarfd.toc toc
+    set tocBytes 0
+    foreach {name info} [array get toc] {
+	incr tocBytes [expr {[string length $name] + [string length $info]}]
+    }
+    return [list toc $tocBytes]
+}
+
 proc vfs::tar::attributes {tarfd} { return [list "state"] }
 proc vfs::tar::state {tarfd args} {
     vfs::attributeCantConfigure "state" "readonly" $args
@@ -60,15 +72,15 @@ proc vfs::tar::matchindirectory {tarfd path actualpath pattern type} {
     set res [vfs::tar::_getdir $tarfd $path $pattern]
     if {![string length $pattern]} {
 	if {![vfs::tar::_exists $tarfd $path]} { return {} }
-	set res [list $actualpath]
-	set actualpath ""
+	return [list -stat [list $actualpath [stat $tarfd $path]]]
     }
 
     set newres [list]
-    foreach p [::vfs::matchCorrectTypes $type $res $actualpath] {
-	lappend newres [file join $actualpath $p]
+    foreach p $res {
+	lappend newres [file join $actualpath $p] \
+	    [stat $tarfd [file join $path $p]]
     }
-    return $newres
+    return [list -stat $newres]
 }
 
 # return the necessary "array"
@@ -93,6 +105,7 @@ proc vfs::tar::access {tarfd name mode} {
 proc vfs::tar::open {tarfd name mode permissions} {
     # return a list of two elements:
     # 1. first element is the Tcl channel name which has been opened
+    #    (or -data and the contents of a file opened read-only)
     # 2. second element (optional) is a command to evaluate when
     #    the channel is closed.
 
@@ -105,18 +118,11 @@ proc vfs::tar::open {tarfd name mode permissions} {
 
 	    vfs::tar::_stat $tarfd $name sb
 
-	    set nfd [vfs::memchan]
-	    fconfigure $nfd -translation binary
-
 	    # get the starting point from structure
 	    seek $tarfd $sb(start) start
 	    vfs::tar::_data $tarfd sb data
 
-	    puts -nonewline $nfd $data
-
-	    fconfigure $nfd -translation auto
-	    seek $nfd 0
-	    return [list $nfd]
+	    return [list -data $data]
 	}
 	default {
 	    vfs::filesystem posixerror $::vfs::posix(EROFS)
@@ -66,17 +66,13 @@ proc vfs::tk::open {widg name mode permissions} {
     ::vfs::log "open $name $mode $permissions"
     # return a list of two elements:
     # 1. first element is the Tcl channel name which has been opened
+    #    (or -data and the contents of a file opened read-only)
     # 2. second element (optional) is a command to evaluate when
     #    the channel is closed.
     switch -- $mode {
 	"" -
 	"r" {
-	    set nfd [vfs::memchan]
-	    fconfigure $nfd -translation binary
-	    puts -nonewline $nfd [_generate ${widg}.${name}]
-	    fconfigure $nfd -translation auto
-	    seek $nfd 0
-	    return [list $nfd]
+	    return [list -data [_generate ${widg}.${name}]]
 	}
 	default {
 	    return -code error "illegal access mode \"$mode\""
@@ -13,10 +13,12 @@ namespace eval ::vfs {
 }
 
 # This can be overridden to use a different memchan implementation
-# With Tcl 8.6 will be overridden using [chan create] via vfslib.tcl
-proc ::vfs::memchan {args} {
-    ::package require Memchan
-    uplevel 1 [list ::memchan] $args
+# The vfs package normally provides one itself, along with vfs::memdata
+if {[info commands ::vfs::memdata] eq ""} {
+    proc ::vfs::memchan {args} {
+	::package require Memchan
+	uplevel 1 [list ::memchan] $args
+    }
 }
 
 # This can be overridden to use a different crc implementation
@@ -62,6 +64,55 @@ proc ::vfs::unmount {mountpoint} {
     unset _unmountCmd($norm)
 }
 
+# Handlers of mounts made with 'vfs::filesystem mount -async' run as
+# coroutines, and use these to yield to the event loop while they wait
+# for I/O.  Anywhere else (including Tcl before 8.6, and a handler
+# which cannot yield because it was called from C code inside the
+# coroutine) they wait with vwait as usual.
+
+# The coroutine of the -async handler we are in, or "".
+proc ::vfs::AsyncCoroutine {} {
+    if {[catch {info coroutine} coro] || ![string match ::vfs::async* $coro]} {
+	return ""
+    }
+    return $coro
+}
+
+# Wait until the variable is set, like vwait.
+proc ::vfs::asyncWait {varName} {
+    set coro [AsyncCoroutine]
+    if {$coro ne ""} {
+	set cmd [list ::vfs::AsyncWake $coro]
+	trace add variable $varName write $cmd
+	set code [catch {yield}]
+	trace remove variable $varName write $cmd
+	if {!$code} {
+	    return
+	}
+    }
+    vwait $varName
+}
+
+# Like http::geturl without -command, returning once the request is
+# complete, but without blocking other events in an -async handler.
+proc ::vfs::geturl {url args} {
+    set coro [AsyncCoroutine]
+    if {$coro eq ""} {
+	return [eval [linsert $args 0 ::http::geturl $url]]
+    }
+    set token [eval [linsert $args 0 ::http::geturl $url \
+		     -command [list ::vfs::AsyncWake $coro]]]
+    if {[::http::status $token] eq "" && [catch {yield}]} {
+	::http::wait $token
+    }
+    return $token
+}
+
+proc ::vfs::AsyncWake {coro args} {
+    # The coroutine may be running, waiting with vwait instead
+    catch {$coro}
+}
+
 proc vfs::states {} {
     return [list "readwrite" "translucent" "readonly"]
 }
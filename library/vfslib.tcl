@@ -30,9 +30,12 @@ if {[llength [info command zlib]] || ![catch {load "" zlib}]} {
 }
 
 # Use 8.6 reflected channels or the rechan package in earlier versions to
-# provide a memory channel implementation.
+# provide a memory channel implementation, unless the vfs package has
+# its own.
 #
-if {[info command ::chan] ne {}} {
+if {[info commands ::vfs::memdata] ne {}} {
+    # vfs::memchan is implemented in C
+} elseif {[info command ::chan] ne {}} {
 
     # As the core zlib channel stacking make non-seekable channels we cannot
     # implement vfs::zstream and this feature is disabled in tclkit boot.tcl
@@ -55,7 +55,7 @@ proc vfs::webdav::Mount {dirurl local} {
 	vfs::unmount $dirurl
     }
     ::vfs::log "http $host, $path mounted at $local"
-    vfs::filesystem mount $local [list vfs::webdav::handler \
+    vfs::filesystem mount -async $local [list vfs::webdav::handler \
 	    $dirurl $extraHeadersList $path]
     # Register command to unmount
     vfs::RegisterMount $local [list ::vfs::webdav::Unmount $dirurl]
@@ -93,7 +93,7 @@ proc vfs::webdav::stat {dirurl extraHeadersList name} {
     # This is a bit of a hack.  We really want to do a 'PROPFIND'
     # request with depth 0, I believe.  I don't think Tcl's http
     # package supports that.
-    set token [::http::geturl $dirurl$name -method PROPFIND \
+    set token [::vfs::geturl $dirurl$name -method PROPFIND \
       -headers [concat $extraHeadersList [list Depth 0]] -protocol 1.1]
     upvar #0 $token state
 
@@ -126,7 +126,7 @@ proc vfs::webdav::stat {dirurl extraHeadersList name} {
 proc vfs::webdav::access {dirurl extraHeadersList name mode} {
     ::vfs::log "access $name $mode"
     if {$name == ""} { return 1 }
-    set token [::http::geturl $dirurl$name -headers $extraHeadersList]
+    set token [::vfs::geturl $dirurl$name -headers $extraHeadersList]
     upvar #0 $token state
     if {![regexp " (OK|Moved Permanently)$" $state(http)]} {
 	::vfs::log "No good: $state(http)"
@@ -149,7 +149,7 @@ proc vfs::webdav::open {dirurl extraHeadersList name mode permissions} {
     switch -glob -- $mode {
 	"" -
 	"r" {
-	    set token [::http::geturl $dirurl$name -headers $extraHeadersList]
+	    set token [::vfs::geturl $dirurl$name -headers $extraHeadersList]
 	    upvar #0 $token state
 
 	    set filed [vfs::memchan]
@@ -175,7 +175,7 @@ proc vfs::webdav::matchindirectory {dirurl extraHeadersList path actualpath patt
 
     if {[string length $pattern]} {
 	# need to match all files in a given remote http site.
-	set token [::http::geturl $dirurl$path -method PROPFIND \
+	set token [::vfs::geturl $dirurl$path -method PROPFIND \
 	  -headers [concat $extraHeadersList [list Depth 1]]]
 	upvar #0 $token state
 	#parray state
@@ -198,18 +198,13 @@ proc vfs::webdav::matchindirectory {dirurl extraHeadersList path actualpath patt
 	    if {$name == ""} { continue }
 	    if {[string match $pattern $name]} {
 		vfs::log "check: $name"
-		if {$type == 0} {
-		    lappend res [file join $actualpath $name]
-		} else {
-		    eval lappend res [_matchtypes $item \
-		      [file join $actualpath $name] $type]
-		}
+		lappend res [file join $actualpath $name] [_itemtype $item]
 	    }
 	    #vfs::log "got: $res"
 	}
     } else {
 	# single file
-	set token [::http::geturl $dirurl$path -method PROPFIND \
+	set token [::vfs::geturl $dirurl$path -method PROPFIND \
 	  -headers [concat $extraHeadersList [list Depth 0]]]
 	
 	upvar #0 $token state
@@ -223,25 +218,20 @@ proc vfs::webdav::matchindirectory {dirurl extraHeadersList path actualpath patt
 	::http::cleanup $token
 	#::vfs::log $body
 	
-	eval lappend res [_matchtypes $body $actualpath $type]
+	lappend res $actualpath [_itemtype $body]
     }
     
-    return $res
+    # The vfs package filters the paths by their types
+    return [list -stat $res]
 }
 
 # Helper function
-proc vfs::webdav::_matchtypes {item actualpath type} {
-    #::vfs::log [list $item $actualpath $type]
+proc vfs::webdav::_itemtype {item} {
     if {[regexp {<D:resourcetype><D:collection/>} $item]} {
-	if {![::vfs::matchDirectories $type]} {
-	    return ""
-	}
+	return directory
     } else {
-	if {![::vfs::matchFiles $type]} {
-	    return ""
-	}
+	return file
     }
-    return [list $actualpath]
 }
 
 proc vfs::webdav::createdirectory {dirurl extraHeadersList name} {
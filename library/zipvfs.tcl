@@ -20,14 +20,18 @@ proc vfs::zip::Execute {zipfile} {
 
 proc vfs::zip::Mount {zipfile local} {
     set fd [::zip::open [::file normalize $zipfile]]
-    vfs::filesystem mount $local [list ::vfs::zip::handler $fd]
+    # Archives are read-only, so their metadata can be cached for good
+    vfs::filesystem mount -cache immutable $local \
+	[list ::vfs::zip::handler $fd]
     # Register command to unmount
     vfs::RegisterMount $local [list ::vfs::zip::Unmount $fd]
     return $fd
 }
 
 proc vfs::zip::Unmount {fd local} {
+    variable prefetched
     vfs::filesystem unmount $local
+    array unset prefetched $fd,*
     ::zip::_close $fd
 }
 
@@ -50,51 +54,63 @@ proc vfs::zip::state {zipfd args} {
 
 proc vfs::zip::matchindirectory {zipfd path actualpath pattern type} {
     #::vfs::log [list matchindirectory $path $actualpath $pattern $type]
-
-    # This call to zip::getdir handles empty patterns properly as asking
-    # for the existence of a single file $path only
-    set res [::zip::getdir $zipfd $path $pattern]
-    #::vfs::log "got $res"
-    if {![string length $pattern]} {
-	if {![::zip::exists $zipfd $path]} { return {} }
-	set res [list $actualpath]
-	set actualpath ""
-    }
-
-    set newres [list]
-    foreach p [::vfs::matchCorrectTypes $type $res $actualpath] {
-	lappend newres [file join $actualpath $p]
-    }
-    #::vfs::log "got $newres"
-    return $newres
+    # The stat of each entry is handed back from the index, so that the
+    # types are filtered, and the stats cached, without a callback per
+    # entry.  An empty pattern asks for the existence of $path only.
+    ::vfs::ZipIndex match $zipfd $path $actualpath $pattern
 }
 
 proc vfs::zip::stat {zipfd name} {
     #::vfs::log "stat $name"
-    ::zip::stat $zipfd $name sb
-    #::vfs::log [array get sb]
-    # remove socket mode file type (0xc000) to prevent Tcl from reporting Fossil archives as socket types
-    if {($sb(mode) & 0xf000) == 0xc000} {
-        set sb(mode) [expr {$sb(mode) ^ 0xc000}]
-    }
-    # remove block device bit file type (0x6000)
-    if {($sb(mode) & 0xf000) == 0x6000} {
-        set sb(mode) [expr {$sb(mode) ^ 0x6000}]
-    }
-    # remove FIFO mode file type (0x1000)
-    if {($sb(mode) & 0xf000) == 0x1000} {
-        set sb(mode) [expr {$sb(mode) ^ 0x1000}]
+    ::vfs::ZipIndex statbuf $zipfd $name
+}
+
+# Stat a number of names in one directory at once, leaving out those
+# which do not exist
+proc vfs::zip::statmany {zipfd dir names} {
+    ::vfs::ZipIndex statmany $zipfd $dir $names
+}
+
+# Inflate files which are about to be read from the event loop, one
+# per idle callback, keeping them until they are opened
+proc vfs::zip::prefetch {zipfd dir names done} {
+    after idle [list ::vfs::zip::Prefetch $zipfd $names $done]
+    return 1
+}
+
+proc vfs::zip::Prefetch {zipfd names done} {
+    variable prefetched
+    if {![llength $names]} {
+	eval $done
+	return
     }
-    # remove character device mode file type (0x2000)
-    if {($sb(mode) & 0xf000) == 0x2000} {
-        set sb(mode) [expr {$sb(mode) ^ 0x2000}]
+    set name [lindex $names 0]
+    if {[catch {
+	if {[::zip::exists $zipfd $name]} {
+	    ::zip::stat $zipfd $name sb
+	    # Large files are streamed, as by open
+	    if {$sb(ino) != -1 \
+		    && !($::zip::useStreaming && $sb(size) >= 1048576)} {
+		seek $zipfd $sb(ino) start
+		set prefetched($zipfd,$name) [zip::Data $zipfd sb 0]
+	    }
+	}
+    } err]} {
+	eval $done [list $err]
+	return
     }
-    # workaround for certain errorneus zip archives
-    if {($sb(mode) & 0xffff) == 0xffff} {
-	# change to directory type and set mode to 0777 + directory flag
-	set sb(mode) 0x41ff
+    after idle [list ::vfs::zip::Prefetch $zipfd [lrange $names 1 end] $done]
+}
+
+# Report the index of the archive and any prefetched data we hold, for
+# 'vfs::filesystem memory'
+proc vfs::zip::memory {zipfd path} {
+    variable prefetched
+    set prefetchBytes 0
+    foreach {name data} [array get prefetched $zipfd,*] {
+	incr prefetchBytes [string length $data]
     }
-    array get sb
+    return [list index [::vfs::ZipIndex size $zipfd] prefetch $prefetchBytes]
 }
 
 proc vfs::zip::access {zipfd name mode} {
@@ -116,12 +132,19 @@ proc vfs::zip::open {zipfd name mode permissions} {
     #::vfs::log "open $name $mode $permissions"
     # return a list of two elements:
     # 1. first element is the Tcl channel name which has been opened
+    #    (or -data and the contents of a file opened read-only)
     # 2. second element (optional) is a command to evaluate when
     #    the channel is closed.
 
     switch -- $mode {
 	"" -
 	"r" {
+	    variable prefetched
+	    if {[info exists prefetched($zipfd,$name)]} {
+		set data $prefetched($zipfd,$name)
+		unset prefetched($zipfd,$name)
+		return [list -data $data]
+	    }
 	    if {![::zip::exists $zipfd $name]} {
 		vfs::filesystem posixerror $::vfs::posix(ENOENT)
 	    }
@@ -153,16 +176,7 @@ proc vfs::zip::open {zipfd name mode permissions} {
 		}
 		return [list $nfd]
 	    }  else  {
-		set nfd [vfs::memchan]
-		fconfigure $nfd -translation binary
-
-		set data [zip::Data $zipfd sb 0]
-
-		puts -nonewline $nfd $data
-
-		fconfigure $nfd -translation auto
-		seek $nfd 0
-		return [list $nfd]
+		return [list -data [zip::Data $zipfd sb 0]]
 	    }
 	}
 	default {
@@ -231,7 +245,7 @@ proc vfs::zip::utime {fd path actime mtime} {
 #
 # 2) for table of contents without reading entire
 #	archive by first fetching EndOfArchive, then
-#	just loading the TOC
+#	just loading the TOC, as 'vfs::ZipIndex open' does
 #
 
 namespace eval zip {
@@ -422,272 +436,41 @@ proc zip::Data {fd arr verify} {
     return $data
 }
 
-proc zip::EndOfArchive {fd arr} {
-    upvar 1 $arr cb
-
-    # [SF Tclvfs Bug 1003574]. Do not seek over beginning of file.
-    seek $fd 0 end
-
-    # Just looking in the last 512 bytes may be enough to handle zip
-    # archives without comments, however for archives which have
-    # comments the chunk may start at an arbitrary distance from the
-    # end of the file. So if we do not find the header immediately
-    # we have to extend the range of our search, possibly until we
-    # have a large part of the archive in memory. We can fail only
-    # after the whole file has been searched.
-
-    set sz  [tell $fd]
-    if {[info exists ::zip::max_header_seek]} {
-        if {$::zip::max_header_seek < $sz} {
-            set sz $::zip::max_header_seek
-        }
-    }
-    set len 512
-    set at  512
-    while {1} {
-	if {$sz < $at} {set n -$sz} else {set n -$at}
-
-	seek $fd $n end
-	set hdr [read $fd $len]
-
-	# We are using 'string last' as we are searching the first
-	# from the end, which is the last from the beginning. See [SF
-	# Bug 2256740]. A zip archive stored in a zip archive can
-	# confuse the unmodified code, triggering on the magic
-	# sequence for the inner, uncompressed archive.
-	set pos [string last "PK\05\06" $hdr]
-	if {$pos == -1} {
-	    if {$at >= $sz} {
-		return -code error "no header found"
-	    }
-	    set len 540 ; # after 1st iteration we force overlap with last buffer
-	    incr at 512 ; # to ensure that the pattern we look for is not split at
-	    #           ; # a buffer boundary, nor the header itself
-	} else {
-	    break
-	}
-    }
-
-     set hdrlen [string length $hdr]
-     set hdr [string range $hdr [expr $pos + 4] [expr $pos + 21]]
- 
-     set pos [expr {wide([tell $fd]) + $pos - $hdrlen}]
- 
-     if {$pos < 0} {
-         set pos 0
-     }
-
-    binary scan $hdr ssssiis \
-	cb(ndisk) cb(cdisk) \
-	cb(nitems) cb(ntotal) \
-	cb(csize) cb(coff) \
-	cb(comment)
-
-    set cb(ndisk)	[u_short $cb(ndisk)]
-    set cb(nitems)	[u_short $cb(nitems)]
-    set cb(ntotal)	[u_short $cb(ntotal)]
-    set cb(comment)	[u_short $cb(comment)]
-
-    # Compute base for situations where ZIP file
-    # has been appended to another media (e.g. EXE)
-    set base            [expr { $pos - $cb(csize) - $cb(coff) }]
-    if {$base < 0} {
-        set base 0
-    }
-    set cb(base)	$base
-
-    if {$cb(coff) < 0} {
-	set cb(base) [expr {wide($cb(base)) - 4294967296}]
-	set cb(coff) [expr {wide($cb(coff)) + 4294967296}]
-    }
-}
-
-proc zip::TOC {fd arr} {
-    upvar #0 zip::$fd cb
-    upvar #0 zip::$fd.dir cbdir
-    upvar 1 $arr sb
-
-    set buf [read $fd 46]
-
-    binary scan $buf A4ssssssiiisssssii hdr \
-      sb(vem) sb(ver) sb(flags) sb(method) time date \
-      sb(crc) sb(csize) sb(size) \
-      flen elen clen sb(disk) sb(attr) \
-      sb(atx) sb(ino)
-
-    set sb(ino) [expr {$cb(base) + $sb(ino)}]
-
-    if { ![string equal "PK\01\02" $hdr] } {
-	binary scan $hdr H* x
-	return -code error "bad central header: $x"
-    }
-
-    foreach v {vem ver flags method disk attr} {
-	set sb($v) [expr {$sb($v) & 0xffff}]
-    }
-    set sb(crc) [expr {$sb(crc) & 0xffffffff}]
-    set sb(csize) [expr {$sb(csize) & 0xffffffff}]
-    set sb(size) [expr {$sb(size) & 0xffffffff}]
-    set sb(mtime) [DosTime $date $time]
-    set sb(mode) [expr { ($sb(atx) >> 16) & 0xffff }]
-    # check atx field or mode field if this is a directory
-    if { ((( $sb(atx) & 0xff ) & 16) != 0) || (($sb(mode) & 0x4000) != 0) } {
-	set sb(type) directory
-    } else {
-	set sb(type) file
-    }
-    set sb(name) [read $fd [u_short $flen]]
-    set sb(extra) [read $fd [u_short $elen]]
-    set sb(comment) [read $fd [u_short $clen]]
-    while {$sb(ino) < 0} {
-	set sb(ino) [expr {wide($sb(ino)) + 4294967296}]
-    }
-    if {$sb(flags) & (1 << 11)} {
-        set sb(name) [encoding convertfrom utf-8 $sb(name)]
-        set sb(comment) [encoding convertfrom utf-8 $sb(comment)]
-    }
-    set sb(name) [string trimleft $sb(name) "./"]
-    set parent [file dirname $sb(name)]
-    if {$parent == "."} {set parent ""}
-    lappend cbdir([string tolower $parent]) [file tail [string trimright $sb(name) /]]
-}
-
+# The central directory is read into an index held by the vfs package,
+# which zip::exists, zip::stat and zip::getdir look names up in, in any
+# case.  It goes when the channel is closed.
 proc zip::open {path} {
     #vfs::log [list open $path]
     set fd [::open $path]
-    
     if {[catch {
-	upvar #0 zip::$fd cb
-	upvar #0 zip::$fd.toc toc
-	upvar #0 zip::$fd.dir cbdir
-
 	fconfigure $fd -translation binary ;#-buffering none
-	
-	zip::EndOfArchive $fd cb
-
-	seek $fd [expr {$cb(base) + $cb(coff)}] start
-
-	set toc(_) 0; unset toc(_); #MakeArray
-	
-	for {set i 0} {$i < $cb(nitems)} {incr i} {
-	    zip::TOC $fd sb
-	    
-	    set origname [string trimright $sb(name) /]
-	    set sb(depth) [llength [file split $sb(name)]]
-	    
-	    set name [string tolower $origname]
-	    set sba [array get sb]
-	    set toc($name) $sba
-	    FAKEDIR toc cbdir [file dirname $origname]
-	}
-	foreach {n v} [array get cbdir] {
-	    set cbdir($n) [lsort -unique $v]
-	}
+	::vfs::ZipIndex open $fd
     } err]} {
 	close $fd
 	return -code error $err
     }
-
     return $fd
 }
 
-proc zip::FAKEDIR {tocarr cbdirarr origpath} {
-    upvar 1 $tocarr toc $cbdirarr cbdir
-
-    set path [string tolower $origpath]
-    if { $path == "."} { return }
-
-    if { ![info exists toc($path)] } {
-	# Implicit directory
-	lappend toc($path) \
-		name $origpath \
-		type directory mtime 0 size 0 mode 0777 \
-		ino -1 depth [llength [file split $path]]
-	
-	set parent [file dirname $path]
-	if {$parent == "."} {set parent ""}
-	lappend cbdir($parent) [file tail $origpath]
-    }
-    FAKEDIR toc cbdir [file dirname $origpath]
-}
-
 proc zip::exists {fd path} {
     #::vfs::log "$fd $path"
-    if {$path == ""} {
-	return 1
-    } else {
-	upvar #0 zip::$fd.toc toc
-	info exists toc([string tolower $path])
-    }
+    ::vfs::ZipIndex exists $fd $path
 }
 
 proc zip::stat {fd path arr} {
-    upvar #0 zip::$fd.toc toc
     upvar 1 $arr sb
     #vfs::log [list stat $fd $path $arr [info level -1]]
-
-    set name [string tolower $path]
-    if { $name == "" || $name == "." } {
-	array set sb {
-	    type directory mtime 0 size 0 mode 0777 
-	    ino -1 depth 0 name ""
-	}
-    } elseif {![info exists toc($name)] } {
-	return -code error "could not read \"$path\": no such file or directory"
-    } else {
-	array set sb $toc($name)
-    }
-    set sb(dev) -1
-    set sb(uid)	-1
-    set sb(gid)	-1
-    set sb(nlink) 1
-    set sb(atime) $sb(mtime)
-    set sb(ctime) $sb(mtime)
+    array set sb [::vfs::ZipIndex stat $fd $path]
     return ""
 }
 
 # Treats empty pattern as asking for a particular file only
 proc zip::getdir {fd path {pat *}} {
     #::vfs::log [list getdir $fd $path $pat]
-    upvar #0 zip::$fd.toc toc
-    upvar #0 zip::$fd.dir cbdir
-
-    if { $path == "." || $path == "" } {
-	set path ""
-    }  else  {
-	set path [string tolower $path]
-    }
-
-    if {$pat == ""} {
-	if {[info exists cbdir($path)]} {
-	    return [list $path]
-	}  else  {
-	    return [list]
-	}
-    }
-
-    set rc [list]
-    if {[info exists cbdir($path)]} {
-	if {$pat == "*"} {
-	    set rc $cbdir($path)
-	}  else  {
-	    foreach f $cbdir($path) {
-		if {[string match -nocase $pat $f]} {
-		    lappend rc $f
-		}
-	    }
-	}
-    }
-    return $rc
+    ::vfs::ZipIndex getdir $fd $path $pat
 }
 
 proc zip::_close {fd} {
-    variable $fd
-    variable $fd.toc
-    variable $fd.dir
-    unset $fd
-    unset $fd.toc
-    unset $fd.dir
     ::close $fd
 }
 
@@ -766,37 +549,14 @@ if {([info commands ::rechan] != "") || ([info commands ::chan] != "")} {
     set ::zip::useStreaming 0
 }
 
+# The streams are always readable, so their fileevents are left to the
+# vfs package, which serves all the channels being watched at once.
 proc ::zip::eventClean {fd} {
-    variable eventEnable
-    eventSet $fd 0
+    ::vfs::ChannelReady $fd {}
 }
 
 proc ::zip::eventWatch {fd a} {
-    if {[lindex $a 0] == "read"} {
-	eventSet $fd 1
-    }  else  {
-	eventSet $fd 0
-    }
-}
-
-proc zip::eventSet {fd e} {
-    variable eventEnable
-    set cmd [list ::zip:::eventPost $fd]
-    after cancel $cmd
-    if {$e} {
-	set eventEnable($fd) 1
-	after 0 $cmd
-    }  else  {
-	catch {unset eventEnable($fd)}
-    }
-}
-
-proc zip::eventPost {fd} {
-    variable eventEnable
-    if {[info exists eventEnable($fd)] && $eventEnable($fd)} {
-	chan postevent $fd read
-	eventSet $fd 1
-    }
+    ::vfs::ChannelReady $fd $a
 }
 
 proc ::zip::zstream {ifd clen ilen} {